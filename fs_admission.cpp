@@ -0,0 +1,159 @@
+#include "fs_admission.h"
+#include "fs_system.h"
+#include "fs_fairshare.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <unistd.h>
+#include <sys/socket.h>
+
+unsigned int max_connections = 0;
+unsigned int request_queue_limit = 1024;
+unsigned int request_deadline_ms = 0;
+int listen_backlog = 30;
+
+static std::atomic<unsigned int> open_connections{0};
+
+//-T's SERVICE SLOTS, AND THE REQUESTS WAITING FOR ONE, BY USER
+struct service_waiter {
+    bool granted = false;
+    bool abandoned = false;  //Its deadline passed first
+    fair_ticket ticket;
+    std::condition_variable_any ready;
+};
+
+static boost::mutex service_mutex;
+static fair_queue<std::shared_ptr<service_waiter>> service_queue;
+static unsigned int busy_slots = 0;
+
+
+uint64_t admission_now() {
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool request_expired(uint64_t arrived_ns) {
+
+    return request_deadline_ms != 0 &&
+           admission_now() - arrived_ns > static_cast<uint64_t>(request_deadline_ms) * 1000000;
+}
+
+bool admit_connection() {
+
+    unsigned int before = open_connections.fetch_add(1, std::memory_order_relaxed);
+
+    if(max_connections != 0 && before >= max_connections) {
+        open_connections.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void connection_closed() {
+    open_connections.fetch_sub(1, std::memory_order_relaxed);
+}
+
+/*REFUSE_CONNECTION
+-------------------------------------------------
+-> Sends BUSY_RESPONSE without waiting (it fits in any socket buffer) and shuts our side
+down, so the client reads it and then the end of the connection.
+-> Whatever the client has sent already is read off first: closing a socket with unread
+data resets the connection, and the reset could reach the client ahead of the response.
+A connection only gets here after waiting in the listen backlog, by which time its first
+request has nearly always arrived.
+-------------------------------------------------*/
+
+void refuse_connection(int client_socket) {
+
+    metrics_busy(BUSY_CONNECTIONS);
+
+    ::send(client_socket, BUSY_RESPONSE.data(), BUSY_RESPONSE.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(client_socket, SHUT_WR);
+
+    char discard[4096];
+    while(recv(client_socket, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+    }
+
+    close(client_socket);
+}
+
+//Hands the free slots to the waiters whose turn it is. The caller holds service_mutex
+static void grant_slots() {
+
+    std::shared_ptr<service_waiter> waiter;
+    fair_ticket ticket;
+
+    while(busy_slots < worker_threads && service_queue.pop(waiter, ticket)) {
+        if(waiter->abandoned) {
+            service_queue.cancel(ticket);
+            continue;
+        }
+
+        busy_slots++;
+        waiter->granted = true;
+        waiter->ticket = ticket;
+        waiter->ready.notify_one();
+    }
+}
+
+/*ENTER_SERVICE
+-------------------------------------------------
+-> -T gives every connection a thread, so without a limit here every request in the server
+would be served at once, and all of them slowly. Instead worker_threads of them are served
+at a time, as on the executors' worker pool, and the rest wait their turn in service_queue,
+at most request_queue_limit of them per user. Turns go round the users as on the pool (see
+fs_fairshare.h).
+-> A request that would make its user's queue longer than that, or whose deadline passes
+while it waits, is turned away. One that gives up is left in the queue, marked, and skipped
+when its turn comes.
+-------------------------------------------------*/
+
+bool enter_service(const std::string& user, uint64_t arrived_ns, fair_ticket& ticket) {
+
+    auto waiter = std::make_shared<service_waiter>();
+
+    boost::unique_lock<boost::mutex> lock(service_mutex);
+
+    if(!service_queue.push(user, waiter, request_queue_limit)) {
+        metrics_busy(BUSY_QUEUE);
+        return false;
+    }
+
+    grant_slots();
+
+    while(!waiter->granted) {
+        if(request_deadline_ms == 0) {
+            waiter->ready.wait(lock);
+            continue;
+        }
+
+        uint64_t deadline_ns = arrived_ns + static_cast<uint64_t>(request_deadline_ms) * 1000000;
+        uint64_t now = admission_now();
+
+        if(now >= deadline_ns) {
+            waiter->abandoned = true;
+            metrics_busy(BUSY_DEADLINE);
+            stats_for_user(user).turned_away.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        waiter->ready.wait_for(lock, std::chrono::nanoseconds(deadline_ns - now));
+    }
+
+    ticket = waiter->ticket;
+    return true;
+}
+
+void leave_service(const fair_ticket& ticket) {
+
+    boost::lock_guard<boost::mutex> lock(service_mutex);
+
+    busy_slots--;
+    service_queue.finish(ticket);
+    grant_slots();
+}
+
+bool is_lease_release(const std::string& message) {
+    return message.compare(0, 11, "FS_RELEASE ") == 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * fs_admission.h
+ *
+ * Admission control: what the server does when it is asked for more than it
+ * can serve. Rather than queue without limit (and let every client's latency
+ * grow with the queue), it turns the excess away at once with BUSY_RESPONSE,
+ * which clients back off from and retry (see fs_client.cpp).
+ *
+ * A request is turned away when
+ *  - its connection would be one more than max_connections (fs -M): the
+ *    connection gets BUSY_RESPONSE in place of its first response and is
+ *    closed,
+ *  - its user already has request_queue_limit requests waiting for a worker
+ *    (fs -Q; see fs_fairshare.h for how users take turns),
+ *  - it waited longer than request_deadline_ms for a worker (fs -D), by which
+ *    time serving it would only make the requests behind it late too.
+ *
+ * A request turned away has not touched the filesystem, so it is always safe
+ * to retry. FS_RELEASE is never turned away, since a write may be waiting on
+ * it. On a tagged session a request turned away is answered "FS_BUSY <n>".
+ */
+
+#pragma once
+
+#include "fs_fairshare.h"
+#include <cstdint>
+#include <string>
+
+//fs -M: connections open at once, 0 for no limit
+extern unsigned int max_connections;
+
+//fs -Q: requests one user may have waiting for a worker (or, with -T, for one of worker_threads slots)
+extern unsigned int request_queue_limit;
+
+//fs -D: how long a request may wait for a worker, 0 for no limit
+extern unsigned int request_deadline_ms;
+
+//fs -B: the listen backlog
+extern int listen_backlog;
+
+/*
+ * The response to a request the server is too busy for.
+ */
+static const std::string BUSY_RESPONSE("FS_BUSY", sizeof("FS_BUSY"));
+
+/*
+ * When a request finished arriving, for request_expired.
+ */
+uint64_t admission_now();
+
+/*
+ * True once a request that arrived at arrived_ns has waited past the deadline.
+ */
+bool request_expired(uint64_t arrived_ns);
+
+/*
+ * Counts a newly accepted connection, or returns false if that would make
+ * more than max_connections. Every connection counted is given back with
+ * connection_closed.
+ */
+bool admit_connection();
+void connection_closed();
+
+/*
+ * Answers a connection admit_connection turned away and closes it.
+ */
+void refuse_connection(int client_socket);
+
+/*
+ * With -T, waits for one of worker_threads service slots in user's turn (see
+ * fs_fairshare.h), queueing behind at most request_queue_limit of their
+ * other requests and for no longer than the deadline. Returns false if the
+ * request should be turned away instead. A slot taken is given back with
+ * leave_service and the ticket it came with.
+ */
+bool enter_service(const std::string& user, uint64_t arrived_ns, fair_ticket& ticket);
+void leave_service(const fair_ticket& ticket);
+
+/*
+ * FS_RELEASE, which is served without waiting its turn.
+ */
+bool is_lease_release(const std::string& message);
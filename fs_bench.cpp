@@ -0,0 +1,262 @@
+#include "fs_system.h"
+#include <chrono>
+#include <iomanip>
+#include <new>
+
+/*
+ * fs_bench
+ *
+ * Microbenchmarks for the server's hot paths, run directly against
+ * fs_system.cpp with no sockets. fs_bench links its own in-memory disk
+ * in place of libfs_server.o, so the numbers measure the server's code
+ * and not the disk image.
+ *
+ * Usage: fs_bench [filter]  (only runs benchmarks whose name contains filter)
+ */
+
+static const char* BENCH_USER = "bench";
+
+//THE IN-MEMORY DISK, STARTS OUT FORMATTED WITH AN EMPTY ROOT DIRECTORY
+static char memory_disk[FS_DISKSIZE][FS_BLOCKSIZE];
+
+void disk_readblock(unsigned int block, void* buf) {
+    memcpy(buf, memory_disk[block], FS_BLOCKSIZE);
+}
+
+void disk_writeblock(unsigned int block, const void* buf) {
+    memcpy(memory_disk[block], buf, FS_BLOCKSIZE);
+}
+
+void print_port(unsigned int port_number) {
+    std::cout << "\n@@@ port " << port_number << std::endl;
+}
+
+static boost::mutex bench_cout_lock;
+
+boost::mutex* cout_lock_func() {
+    return &bench_cout_lock;
+}
+
+//EVERY OPERATOR NEW ON THE BENCHMARK THREAD IS COUNTED
+static uint64_t allocation_count = 0;
+
+void* operator new(size_t size) {
+    allocation_count++;
+    void* ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+
+/*RUN_BENCHMARK
+-------------------------------------------------
+-> Doubles the iteration count until a run of op takes at least 200ms, then prints the
+time and the number of operator new calls per iteration of the last run.
+-------------------------------------------------*/
+
+template <typename Op>
+static void run_benchmark(const char* filter, const std::string& name, Op op) {
+
+    if (filter != nullptr && name.find(filter) == std::string::npos) {
+        return;
+    }
+
+    uint64_t iterations = 1;
+
+    while (true) {
+        uint64_t allocations_before = allocation_count;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        for (uint64_t i = 0; i < iterations; i++) {
+            op();
+        }
+
+        uint64_t elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        uint64_t allocations = allocation_count - allocations_before;
+
+        if (elapsed_ns >= 200000000 || iterations >= (1ULL << 40)) {
+            std::cout << std::left << std::setw(40) << name << std::right
+                      << std::setw(12) << iterations
+                      << std::setw(12) << std::fixed << std::setprecision(1) << static_cast<double>(elapsed_ns) / iterations
+                      << std::setw(12) << std::setprecision(2) << static_cast<double>(allocations) / iterations << "\n";
+            return;
+        }
+
+        iterations *= 2;
+    }
+}
+
+static std::vector<char> path_chars(const std::string& path) {
+
+    std::vector<char> chars(path.begin(), path.end());
+    chars.push_back('\0');
+    return chars;
+}
+
+static fs_inode read_inode(uint32_t block_num) {
+
+    fs_inode node;
+    char buf[FS_BLOCKSIZE];
+    disk_readblock(block_num, buf);
+    memcpy(&node, buf, sizeof(fs_inode));
+    return node;
+}
+
+
+/*BUILD_TREE
+-------------------------------------------------
+-> /bench/d0/d1/file is a file 3 levels down, with one block, for the traversal benchmarks.
+-> /bench/wide is a directory with wide_entries files in it, for the direntry scans.
+-------------------------------------------------*/
+
+static const unsigned int wide_entries = 200;
+
+static void build_tree() {
+
+    char user[FS_MAXUSERNAME + 1];
+    std::strcpy(user, BENCH_USER);
+
+    const char* dirs[] = {"/bench", "/bench/d0", "/bench/d0/d1", "/bench/wide"};
+    for (const char* dir : dirs) {
+        std::vector<char> path = path_chars(dir);
+        handle_create(user, path.data(), 'd');
+    }
+
+    std::vector<char> file = path_chars("/bench/d0/d1/file");
+    handle_create(user, file.data(), 'f');
+
+    char block[FS_BLOCKSIZE];
+    memset(block, 'b', FS_BLOCKSIZE);
+    handle_writeblock(user, file.data(), 0, block, FS_BLOCKSIZE);
+
+    for (unsigned int i = 0; i < wide_entries; i++) {
+        std::vector<char> entry = path_chars("/bench/wide/file" + std::to_string(i));
+        handle_create(user, entry.data(), 'f');
+    }
+}
+
+
+int main(int argc, char* argv[]) {
+
+    const char* filter = argc > 1 ? argv[1] : nullptr;
+
+    //FORMAT THE DISK THE WAY CREATEFS DOES: BLOCK 0 IS AN EMPTY ROOT DIRECTORY
+    fs_inode root{};
+    root.type = 'd';
+    root.size = 0;
+    disk_writeblock(0, &root);
+
+    load_filesystem();
+    build_tree();
+
+    char user[FS_MAXUSERNAME + 1];
+    std::strcpy(user, BENCH_USER);
+
+    std::vector<char> file_path = path_chars("/bench/d0/d1/file");
+    std::vector<char> new_path = path_chars("/bench/d0/d1/newfile");
+    std::vector<std::string> file_vector = char_array_to_string_vector(file_path.data());
+    std::vector<std::string> new_vector = char_array_to_string_vector(new_path.data());
+
+    uint32_t wide_block = 0;
+    {
+        fs_inode bench_dir = read_inode(find_direntry(read_inode(0), "bench"));
+        wide_block = find_direntry(bench_dir, "wide");
+    }
+    fs_inode wide_dir = read_inode(wide_block);
+    std::string last_entry = "file" + std::to_string(wide_entries - 1);
+
+    std::string create_message = std::string("FS_CREATE bench /bench/d0/d1/newfile f") + '\0';
+    std::string read_message = std::string("FS_READBLOCK bench /bench/d0/d1/file 0") + '\0';
+    std::string write_message = std::string("FS_WRITEBLOCK bench /bench/d0/d1/file 0") + '\0' + std::string(FS_BLOCKSIZE, 'w');
+
+    std::cout << std::left << std::setw(40) << "benchmark" << std::right
+              << std::setw(12) << "iterations" << std::setw(12) << "ns/op" << std::setw(12) << "allocs/op" << "\n";
+
+    run_benchmark(filter, "char_array_to_string_vector", [&]() {
+        std::vector<std::string> path_vector = char_array_to_string_vector(file_path.data());
+    });
+
+    run_benchmark(filter, "traverse_tree/read", [&]() {
+        uint32_t child_block = 0;
+        uint32_t parent_block = 0;
+        traverse_tree(file_vector, false, child_block, parent_block, user);
+        reader_unlock(child_block);
+        reader_unlock(parent_block);
+    });
+
+    run_benchmark(filter, "traverse_tree/write", [&]() {
+        uint32_t child_block = 0;
+        uint32_t parent_block = 0;
+        traverse_tree(file_vector, true, child_block, parent_block, user);
+        writer_unlock(child_block);
+        reader_unlock(parent_block);
+    });
+
+    run_benchmark(filter, "traverse_tree_create", [&]() {
+        uint32_t parent_block = 0;
+        traverse_tree_create(new_vector, true, parent_block, user);
+        writer_unlock(parent_block);
+    });
+
+    run_benchmark(filter, "traverse_tree_delete", [&]() {
+        uint32_t child_block = 0;
+        uint32_t parent_block = 0;
+        traverse_tree_delete(file_vector, true, child_block, parent_block, user);
+        writer_unlock(parent_block);
+    });
+
+    run_benchmark(filter, "find_duplicate/" + std::to_string(wide_entries) + "_entries_miss", [&]() {
+        find_duplicate(wide_dir, "missing");
+    });
+
+    run_benchmark(filter, "find_direntry/" + std::to_string(wide_entries) + "_entries_last", [&]() {
+        find_direntry(wide_dir, last_entry);
+    });
+
+    run_benchmark(filter, "allocate_release_block", [&]() {
+        ds_mutex.lock();
+        uint32_t block_num = allocate_block();
+        release_block(block_num);
+        ds_mutex.unlock();
+    });
+
+    run_benchmark(filter, "parse_request/create", [&]() {
+        fs_request request;
+        parse_request(create_message, request);
+    });
+
+    run_benchmark(filter, "parse_request/readblock", [&]() {
+        fs_request request;
+        parse_request(read_message, request);
+    });
+
+    run_benchmark(filter, "parse_request/writeblock", [&]() {
+        fs_request request;
+        parse_request(write_message, request);
+    });
+
+    return 0;
+}
@@ -0,0 +1,1340 @@
+#include "fs_client.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 //macOS: SO_NOSIGPIPE is set on the socket instead
+#endif
+
+/*
+ * The client library.
+ *
+ * Every call borrows a connection to the server from a pool, sends its
+ * request, reads the response and gives the connection back, so threads that
+ * make call after call don't pay a TCP handshake (and the server a thread or
+ * coroutine start) for each one. A new connection opens with the session
+ * request, which tells the server to keep it open after each response.
+ *
+ * The server closes a connection when a request fails, so a failed call
+ * never returns its connection to the pool.
+ *
+ * A server that is too busy answers FS_BUSY instead (see fs_admission.h on
+ * the server), and the call is tried again after a randomized, doubling
+ * backoff (fs_clientretry), so a crowd of clients turned away together
+ * doesn't come back together.
+ *
+ * With the block cache on (fs_clientcache), reads go out as FS_READLEASE and
+ * the blocks are kept for as long as the server's read lease on the file
+ * lasts (see fs_lease.h on the server). Writing to or deleting a cached file
+ * drops it from the cache and gives its leases back with FS_RELEASE, sent
+ * ahead of the write on the same connection.
+ *
+ * The _async calls share a few tagged sessions instead (fs_clientasync),
+ * where every request carries a number the server answers it under, so many
+ * can be outstanding on one connection and complete in any order. A receiver
+ * thread per connection reads the responses and completes the calls.
+ */
+
+//MUST MATCH SESSION_REQUEST IN fs_system.h
+static const std::string SESSION_REQUEST("FS_SESSION", sizeof("FS_SESSION"));
+
+static bool initialized = false;
+static sockaddr_storage server_address;
+static socklen_t server_address_len = 0;
+
+struct pooled_connection {
+    int fd;
+    std::chrono::steady_clock::time_point last_used;
+};
+
+//IDLE CONNECTIONS, MOST RECENTLY USED AT THE BACK
+static std::mutex pool_mutex;
+static std::vector<pooled_connection> idle_connections;
+static unsigned int pool_size = 16;
+static std::chrono::milliseconds idle_timeout(30000);
+
+//MUST MATCH LEASE_TRAILER_LEN IN fs_lease.h
+static constexpr size_t LEASE_TRAILER_LEN = 12;
+
+struct held_lease {
+    uint64_t token;
+    std::chrono::steady_clock::time_point expiry;
+};
+
+//The cached blocks of one file, good until expiry
+struct cached_file {
+    std::chrono::steady_clock::time_point expiry;
+    std::vector<held_lease> leases;
+    std::unordered_map<unsigned int, std::string> blocks;
+    unsigned int reads_in_flight = 0;   //FS_READLEASEs sent but not yet cached
+    unsigned int changes_in_flight = 0; //Writes and deletes under way
+};
+
+//KEYED BY USERNAME AND PATHNAME, NULL SEPARATED
+static std::mutex cache_mutex;
+static std::condition_variable reads_landed;
+static std::unordered_map<std::string, cached_file> cached_files;
+static unsigned int cache_capacity = 0;
+static size_t cached_block_count = 0;
+
+//Whether a file's entry holds nothing worth keeping: no leases still running (and so no good
+//blocks) or nothing at all, and no reads or changes under way. The caller holds cache_mutex
+static bool cache_idle(const cached_file& file, std::chrono::steady_clock::time_point now) {
+    return file.reads_in_flight == 0 && file.changes_in_flight == 0 &&
+           (file.expiry <= now || (file.blocks.empty() && file.leases.empty()));
+}
+
+//THE CACHE KEY OF THE FILE EACH HANDLE FROM fs_open WAS OPENED ON, ALSO GUARDED BY CACHE_MUTEX
+static std::unordered_map<uint64_t, std::string> handle_keys;
+
+//MUST MATCH HANDLE_LEN IN fs_handle.h
+static constexpr size_t HANDLE_LEN = 8;
+
+//MUST MATCH BUSY_RESPONSE IN fs_admission.h
+static const std::string BUSY_RESPONSE("FS_BUSY", sizeof("FS_BUSY"));
+
+//What FS_ATTEMPT returns when the server was too busy for the call
+static constexpr int CALL_BUSY = 1;
+
+//HOW CALLS THE SERVER IS TOO BUSY FOR ARE RETRIED (fs_clientretry)
+static std::mutex retry_mutex;
+static unsigned int busy_retries = 8;
+static unsigned int max_backoff_ms = 100;
+
+
+int fs_clientinit(const char* hostname, uint16_t port) {
+
+    if(initialized || hostname == nullptr) {
+        return -1;
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* result = nullptr;
+    std::string service = std::to_string(port);
+
+    if(getaddrinfo(hostname, service.c_str(), &hints, &result) != 0 || result == nullptr) {
+        return -1;
+    }
+
+    memcpy(&server_address, result->ai_addr, result->ai_addrlen);
+    server_address_len = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    initialized = true;
+    return 0;
+}
+
+int fs_clientpool(unsigned int max_connections, unsigned int idle_timeout_ms) {
+
+    std::vector<int> closing;
+
+    pool_mutex.lock();
+
+    pool_size = max_connections;
+    idle_timeout = std::chrono::milliseconds(idle_timeout_ms);
+
+    while(idle_connections.size() > pool_size) {
+        closing.push_back(idle_connections.front().fd);
+        idle_connections.erase(idle_connections.begin());
+    }
+
+    pool_mutex.unlock();
+
+    for(int fd : closing) {
+        close(fd);
+    }
+
+    return 0;
+}
+
+
+int fs_clientretry(unsigned int max_retries, unsigned int backoff_ms) {
+
+    if(backoff_ms == 0) {
+        return -1;
+    }
+
+    retry_mutex.lock();
+    busy_retries = max_retries;
+    max_backoff_ms = backoff_ms;
+    retry_mutex.unlock();
+
+    return 0;
+}
+
+
+int fs_clientcache(unsigned int max_blocks) {
+
+    cache_mutex.lock();
+
+    cache_capacity = max_blocks;
+    if(cache_capacity == 0) {
+        for(auto it = cached_files.begin(); it != cached_files.end(); ) {
+            it->second.blocks.clear();
+            if(cache_idle(it->second, std::chrono::steady_clock::now())) {
+                it = cached_files.erase(it);
+            }else {
+                ++it;
+            }
+        }
+        cached_block_count = 0;
+    }
+
+    cache_mutex.unlock();
+
+    return 0;
+}
+
+
+static bool send_all(int fd, const char* buf, size_t len) {
+
+    while(len > 0) {
+        ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+
+        if(sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if(sent <= 0) {
+            return false;
+        }
+        buf += sent;
+        len -= sent;
+    }
+
+    return true;
+}
+
+//Reads exactly len bytes, false if the connection ends first
+static bool recv_all(int fd, char* buf, size_t len) {
+
+    while(len > 0) {
+        ssize_t got = recv(fd, buf, len, 0);
+
+        if(got < 0 && errno == EINTR) {
+            continue;
+        }
+        if(got <= 0) {
+            return false;
+        }
+        buf += got;
+        len -= got;
+    }
+
+    return true;
+}
+
+/*RECV_ECHO
+-------------------------------------------------
+-> Reads a response of length bytes that should start with expected into response. Returns
+0 if it does, CALL_BUSY if the server sent BUSY_RESPONSE in its place, and -1 if the
+connection ended first or something else came back.
+-> Every echo is longer than BUSY_RESPONSE, so its first bytes tell the two apart.
+-------------------------------------------------*/
+
+static int recv_echo(int fd, const std::string& expected, size_t length, std::string& response) {
+
+    response.assign(length, '\0');
+    size_t first = std::min(length, BUSY_RESPONSE.length());
+
+    if(!recv_all(fd, &response[0], first)) {
+        return -1;
+    }
+    if(response.compare(0, first, BUSY_RESPONSE) == 0) {
+        return CALL_BUSY;
+    }
+    if(!recv_all(fd, &response[first], length - first) || response.compare(0, expected.length(), expected) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int open_connection() {
+
+    int fd = socket(server_address.ss_family, SOCK_STREAM, 0);
+    if(fd == -1) {
+        throw std::runtime_error("The file server is not accepting connections on this port");
+    }
+
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+    if(connect(fd, reinterpret_cast<const sockaddr*>(&server_address), server_address_len) == -1) {
+        close(fd);
+        throw std::runtime_error("The file server is not accepting connections on this port");
+    }
+
+    //REQUESTS ARE SENT WHOLE, SO DON'T HOLD THE LAST PIECE BACK WAITING FOR AN ACK
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    return fd;
+}
+
+/*ACQUIRE_CONNECTION
+-------------------------------------------------
+-> Hands out the most recently used idle connection that is still open, closing any that
+have sat idle longer than idle_timeout along the way. A connection the server has closed
+(or that has stray data on it) shows up as readable without blocking, and is dropped.
+-> If none is left, opens a new one. new_session tells the caller it still has to send
+the session request.
+-------------------------------------------------*/
+
+static int acquire_connection(bool& new_session) {
+
+    std::vector<int> closing;
+    int fd = -1;
+
+    pool_mutex.lock();
+
+    auto now = std::chrono::steady_clock::now();
+
+    //THE OLDEST ARE AT THE FRONT, SO ONLY A PREFIX CAN HAVE TIMED OUT
+    size_t expired = 0;
+    while(expired < idle_connections.size() && now - idle_connections[expired].last_used > idle_timeout) {
+        closing.push_back(idle_connections[expired].fd);
+        expired++;
+    }
+    idle_connections.erase(idle_connections.begin(), idle_connections.begin() + expired);
+
+    while(fd == -1 && !idle_connections.empty()) {
+        int candidate = idle_connections.back().fd;
+        idle_connections.pop_back();
+
+        char probe;
+        ssize_t peeked = recv(candidate, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+
+        if(peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            fd = candidate;
+        }else {
+            closing.push_back(candidate);
+        }
+    }
+
+    pool_mutex.unlock();
+
+    for(int stale : closing) {
+        close(stale);
+    }
+
+    new_session = (fd == -1);
+
+    if(new_session) {
+        fd = open_connection();
+    }
+
+    return fd;
+}
+
+static void release_connection(int fd) {
+
+    pool_mutex.lock();
+
+    if(idle_connections.size() < pool_size) {
+        idle_connections.push_back({fd, std::chrono::steady_clock::now()});
+        fd = -1;
+    }
+
+    pool_mutex.unlock();
+
+    if(fd != -1) {
+        close(fd);
+    }
+}
+
+/*FS_ATTEMPT
+-------------------------------------------------
+-> Sends request (header, null terminator and any data) on a pooled connection and checks
+that the response starts with the header echoed back. response_data bytes follow the
+echo for FS_READBLOCK and are copied into data.
+-> preamble holds whole requests (FS_RELEASE) to send ahead of it on the same connection.
+Each of them is answered with its own echo.
+-> With pooling turned off (a pool size of 0), each call uses a connection of its own
+without a session, exactly like the one-shot protocol: the server closes it after
+responding, and the response must be everything that arrives.
+-> Returns 0 on success, -1 if the server refused the request (closed without responding)
+or answered with something else, and CALL_BUSY if it was too busy. A busy answer in place of
+an echo of the preamble means the server turned the whole connection away (it never turns
+FS_RELEASE away), and closes it; one in place of the response leaves a session usable.
+-------------------------------------------------*/
+
+static int fs_common(const std::string& request, size_t header_len, char* data, size_t response_data,
+                     const std::vector<std::string>& preamble = {});
+
+static int fs_attempt(const std::string& request, size_t header_len, char* data, size_t response_data,
+                      const std::vector<std::string>& preamble) {
+
+    pool_mutex.lock();
+    bool pooled = pool_size > 0;
+    pool_mutex.unlock();
+
+    if(!pooled) {
+        //ONE REQUEST PER CONNECTION, SO THE PREAMBLE GOES FIRST ON CONNECTIONS OF ITS OWN
+        for(const std::string& message : preamble) {
+            fs_common(message, message.length(), nullptr, 0);
+        }
+    }
+
+    bool new_session = false;
+    int fd = pooled ? acquire_connection(new_session) : open_connection();
+
+    std::vector<std::string> echoes;
+    if(pooled && new_session) {
+        echoes.push_back(SESSION_REQUEST);
+    }
+    if(pooled) {
+        echoes.insert(echoes.end(), preamble.begin(), preamble.end());
+    }
+
+    std::string outgoing;
+    for(const std::string& message : echoes) {
+        outgoing += message;
+    }
+    outgoing += request;
+
+    if(!send_all(fd, outgoing.data(), outgoing.length())) {
+        close(fd);
+        return -1;
+    }
+
+    std::string echo;
+    for(const std::string& expected : echoes) {
+        int echoed = recv_echo(fd, expected, expected.length(), echo);
+        if(echoed != 0) {
+            close(fd);
+            return echoed;
+        }
+    }
+
+    std::string response;
+    int answered = recv_echo(fd, request.substr(0, header_len), header_len + response_data, response);
+
+    if(answered == CALL_BUSY && pooled) {
+        release_connection(fd);
+        return CALL_BUSY;
+    }
+    if(answered != 0) {
+        close(fd);
+        return answered;
+    }
+
+    if(!pooled) {
+        //ONE-SHOT: NOTHING MAY FOLLOW THE RESPONSE
+        char extra;
+        ssize_t got;
+        do {
+            got = recv(fd, &extra, 1, 0);
+        } while(got < 0 && errno == EINTR);
+
+        close(fd);
+        if(got != 0) {
+            return -1;
+        }
+    }else {
+        release_connection(fd);
+    }
+
+    if(response_data > 0) {
+        memcpy(data, response.data() + header_len, response_data);
+    }
+
+    return 0;
+}
+
+/*FS_COMMON
+-------------------------------------------------
+-> fs_attempt, tried again for as long as the server is too busy for it, up to busy_retries
+more times. Before each retry it sleeps for a backoff that starts at 1ms and doubles, up to
+max_backoff_ms, with the lower half of it random: clients turned away together come back
+spread out, while each still backs off at least half as long as it would without jitter.
+-> Returns 0 on success, -1 on failure (including running out of retries).
+-------------------------------------------------*/
+
+static int fs_common(const std::string& request, size_t header_len, char* data, size_t response_data,
+                     const std::vector<std::string>& preamble) {
+
+    if(!initialized) {
+        throw std::runtime_error("must first call fs_clientinit");
+    }
+
+    retry_mutex.lock();
+    unsigned int retries = busy_retries;
+    uint64_t max_backoff_us = static_cast<uint64_t>(max_backoff_ms) * 1000;
+    retry_mutex.unlock();
+
+    static thread_local std::mt19937_64 jitter(std::random_device{}());
+
+    uint64_t backoff_us = std::min<uint64_t>(1000, max_backoff_us);
+
+    for(unsigned int attempt = 0; ; attempt++) {
+        int result = fs_attempt(request, header_len, data, response_data, preamble);
+
+        if(result != CALL_BUSY) {
+            return result;
+        }
+        if(attempt >= retries) {
+            return -1;
+        }
+
+        uint64_t sleep_us = backoff_us / 2 + jitter() % (backoff_us / 2 + 1);
+        std::this_thread::sleep_for(std::chrono::microseconds(sleep_us));
+
+        backoff_us = std::min(backoff_us * 2, max_backoff_us);
+    }
+}
+
+//The header of a request, including its null terminator
+static std::string request_header(const std::string& fields) {
+    return std::string(fields.c_str(), fields.length() + 1);
+}
+
+
+static std::string cache_key(const char* username, const char* pathname) {
+    return std::string(username) + '\0' + pathname;
+}
+
+//Erases key's entry if it is idle, so the map doesn't keep one for every path ever read or
+//changed. The caller holds cache_mutex
+static void forget_if_idle(const std::string& key) {
+
+    auto file = cached_files.find(key);
+    if(file != cached_files.end() && cache_idle(file->second, std::chrono::steady_clock::now())) {
+        cached_block_count -= file->second.blocks.size();
+        cached_files.erase(file);
+    }
+}
+
+/*BEGIN_CHANGE
+-------------------------------------------------
+-> Drops a file from the cache before this client writes to or deletes it, and returns an
+FS_RELEASE for each of its leases that hasn't run out, so the server doesn't make the change
+wait for leases we hold ourselves.
+-> A lease still on its way back to one of our own reads would be missed (and the server
+would wait it out), so we wait for those reads to land first. Reads that start while the
+change is going on skip the cache and ask for no lease.
+-------------------------------------------------*/
+
+static std::vector<std::string> begin_change(const std::string& key) {
+
+    std::vector<std::string> releases;
+
+    std::unique_lock<std::mutex> lock(cache_mutex);
+
+    if(cache_capacity == 0 && cached_files.count(key) == 0) {
+        return releases;
+    }
+
+    cached_file& file = cached_files[key];
+    file.changes_in_flight++;
+
+    while(file.reads_in_flight > 0) {
+        reads_landed.wait(lock);
+    }
+
+    auto now = std::chrono::steady_clock::now();
+
+    for(const held_lease& lease : file.leases) {
+        if(lease.expiry > now) {
+            releases.push_back(request_header("FS_RELEASE " + std::to_string(lease.token)));
+        }
+    }
+
+    cached_block_count -= file.blocks.size();
+    file.blocks.clear();
+    file.leases.clear();
+    file.expiry = {};
+
+    return releases;
+}
+
+static void end_change(const std::string& key) {
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    auto file = cached_files.find(key);
+    if(file != cached_files.end() && file->second.changes_in_flight > 0) {
+        file->second.changes_in_flight--;
+    }
+
+    forget_if_idle(key);
+}
+
+/*CACHE_BLOCK
+-------------------------------------------------
+-> Keeps a block read under a lease that was asked for at requested. The file's other blocks
+stay good only if its last lease was still running when this response arrived: then no
+write can have happened in between, since the server waits for every lease to run out.
+-> When the cache is full, files whose leases have run out go first, then any others' blocks.
+Files with reads or changes in flight stay put, since those count on them.
+The caller holds cache_mutex.
+-------------------------------------------------*/
+
+static void cache_block(cached_file& file, const std::string& key, unsigned int offset, const char* data,
+                        uint64_t token, uint32_t term_ms, std::chrono::steady_clock::time_point requested) {
+
+    auto now = std::chrono::steady_clock::now();
+    auto expiry = requested + std::chrono::milliseconds(term_ms);
+
+    if(term_ms == 0 || expiry <= now || cache_capacity == 0) {
+        return;
+    }
+
+    if(file.expiry <= now) {
+        cached_block_count -= file.blocks.size();
+        file.blocks.clear();
+    }
+
+    if(expiry > file.expiry) {
+        file.expiry = expiry;
+    }
+
+    size_t kept = 0;
+    for(const held_lease& lease : file.leases) {
+        if(lease.expiry > now) {
+            file.leases[kept++] = lease;
+        }
+    }
+    file.leases.resize(kept);
+    file.leases.push_back({token, expiry});
+
+    if(file.blocks.count(offset) == 0) {
+        cached_block_count++;
+    }
+    file.blocks[offset] = std::string(data, FS_BLOCKSIZE);
+
+    //FILES WHOSE BLOCKS WERE EVICTED STAY FOR THEIR LEASES, SO SWEEP THOSE UP TOO ONCE THEY PILE UP
+    bool sweep = cached_files.size() > 2 * static_cast<size_t>(cache_capacity);
+
+    for(auto it = cached_files.begin(); it != cached_files.end() && (sweep || cached_block_count > cache_capacity); ) {
+        if(it->first != key && cache_idle(it->second, now)) {
+            cached_block_count -= it->second.blocks.size();
+            it = cached_files.erase(it);
+        }else {
+            ++it;
+        }
+    }
+
+    //EVICTED FILES KEEP THEIR LEASES, SO THEY CAN STILL BE GIVEN BACK BEFORE A WRITE
+    for(auto it = cached_files.begin(); it != cached_files.end() && cached_block_count > cache_capacity; ++it) {
+        if(it->first != key) {
+            cached_block_count -= it->second.blocks.size();
+            it->second.blocks.clear();
+        }
+    }
+}
+
+
+int fs_readblock(const char* username, const char* pathname, unsigned int offset, void* buf) {
+
+    std::string key = cache_key(username, pathname);
+    bool leased = false;
+
+    cache_mutex.lock();
+
+    if(cache_capacity > 0) {
+        cached_file& file = cached_files[key];
+
+        if(file.expiry > std::chrono::steady_clock::now()) {
+            auto block = file.blocks.find(offset);
+
+            if(block != file.blocks.end()) {
+                memcpy(buf, block->second.data(), FS_BLOCKSIZE);
+                cache_mutex.unlock();
+                return 0;
+            }
+        }
+
+        if(file.changes_in_flight == 0) {
+            file.reads_in_flight++;
+            leased = true;
+        }
+    }
+
+    cache_mutex.unlock();
+
+    if(!leased) {
+        std::string header = request_header(std::string("FS_READBLOCK ") + username + " " + pathname + " " + std::to_string(offset));
+
+        return fs_common(header, header.length(), static_cast<char*>(buf), FS_BLOCKSIZE);
+    }
+
+    std::string header = request_header(std::string("FS_READLEASE ") + username + " " + pathname + " " + std::to_string(offset));
+    char body[FS_BLOCKSIZE + LEASE_TRAILER_LEN];
+
+    auto requested = std::chrono::steady_clock::now();
+
+    int status = -1;
+
+    try {
+        status = fs_common(header, header.length(), body, sizeof(body));
+    } catch(...) {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        cached_files[key].reads_in_flight--;
+        forget_if_idle(key);
+        reads_landed.notify_all();
+        throw;
+    }
+
+    cache_mutex.lock();
+
+    cached_file& file = cached_files[key];
+
+    if(status == 0) {
+        uint32_t fields[3];
+        memcpy(fields, body + FS_BLOCKSIZE, LEASE_TRAILER_LEN);
+
+        uint64_t token = (static_cast<uint64_t>(ntohl(fields[0])) << 32) | ntohl(fields[1]);
+        uint32_t term_ms = ntohl(fields[2]);
+
+        cache_block(file, key, offset, body, token, term_ms, requested);
+    }
+
+    file.reads_in_flight--;
+    forget_if_idle(key);
+    reads_landed.notify_all();
+
+    cache_mutex.unlock();
+
+    if(status == 0) {
+        memcpy(buf, body, FS_BLOCKSIZE);
+    }
+
+    return status;
+}
+
+int fs_writeblock(const char* username, const char* pathname, unsigned int offset, const void* buf) {
+
+    std::string key = cache_key(username, pathname);
+    std::vector<std::string> releases = begin_change(key);
+
+    std::string header = request_header(std::string("FS_WRITEBLOCK ") + username + " " + pathname + " " + std::to_string(offset));
+    std::string request = header + std::string(static_cast<const char*>(buf), FS_BLOCKSIZE);
+
+    int status = -1;
+
+    try {
+        //THE SERVER ECHOES ONLY THE HEADER
+        status = fs_common(request, header.length(), nullptr, 0, releases);
+    } catch(...) {
+        end_change(key);
+        throw;
+    }
+
+    end_change(key);
+    return status;
+}
+
+int fs_create(const char* username, const char* pathname, char type) {
+
+    std::string header = request_header(std::string("FS_CREATE ") + username + " " + pathname + " " + type);
+
+    return fs_common(header, header.length(), nullptr, 0);
+}
+
+int fs_delete(const char* username, const char* pathname) {
+
+    std::string key = cache_key(username, pathname);
+    std::vector<std::string> releases = begin_change(key);
+
+    std::string header = request_header(std::string("FS_DELETE ") + username + " " + pathname);
+
+    int status = -1;
+
+    try {
+        status = fs_common(header, header.length(), nullptr, 0, releases);
+    } catch(...) {
+        end_change(key);
+        throw;
+    }
+
+    end_change(key);
+    return status;
+}
+int fs_clone(const char* username, const char* pathname, const char* new_pathname) {
+
+    std::string header = request_header(std::string("FS_CLONE ") + username + " " + pathname + " " + new_pathname);
+
+    return fs_common(header, header.length(), nullptr, 0);
+}
+int fs_snapshot(const char* username, const char* pathname) {
+
+    std::string header = request_header(std::string("FS_SNAPSHOT ") + username + " " + pathname);
+
+    return fs_common(header, header.length(), nullptr, 0);
+}
+
+/*CACHE_KEYS_UNDER
+-------------------------------------------------
+-> The cache key of pathname and of every cached file under it, for fs_rename to change
+them all: a rename moves a directory's whole subtree.
+-------------------------------------------------*/
+
+static std::vector<std::string> cache_keys_under(const char* username, const char* pathname) {
+
+    std::string key = cache_key(username, pathname);
+    std::string prefix = key + '/';
+
+    std::vector<std::string> keys = {key};
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    for(const auto& file : cached_files) {
+        if(file.first.compare(0, prefix.length(), prefix) == 0) {
+            keys.push_back(file.first);
+        }
+    }
+
+    return keys;
+}
+
+int fs_rename(const char* username, const char* pathname, const char* new_pathname) {
+
+    std::vector<std::string> keys = cache_keys_under(username, pathname);
+    std::vector<std::string> releases;
+
+    for(const std::string& key : keys) {
+        std::vector<std::string> key_releases = begin_change(key);
+        releases.insert(releases.end(), key_releases.begin(), key_releases.end());
+    }
+
+    std::string header = request_header(std::string("FS_RENAME ") + username + " " + pathname + " " + new_pathname);
+
+    int status = -1;
+
+    try {
+        status = fs_common(header, header.length(), nullptr, 0, releases);
+    } catch(...) {
+        for(const std::string& key : keys) {
+            end_change(key);
+        }
+        throw;
+    }
+
+    for(const std::string& key : keys) {
+        end_change(key);
+    }
+    return status;
+}
+
+
+int fs_open(const char* username, const char* pathname, uint64_t* handle) {
+
+    std::string header = request_header(std::string("FS_OPEN ") + username + " " + pathname);
+    char encoded[HANDLE_LEN];
+
+    if(fs_common(header, header.length(), encoded, HANDLE_LEN) == -1) {
+        return -1;
+    }
+
+    uint32_t fields[2];
+    memcpy(fields, encoded, HANDLE_LEN);
+    *handle = (static_cast<uint64_t>(ntohl(fields[0])) << 32) | ntohl(fields[1]);
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    handle_keys[*handle] = cache_key(username, pathname);
+
+    return 0;
+}
+
+int fs_readblock_h(const char* username, uint64_t handle, unsigned int offset, void* buf) {
+
+    std::string header = request_header(std::string("FS_READ_H ") + username + " " + std::to_string(handle) + " " + std::to_string(offset));
+
+    return fs_common(header, header.length(), static_cast<char*>(buf), FS_BLOCKSIZE);
+}
+
+int fs_writeblock_h(const char* username, uint64_t handle, unsigned int offset, const void* buf) {
+
+    //A WRITE THROUGH A HANDLE CHANGES THE FILE AS CACHED UNDER THE PATH IT WAS OPENED BY
+    std::string key;
+
+    cache_mutex.lock();
+    auto found = handle_keys.find(handle);
+    if(found != handle_keys.end()) {
+        key = found->second;
+    }
+    cache_mutex.unlock();
+
+    std::vector<std::string> releases;
+    if(!key.empty()) {
+        releases = begin_change(key);
+    }
+
+    std::string header = request_header(std::string("FS_WRITE_H ") + username + " " + std::to_string(handle) + " " + std::to_string(offset));
+    std::string request = header + std::string(static_cast<const char*>(buf), FS_BLOCKSIZE);
+
+    int status = -1;
+
+    try {
+        status = fs_common(request, header.length(), nullptr, 0, releases);
+    } catch(...) {
+        if(!key.empty()) {
+            end_change(key);
+        }
+        throw;
+    }
+
+    if(!key.empty()) {
+        end_change(key);
+    }
+    return status;
+}
+
+int fs_close(const char* username, uint64_t handle) {
+
+    cache_mutex.lock();
+    handle_keys.erase(handle);
+    cache_mutex.unlock();
+
+    std::string header = request_header(std::string("FS_CLOSE ") + username + " " + std::to_string(handle));
+
+    return fs_common(header, header.length(), nullptr, 0);
+}
+
+
+//MUST MATCH TAGGED_SESSION_REQUEST IN fs_system.h
+static const std::string TAGGED_SESSION_REQUEST("FS_SESSION TAGGED", sizeof("FS_SESSION TAGGED"));
+
+//An async request waiting for its response
+struct async_request {
+    std::string header;     //Echoed back ahead of the data
+    size_t response_data;   //Bytes after the echo, copied into data
+    char* data;
+    fs_callback done;
+};
+
+//One tagged session that async calls share (see ASYNC_SUBMIT)
+struct mux_connection {
+    int fd = -1;
+    std::mutex send_mutex;
+    bool send_closed = false;   //The receiver has closed fd
+
+    std::mutex pending_mutex;
+    std::unordered_map<uint64_t, async_request> pending;
+    uint64_t next_tag = 0;
+    bool closed = false;        //Everything still pending has been failed
+
+    //COMPLETED REQUESTS WHOSE CALLBACKS HAVEN'T RUN YET (SEE RUN_CALLBACKS)
+    std::mutex callback_mutex;
+    std::condition_variable callback_ready;
+    std::deque<std::pair<fs_callback, int>> callbacks;
+    bool received_all = false;  //The receiver has queued its last callback
+};
+
+static std::mutex mux_mutex;
+static std::vector<std::shared_ptr<mux_connection>> mux_connections;
+static unsigned int mux_count = 2;
+static unsigned int next_mux = 0;
+
+
+int fs_clientasync(unsigned int connections) {
+
+    if(connections == 0) {
+        return -1;
+    }
+
+    std::vector<std::shared_ptr<mux_connection>> dropped;
+
+    mux_mutex.lock();
+    mux_count = connections;
+    while(mux_connections.size() > mux_count) {
+        dropped.push_back(mux_connections.back());
+        mux_connections.pop_back();
+    }
+    mux_mutex.unlock();
+
+    //THE SERVER STILL ANSWERS WHAT IS IN FLIGHT ON THEM, THEN CLOSES THEM, WHICH STOPS THEIR RECEIVERS
+    for(auto& connection : dropped) {
+        if(connection) {
+            connection->send_mutex.lock();
+            if(!connection->send_closed) {
+                shutdown(connection->fd, SHUT_WR);
+            }
+            connection->send_mutex.unlock();
+        }
+    }
+
+    return 0;
+}
+
+//Hands a completed request's callback to the connection's callback thread
+static void queue_callback(mux_connection& connection, fs_callback done, int status) {
+
+    connection.callback_mutex.lock();
+    connection.callbacks.emplace_back(std::move(done), status);
+    connection.callback_mutex.unlock();
+
+    connection.callback_ready.notify_one();
+}
+
+/*RECEIVE_RESPONSES
+-------------------------------------------------
+-> The receiver thread of one tagged session. Reads "FS_TAG <n>" and then the response to
+request n (its echo and any data), or "FS_FAIL <n>" if the server refused it, and completes
+the request, in whatever order the responses come.
+-> Callbacks don't run here but on the connection's callback thread (see RUN_CALLBACKS), so
+the receiver keeps reading responses whatever a callback does.
+-> When the connection ends (or the server sends something we didn't ask for), every
+request still pending on it fails, and the next async call opens a new one.
+-------------------------------------------------*/
+
+static void receive_responses(std::shared_ptr<mux_connection> connection) {
+
+    std::string buffer;
+    char chunk[4096];
+
+    //READS UNTIL buffer HOLDS AT LEAST want BYTES
+    auto fill = [&](size_t want) {
+        while(buffer.length() < want) {
+            ssize_t got = recv(connection->fd, chunk, sizeof(chunk), 0);
+            if(got < 0 && errno == EINTR) {
+                continue;
+            }
+            if(got <= 0) {
+                return false;
+            }
+            buffer.append(chunk, got);
+        }
+        return true;
+    };
+
+    while(true) {
+
+        size_t end = buffer.find('\0');
+        while(end == std::string::npos && buffer.length() <= 32) {
+            if(!fill(buffer.length() + 1)) {
+                break;
+            }
+            end = buffer.find('\0');
+        }
+        if(end == std::string::npos) {
+            break;
+        }
+
+        std::string tag_line = buffer.substr(0, end);
+        buffer.erase(0, end + 1);
+
+        //A REQUEST THE SERVER WAS TOO BUSY FOR FAILS TOO: THE RECEIVER MUSTN'T SLEEP OFF A BACKOFF
+        bool failed = tag_line.compare(0, 8, "FS_FAIL ") == 0 || tag_line.compare(0, 8, "FS_BUSY ") == 0;
+        if(!failed && tag_line.compare(0, 7, "FS_TAG ") != 0) {
+            break;
+        }
+
+        uint64_t tag = std::strtoull(tag_line.c_str() + (failed ? 8 : 7), nullptr, 10);
+
+        connection->pending_mutex.lock();
+        auto found = connection->pending.find(tag);
+        if(found == connection->pending.end()) {
+            connection->pending_mutex.unlock();
+            break;
+        }
+        async_request request = std::move(found->second);
+        connection->pending.erase(found);
+        connection->pending_mutex.unlock();
+
+        int status = -1;
+
+        if(!failed) {
+            size_t length = request.header.length() + request.response_data;
+
+            if(!fill(length) || buffer.compare(0, request.header.length(), request.header) != 0) {
+                queue_callback(*connection, std::move(request.done), -1);
+                break;
+            }
+
+            if(request.response_data > 0) {
+                memcpy(request.data, buffer.data() + request.header.length(), request.response_data);
+            }
+            buffer.erase(0, length);
+            status = 0;
+        }
+
+        queue_callback(*connection, std::move(request.done), status);
+    }
+
+    connection->send_mutex.lock();
+    connection->send_closed = true;
+    close(connection->fd);
+    connection->send_mutex.unlock();
+
+    connection->pending_mutex.lock();
+    connection->closed = true;
+    std::unordered_map<uint64_t, async_request> abandoned;
+    abandoned.swap(connection->pending);
+    connection->pending_mutex.unlock();
+
+    for(auto& entry : abandoned) {
+        queue_callback(*connection, std::move(entry.second.done), -1);
+    }
+
+    connection->callback_mutex.lock();
+    connection->received_all = true;
+    connection->callback_mutex.unlock();
+    connection->callback_ready.notify_one();
+}
+
+/*RUN_CALLBACKS
+-------------------------------------------------
+-> The callback thread of one tagged session: runs the callbacks of its completed requests,
+in the order their responses arrived, until the receiver has finished.
+-> It is a thread of its own so that a callback can make another async call. That call may
+have to wait for the server to read it, which the server does only once it has sent more
+responses, and the receiver is still there to read those.
+-------------------------------------------------*/
+
+static void run_callbacks(std::shared_ptr<mux_connection> connection) {
+
+    std::unique_lock<std::mutex> lock(connection->callback_mutex);
+
+    while(true) {
+        while(connection->callbacks.empty() && !connection->received_all) {
+            connection->callback_ready.wait(lock);
+        }
+        if(connection->callbacks.empty()) {
+            return;
+        }
+
+        std::pair<fs_callback, int> callback = std::move(connection->callbacks.front());
+        connection->callbacks.pop_front();
+
+        lock.unlock();
+        callback.first(callback.second);
+        lock.lock();
+    }
+}
+
+static std::shared_ptr<mux_connection> open_mux_connection() {
+
+    auto connection = std::make_shared<mux_connection>();
+    connection->fd = open_connection();
+
+    std::string echo;
+    int echoed = -1;
+
+    if(send_all(connection->fd, TAGGED_SESSION_REQUEST.data(), TAGGED_SESSION_REQUEST.length())) {
+        echoed = recv_echo(connection->fd, TAGGED_SESSION_REQUEST, TAGGED_SESSION_REQUEST.length(), echo);
+    }
+
+    //TURNED AWAY: THE CALLS SENT ON IT FAIL, AND THE NEXT ONE AFTER THEM TRIES AGAIN
+    if(echoed == CALL_BUSY) {
+        close(connection->fd);
+        connection->send_closed = true;
+        connection->closed = true;
+        return connection;
+    }
+
+    if(echoed != 0) {
+        close(connection->fd);
+        throw std::runtime_error("The file server does not support tagged sessions");
+    }
+
+    std::thread receiver(receive_responses, connection);
+    receiver.detach();
+
+    std::thread callback_runner(run_callbacks, connection);
+    callback_runner.detach();
+
+    return connection;
+}
+
+//The next tagged session, round robin, replacing any that has closed
+static std::shared_ptr<mux_connection> acquire_mux_connection() {
+
+    std::lock_guard<std::mutex> lock(mux_mutex);
+
+    if(mux_connections.size() < mux_count) {
+        mux_connections.resize(mux_count);
+    }
+
+    std::shared_ptr<mux_connection>& slot = mux_connections[next_mux++ % mux_count];
+
+    bool usable = false;
+    if(slot) {
+        std::lock_guard<std::mutex> pending_lock(slot->pending_mutex);
+        usable = !slot->closed;
+    }
+
+    if(!usable) {
+        slot = open_mux_connection();
+    }
+
+    return slot;
+}
+
+/*ASYNC_SUBMIT
+-------------------------------------------------
+-> Sends request (header, null terminator and any data) on one of the shared tagged sessions
+and returns without waiting; done gets 0 or -1 once the response arrives, as fs_common
+would have returned. response_data bytes after the echo are copied into data first.
+-> Each request gets the next tag on its connection, and is registered under it before it
+is sent, so the response can't beat it there.
+-> preamble (FS_RELEASE) goes out just ahead of it, each with a tag of its own. The server
+applies those as soon as it reads them, so they are in effect before request starts.
+-------------------------------------------------*/
+
+static void async_submit(const std::string& request, size_t header_len, char* data, size_t response_data,
+                         fs_callback done, const std::vector<std::string>& preamble = {}) {
+
+    if(!initialized) {
+        throw std::runtime_error("must first call fs_clientinit");
+    }
+
+    std::shared_ptr<mux_connection> connection = acquire_mux_connection();
+
+    std::string outgoing;
+
+    connection->pending_mutex.lock();
+
+    if(connection->closed) {
+        connection->pending_mutex.unlock();
+        done(-1);
+        return;
+    }
+
+    for(const std::string& message : preamble) {
+        uint64_t tag = connection->next_tag++;
+        connection->pending[tag] = {message, 0, nullptr, [](int) {}};
+        outgoing += request_header("FS_TAG " + std::to_string(tag)) + message;
+    }
+
+    uint64_t tag = connection->next_tag++;
+    connection->pending[tag] = {request.substr(0, header_len), response_data, data, std::move(done)};
+    outgoing += request_header("FS_TAG " + std::to_string(tag)) + request;
+
+    connection->pending_mutex.unlock();
+
+    //IF THE SEND FAILS, THE RECEIVER SEES THE CONNECTION END AND FAILS THE REQUEST
+    connection->send_mutex.lock();
+    if(!connection->send_closed && !send_all(connection->fd, outgoing.data(), outgoing.length())) {
+        shutdown(connection->fd, SHUT_RDWR);
+    }
+    connection->send_mutex.unlock();
+}
+
+//Turns a callback call into a future
+template <typename Call>
+static std::future<int> async_future(Call call) {
+
+    auto promise = std::make_shared<std::promise<int>>();
+    std::future<int> result = promise->get_future();
+
+    call([promise](int status) { promise->set_value(status); });
+
+    return result;
+}
+
+
+void fs_readblock_async(const char* username, const char* pathname, unsigned int offset, void* buf,
+                        fs_callback done) {
+
+    std::string key = cache_key(username, pathname);
+
+    //ASYNC READS USE THE CACHE BUT DON'T FILL IT
+    cache_mutex.lock();
+
+    auto file = cached_files.find(key);
+    if(cache_capacity > 0 && file != cached_files.end() && file->second.expiry > std::chrono::steady_clock::now()) {
+        auto block = file->second.blocks.find(offset);
+
+        if(block != file->second.blocks.end()) {
+            memcpy(buf, block->second.data(), FS_BLOCKSIZE);
+            cache_mutex.unlock();
+            done(0);
+            return;
+        }
+    }
+
+    cache_mutex.unlock();
+
+    std::string header = request_header(std::string("FS_READBLOCK ") + username + " " + pathname + " " + std::to_string(offset));
+
+    async_submit(header, header.length(), static_cast<char*>(buf), FS_BLOCKSIZE, std::move(done));
+}
+
+void fs_writeblock_async(const char* username, const char* pathname, unsigned int offset, const void* buf,
+                         fs_callback done) {
+
+    std::string key = cache_key(username, pathname);
+    std::vector<std::string> releases = begin_change(key);
+
+    std::string header = request_header(std::string("FS_WRITEBLOCK ") + username + " " + pathname + " " + std::to_string(offset));
+    std::string request = header + std::string(static_cast<const char*>(buf), FS_BLOCKSIZE);
+
+    auto finish = [key, done = std::move(done)](int status) {
+        end_change(key);
+        done(status);
+    };
+
+    try {
+        async_submit(request, header.length(), nullptr, 0, std::move(finish), releases);
+    } catch(...) {
+        end_change(key);
+        throw;
+    }
+}
+
+void fs_create_async(const char* username, const char* pathname, char type, fs_callback done) {
+
+    std::string header = request_header(std::string("FS_CREATE ") + username + " " + pathname + " " + type);
+
+    async_submit(header, header.length(), nullptr, 0, std::move(done));
+}
+
+void fs_delete_async(const char* username, const char* pathname, fs_callback done) {
+
+    std::string key = cache_key(username, pathname);
+    std::vector<std::string> releases = begin_change(key);
+
+    std::string header = request_header(std::string("FS_DELETE ") + username + " " + pathname);
+
+    auto finish = [key, done = std::move(done)](int status) {
+        end_change(key);
+        done(status);
+    };
+
+    try {
+        async_submit(header, header.length(), nullptr, 0, std::move(finish), releases);
+    } catch(...) {
+        end_change(key);
+        throw;
+    }
+}
+
+std::future<int> fs_readblock_async(const char* username, const char* pathname, unsigned int offset, void* buf) {
+    return async_future([&](fs_callback done) { fs_readblock_async(username, pathname, offset, buf, std::move(done)); });
+}
+
+std::future<int> fs_writeblock_async(const char* username, const char* pathname, unsigned int offset, const void* buf) {
+    return async_future([&](fs_callback done) { fs_writeblock_async(username, pathname, offset, buf, std::move(done)); });
+}
+
+std::future<int> fs_create_async(const char* username, const char* pathname, char type) {
+    return async_future([&](fs_callback done) { fs_create_async(username, pathname, type, std::move(done)); });
+}
+
+std::future<int> fs_delete_async(const char* username, const char* pathname) {
+    return async_future([&](fs_callback done) { fs_delete_async(username, pathname, std::move(done)); });
+}
@@ -14,6 +14,8 @@
 #error Please use g++ version 11 or higher
 #endif
 
+#include <functional>
+#include <future>
 #include <sys/types.h>
 #include <netinet/in.h>
 
@@ -27,6 +29,46 @@
  */
 int fs_clientinit(const char* hostname, uint16_t port);
 
+/*
+ * Configure the pool of connections the client library keeps open to the
+ * server.  Calls reuse an idle connection when there is one and open another
+ * when there isn't.  Up to max_connections of them are kept open between
+ * calls, each for at most idle_timeout_ms after its last use.  A
+ * max_connections of 0 turns pooling off: every call opens a connection of
+ * its own and the server closes it after responding.
+ *
+ * The default is 16 connections and a 30 second idle timeout.
+ *
+ * fs_clientpool returns 0 on success, -1 on failure.  It is thread safe.
+ */
+int fs_clientpool(unsigned int max_connections, unsigned int idle_timeout_ms);
+
+/*
+ * Configure how calls are retried when the server answers that it is too
+ * busy to serve them (it never started on those, so a retry is always safe).
+ * Such a call is tried again up to max_retries times, each after a random
+ * backoff that starts around 1ms and doubles up to max_backoff_ms, and then
+ * fails.  A max_retries of 0 fails it straight away.
+ *
+ * The default is 8 retries and a 100ms backoff at most.
+ *
+ * fs_clientretry returns 0 on success, -1 on failure (max_backoff_ms is 0).
+ * It is thread safe.
+ */
+int fs_clientretry(unsigned int max_retries, unsigned int max_backoff_ms);
+
+/*
+ * Turn the client block cache on (or off, with 0).  Up to max_blocks blocks
+ * read with fs_readblock are kept, and repeat reads of them are served
+ * without asking the server for as long as the server's read lease on the
+ * file lasts.  The server makes writes, deletes and renames from other
+ * clients wait until every lease on the file has run out, so cached blocks
+ * are never stale.  The cache is off by default.
+ *
+ * fs_clientcache returns 0 on success, -1 on failure.  It is thread safe.
+ */
+int fs_clientcache(unsigned int max_blocks);
+
 /*
  * Read a block of data from the file specified by pathname.  offset specifies
  * the block to be read.  buf specifies where to store the data read from the
@@ -92,3 +134,136 @@ int fs_create(const char* username, const char* pathname, char type);
  * fs_delete is thread safe.
  */
 int fs_delete(const char* username, const char* pathname);
+
+/*
+ * Move the existing file or directory "pathname" to "new_pathname", which may
+ * be in another directory.  A directory is moved along with everything in it.
+ *
+ * fs_rename returns 0 on success, -1 on failure.  Possible failures include:
+ *     pathname or new_pathname is invalid
+ *     pathname does not exist or is not owned by username
+ *     either parent directory does not exist or is not owned by username
+ *     new_pathname already exists
+ *     new_pathname is inside pathname
+ *     the disk or directory containing new_pathname is out of space
+ *     username is invalid
+ *
+ * fs_rename is thread safe.
+ */
+int fs_rename(const char* username, const char* pathname, const char* new_pathname);
+
+/*
+ * Create the file "new_pathname" as a copy of the existing file "pathname".
+ * No data is copied: the two files share their blocks until one of them is
+ * written to, and only the block written is then copied.
+ *
+ * fs_clone returns 0 on success, -1 on failure.  Possible failures include:
+ *     pathname or new_pathname is invalid
+ *     pathname does not exist, is not a file, or is not owned by username
+ *     new_pathname is in a directory that does not exist
+ *     new_pathname is in a directory not owned by username
+ *     new_pathname already exists
+ *     the disk or directory containing new_pathname is out of space
+ *     username is invalid
+ *
+ * fs_clone is thread safe.
+ */
+int fs_clone(const char* username, const char* pathname, const char* new_pathname);
+
+/*
+ * Take a read-only snapshot of the tree "pathname", which must be "/" (the
+ * whole filesystem).  Its files are read with fs_readblock under
+ * "/.snapshot", e.g. "/.snapshot/dir/file", and it is deleted with fs_delete
+ * of "/.snapshot".  There is only one snapshot at a time, and only the user
+ * who took it may delete it.  The server deletes it on its own if a write
+ * would otherwise run out of disk space, or when it restarts.
+ *
+ * fs_snapshot returns 0 on success, -1 on failure.  Possible failures include:
+ *     pathname is not "/"
+ *     a snapshot already exists
+ *     username is invalid
+ *
+ * fs_snapshot is thread safe.
+ */
+int fs_snapshot(const char* username, const char* pathname);
+
+/*
+ * Open the file "pathname" for fs_readblock_h and fs_writeblock_h, which name
+ * it by *handle instead of by path, so the server doesn't have to look the
+ * path up again on every call.  A handle stays bound to the file it was
+ * opened on, even if the file is renamed; once the file is deleted, calls
+ * through it fail.  Close it with fs_close when done.
+ *
+ * fs_open returns 0 on success, -1 on failure.  Possible failures include
+ * those of fs_readblock, and the server having too many files open.
+ *
+ * fs_open, fs_readblock_h, fs_writeblock_h and fs_close are thread safe.
+ */
+int fs_open(const char* username, const char* pathname, uint64_t* handle);
+
+/*
+ * fs_readblock and fs_writeblock on the file handle was opened on.  Both
+ * return 0 on success, -1 on failure.  Possible failures include those of
+ * fs_readblock and fs_writeblock, handle not being open for username, and
+ * the file having been deleted.
+ */
+int fs_readblock_h(const char* username, uint64_t handle, unsigned int offset,
+                   void* buf);
+int fs_writeblock_h(const char* username, uint64_t handle, unsigned int offset,
+                    const void* buf);
+
+/*
+ * Close a handle from fs_open.
+ *
+ * fs_close returns 0 on success, -1 on failure (handle is not open for
+ * username).
+ */
+int fs_close(const char* username, uint64_t handle);
+
+/*
+ * Asynchronous versions of the calls above.  They send the request and return
+ * straight away; the result (what the synchronous call would have returned)
+ * is delivered later, either through the returned future or by calling done.
+ * done is called on a thread the client library keeps for the connection the
+ * call went out on, one call at a time, so a slow done holds up the other
+ * callbacks on that connection (but not the responses).  done may make more
+ * calls, but must not wait for another asynchronous call to complete.  A
+ * read served from the block cache calls done before returning.
+ *
+ * Many calls can be outstanding at once.  They are multiplexed over a few
+ * connections to the server (see fs_clientasync) and may complete in any
+ * order.  They are not retried (see fs_clientretry): one the server is too
+ * busy for fails.  fs_writeblock_async copies buf before returning; fs_readblock_async
+ * writes into buf, which must stay valid until the call completes.
+ *
+ * All of them are thread safe.
+ */
+typedef std::function<void(int status)> fs_callback;
+
+void fs_readblock_async(const char* username, const char* pathname,
+                        unsigned int offset, void* buf, fs_callback done);
+std::future<int> fs_readblock_async(const char* username, const char* pathname,
+                                    unsigned int offset, void* buf);
+
+void fs_writeblock_async(const char* username, const char* pathname,
+                         unsigned int offset, const void* buf, fs_callback done);
+std::future<int> fs_writeblock_async(const char* username, const char* pathname,
+                                     unsigned int offset, const void* buf);
+
+void fs_create_async(const char* username, const char* pathname, char type,
+                     fs_callback done);
+std::future<int> fs_create_async(const char* username, const char* pathname,
+                                 char type);
+
+void fs_delete_async(const char* username, const char* pathname,
+                     fs_callback done);
+std::future<int> fs_delete_async(const char* username, const char* pathname);
+
+/*
+ * Set how many connections the asynchronous calls are spread over, round
+ * robin.  The default is 2.
+ *
+ * fs_clientasync returns 0 on success, -1 on failure (connections is 0).  It
+ * is thread safe.
+ */
+int fs_clientasync(unsigned int connections);
@@ -0,0 +1,367 @@
+#include "fs_defrag.h"
+#include "fs_system.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <sstream>
+#include <thread>
+#include <sys/resource.h>
+#include <unistd.h>
+
+unsigned int defrag_blocks_per_sec = 0;
+
+//HOW LONG THE DEFRAGMENTER RESTS BETWEEN PASSES
+static constexpr unsigned int DEFRAG_PASS_INTERVAL_MS = 5000;
+
+//WHY AN INODE WASN'T MOVED
+enum defrag_skip : uint8_t { SKIP_BUSY, SKIP_SHARED, SKIP_SNAPSHOT, SKIP_NO_ROOM, SKIP_COUNT };
+
+static const char* const defrag_skip_names[SKIP_COUNT] = { "busy", "shared", "snapshot", "no_room" };
+
+/*
+ * A pass's fragmentation: of the pairs of neighbouring blocks in its files,
+ * how many weren't neighbours on disk when it found them and when it left them.
+ */
+struct defrag_score {
+    uint64_t pairs = 0;
+    uint64_t breaks_before = 0;
+    uint64_t breaks_after = 0;
+};
+
+//THE LAST FINISHED PASS'S SCORE
+static boost::mutex score_mutex;
+static defrag_score last_score;
+static bool scored = false;
+
+static std::atomic<uint64_t> passes{0};
+static std::atomic<uint64_t> inodes_moved{0};
+static std::atomic<uint64_t> blocks_moved{0};
+static std::atomic<uint64_t> inodes_skipped[SKIP_COUNT];
+
+
+static uint32_t count_breaks(const fs_inode& node) {
+
+    uint32_t breaks = 0;
+    for(uint32_t i = 1; i < node.size; i++) {
+        if(node.blocks[i] != node.blocks[i - 1] + 1) {
+            breaks++;
+        }
+    }
+    return breaks;
+}
+
+/*LOCK_DIRENTRY_FOR_DEFRAG
+-------------------------------------------------
+-> Like lock_direntry, but the child is only tried for a writer lock. If someone else has it,
+it is reader-locked instead (which is enough to list a directory) and writing is cleared.
+-> Returns the child's inode block, or 0 with nothing locked if fname isn't in main.
+-------------------------------------------------*/
+
+static uint32_t lock_direntry_for_defrag(const fs_inode& main, const std::string& fname, bool& writing) {
+
+    char dir_block_buf[FS_BLOCKSIZE];
+
+    for(uint32_t i = 0; i < main.size; i++) {
+
+        reader_lock(main.blocks[i]);
+        read_block(main.blocks[i], dir_block_buf);
+
+        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_block_buf);
+
+        for(uint32_t j = 0; j < FS_DIRENTRIES; j++) {
+
+            if(direntries[j].inode_block != 0 && strcmp(direntries[j].name, fname.c_str()) == 0) {
+
+                uint32_t child_block = direntries[j].inode_block;
+
+                writing = writer_try_lock(child_block);
+                if(!writing) {
+                    reader_lock(child_block);
+                }
+
+                reader_unlock(main.blocks[i]);
+                return child_block;
+            }
+        }
+
+        reader_unlock(main.blocks[i]);
+    }
+    return 0;
+}
+
+/*LOCK_FOR_DEFRAG
+-------------------------------------------------
+-> Locks the inode at path (the root if path is empty), hand over hand on the way down like
+traverse_tree, but without its ownership checks: the defragmenter works for nobody in
+particular. The inode is writer-locked if it was free, and reader-locked (with writing
+cleared) if not, so a busy directory can still be listed.
+-> Returns false with nothing locked if the path is gone.
+-------------------------------------------------*/
+
+static bool lock_for_defrag(const std::vector<std::string>& path, uint32_t& inode_block, bool& writing) {
+
+    if(path.empty()) {
+        inode_block = 0;
+        writing = writer_try_lock(0);
+        if(!writing) {
+            reader_lock(0);
+        }
+        return true;
+    }
+
+    uint32_t current_block = 0;
+    reader_lock(current_block);
+
+    for(size_t i = 0; i < path.size(); i++) {
+
+        fs_inode main_inode;
+        char main_inode_buf[FS_BLOCKSIZE];
+        read_block(current_block, main_inode_buf);
+        memcpy(&main_inode, main_inode_buf, sizeof(fs_inode));
+
+        uint32_t next_block = 0;
+        if(main_inode.type == 'd' && i + 1 < path.size()) {
+            next_block = lock_direntry(main_inode, path[i], false);
+        } else if(main_inode.type == 'd') {
+            next_block = lock_direntry_for_defrag(main_inode, path[i], writing);
+        }
+
+        reader_unlock(current_block);
+
+        if(next_block == 0) {
+            return false;
+        }
+        current_block = next_block;
+    }
+
+    inode_block = current_block;
+    return true;
+}
+
+/*RELOCATE
+-------------------------------------------------
+-> Moves the blocks of node, whose inode the caller holds writer-locked, into a run of
+neighbouring free blocks (see allocate_run), and returns how many it moved, or 0 if it left
+it where it was.
+-> The copies are written before the inode that points at them, and the old blocks are
+released only after, so a crash part way leaves the file as it was plus some lost free
+blocks, as with any other write.
+-> Blocks shared with another inode would have to stay where the other inode points, so a
+file with any is left alone. snapshot_mutex is reader-locked throughout, so no snapshot can
+be taken in the middle (write_block would copy the new blocks aside for it). The old blocks
+are taken out of the dedup index up front, so nothing starts sharing them while they're being
+copied, and their fingerprints go to the new blocks afterwards.
+-------------------------------------------------*/
+
+static uint32_t relocate(uint32_t inode_block, fs_inode& node) {
+
+    snapshot_mutex.lock_shared();
+    ds_mutex.lock();
+
+    defrag_skip skip = SKIP_COUNT;
+    if(snapshot_active) {
+        skip = SKIP_SNAPSHOT;
+    }
+
+    for(uint32_t i = 0; i < node.size && skip == SKIP_COUNT; i++) {
+        if(block_refcounts[node.blocks[i]] != 1) {
+            skip = SKIP_SHARED;
+        }
+    }
+
+    uint32_t first_block = 0;
+    if(skip == SKIP_COUNT && !allocate_run(node.size, first_block)) {
+        skip = SKIP_NO_ROOM;
+    }
+
+    if(skip != SKIP_COUNT) {
+        ds_mutex.unlock();
+        snapshot_mutex.unlock_shared();
+        inodes_skipped[skip].fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+
+    std::vector<std::pair<uint32_t, uint64_t>> fingerprints;
+    for(uint32_t i = 0; i < node.size; i++) {
+        auto indexed = block_fingerprints.find(node.blocks[i]);
+        if(indexed != block_fingerprints.end()) {
+            fingerprints.emplace_back(first_block + i, indexed->second);
+            dedup_unindex(node.blocks[i]);
+        }
+    }
+
+    ds_mutex.unlock();
+
+    std::vector<char> data(static_cast<size_t>(node.size) * FS_BLOCKSIZE);
+    read_blocks(node.blocks, node.size, data.data());
+
+    for(uint32_t i = 0; i < node.size; i++) {
+        write_block(first_block + i, data.data() + static_cast<size_t>(i) * FS_BLOCKSIZE);
+    }
+
+    uint32_t old_blocks[FS_MAXFILEBLOCKS];
+    memcpy(old_blocks, node.blocks, sizeof(old_blocks));
+
+    for(uint32_t i = 0; i < node.size; i++) {
+        node.blocks[i] = first_block + i;
+    }
+
+    char inode_buf[FS_BLOCKSIZE];
+    memset(inode_buf, 0, FS_BLOCKSIZE);
+    memcpy(inode_buf, &node, sizeof(fs_inode));
+    write_block(inode_block, inode_buf);
+
+    ds_mutex.lock();
+    for(uint32_t i = 0; i < node.size; i++) {
+        release_block(old_blocks[i]);
+    }
+    ds_mutex.unlock();
+
+    snapshot_mutex.unlock_shared();
+
+    for(auto& fingerprint : fingerprints) {
+        dedup_index(fingerprint.first, fingerprint.second);
+    }
+
+    inodes_moved.fetch_add(1, std::memory_order_relaxed);
+    blocks_moved.fetch_add(node.size, std::memory_order_relaxed);
+    return node.size;
+}
+
+/*DEFRAG_PASS
+-------------------------------------------------
+-> Visits every inode in the tree, breadth first by path, and relocates the ones that are
+scattered. Each is locked from the root down on its own, so nothing stays locked between
+inodes, and the pass sleeps off every block it moved at defrag_blocks_per_sec with no locks
+held. A path that was deleted or renamed meanwhile is just gone, and a file created meanwhile
+may be missed until the next pass.
+-> When it is done, the free list is sorted so allocate_block hands blocks out lowest first,
+which lays the next files written out in runs too (the freshly freed blocks would otherwise
+go first).
+-------------------------------------------------*/
+
+static void defrag_pass() {
+
+    defrag_score score;
+
+    std::deque<std::vector<std::string>> paths;
+    paths.emplace_back();
+
+    std::vector<char> dir_blocks_buf(FS_MAXFILEBLOCKS * FS_BLOCKSIZE);
+
+    while(!paths.empty()) {
+
+        std::vector<std::string> path = std::move(paths.front());
+        paths.pop_front();
+
+        uint32_t inode_block = 0;
+        bool writing = false;
+        if(!lock_for_defrag(path, inode_block, writing)) {
+            continue;
+        }
+
+        fs_inode node;
+        char inode_buf[FS_BLOCKSIZE];
+        read_block(inode_block, inode_buf);
+        memcpy(&node, inode_buf, sizeof(fs_inode));
+
+        if(node.type == 'd') {
+            read_blocks(node.blocks, node.size, dir_blocks_buf.data());
+            fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_blocks_buf.data());
+
+            for(uint32_t j = 0; j < node.size * FS_DIRENTRIES; j++) {
+                if(direntries[j].inode_block != 0) {
+                    paths.push_back(path);
+                    paths.back().emplace_back(direntries[j].name, strnlen(direntries[j].name, FS_MAXFILENAME + 1));
+                }
+            }
+        }
+
+        uint32_t breaks = count_breaks(node);
+        uint32_t moved = 0;
+
+        if(breaks > 0 && writing) {
+            moved = relocate(inode_block, node);
+        } else if(breaks > 0) {
+            inodes_skipped[SKIP_BUSY].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        if(writing) {
+            writer_unlock(inode_block);
+        } else {
+            reader_unlock(inode_block);
+        }
+
+        score.pairs += node.size > 0 ? node.size - 1 : 0;
+        score.breaks_before += breaks;
+        score.breaks_after += moved > 0 ? 0 : breaks;
+
+        if(moved > 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(
+                static_cast<uint64_t>(moved) * 1000000 / defrag_blocks_per_sec));
+        }
+    }
+
+    ds_mutex.lock();
+    std::sort(available_disk_blocks.begin(), available_disk_blocks.end(), std::greater<uint32_t>());
+    ds_mutex.unlock();
+
+    score_mutex.lock();
+    last_score = score;
+    scored = true;
+    score_mutex.unlock();
+
+    passes.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void defragmenter() {
+
+#ifdef __linux__
+    //NICE APPLIES PER THREAD ON LINUX, SO THIS LEAVES THE REST OF THE SERVER ALONE
+    setpriority(PRIO_PROCESS, gettid(), 19);
+#endif
+
+    while(true) {
+        defrag_pass();
+        std::this_thread::sleep_for(std::chrono::milliseconds(DEFRAG_PASS_INTERVAL_MS));
+    }
+}
+
+void start_defragmenter() {
+
+    boost::thread defrag_thread(&defragmenter);
+    defrag_thread.detach();
+}
+
+std::string defrag_report() {
+
+    if(defrag_blocks_per_sec == 0) {
+        return "";
+    }
+
+    std::ostringstream report;
+
+    score_mutex.lock();
+    if(scored) {
+        double pairs = last_score.pairs > 0 ? last_score.pairs : 1;
+        report << "# TYPE fs_defrag_score gauge\n"
+               << "fs_defrag_score{when=\"before\"} " << last_score.breaks_before / pairs << "\n"
+               << "fs_defrag_score{when=\"after\"} " << last_score.breaks_after / pairs << "\n";
+    }
+    score_mutex.unlock();
+
+    report << "# TYPE fs_defrag_passes_total counter\n"
+           << "fs_defrag_passes_total " << passes.load(std::memory_order_relaxed) << "\n"
+           << "# TYPE fs_defrag_moved_total counter\n"
+           << "fs_defrag_moved_total{what=\"inodes\"} " << inodes_moved.load(std::memory_order_relaxed) << "\n"
+           << "fs_defrag_moved_total{what=\"blocks\"} " << blocks_moved.load(std::memory_order_relaxed) << "\n"
+           << "# TYPE fs_defrag_skipped_total counter\n";
+
+    for(unsigned int i = 0; i < SKIP_COUNT; i++) {
+        report << "fs_defrag_skipped_total{reason=\"" << defrag_skip_names[i] << "\"} "
+               << inodes_skipped[i].load(std::memory_order_relaxed) << "\n";
+    }
+    return report.str();
+}
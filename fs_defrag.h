@@ -0,0 +1,43 @@
+/*
+ * fs_defrag.h
+ *
+ * The online defragmenter. Blocks come off available_disk_blocks in the
+ * order they were freed, so once files have been created and deleted for
+ * a while, a file's blocks end up scattered across the disk. With fs -F
+ * RATE, a background thread walks the tree over and over and moves each
+ * scattered file (or directory) into a run of neighbouring free blocks,
+ * rewriting its inode's blocks, with the inode writer-locked while it does.
+ * The inode itself stays where it is, so direntries and open handles still
+ * point at it.
+ *
+ * It is throttled to RATE blocks moved per second and runs at the lowest
+ * scheduling priority. An inode that someone else has locked is skipped
+ * until the next pass rather than waited for. A file that shares blocks
+ * with a clone or a dedup match is left alone, and so is everything while
+ * a snapshot is active, since moving blocks the snapshot still reads would
+ * only pin them.
+ *
+ * How scattered the files are is measured by the fragmentation score: the
+ * share of neighbouring blocks in a file that aren't neighbours on disk,
+ * from 0 (every file is one run) to 1. Every pass works it out for the
+ * tree as it found it and as it left it (see defrag_report).
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+//fs -F: blocks the defragmenter may move per second, 0 (the default) to not run it
+extern unsigned int defrag_blocks_per_sec;
+
+/*
+ * Starts the defragmenter's thread. Called once the filesystem is loaded.
+ */
+void start_defragmenter();
+
+/*
+ * The last pass's fragmentation scores and what the passes so far have
+ * moved, for FS_STATS. Empty when the defragmenter isn't running.
+ */
+std::string defrag_report();
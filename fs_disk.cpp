@@ -0,0 +1,719 @@
+#include "fs_disk.h"
+#include "fs_server.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+static uint64_t disk_now() {
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//Block 0 of a freshly formatted disk: an empty root directory, like createfs makes
+static void format_root(char* block) {
+
+    fs_inode root{};
+    root.type = 'd';
+    root.size = 0;
+    memset(block, 0, FS_BLOCKSIZE);
+    memcpy(block, &root, sizeof(fs_inode));
+}
+
+
+void disk_backend::read_batch(const uint32_t* block_nums, size_t count, char* bufs) {
+
+    for (size_t i = 0; i < count; i++) {
+        read(block_nums[i], bufs + i * FS_BLOCKSIZE);
+    }
+}
+
+void disk_backend::write_batch(const uint32_t* block_nums, size_t count, const char* bufs) {
+
+    for (size_t i = 0; i < count; i++) {
+        write(block_nums[i], bufs + i * FS_BLOCKSIZE);
+    }
+}
+
+
+void lib_disk::read(uint32_t block_num, void* buf) {
+    disk_readblock(block_num, buf);
+}
+
+void lib_disk::write(uint32_t block_num, const void* buf) {
+    disk_writeblock(block_num, buf);
+}
+
+
+ram_disk::ram_disk(disk_backend* initial) : image(new char[FS_DISKSIZE * FS_BLOCKSIZE]()) {
+
+    if (initial == nullptr) {
+        format_root(image.get());
+        return;
+    }
+
+    for (uint32_t block_num = 0; block_num < FS_DISKSIZE; block_num++) {
+        initial->read(block_num, image.get() + block_num * FS_BLOCKSIZE);
+    }
+}
+
+//Blocks are copied in and out whole, and the handlers' locks keep two threads from writing one block at once
+void ram_disk::read(uint32_t block_num, void* buf) {
+    memcpy(buf, image.get() + block_num * FS_BLOCKSIZE, FS_BLOCKSIZE);
+}
+
+void ram_disk::write(uint32_t block_num, const void* buf) {
+    memcpy(image.get() + block_num * FS_BLOCKSIZE, buf, FS_BLOCKSIZE);
+}
+
+
+/*OPEN_DISK_IMAGE
+-------------------------------------------------
+-> Opens an image file with the extra open flags, creating and formatting it if it is
+missing or empty. Returns the descriptor, or -1 if the file can't be opened or isn't
+exactly FS_DISKSIZE blocks long.
+-------------------------------------------------*/
+
+int open_disk_image(const std::string& path, int flags) {
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | flags, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (file_stat.st_size == 0) { //NEW IMAGE, FORMAT IT
+        char block[FS_BLOCKSIZE];
+        format_root(block);
+
+        if (ftruncate(fd, static_cast<off_t>(FS_DISKSIZE) * FS_BLOCKSIZE) == -1 ||
+            pwrite(fd, block, FS_BLOCKSIZE, 0) != FS_BLOCKSIZE) {
+            close(fd);
+            return -1;
+        }
+    } else if (file_stat.st_size != static_cast<off_t>(FS_DISKSIZE) * FS_BLOCKSIZE) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+file_disk::file_disk(const std::string& path) : fd(open_disk_image(path, O_DSYNC)) {
+}
+
+file_disk::~file_disk() {
+
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+bool file_disk::is_open() const {
+    return fd != -1;
+}
+
+void file_disk::read(uint32_t block_num, void* buf) {
+
+    off_t offset = static_cast<off_t>(block_num) * FS_BLOCKSIZE;
+    size_t done = 0;
+
+    while (done < FS_BLOCKSIZE) {
+        ssize_t got = pread(fd, static_cast<char*>(buf) + done, FS_BLOCKSIZE - done, offset + done);
+        if (got <= 0) {
+            memset(static_cast<char*>(buf) + done, 0, FS_BLOCKSIZE - done);
+            return;
+        }
+        done += got;
+    }
+}
+
+void file_disk::write(uint32_t block_num, const void* buf) {
+
+    off_t offset = static_cast<off_t>(block_num) * FS_BLOCKSIZE;
+    size_t done = 0;
+
+    while (done < FS_BLOCKSIZE) {
+        ssize_t put = pwrite(fd, static_cast<const char*>(buf) + done, FS_BLOCKSIZE - done, offset + done);
+        if (put <= 0) {
+            return;
+        }
+        done += put;
+    }
+}
+
+
+/*FILE_DISK::WRITE_BATCH
+-------------------------------------------------
+-> Each run of consecutive block numbers (the batch is usually sorted, see write_queue_disk)
+goes down as one pwrite, so O_DSYNC waits for the device once per run instead of once per block.
+-------------------------------------------------*/
+
+void file_disk::write_batch(const uint32_t* block_nums, size_t count, const char* bufs) {
+
+    size_t run_start = 0;
+
+    while (run_start < count) {
+
+        size_t run_end = run_start + 1;
+        while (run_end < count && block_nums[run_end] == block_nums[run_end - 1] + 1) {
+            run_end++;
+        }
+
+        off_t offset = static_cast<off_t>(block_nums[run_start]) * FS_BLOCKSIZE;
+        size_t length = (run_end - run_start) * FS_BLOCKSIZE;
+        size_t done = 0;
+
+        while (done < length) {
+            ssize_t put = pwrite(fd, bufs + run_start * FS_BLOCKSIZE + done, length - done, offset + done);
+            if (put <= 0) {
+                break;
+            }
+            done += put;
+        }
+
+        run_start = run_end;
+    }
+}
+
+
+mmap_disk::mmap_disk(const std::string& path) {
+
+    fd = open_disk_image(path, 0);
+    if (fd == -1) {
+        return;
+    }
+
+    void* mapping = mmap(nullptr, FS_DISKSIZE * FS_BLOCKSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    image = static_cast<char*>(mapping);
+    page_size = sysconf(_SC_PAGESIZE);
+}
+
+mmap_disk::~mmap_disk() {
+
+    if (image != nullptr) {
+        munmap(image, FS_DISKSIZE * FS_BLOCKSIZE);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+bool mmap_disk::is_open() const {
+    return image != nullptr;
+}
+
+void mmap_disk::read(uint32_t block_num, void* buf) {
+    memcpy(buf, image + static_cast<size_t>(block_num) * FS_BLOCKSIZE, FS_BLOCKSIZE);
+}
+
+/*MMAP_DISK::WRITE
+-------------------------------------------------
+-> Copies the block into the mapping and msyncs its page before returning, so blocks
+reach the image in the same order the handlers write them (the order they rely on to
+survive a crash), just like the synchronous writes of the other backends.
+-> msync flushes the whole page, so the other blocks on the page must not be caught halfway
+through a copy. Writers to one page are serialized on that page's stripe of page_mutexes.
+-------------------------------------------------*/
+
+void mmap_disk::write(uint32_t block_num, const void* buf) {
+
+    size_t offset = static_cast<size_t>(block_num) * FS_BLOCKSIZE;
+    size_t page_offset = offset - offset % page_size;
+
+    boost::mutex& page_mutex = page_mutexes[(page_offset / page_size) % PAGE_MUTEX_STRIPES];
+
+    page_mutex.lock();
+    memcpy(image + offset, buf, FS_BLOCKSIZE);
+    msync(image + page_offset, page_size, MS_SYNC);
+    page_mutex.unlock();
+}
+
+const char* mmap_disk::mapped_block(uint32_t block_num) {
+    return image + static_cast<size_t>(block_num) * FS_BLOCKSIZE;
+}
+
+
+simulated_disk::simulated_disk(std::unique_ptr<disk_backend> inner_disk, const disk_profile& disk_profile)
+    : inner(std::move(inner_disk)), profile(disk_profile),
+      channel_free_ns(disk_profile.channels == 0 ? 1 : disk_profile.channels, 0),
+      channel_next_block(channel_free_ns.size(), UINT32_MAX),
+      random_state(disk_now() | 1) {
+}
+
+/*WAIT_FOR_SERVICE
+-------------------------------------------------
+-> Queues count I/Os, each on the channel that frees up first, and sleeps until the last
+of them would have finished, so a busy device builds up a queue the way a real one does
+and a batch spreads over the channels.
+-> An I/O of the block right after the one a channel did last goes to that channel and
+costs only its transfer time, the way a disk head that is already in place doesn't seek.
+-------------------------------------------------*/
+
+void simulated_disk::wait_for_service(const uint32_t* block_nums, size_t count) {
+
+    uint64_t transfer_ns = 0;
+    if (profile.bandwidth_bytes_per_ns > 0) {
+        transfer_ns = static_cast<uint64_t>(FS_BLOCKSIZE / profile.bandwidth_bytes_per_ns);
+    }
+
+    uint64_t now = disk_now();
+    uint64_t last_finish_ns = now;
+
+    channel_mutex.lock();
+
+    for (size_t io = 0; io < count; io++) {
+
+        size_t channel = channel_free_ns.size();
+        for (size_t i = 0; i < channel_next_block.size(); i++) {
+            if (channel_next_block[i] == block_nums[io]) {
+                channel = i;
+                break;
+            }
+        }
+
+        uint64_t service_ns = transfer_ns;
+
+        if (channel == channel_free_ns.size()) {
+            channel = 0;
+            for (size_t i = 1; i < channel_free_ns.size(); i++) {
+                if (channel_free_ns[i] < channel_free_ns[channel]) {
+                    channel = i;
+                }
+            }
+            service_ns += profile.latency_ns;
+        }
+
+        if (profile.jitter_ns > 0 && service_ns > transfer_ns) {
+            //XORSHIFT, GOOD ENOUGH FOR JITTER AND CHEAP UNDER THE MUTEX
+            random_state ^= random_state << 13;
+            random_state ^= random_state >> 7;
+            random_state ^= random_state << 17;
+            service_ns += random_state % (profile.jitter_ns + 1);
+        }
+
+        channel_next_block[channel] = block_nums[io] + 1;
+
+        uint64_t start_ns = channel_free_ns[channel] > now ? channel_free_ns[channel] : now;
+        uint64_t finish_ns = start_ns + service_ns;
+        channel_free_ns[channel] = finish_ns;
+
+        if (finish_ns > last_finish_ns) {
+            last_finish_ns = finish_ns;
+        }
+    }
+
+    channel_mutex.unlock();
+
+    std::this_thread::sleep_for(std::chrono::nanoseconds(last_finish_ns - now));
+}
+
+void simulated_disk::read(uint32_t block_num, void* buf) {
+
+    wait_for_service(&block_num, 1);
+    inner->read(block_num, buf);
+}
+
+void simulated_disk::write(uint32_t block_num, const void* buf) {
+
+    wait_for_service(&block_num, 1);
+    inner->write(block_num, buf);
+}
+
+void simulated_disk::read_batch(const uint32_t* block_nums, size_t count, char* bufs) {
+
+    wait_for_service(block_nums, count);
+    inner->read_batch(block_nums, count, bufs);
+}
+
+void simulated_disk::write_batch(const uint32_t* block_nums, size_t count, const char* bufs) {
+
+    wait_for_service(block_nums, count);
+    inner->write_batch(block_nums, count, bufs);
+}
+
+
+
+coalescing_disk::coalescing_disk(std::unique_ptr<disk_backend> inner_disk) : inner(std::move(inner_disk)) {
+}
+
+//Waits for another thread's read of block_num to land and copies it into buf
+void coalescing_disk::join(uint32_t block_num, read_flight& flight, char* buf) {
+
+    flight_stripe& stripe = stripe_of(block_num);
+    boost::unique_lock<boost::mutex> lock(stripe.mutex);
+
+    while (!flight.done) {
+        stripe.changed.wait(lock);
+    }
+
+    memcpy(buf, flight.data, FS_BLOCKSIZE);
+
+    if (--flight.followers == 0) {
+        stripe.changed.notify_all();
+    }
+}
+
+/*COALESCING_DISK::LAND
+-------------------------------------------------
+-> Called by the thread that issued a read once its data is in. Takes the flight out of the
+table (unless a write already has), wakes its followers, and waits for them to copy the data,
+since the flight and its buffer live on this thread's stack.
+-------------------------------------------------*/
+
+void coalescing_disk::land(uint32_t block_num, read_flight& flight) {
+
+    flight_stripe& stripe = stripe_of(block_num);
+    boost::unique_lock<boost::mutex> lock(stripe.mutex);
+
+    auto it = stripe.flights.find(block_num);
+    if (it != stripe.flights.end() && it->second == &flight) {
+        stripe.flights.erase(it);
+    }
+
+    flight.done = true;
+
+    if (flight.followers == 0) {
+        return;
+    }
+
+    stripe.changed.notify_all();
+
+    while (flight.followers > 0) {
+        stripe.changed.wait(lock);
+    }
+}
+
+void coalescing_disk::read(uint32_t block_num, void* buf) {
+
+    flight_stripe& stripe = stripe_of(block_num);
+
+    stripe.mutex.lock();
+
+    auto it = stripe.flights.find(block_num);
+    if (it != stripe.flights.end()) {
+        read_flight& leader = *it->second;
+        leader.followers++;
+        stripe.mutex.unlock();
+
+        join(block_num, leader, static_cast<char*>(buf));
+        return;
+    }
+
+    read_flight flight;
+    flight.data = static_cast<const char*>(buf);
+    stripe.flights[block_num] = &flight;
+
+    stripe.mutex.unlock();
+
+    inner->read(block_num, buf);
+    land(block_num, flight);
+}
+
+/*COALESCING_DISK::WRITE
+-------------------------------------------------
+-> A read issued before the write finishes may return the old contents, so nobody may join
+one once the write is done. The flight (if any) is dropped from the table before the write,
+and again after it, in case a read was issued while it was under way. Reads that already
+joined still get the result they were waiting for: they overlapped the write.
+-------------------------------------------------*/
+
+void coalescing_disk::drop_flights(const uint32_t* block_nums, size_t count) {
+
+    for (size_t i = 0; i < count; i++) {
+        flight_stripe& stripe = stripe_of(block_nums[i]);
+
+        stripe.mutex.lock();
+        stripe.flights.erase(block_nums[i]);
+        stripe.mutex.unlock();
+    }
+}
+
+void coalescing_disk::write(uint32_t block_num, const void* buf) {
+
+    drop_flights(&block_num, 1);
+    inner->write(block_num, buf);
+    drop_flights(&block_num, 1);
+}
+
+void coalescing_disk::write_batch(const uint32_t* block_nums, size_t count, const char* bufs) {
+
+    drop_flights(block_nums, count);
+    inner->write_batch(block_nums, count, bufs);
+    drop_flights(block_nums, count);
+}
+
+/*COALESCING_DISK::READ_BATCH
+-------------------------------------------------
+-> Joins the flights already under way for any of the blocks, and issues the rest as one
+read_batch of its own (so the inner backend still gets them all at once). Its own reads land
+before it waits on anyone else's, so two batches that joined each other can't deadlock.
+-------------------------------------------------*/
+
+void coalescing_disk::read_batch(const uint32_t* block_nums, size_t count, char* bufs) {
+
+    std::vector<read_flight> flights(count);
+    std::vector<read_flight*> joined(count, nullptr);
+    std::vector<size_t> issued;
+
+    for (size_t i = 0; i < count; i++) {
+        flight_stripe& stripe = stripe_of(block_nums[i]);
+
+        stripe.mutex.lock();
+
+        auto it = stripe.flights.find(block_nums[i]);
+        if (it != stripe.flights.end()) {
+            it->second->followers++;
+            joined[i] = it->second;
+        } else {
+            flights[i].data = bufs + i * FS_BLOCKSIZE;
+            stripe.flights[block_nums[i]] = &flights[i];
+            issued.push_back(i);
+        }
+
+        stripe.mutex.unlock();
+    }
+
+    if (issued.size() == count) {
+        inner->read_batch(block_nums, count, bufs);
+    } else if (!issued.empty()) {
+        std::vector<uint32_t> issued_blocks;
+        std::vector<char> issued_bufs(issued.size() * FS_BLOCKSIZE);
+
+        for (size_t i : issued) {
+            issued_blocks.push_back(block_nums[i]);
+        }
+
+        inner->read_batch(issued_blocks.data(), issued_blocks.size(), issued_bufs.data());
+
+        for (size_t n = 0; n < issued.size(); n++) {
+            memcpy(bufs + issued[n] * FS_BLOCKSIZE, &issued_bufs[n * FS_BLOCKSIZE], FS_BLOCKSIZE);
+        }
+    }
+
+    //EVERY ONE OF OUR READS LANDS BEFORE WE WAIT ON ANYBODY ELSE'S (OR FOR OUR FOLLOWERS)
+    for (size_t i : issued) {
+        flight_stripe& stripe = stripe_of(block_nums[i]);
+        boost::lock_guard<boost::mutex> lock(stripe.mutex);
+
+        auto it = stripe.flights.find(block_nums[i]);
+        if (it != stripe.flights.end() && it->second == &flights[i]) {
+            stripe.flights.erase(it);
+        }
+        flights[i].done = true;
+        stripe.changed.notify_all();
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (joined[i] != nullptr) {
+            join(block_nums[i], *joined[i], bufs + i * FS_BLOCKSIZE);
+        }
+    }
+
+    for (size_t i : issued) {
+        land(block_nums[i], flights[i]);
+    }
+}
+
+const char* coalescing_disk::mapped_block(uint32_t block_num) {
+    return inner->mapped_block(block_num);
+}
+
+
+write_queue_disk::write_queue_disk(std::unique_ptr<disk_backend> inner_disk) : inner(std::move(inner_disk)) {
+}
+
+void write_queue_disk::read(uint32_t block_num, void* buf) {
+    inner->read(block_num, buf);
+}
+
+void write_queue_disk::read_batch(const uint32_t* block_nums, size_t count, char* bufs) {
+    inner->read_batch(block_nums, count, bufs);
+}
+
+const char* write_queue_disk::mapped_block(uint32_t block_num) {
+    return inner->mapped_block(block_num);
+}
+
+void write_queue_disk::write(uint32_t block_num, const void* buf) {
+    write_batch(&block_num, 1, static_cast<const char*>(buf));
+}
+
+/*WRITE_QUEUE_DISK::WRITE_BATCH
+-------------------------------------------------
+-> Adds the blocks to the batch being queued (over the queued copy, if a block is already in
+it) and waits until that batch is durable.
+-> Whichever waiting thread finds no batch being written writes the next one, so there is no
+flusher thread to hand off to, and the thread that wrote a batch returns as soon as its own
+batch is down instead of staying on to write everyone else's.
+-------------------------------------------------*/
+
+void write_queue_disk::write_batch(const uint32_t* block_nums, size_t count, const char* bufs) {
+
+    boost::unique_lock<boost::mutex> lock(queue_mutex);
+
+    for (size_t i = 0; i < count; i++) {
+        auto queued = queued_index.find(block_nums[i]);
+        size_t index = 0;
+
+        if (queued != queued_index.end()) {
+            index = queued->second;
+        } else {
+            index = queued_blocks.size();
+            queued_index[block_nums[i]] = index;
+            queued_blocks.push_back(block_nums[i]);
+            queued_data.resize(queued_data.size() + FS_BLOCKSIZE);
+        }
+
+        memcpy(&queued_data[index * FS_BLOCKSIZE], bufs + i * FS_BLOCKSIZE, FS_BLOCKSIZE);
+    }
+
+    uint64_t batch = queued_batch;
+
+    while (written_batch < batch) {
+        if (!writing) {
+            flush_queued(lock);
+        } else {
+            batch_written.wait(lock);
+        }
+    }
+}
+
+//Writes the batch being queued, sorted by block number. Called, and returns, with lock held
+void write_queue_disk::flush_queued(boost::unique_lock<boost::mutex>& lock) {
+
+    std::vector<uint32_t> blocks;
+    std::vector<char> data;
+
+    blocks.swap(queued_blocks);
+    data.swap(queued_data);
+    queued_index.clear();
+
+    uint64_t batch = queued_batch++;
+    writing = true;
+
+    lock.unlock();
+
+    std::vector<size_t> order(blocks.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&blocks](size_t a, size_t b) { return blocks[a] < blocks[b]; });
+
+    std::vector<uint32_t> sorted_blocks(blocks.size());
+    std::vector<char> sorted_data(data.size());
+
+    for (size_t i = 0; i < order.size(); i++) {
+        sorted_blocks[i] = blocks[order[i]];
+        memcpy(&sorted_data[i * FS_BLOCKSIZE], &data[order[i] * FS_BLOCKSIZE], FS_BLOCKSIZE);
+    }
+
+    inner->write_batch(sorted_blocks.data(), sorted_blocks.size(), sorted_data.data());
+
+    lock.lock();
+
+    written_batch = batch;
+    writing = false;
+
+    batch_written.notify_all();
+}
+
+
+std::unique_ptr<disk_backend> make_disk_backend(const std::string& spec) {
+
+    if (spec == "lib") {
+        return std::unique_ptr<disk_backend>(new lib_disk());
+    }
+
+    if (spec == "ram") {
+        lib_disk initial;
+        return std::unique_ptr<disk_backend>(new ram_disk(&initial));
+    }
+
+    if (spec.compare(0, 5, "file:") == 0 && spec.length() > 5) {
+        std::unique_ptr<file_disk> disk(new file_disk(spec.substr(5)));
+        if (!disk->is_open()) {
+            return nullptr;
+        }
+        return std::move(disk);
+    }
+
+    if (spec.compare(0, 5, "mmap:") == 0 && spec.length() > 5) {
+        std::unique_ptr<mmap_disk> disk(new mmap_disk(spec.substr(5)));
+        if (!disk->is_open()) {
+            return nullptr;
+        }
+        return std::move(disk);
+    }
+
+    if (spec.compare(0, 6, "uring:") == 0 && spec.length() > 6) {
+        std::unique_ptr<uring_disk> disk(new uring_disk(spec.substr(6)));
+        if (!disk->is_open()) {
+            return nullptr;
+        }
+        return std::move(disk);
+    }
+
+    return nullptr;
+}
+
+bool parse_disk_profile(const std::string& profile_spec, disk_profile& profile) {
+
+    //ROUGH NUMBERS FOR A SATA SSD AND A 7200RPM DISK
+    if (profile_spec == "ssd") {
+        profile = {80000, 500e6 / 1e9, 20000, 8};
+        return true;
+    }
+    if (profile_spec == "hdd") {
+        profile = {8000000, 150e6 / 1e9, 4000000, 1};
+        return true;
+    }
+
+    std::vector<double> fields;
+    size_t start = 0;
+
+    while (start <= profile_spec.length()) {
+        size_t comma = profile_spec.find(',', start);
+        if (comma == std::string::npos) {
+            comma = profile_spec.length();
+        }
+
+        std::string field = profile_spec.substr(start, comma - start);
+        char* end = nullptr;
+        double value = std::strtod(field.c_str(), &end);
+        if (field.empty() || *end != '\0' || value < 0) {
+            return false;
+        }
+        fields.push_back(value);
+
+        start = comma + 1;
+    }
+
+    if (fields.size() < 2 || fields.size() > 4) {
+        return false;
+    }
+
+    profile.latency_ns = static_cast<uint64_t>(fields[0] * 1000);
+    profile.bandwidth_bytes_per_ns = fields[1] * 1e6 / 1e9;
+    profile.jitter_ns = fields.size() > 2 ? static_cast<uint64_t>(fields[2] * 1000) : 0;
+    profile.channels = fields.size() > 3 ? static_cast<unsigned int>(fields[3]) : 1;
+
+    return profile.channels > 0;
+}
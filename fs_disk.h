@@ -0,0 +1,301 @@
+/*
+ * fs_disk.h
+ *
+ * Block devices the file server can store its filesystem on.
+ *
+ * read_block and write_block in fs_system.cpp go through the current
+ * disk_backend, so storage can be swapped (or slowed down to model a real
+ * device) without touching the handlers. Every backend holds FS_DISKSIZE
+ * blocks of FS_BLOCKSIZE bytes and must be safe to call from many threads.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/thread.hpp>
+
+class disk_backend {
+public:
+    virtual ~disk_backend() = default;
+
+    virtual void read(uint32_t block_num, void* buf) = 0;
+    virtual void write(uint32_t block_num, const void* buf) = 0;
+
+    /*
+     * Reads count blocks into bufs (count * FS_BLOCKSIZE bytes, in order).
+     * Backends that can have many I/Os in flight issue them all at once;
+     * the default reads them one at a time.
+     */
+    virtual void read_batch(const uint32_t* block_nums, size_t count, char* bufs);
+
+    /*
+     * Writes count blocks from bufs, in no particular order: the caller
+     * must not need any of them to reach the disk before another. Durable
+     * when it returns, like write. The default writes them one at a time.
+     */
+    virtual void write_batch(const uint32_t* block_nums, size_t count, const char* bufs);
+
+    /*
+     * Where block_num's contents live in memory, for backends that can hand
+     * them out without a copy (null otherwise). The pointer stays valid for
+     * the life of the backend; callers must hold the block's inode lock
+     * while they look at it, since a write changes it in place.
+     */
+    virtual const char* mapped_block(uint32_t block_num) { return nullptr; }
+};
+
+/*
+ * The disk image provided by libfs_server.o (disk_readblock/disk_writeblock).
+ * This is the default.
+ */
+class lib_disk : public disk_backend {
+public:
+    void read(uint32_t block_num, void* buf) override;
+    void write(uint32_t block_num, const void* buf) override;
+};
+
+/*
+ * An image held entirely in memory. It starts out as a copy of initial (or
+ * as a freshly formatted disk if initial is null), and nothing is persisted.
+ */
+class ram_disk : public disk_backend {
+public:
+    explicit ram_disk(disk_backend* initial);
+
+    void read(uint32_t block_num, void* buf) override;
+    void write(uint32_t block_num, const void* buf) override;
+
+private:
+    std::unique_ptr<char[]> image;
+};
+
+/*
+ * An image file accessed with pread/pwrite. Writes are synchronous
+ * (O_DSYNC), so they reach the file in the order the handlers issue them.
+ * A missing or empty file is created and formatted.
+ */
+class file_disk : public disk_backend {
+public:
+    explicit file_disk(const std::string& path);
+    ~file_disk() override;
+
+    bool is_open() const;
+
+    void read(uint32_t block_num, void* buf) override;
+    void write(uint32_t block_num, const void* buf) override;
+    void write_batch(const uint32_t* block_nums, size_t count, const char* bufs) override;
+
+private:
+    int fd = -1;
+};
+
+/*
+ * An image file mapped into memory. Reads can be served straight from the
+ * mapping (mapped_block), and every write is msynced before it returns.
+ * A missing or empty file is created and formatted.
+ */
+class mmap_disk : public disk_backend {
+public:
+    explicit mmap_disk(const std::string& path);
+    ~mmap_disk() override;
+
+    bool is_open() const;
+
+    void read(uint32_t block_num, void* buf) override;
+    void write(uint32_t block_num, const void* buf) override;
+    const char* mapped_block(uint32_t block_num) override;
+
+private:
+    static constexpr unsigned int PAGE_MUTEX_STRIPES = 64;
+
+    int fd = -1;
+    char* image = nullptr;
+    size_t page_size = 4096;
+    boost::mutex page_mutexes[PAGE_MUTEX_STRIPES];
+};
+
+/*
+ * An image file read and written through an io_uring (Linux only), with
+ * O_DSYNC so every write is durable when it completes.
+ *
+ * Any thread can queue I/Os. Whichever thread finds no submit in progress
+ * submits everything queued so far in one io_uring_enter call, so under
+ * load many threads' I/Os go to the kernel together. A reaper thread takes
+ * completions off the ring and wakes the threads waiting on them. A
+ * read_batch of a whole directory puts all of its blocks in flight at once.
+ */
+struct uring_ring;
+
+class uring_disk : public disk_backend {
+public:
+    explicit uring_disk(const std::string& path, unsigned int entries = 256);
+    ~uring_disk() override;
+
+    bool is_open() const;
+
+    void read(uint32_t block_num, void* buf) override;
+    void write(uint32_t block_num, const void* buf) override;
+    void read_batch(const uint32_t* block_nums, size_t count, char* bufs) override;
+    void write_batch(const uint32_t* block_nums, size_t count, const char* bufs) override;
+
+private:
+    struct io_batch;
+
+    void submit_and_wait(const uint32_t* block_nums, size_t count, char* bufs, bool is_write);
+    void reap();
+
+    int fd = -1;
+    std::unique_ptr<uring_ring> ring;
+    boost::thread reaper;
+};
+
+/*
+ * How long a simulated device takes per I/O: a fixed latency, the transfer
+ * time at bandwidth, and a uniformly distributed extra delay of up to jitter.
+ * An I/O that carries on from where the last one on its channel ended pays
+ * only the transfer time.
+ * channels I/Os can be in service at once; the rest wait their turn.
+ */
+struct disk_profile {
+    uint64_t latency_ns = 0;
+    double bandwidth_bytes_per_ns = 0; //0 for unlimited
+    uint64_t jitter_ns = 0;
+    unsigned int channels = 1;
+};
+
+/*
+ * Adds a disk_profile's service time to every I/O on another backend.
+ */
+class simulated_disk : public disk_backend {
+public:
+    simulated_disk(std::unique_ptr<disk_backend> inner, const disk_profile& profile);
+
+    void read(uint32_t block_num, void* buf) override;
+    void write(uint32_t block_num, const void* buf) override;
+    void read_batch(const uint32_t* block_nums, size_t count, char* bufs) override;
+    void write_batch(const uint32_t* block_nums, size_t count, const char* bufs) override;
+
+private:
+    void wait_for_service(const uint32_t* block_nums, size_t count);
+
+    std::unique_ptr<disk_backend> inner;
+    disk_profile profile;
+
+    boost::mutex channel_mutex;
+    std::vector<uint64_t> channel_free_ns; //When each channel finishes its last queued I/O
+    std::vector<uint32_t> channel_next_block; //The block right after each channel's last I/O
+    uint64_t random_state;
+};
+
+/*
+ * Coalesces concurrent reads of the same block on another backend: a read
+ * of a block that is already being read waits for that I/O and copies its
+ * result instead of issuing its own, so a crowd of requests for one hot
+ * block costs the device a single read.
+ *
+ * A read never returns data older than a write that finished before it
+ * started, since a write keeps later reads from joining I/Os that were
+ * issued before it finished. fs -C wraps the server's backend in one.
+ */
+class coalescing_disk : public disk_backend {
+public:
+    explicit coalescing_disk(std::unique_ptr<disk_backend> inner);
+
+    void read(uint32_t block_num, void* buf) override;
+    void write(uint32_t block_num, const void* buf) override;
+    void read_batch(const uint32_t* block_nums, size_t count, char* bufs) override;
+    void write_batch(const uint32_t* block_nums, size_t count, const char* bufs) override;
+    const char* mapped_block(uint32_t block_num) override;
+
+private:
+    void drop_flights(const uint32_t* block_nums, size_t count);
+
+    //One read in flight, on the stack of the thread that issued it
+    struct read_flight {
+        const char* data = nullptr;
+        bool done = false;
+        unsigned int followers = 0; //Threads still waiting to copy data
+    };
+
+    static constexpr unsigned int FLIGHT_STRIPES = 64;
+
+    struct flight_stripe {
+        boost::mutex mutex;
+        boost::condition_variable changed;
+        std::unordered_map<uint32_t, read_flight*> flights;
+    };
+
+    flight_stripe& stripe_of(uint32_t block_num) { return stripes[block_num % FLIGHT_STRIPES]; }
+    void join(uint32_t block_num, read_flight& flight, char* buf);
+    void land(uint32_t block_num, read_flight& flight);
+
+    std::unique_ptr<disk_backend> inner;
+    flight_stripe stripes[FLIGHT_STRIPES];
+};
+
+/*
+ * Group commit for another backend's writes. A write waits in a queue while
+ * the batch before it is being written, and then goes down with everything
+ * else that queued up meanwhile as one write_batch, sorted by block number
+ * (so runs of neighbouring blocks are written in one sweep). Two queued
+ * writes of the same block are merged, and only the later one is written.
+ *
+ * write still returns only once its block is durable, so a handler never
+ * has two writes queued at once, and the order it writes in (data before
+ * the inode that points at it, direntry before its parent's inode) is the
+ * order they reach the disk. Writes from different handlers that are in
+ * the queue together don't depend on each other, which is what makes
+ * sorting and merging them safe. fs -W wraps the server's backend in one.
+ */
+class write_queue_disk : public disk_backend {
+public:
+    explicit write_queue_disk(std::unique_ptr<disk_backend> inner);
+
+    void read(uint32_t block_num, void* buf) override;
+    void write(uint32_t block_num, const void* buf) override;
+    void read_batch(const uint32_t* block_nums, size_t count, char* bufs) override;
+    void write_batch(const uint32_t* block_nums, size_t count, const char* bufs) override;
+    const char* mapped_block(uint32_t block_num) override;
+
+private:
+    void flush_queued(boost::unique_lock<boost::mutex>& lock);
+
+    std::unique_ptr<disk_backend> inner;
+
+    boost::mutex queue_mutex;
+    boost::condition_variable batch_written;
+
+    //THE BATCH BEING QUEUED: EACH BLOCK ONCE, ITS DATA AT THE SAME INDEX IN queued_data
+    std::vector<uint32_t> queued_blocks;
+    std::vector<char> queued_data;
+    std::unordered_map<uint32_t, size_t> queued_index;
+
+    uint64_t queued_batch = 1;  //Number of the batch being queued
+    uint64_t written_batch = 0; //Every batch up to this one is durable
+    bool writing = false;       //A thread is writing a batch
+};
+
+/*
+ * Opens an image file for the file-backed backends (open_flags are added to
+ * O_RDWR | O_CREAT), formatting it if it's new. Returns -1 if the file can't
+ * be opened or isn't FS_DISKSIZE blocks long.
+ */
+int open_disk_image(const std::string& path, int open_flags);
+
+/*
+ * Builds a backend from its command line name: "lib", "ram", "file:PATH",
+ * "mmap:PATH" or "uring:PATH".
+ * Returns null if the name isn't recognized or the file can't be opened.
+ */
+std::unique_ptr<disk_backend> make_disk_backend(const std::string& spec);
+
+/*
+ * Parses a simulated device: "ssd", "hdd", or
+ * "LATENCY_US,BANDWIDTH_MBPS[,JITTER_US[,CHANNELS]]".
+ * Returns false if profile_spec isn't valid.
+ */
+bool parse_disk_profile(const std::string& profile_spec, disk_profile& profile);
@@ -0,0 +1,394 @@
+#include "fs_executor.h"
+#include "fs_system.h"
+#include "fs_fairshare.h"
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+
+//The executor the calling thread runs, if any
+static thread_local executor* current_executor = nullptr;
+
+static std::vector<executor*> executors;
+static std::atomic<unsigned int> next_executor{0};
+
+//THE WORKER POOL THE HANDLERS RUN ON, AND THE JOBS WAITING FOR IT, BY USER
+static boost::mutex pool_mutex;
+static boost::condition_variable pool_ready;
+static fair_queue<std::function<void()>> pool_queue;
+
+
+executor::executor() {
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    //A NULL data.ptr MARKS THE EVENTFD, EVERYTHING ELSE IS A SUSPENDED COROUTINE
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &event);
+
+    thread = boost::thread(&executor::run, this);
+}
+
+executor* executor::current() {
+    return current_executor;
+}
+
+void executor::post(std::function<void()> job) {
+
+    queue_mutex.lock();
+    bool was_empty = queue.empty();
+    queue.push_back(std::move(job));
+    queue_mutex.unlock();
+
+    //ONE WAKEUP IS ENOUGH FOR EVERYTHING QUEUED BEFORE THE EXECUTOR GETS TO IT
+    if(was_empty) {
+        uint64_t one = 1;
+        ssize_t written = write(event_fd, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+/*EXECUTOR::WAIT_FD
+-------------------------------------------------
+-> Arms fd in this executor's epoll set for one event (EPOLLONESHOT), with the coroutine
+to resume as its data, so nothing has to be looked up when the event arrives.
+-> A connection's fd is added the first time it waits and re-armed after that. If it
+can't be armed at all, the coroutine is resumed straight away and finds out from its
+next recv or send.
+-------------------------------------------------*/
+
+void executor::wait_fd(int fd, uint32_t events, std::coroutine_handle<> handle) {
+
+    epoll_event event{};
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = handle.address();
+
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1 &&
+       epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        post([handle]() { handle.resume(); });
+    }
+}
+
+/*EXECUTOR::RUN
+-------------------------------------------------
+-> The executor's loop: waits on epoll, resumes every coroutine whose fd is ready, and
+runs the jobs posted to it whenever the eventfd fires.
+-------------------------------------------------*/
+
+void executor::run() {
+
+    current_executor = this;
+
+    static constexpr int MAX_EVENTS = 64;
+    epoll_event events[MAX_EVENTS];
+    std::vector<std::function<void()>> jobs;
+
+    while(true) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+
+        if(ready == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for(int i = 0; i < ready; i++) {
+
+            if(events[i].data.ptr != nullptr) {
+                std::coroutine_handle<>::from_address(events[i].data.ptr).resume();
+                continue;
+            }
+
+            uint64_t count = 0;
+            ssize_t got = read(event_fd, &count, sizeof(count));
+            (void)got;
+
+            queue_mutex.lock();
+            jobs.swap(queue);
+            queue_mutex.unlock();
+
+            for(std::function<void()>& job : jobs) {
+                job();
+            }
+            jobs.clear();
+        }
+    }
+}
+
+
+bool pool_post(std::function<void()> job, const std::string& user, bool bounded) {
+
+    pool_mutex.lock();
+    bool queued = pool_queue.push(user, std::move(job), bounded ? request_queue_limit : SIZE_MAX);
+    pool_mutex.unlock();
+
+    if(queued) {
+        pool_ready.notify_one();
+    }
+    return queued;
+}
+
+static void pool_worker() {
+
+    std::function<void()> job;
+    fair_ticket ticket;
+
+    while(true) {
+        boost::unique_lock<boost::mutex> lock(pool_mutex);
+        while(!pool_queue.pop(job, ticket)) {
+            pool_ready.wait(lock);
+        }
+        lock.unlock();
+
+        job();
+        job = nullptr;
+
+        lock.lock();
+        pool_queue.finish(ticket);
+        bool waiting = !pool_queue.empty();
+        lock.unlock();
+
+        //A USER AT THEIR CAP MAY HAVE HAD A JOB WAITING ON THIS ONE
+        if(waiting) {
+            pool_ready.notify_one();
+        }
+    }
+}
+
+
+//Takes a slot for one more request in flight on connection, if it has one free
+static bool take_tagged_slot(tagged_connection& connection) {
+
+    boost::lock_guard<boost::mutex> lock(connection.state_mutex);
+
+    if(connection.in_flight >= MAX_TAGGED_IN_FLIGHT) {
+        return false;
+    }
+    connection.in_flight++;
+    return true;
+}
+
+/*
+ * co_await tagged_slot_freed{connection} suspends until one of the
+ * connection's requests finishes (see tagged_connection::finish_request).
+ */
+struct tagged_slot_freed {
+    tagged_connection& connection;
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        boost::lock_guard<boost::mutex> lock(connection.state_mutex);
+
+        //A REQUEST MAY HAVE FINISHED SINCE take_tagged_slot LOOKED
+        if(connection.in_flight < MAX_TAGGED_IN_FLIGHT) {
+            return false;
+        }
+        connection.parked = handle;
+        return true;
+    }
+
+    void await_resume() const noexcept {}
+};
+
+
+/*SERVE_CONNECTION
+-------------------------------------------------
+-> One connection, start to finish, as a coroutine on the executor it was dispatched to.
+-> Receives until a whole request is in (suspending whenever the socket runs dry), then runs
+serve_request on the worker pool with a non-blocking response_writer. Whatever the
+writer couldn't send right away is flushed here, suspending whenever the socket is full.
+-> A session connection (see handle_request) goes around again for its next request.
+The socket is closed either way, as in handle_request.
+-> On a tagged session, requests go to the worker pool without waiting for each other, and
+answer for themselves (see TAGGED_CONNECTION in fs_system.cpp). Once MAX_TAGGED_IN_FLIGHT
+are in flight, the coroutine stops reading until one of them finishes.
+-> A request that finds the pool's queue full is answered FS_BUSY without being queued, and
+FS_RELEASE is served right here without queueing at all (see fs_admission.h).
+-------------------------------------------------*/
+
+static detached_task serve_connection(int client_socket) {
+
+    std::string buffer;
+    char buf[FS_BLOCKSIZE + 64];
+    bool session = false;
+
+    std::shared_ptr<tagged_connection> tagged;
+    std::string tag;
+
+    while(true) {
+
+        while(request_length(buffer) == 0 && buffer.length() < MAX_REQUEST_LEN) {
+
+            //NEVER READ FURTHER PAST MAX_REQUEST_LEN THAN handle_request WOULD
+            size_t want = std::min(sizeof(buf), MAX_REQUEST_LEN + 1 - buffer.length());
+            ssize_t got = recv(client_socket, buf, want, MSG_DONTWAIT);
+
+            if(got > 0) {
+                buffer.append(buf, got);
+            }else if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                co_await fd_ready{client_socket, EPOLLIN};
+            }else if(got < 0 && errno == EINTR) {
+                continue;
+            }else {
+                break;
+            }
+        }
+
+        size_t length = request_length(buffer);
+
+        if(session && length == 0) {
+            break;
+        }
+
+        std::string message = (length == 0) ? buffer : buffer.substr(0, length);
+        buffer.erase(0, message.length());
+
+        response_writer writer;
+        writer.client_socket = client_socket;
+        writer.blocking = false;
+
+        if(!session && (message == SESSION_REQUEST || message == TAGGED_SESSION_REQUEST)) {
+            session = true;
+
+            //RESPONSES ON A SESSION CAN FOLLOW EACH OTHER CLOSELY (FS_RELEASE THEN A WRITE), SO
+            //DON'T LET NAGLE HOLD ONE BACK UNTIL THE CLIENT ACKS THE LAST
+            int nodelay = 1;
+            setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+            writer.send(message.c_str(), message.length());
+
+            if(message == TAGGED_SESSION_REQUEST) {
+                tagged = std::make_shared<tagged_connection>(client_socket);
+                tagged->home = executor::current();
+            }
+        }else if(tagged && tag.empty()) {
+            if(!parse_tag(message)) {
+                break;
+            }
+            tag = message;
+            continue;
+        }else if(tagged) {
+            while(!take_tagged_slot(*tagged)) {
+                co_await tagged_slot_freed{*tagged};
+            }
+
+            std::string user = request_user(message);
+
+            if(!pool_post(start_tagged_request(tagged, tag, std::move(message), admission_now()), user)) {
+                metrics_busy(BUSY_QUEUE);
+
+                //THE BUSY RESPONSE STILL GOES OUT FROM THE POOL, BEHIND ANY RESPONSE ALREADY SENDING
+                std::string busy = "FS_BUSY" + tag.substr(6);
+                pool_post([tagged, busy]() {
+                    tagged->send_response(busy);
+                }, "", false);
+            }
+
+            tag.clear();
+            continue;
+        }else if(is_lease_release(message)) {
+            serve_request(message, writer);
+        }else {
+            uint64_t arrived_ns = admission_now();
+            on_pool serving{[&message, &writer, arrived_ns]() {
+                if(!serve_admitted(message, writer, arrived_ns)) {
+                    writer.send(BUSY_RESPONSE.c_str(), BUSY_RESPONSE.length());
+                }
+            }, request_user(message)};
+
+            if(!co_await serving) {
+                metrics_busy(BUSY_QUEUE);
+                writer.send(BUSY_RESPONSE.c_str(), BUSY_RESPONSE.length());
+            }
+        }
+
+        size_t flushed = 0;
+
+        while(!writer.failed && flushed < writer.pending.length()) {
+            ssize_t sent = send(client_socket, writer.pending.data() + flushed,
+                                writer.pending.length() - flushed, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+            if(sent > 0) {
+                flushed += sent;
+            }else if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                co_await fd_ready{client_socket, EPOLLOUT};
+            }else if(sent < 0 && errno == EINTR) {
+                continue;
+            }else {
+                writer.failed = true;
+            }
+        }
+
+        if(!session || !writer.responded || writer.failed) {
+            break;
+        }
+    }
+
+    //A TAGGED SOCKET IS CLOSED BY THE LAST REQUEST STILL ANSWERING ON IT
+    if(!tagged) {
+        close(client_socket);
+        connection_closed();
+    }
+}
+
+
+static detached_task flush_tagged(std::shared_ptr<tagged_connection> connection) {
+
+    do {
+        co_await fd_ready{connection->write_socket, EPOLLOUT};
+    } while(!connection->flush());
+}
+
+/*FLUSH_TAGGED_LATER
+-------------------------------------------------
+-> Starts a coroutine on the connection's executor that waits for room in the socket and
+sends the outbox, until it is empty. It waits on write_socket, a dup of the socket made the
+first time, since the connection's reader may be waiting on the socket itself for EPOLLIN,
+and an fd has only one registration in the executor's epoll set.
+-------------------------------------------------*/
+
+void flush_tagged_later(std::shared_ptr<tagged_connection> connection) {
+
+    connection->home->post([connection]() {
+        if(connection->write_socket == -1) {
+            connection->write_socket = dup(connection->client_socket);
+        }
+
+        //OUT OF FDS: GIVE UP ON THE CLIENT RATHER THAN SPIN
+        if(connection->write_socket == -1) {
+            connection->send_mutex.lock();
+            connection->failed = true;
+            connection->send_mutex.unlock();
+            connection->flush();
+            return;
+        }
+
+        flush_tagged(connection);
+    });
+}
+
+
+void start_executors(unsigned int executor_count, unsigned int worker_count) {
+
+    for(unsigned int i = 0; i < worker_count; i++) {
+        boost::thread worker(&pool_worker);
+        worker.detach();
+    }
+
+    for(unsigned int i = 0; i < executor_count; i++) {
+        executors.push_back(new executor());
+    }
+}
+
+void dispatch_connection(int client_socket) {
+
+    executor* target = executors[next_executor.fetch_add(1, std::memory_order_relaxed) % executors.size()];
+    target->post([client_socket]() { serve_connection(client_socket); });
+}
@@ -0,0 +1,137 @@
+/*
+ * fs_executor.h
+ *
+ * The server's default request pipeline: one executor thread per core, each
+ * running its own epoll loop, and C++20 coroutines for the connections.
+ *
+ * A connection is a coroutine pinned to one executor. It suspends whenever
+ * its socket has nothing to read (or no room to write), so an executor can
+ * keep thousands of slow connections in flight at once. Once a whole request
+ * has arrived, the coroutine hands the handler to the worker pool with
+ * co_await on_pool(...), since the handlers block on inode locks and disk
+ * reads, and resumes back on its executor to finish the response.
+ */
+
+#pragma once
+
+#include <coroutine>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+
+/*
+ * Executors run until the server exits, so they are never destroyed.
+ */
+class executor {
+public:
+    executor();
+    executor(const executor&) = delete;
+    executor& operator=(const executor&) = delete;
+
+    /*
+     * Runs job on this executor's thread. Safe to call from any thread.
+     */
+    void post(std::function<void()> job);
+
+    /*
+     * Resumes handle on this executor once fd has one of events (EPOLLIN,
+     * EPOLLOUT). Only called from this executor's thread.
+     */
+    void wait_fd(int fd, uint32_t events, std::coroutine_handle<> handle);
+
+    /*
+     * The executor the calling thread runs, or null off the executors.
+     */
+    static executor* current();
+
+private:
+    void run();
+
+    int epoll_fd = -1;
+    int event_fd = -1;
+
+    boost::mutex queue_mutex;
+    std::vector<std::function<void()>> queue;
+
+    boost::thread thread;
+};
+
+/*
+ * Fire-and-forget coroutine: starts running as soon as it is called, and
+ * frees itself when it finishes.
+ */
+struct detached_task {
+    struct promise_type {
+        detached_task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/*
+ * co_await fd_ready{fd, EPOLLIN} suspends until fd is readable.
+ */
+struct fd_ready {
+    int fd;
+    uint32_t events;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) { executor::current()->wait_fd(fd, events, handle); }
+    void await_resume() const noexcept {}
+};
+
+struct tagged_connection;
+
+/*
+ * Sends what is left in connection's outbox from its home executor, waiting
+ * for room in the socket as often as it takes (see TAGGED_CONNECTION in
+ * fs_system.cpp). Safe to call from any thread.
+ */
+void flush_tagged_later(std::shared_ptr<tagged_connection> connection);
+
+/*
+ * Queues job on the worker pool as user's (see fs_fairshare.h), unless it is
+ * bounded and user has request_queue_limit jobs waiting there already (see
+ * fs_admission.h). Returns whether it was queued.
+ */
+bool pool_post(std::function<void()> job, const std::string& user, bool bounded = true);
+
+/*
+ * co_await on_pool{fn, user} runs fn on a worker thread, in user's turn, and
+ * resumes the coroutine on the executor it was running on. It returns false,
+ * without suspending, if user's queue was full and fn never ran.
+ */
+struct on_pool {
+    std::function<void()> fn;
+    std::string user;
+    bool queued = false;
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        executor* home = executor::current();
+        queued = pool_post([this, home, handle]() {
+            fn();
+            home->post([handle]() { handle.resume(); });
+        }, user);
+        return queued;
+    }
+
+    bool await_resume() const noexcept { return queued; }
+};
+
+/*
+ * Starts executor_count executors and worker_count pool workers.
+ * Call once, before dispatch_connection.
+ */
+void start_executors(unsigned int executor_count, unsigned int worker_count);
+
+/*
+ * Serves a newly accepted connection on the next executor, round robin.
+ */
+void dispatch_connection(int client_socket);
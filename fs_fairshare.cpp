@@ -0,0 +1,204 @@
+#include "fs_fairshare.h"
+#include "fs_param.h"
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <vector>
+#include <boost/thread.hpp>
+
+//SET BY PARSE_USER_SHARES BEFORE THE SERVER STARTS, READ-ONLY AFTER THAT
+static std::unordered_map<std::string, user_share> user_shares;
+static user_share default_share;
+
+//THE FIRST FAIR_MAX_USER_STATS USERS SEEN, AND EVERYONE ELSE. ENTRIES ARE NEVER REMOVED, SO
+//REFERENCES TO THEM STAY GOOD
+static boost::mutex stats_mutex;
+static std::map<std::string, std::unique_ptr<user_stats>> all_user_stats;
+static user_stats other_user_stats;
+
+static const double report_quantiles[] = { 0.5, 0.99 };
+
+
+//Parses one "WEIGHT[:CAP]"
+static bool parse_share(const std::string& text, user_share& share) {
+
+    char* end = nullptr;
+    unsigned long weight = std::strtoul(text.c_str(), &end, 10);
+    if(end == text.c_str() || weight == 0 || weight > 1000) {
+        return false;
+    }
+
+    unsigned long cap = 0;
+    if(*end == ':') {
+        const char* cap_text = end + 1;
+        cap = std::strtoul(cap_text, &end, 10);
+        if(end == cap_text || cap > 1000000) {
+            return false;
+        }
+    }
+
+    if(*end != '\0') {
+        return false;
+    }
+
+    share.weight = weight;
+    share.max_in_service = cap;
+    return true;
+}
+
+bool parse_user_shares(const std::string& spec) {
+
+    std::unordered_map<std::string, user_share> shares;
+    user_share fallback;
+
+    std::stringstream entries(spec);
+    std::string entry;
+
+    while(std::getline(entries, entry, ',')) {
+
+        size_t equals = entry.find('=');
+        if(equals == std::string::npos || equals == 0 || equals > FS_MAXUSERNAME) {
+            return false;
+        }
+
+        user_share share;
+        if(!parse_share(entry.substr(equals + 1), share)) {
+            return false;
+        }
+
+        std::string user = entry.substr(0, equals);
+        if(user == "*") {
+            fallback = share;
+        }else {
+            shares[user] = share;
+        }
+    }
+
+    user_shares = std::move(shares);
+    default_share = fallback;
+    return true;
+}
+
+user_share share_of(const std::string& user) {
+
+    auto found = user_shares.find(user);
+    return found == user_shares.end() ? default_share : found->second;
+}
+
+std::string request_user(const std::string& message) {
+
+    size_t start = message.find(' ');
+    if(start == std::string::npos) {
+        return "";
+    }
+    start++;
+
+    size_t end = start;
+    while(end < message.length() && message[end] != ' ' && message[end] != '\0') {
+        end++;
+    }
+
+    if(end - start > FS_MAXUSERNAME) {
+        return "";
+    }
+    return message.substr(start, end - start);
+}
+
+user_stats& stats_for_user(const std::string& user) {
+
+    boost::lock_guard<boost::mutex> lock(stats_mutex);
+
+    auto found = all_user_stats.find(user);
+    if(found != all_user_stats.end()) {
+        return *found->second;
+    }
+    if(all_user_stats.size() >= FAIR_MAX_USER_STATS) {
+        return other_user_stats;
+    }
+
+    std::unique_ptr<user_stats>& stats = all_user_stats[user];
+    stats.reset(new user_stats());
+    return *stats;
+}
+
+//A username as a label value, with the characters the text format reserves escaped
+static std::string label_value(const std::string& user) {
+
+    std::string escaped;
+    for(char c : user) {
+        if(c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+/*FAIRSHARE_REPORT
+-------------------------------------------------
+-> One sample per user per line, in the format of metrics_report: fs_user_requests_total,
+fs_user_busy_total, fs_user_service_ns_total, the fs_user_queued and fs_user_in_service
+gauges, and the fs_user_queue_wait_ns summary (p50/p99, _count).
+-> Requests without a user (FS_STATS, replies to requests turned away) are under user="",
+and those of users past the first FAIR_MAX_USER_STATS together under user="*", which is
+how fs -U names everyone not named either.
+-------------------------------------------------*/
+
+std::string fairshare_report() {
+
+    std::vector<std::pair<std::string, user_stats*>> users;
+
+    stats_mutex.lock();
+    for(auto& entry : all_user_stats) {
+        users.emplace_back(label_value(entry.first), entry.second.get());
+    }
+    if(all_user_stats.size() >= FAIR_MAX_USER_STATS) {
+        users.emplace_back("*", &other_user_stats);
+    }
+    stats_mutex.unlock();
+
+    std::ostringstream report;
+
+    report << "# TYPE fs_user_requests_total counter\n";
+    for(auto& user : users) {
+        report << "fs_user_requests_total{user=\"" << user.first << "\"} "
+               << user.second->served.load(std::memory_order_relaxed) << "\n";
+    }
+
+    report << "# TYPE fs_user_busy_total counter\n";
+    for(auto& user : users) {
+        report << "fs_user_busy_total{user=\"" << user.first << "\"} "
+               << user.second->turned_away.load(std::memory_order_relaxed) << "\n";
+    }
+
+    report << "# TYPE fs_user_service_ns_total counter\n";
+    for(auto& user : users) {
+        report << "fs_user_service_ns_total{user=\"" << user.first << "\"} "
+               << user.second->service_ns.load(std::memory_order_relaxed) << "\n";
+    }
+
+    report << "# TYPE fs_user_queued gauge\n";
+    for(auto& user : users) {
+        report << "fs_user_queued{user=\"" << user.first << "\"} "
+               << user.second->queued.load(std::memory_order_relaxed) << "\n";
+    }
+
+    report << "# TYPE fs_user_in_service gauge\n";
+    for(auto& user : users) {
+        report << "fs_user_in_service{user=\"" << user.first << "\"} "
+               << user.second->in_service.load(std::memory_order_relaxed) << "\n";
+    }
+
+    report << "# TYPE fs_user_queue_wait_ns summary\n";
+    for(auto& user : users) {
+        const latency_histogram& wait = user.second->queue_wait;
+        for(double q : report_quantiles) {
+            report << "fs_user_queue_wait_ns{user=\"" << user.first << "\",quantile=\"" << q << "\"} "
+                   << wait.percentile(q) << "\n";
+        }
+        report << "fs_user_queue_wait_ns_count{user=\"" << user.first << "\"} " << wait.count() << "\n";
+    }
+
+    return report.str();
+}
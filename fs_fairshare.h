@@ -0,0 +1,321 @@
+/*
+ * fs_fairshare.h
+ *
+ * Per-user fair sharing of the server's workers.
+ *
+ * Requests wait for a worker (on the executors' pool, or for one of -T's
+ * service slots) in a fair_queue, which keeps a queue per user and takes
+ * from them by deficit round robin. A user who floods the server waits
+ * behind their own requests instead of in front of everyone else's.
+ *
+ * What is shared out is worker time, not request counts: each turn earns a
+ * user weight * FAIR_QUANTUM_NS of credit, and each request they start is
+ * charged its cost, estimated up front from their recent requests and
+ * corrected once it finishes. A user whose requests are slow gets fewer.
+ *
+ * A user can also be capped at some number of requests in service at once,
+ * so they can't take every worker even when nobody else is waiting.
+ *
+ * Weights and caps are set with fs -U (see parse_user_shares). FS_STATS
+ * reports each user's requests and queue waits (see fairshare_report).
+ */
+
+#pragma once
+
+#include "fs_metrics.h"
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+/*
+ * A user's share of the workers: their weight in the round robin, and how
+ * many of their requests may be in service at once (0 for no cap).
+ */
+struct user_share {
+    unsigned int weight = 1;
+    unsigned int max_in_service = 0;
+};
+
+/*
+ * Parses fs -U's "USER=WEIGHT[:CAP],...", where "*" stands for every user
+ * not named. Returns false, leaving the shares alone, if spec is malformed.
+ */
+bool parse_user_shares(const std::string& spec);
+
+user_share share_of(const std::string& user);
+
+/*
+ * The user a request message is from (its second field), or "" for the
+ * requests that have none (FS_STATS) or an overlong one.
+ */
+std::string request_user(const std::string& message);
+
+/*
+ * Since the server started. queued and in_service are what they are now.
+ */
+struct user_stats {
+    std::atomic<uint64_t> served{0};
+    std::atomic<uint64_t> turned_away{0};    //Answered FS_BUSY
+    std::atomic<uint64_t> service_ns{0};     //Worker time spent on them
+    std::atomic<int64_t> queued{0};
+    std::atomic<int64_t> in_service{0};
+    latency_histogram queue_wait;            //ns from queued to started
+};
+
+/*
+ * The stats of user, created the first time they are asked for. Only the
+ * first FAIR_MAX_USER_STATS users get their own; everyone after them shares
+ * one, reported as user="*". The reference stays good for as long as the
+ * server runs.
+ */
+user_stats& stats_for_user(const std::string& user);
+
+/*
+ * Every user's stats in the Prometheus text format, for FS_STATS.
+ */
+std::string fairshare_report();
+
+//CREDIT PER UNIT OF WEIGHT PER TURN, AND WHAT A NEW USER'S REQUESTS ARE EXPECTED TO COST
+static constexpr int64_t FAIR_QUANTUM_NS = 1000000;
+static constexpr uint64_t FAIR_FIRST_ESTIMATE_NS = 100000;
+
+//USERS WITH STATS OF THEIR OWN, AND IDLE TENANTS IN DEBT A FAIR_QUEUE KEEPS BEFORE FORGIVING THEM
+static constexpr size_t FAIR_MAX_USER_STATS = 1024;
+static constexpr size_t FAIR_MAX_IDLE_TENANTS = 1024;
+
+/*
+ * One user's standing in a fair_queue.
+ */
+struct fair_account {
+    std::string user;
+    user_share share;
+    user_stats* stats = nullptr;
+    int64_t deficit_ns = 0;           //Credit left this turn, negative while in debt
+    uint64_t estimate_ns = FAIR_FIRST_ESTIMATE_NS;
+    unsigned int in_service = 0;
+    bool in_round = false;            //Has requests queued, so takes turns
+};
+
+/*
+ * What fair_queue::pop hands out with a request, to give back to finish
+ * (or cancel, if the request never ran) once it is done.
+ */
+struct fair_ticket {
+    fair_account* account = nullptr;
+    uint64_t charged_ns = 0;
+    uint64_t started_ns = 0;
+};
+
+/*
+ * fair_queue
+ *
+ * Items (jobs, or threads waiting for a slot) queued per user and taken in
+ * deficit round robin order. Not thread safe: its owner guards it, and
+ * calls finish and cancel under the same lock.
+ *
+ * A user has a tenant only while they have something queued or in service,
+ * or are in debt (see pop); once idle and square, the tenant is dropped.
+ */
+template <typename Item>
+class fair_queue {
+public:
+    /*
+     * Queues item for user, unless they already have limit items queued.
+     * Returns whether it was queued.
+     */
+    bool push(const std::string& user, Item item, size_t limit);
+
+    /*
+     * Takes the next item from a user under their cap. Returns false if
+     * there is none.
+     */
+    bool pop(Item& item, fair_ticket& ticket);
+
+    /*
+     * The item ticket was handed out with has finished, or with cancel,
+     * gave up its turn without running.
+     */
+    void finish(const fair_ticket& ticket);
+    void cancel(const fair_ticket& ticket);
+
+    bool empty() const { return queued_total == 0; }
+
+private:
+    struct tenant {
+        fair_account account;
+        std::deque<std::pair<Item, uint64_t>> queued;  //With when each was queued
+    };
+
+    void retire_if_idle(fair_account& account);
+    void forgive_idle();
+
+    std::unordered_map<std::string, tenant> tenants;
+    std::deque<tenant*> round;  //The tenants with something queued, whoever's turn it is first
+    size_t queued_total = 0;
+    size_t forgive_at = FAIR_MAX_IDLE_TENANTS;  //Sweep idle debtors once there are this many tenants
+};
+
+
+template <typename Item>
+bool fair_queue<Item>::push(const std::string& user, Item item, size_t limit) {
+
+    auto found = tenants.find(user);
+    if(found == tenants.end()) {
+        if(tenants.size() >= forgive_at) {
+            forgive_idle();
+        }
+        found = tenants.emplace(user, tenant()).first;
+        found->second.account.user = user;
+        found->second.account.share = share_of(user);
+        found->second.account.stats = &stats_for_user(user);
+    }
+    tenant& queue = found->second;
+
+    if(queue.queued.size() >= limit) {
+        queue.account.stats->turned_away.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    queue.queued.emplace_back(std::move(item), metrics_now());
+    queued_total++;
+    queue.account.stats->queued.fetch_add(1, std::memory_order_relaxed);
+
+    if(!queue.account.in_round) {
+        queue.account.in_round = true;
+        round.push_back(&queue);
+    }
+    return true;
+}
+
+/*FAIR_QUEUE::POP
+-------------------------------------------------
+-> Deficit round robin: the tenant at the front of the round starts requests for as long as
+it has credit, then goes to the back with another quantum. A tenant still in debt from a
+slow request takes turns without starting anything until its credit comes back.
+-> A tenant at its cap is passed over (and earns nothing), and if every tenant in the round
+is, nothing can start.
+-> Each request is charged the tenant's running estimate as it starts; finish settles the
+difference. Charging up front keeps one tenant from taking several workers at once on
+credit that its requests already in service will use up.
+-> A tenant whose queue runs dry leaves the round and loses any credit left, so a user
+can't bank credit while idle, but keeps any debt. Once its last request is done too, it
+is dropped if it is square, and otherwise kept with its debt until it comes back, or
+until FAIR_MAX_IDLE_TENANTS idle debtors pile up and forgive_idle drops them all.
+-------------------------------------------------*/
+
+template <typename Item>
+bool fair_queue<Item>::pop(Item& item, fair_ticket& ticket) {
+
+    size_t passed_over = 0;
+
+    while(passed_over < round.size()) {
+
+        tenant* next = round.front();
+        fair_account& account = next->account;
+
+        if(account.share.max_in_service != 0 && account.in_service >= account.share.max_in_service) {
+            round.pop_front();
+            round.push_back(next);
+            passed_over++;
+            continue;
+        }
+        passed_over = 0;
+
+        if(account.deficit_ns <= 0) {
+            account.deficit_ns += FAIR_QUANTUM_NS * account.share.weight;
+            round.pop_front();
+            round.push_back(next);
+            continue;
+        }
+
+        uint64_t now = metrics_now();
+
+        item = std::move(next->queued.front().first);
+        account.stats->queue_wait.record(now - next->queued.front().second);
+        next->queued.pop_front();
+        queued_total--;
+
+        account.in_service++;
+        account.deficit_ns -= account.estimate_ns;
+        account.stats->queued.fetch_sub(1, std::memory_order_relaxed);
+        account.stats->in_service.fetch_add(1, std::memory_order_relaxed);
+
+        ticket.account = &account;
+        ticket.charged_ns = account.estimate_ns;
+        ticket.started_ns = now;
+
+        if(next->queued.empty()) {
+            round.pop_front();
+            account.in_round = false;
+            if(account.deficit_ns > 0) {
+                account.deficit_ns = 0;
+            }
+        }
+        return true;
+    }
+
+    return false;
+}
+
+template <typename Item>
+void fair_queue<Item>::finish(const fair_ticket& ticket) {
+
+    fair_account& account = *ticket.account;
+    uint64_t service_ns = metrics_now() - ticket.started_ns;
+
+    account.in_service--;
+    account.deficit_ns -= static_cast<int64_t>(service_ns) - static_cast<int64_t>(ticket.charged_ns);
+    account.estimate_ns = (account.estimate_ns * 7 + service_ns) / 8;
+
+    account.stats->in_service.fetch_sub(1, std::memory_order_relaxed);
+    account.stats->served.fetch_add(1, std::memory_order_relaxed);
+    account.stats->service_ns.fetch_add(service_ns, std::memory_order_relaxed);
+
+    retire_if_idle(account);
+}
+
+template <typename Item>
+void fair_queue<Item>::cancel(const fair_ticket& ticket) {
+
+    fair_account& account = *ticket.account;
+
+    account.in_service--;
+    account.deficit_ns += ticket.charged_ns;
+    account.stats->in_service.fetch_sub(1, std::memory_order_relaxed);
+
+    retire_if_idle(account);
+}
+
+//Drops account's tenant if it has nothing queued or in service and owes nothing
+template <typename Item>
+void fair_queue<Item>::retire_if_idle(fair_account& account) {
+
+    if(account.in_round || account.in_service != 0) {
+        return;
+    }
+
+    //IDLE TENANTS DON'T KEEP CREDIT (SEE POP)
+    if(account.deficit_ns > 0) {
+        account.deficit_ns = 0;
+    }
+
+    if(account.deficit_ns == 0) {
+        tenants.erase(tenants.find(account.user));
+    }
+}
+
+//Drops every idle tenant, debt or not, so users seen once can't pile up
+template <typename Item>
+void fair_queue<Item>::forgive_idle() {
+
+    for(auto it = tenants.begin(); it != tenants.end();) {
+        if(!it->second.account.in_round && it->second.account.in_service == 0) {
+            it = tenants.erase(it);
+        }else {
+            it++;
+        }
+    }
+    forgive_at = tenants.size() + FAIR_MAX_IDLE_TENANTS;
+}
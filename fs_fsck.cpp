@@ -0,0 +1,572 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fs_server.h"
+
+/*
+ * fs_fsck
+ *
+ * Checks a disk image (as the file, mmap and uring backends keep one, see
+ * fs_disk.h) for the damage the server would otherwise trust at startup,
+ * and with -r repairs it:
+ *
+ *   fs_fsck [-r] [-j THREADS] IMAGE
+ *
+ * The image can be any whole number of blocks, so images for a server built
+ * with a larger FS_DISKSIZE are checked the same way.
+ *
+ * There is no allocation map on disk: the server takes every block it can't
+ * reach from the root to be free (see set_used_blocks). So the checker walks
+ * the tree from block 0 and finds
+ *  - blocks used twice: an inode linked from two direntries (or from inside
+ *    itself), or a block that is two things at once. File data blocks shared
+ *    between files are fine, since FS_CLONE and dedup (fs -d) share them,
+ *  - direntries that are malformed, repeat a name in their directory, or
+ *    dangle: point outside the image or at a block that isn't an inode,
+ *  - inodes with bad sizes: more than FS_MAXFILEBLOCKS blocks (cut back to
+ *    the blocks listed), or blocks outside the image,
+ *  - directory blocks with no direntries left (the server frees those).
+ * Unreachable blocks are free, whatever they hold: a deleted file leaves
+ * its inode behind on disk, and that can't be told apart from a lost one,
+ * so neither is counted.
+ *
+ * Repairs keep as much as they can. A direntry that can't be followed is
+ * cleared; of two links to one inode, the first one found is kept. A file block that is bad or taken by something else is replaced
+ * with a free block (a copy of the taken one's contents, or zeros), so the
+ * file's other blocks stay at their offsets. A directory block that is bad,
+ * taken or empty is dropped. Everything is fixed in memory first and the
+ * changed blocks written back at the end, after which the image is checked
+ * again.
+ *
+ * Reading and sizing up the image's blocks is split across THREADS threads
+ * (as many as there are CPUs by default). The walk itself only touches
+ * memory by then, and is done on one thread, so its repairs don't depend on
+ * thread timing.
+ *
+ * Exits with 0 if the image is clean, 1 if it was repaired, 4 if problems
+ * are left (it wasn't run with -r, or the root isn't a directory) and 8 if
+ * the image can't be read.
+ */
+
+enum block_use : uint8_t {
+    USE_FREE, USE_INODE, USE_DIRECTORY, USE_FILE
+};
+
+enum fsck_problem {
+    PROBLEM_DOUBLY_ALLOCATED, PROBLEM_DANGLING_DIRENTRY, PROBLEM_BAD_DIRENTRY, PROBLEM_DUPLICATE_NAME,
+    PROBLEM_BAD_SIZE, PROBLEM_BAD_BLOCK, PROBLEM_EMPTY_DIRECTORY_BLOCK, PROBLEM_COUNT
+};
+
+static const char* problem_names[PROBLEM_COUNT] = {
+    "doubly allocated blocks", "dangling direntries", "malformed direntries", "repeated names",
+    "bad sizes", "bad block numbers", "empty directory blocks"
+};
+
+struct fsck_config {
+    const char* image_path = nullptr;
+    bool repair = false;
+    unsigned int threads = 1;
+};
+
+//A FILE BLOCK TO REPLACE ONCE THE FREE BLOCKS ARE KNOWN: blocks[index] OF THE INODE, WITH A COPY OF source (OR ZEROS)
+struct block_replacement {
+    uint32_t inode_block;
+    uint32_t index;
+    uint32_t source;
+};
+
+struct fsck_image {
+    std::vector<char> data;
+    uint32_t block_count = 0;
+    std::vector<uint8_t> inode_shaped;   //Filled in by scan_image
+    std::vector<uint8_t> dirty;          //Changed by a repair, to be written back
+
+    char* block(uint32_t block_num) { return data.data() + static_cast<size_t>(block_num) * FS_BLOCKSIZE; }
+};
+
+//What one check found
+struct fsck_result {
+    uint64_t problems[PROBLEM_COUNT] = {};
+    uint64_t files = 0;
+    uint64_t directories = 0;
+    uint64_t data_blocks = 0;
+    uint64_t shared_blocks = 0;   //File data blocks listed more than once
+    uint64_t free_blocks = 0;
+    bool root_ok = true;
+
+    uint64_t total() const {
+        uint64_t sum = 0;
+        for (uint64_t count : problems) {
+            sum += count;
+        }
+        return sum;
+    }
+};
+
+
+static void usage(const char* name) {
+
+    std::cout << "usage: " << name << " [options] <image>\n"
+              << "  -r           repair what can be repaired\n"
+              << "  -j threads   threads to read and scan the image with (default one per CPU)\n";
+    exit(8);
+}
+
+static double ms_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+//True if field (of size bytes) holds a null terminated string, and a non-empty one if need_text
+static bool terminated(const char* field, size_t size, bool need_text) {
+
+    const char* end = static_cast<const char*>(memchr(field, '\0', size));
+    return end != nullptr && (!need_text || end != field);
+}
+
+
+/*SCAN_IMAGE
+-------------------------------------------------
+-> Reads the image into memory, each of threads threads reading (with pread) and then sizing up
+its own stretch of blocks: whether each block is shaped like an inode, that is has a type of
+'f' or 'd' and a null terminated owner. Sizes and block numbers are the walk's to check.
+-> Returns false if the image can't be read.
+-------------------------------------------------*/
+
+static bool scan_image(int fd, unsigned int threads, fsck_image& image) {
+
+    image.data.resize(static_cast<size_t>(image.block_count) * FS_BLOCKSIZE);
+    image.inode_shaped.assign(image.block_count, 0);
+    image.dirty.assign(image.block_count, 0);
+
+    std::vector<uint8_t> failed(threads, 0);
+    std::vector<std::thread> scanners;
+    uint32_t stretch = (image.block_count + threads - 1) / threads;
+
+    for (unsigned int id = 0; id < threads; id++) {
+        scanners.emplace_back([&, id]() {
+            uint32_t first = std::min(image.block_count, id * stretch);
+            uint32_t last = std::min(image.block_count, first + stretch);
+
+            size_t done = 0;
+            size_t length = static_cast<size_t>(last - first) * FS_BLOCKSIZE;
+            off_t offset = static_cast<off_t>(first) * FS_BLOCKSIZE;
+
+            while (done < length) {
+                ssize_t got = pread(fd, image.block(first) + done, length - done, offset + done);
+                if (got <= 0) {
+                    failed[id] = 1;
+                    return;
+                }
+                done += got;
+            }
+
+            for (uint32_t block_num = first; block_num < last; block_num++) {
+                const fs_inode* node = reinterpret_cast<const fs_inode*>(image.block(block_num));
+                image.inode_shaped[block_num] = (node->type == 'f' || node->type == 'd') &&
+                                                terminated(node->owner, sizeof(node->owner), false);
+            }
+        });
+    }
+    for (std::thread& scanner : scanners) {
+        scanner.join();
+    }
+
+    for (uint8_t failure : failed) {
+        if (failure) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * fsck_walk
+ *
+ * One walk of the tree from the root, fixing what it finds in the image in
+ * memory as it goes so that one problem doesn't set off others further down.
+ */
+class fsck_walk {
+public:
+    fsck_walk(fsck_image& image, fsck_result& result) :
+        image(image), result(result), use(image.block_count, USE_FREE), paths(image.block_count) {}
+
+    void run();
+
+private:
+    void report(fsck_problem problem, const std::string& path, const std::string& what);
+    void check_blocks(uint32_t inode_block, fs_inode& node, const std::string& path);
+    void check_directory(uint32_t inode_block, fs_inode& node, const std::string& path);
+    void replace_blocks();
+
+    fsck_image& image;
+    fsck_result& result;
+    std::vector<uint8_t> use;
+    std::vector<std::string> paths;   //Whose each block is, for the reports
+    std::vector<std::pair<uint32_t, std::string>> pending;   //Inodes linked but not yet checked
+    std::vector<block_replacement> replacements;
+};
+
+void fsck_walk::report(fsck_problem problem, const std::string& path, const std::string& what) {
+
+    result.problems[problem]++;
+    std::cout << (path.empty() ? "/" : path) << ": " << what << "\n";
+}
+
+/*FSCK_WALK::CHECK_BLOCKS
+-------------------------------------------------
+-> Checks node's size and block list, and claims its blocks for it. A block outside the image,
+or one already in use by something other than another file's data, is a problem: a file's is
+kept in its slot and replaced by replace_blocks once the walk is done, a directory's is dropped.
+-------------------------------------------------*/
+
+void fsck_walk::check_blocks(uint32_t inode_block, fs_inode& node, const std::string& path) {
+
+    //THE SERVER ZEROES THE SLOTS PAST THE END, SO THOSE TELL HOW MANY BLOCKS THERE REALLY ARE
+    if (node.size > FS_MAXFILEBLOCKS) {
+        report(PROBLEM_BAD_SIZE, path, "size " + std::to_string(node.size) + " is more than " +
+               std::to_string(FS_MAXFILEBLOCKS) + " blocks");
+        node.size = 0;
+        while (node.size < FS_MAXFILEBLOCKS && node.blocks[node.size] != 0) {
+            node.size++;
+        }
+    }
+
+    block_use kind = node.type == 'd' ? USE_DIRECTORY : USE_FILE;
+    uint32_t kept = 0;
+
+    for (uint32_t i = 0; i < node.size; i++) {
+        uint32_t block_num = node.blocks[i];
+        bool bad = block_num == 0 || block_num >= image.block_count;
+        uint32_t source = 0;
+
+        if (bad) {
+            report(PROBLEM_BAD_BLOCK, path, "block " + std::to_string(i) + " is " + std::to_string(block_num) +
+                   ", outside the image");
+        } else if (use[block_num] == USE_FILE && kind == USE_FILE) {
+            result.shared_blocks++;
+        } else if (use[block_num] != USE_FREE) {
+            report(PROBLEM_DOUBLY_ALLOCATED, path, "block " + std::to_string(block_num) + " is also used by " +
+                   (paths[block_num].empty() ? "/" : paths[block_num]));
+            bad = true;
+            source = block_num;
+        } else {
+            use[block_num] = kind;
+            paths[block_num] = path;
+            result.data_blocks++;
+        }
+
+        if (bad && kind == USE_DIRECTORY) {
+            continue;
+        }
+        if (bad) {
+            replacements.push_back({inode_block, kept, source});
+        }
+        node.blocks[kept++] = block_num;
+    }
+
+    node.size = kept;
+    for (uint32_t i = node.size; i < FS_MAXFILEBLOCKS; i++) {
+        node.blocks[i] = 0;
+    }
+}
+
+/*FSCK_WALK::CHECK_DIRECTORY
+-------------------------------------------------
+-> Checks every direntry in node's blocks and links the inodes they name into the walk. A
+direntry is cleared if its name isn't a null terminated one, repeats another in the directory,
+or its inode isn't one (dangling) or is already linked from somewhere (doubly allocated: a
+second link, or a loop).
+-> A block left with no direntries is dropped, as handle_delete would have.
+-------------------------------------------------*/
+
+void fsck_walk::check_directory(uint32_t inode_block, fs_inode& node, const std::string& path) {
+
+    std::unordered_set<std::string> names;
+    uint32_t kept = 0;
+
+    for (uint32_t i = 0; i < node.size; i++) {
+        uint32_t block_num = node.blocks[i];
+        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(image.block(block_num));
+        bool changed = false;
+        bool any_left = false;
+
+        for (uint32_t j = 0; j < FS_DIRENTRIES; j++) {
+            fs_direntry& entry = direntries[j];
+            if (entry.inode_block == 0) {
+                continue;
+            }
+
+            uint32_t child = entry.inode_block;
+            std::string name = terminated(entry.name, sizeof(entry.name), true) ? entry.name : "";
+            std::string child_path = path + "/" + name;
+            bool clear = true;
+
+            if (name.empty() || name.find('/') != std::string::npos) {
+                report(PROBLEM_BAD_DIRENTRY, path, "direntry " + std::to_string(j) + " of block " +
+                       std::to_string(block_num) + " has no proper name");
+            } else if (names.count(name) > 0) {
+                report(PROBLEM_DUPLICATE_NAME, child_path, "named twice in its directory");
+            } else if (child >= image.block_count || !image.inode_shaped[child]) {
+                report(PROBLEM_DANGLING_DIRENTRY, child_path, "points at block " + std::to_string(child) +
+                       ", which isn't an inode");
+            } else if (use[child] != USE_FREE) {
+                report(PROBLEM_DOUBLY_ALLOCATED, child_path, "inode block " + std::to_string(child) +
+                       " is also used by " + (paths[child].empty() ? "/" : paths[child]));
+            } else {
+                clear = false;
+            }
+
+            if (clear) {
+                memset(&entry, 0, sizeof(fs_direntry));
+                changed = true;
+                continue;
+            }
+
+            names.insert(name);
+            use[child] = USE_INODE;
+            paths[child] = child_path;
+            pending.emplace_back(child, child_path);
+            any_left = true;
+        }
+
+        if (changed) {
+            image.dirty[block_num] = 1;
+        }
+
+        if (!any_left) {
+            report(PROBLEM_EMPTY_DIRECTORY_BLOCK, path, "block " + std::to_string(block_num) + " has no direntries");
+            use[block_num] = USE_FREE;
+            result.data_blocks--;
+            continue;
+        }
+        node.blocks[kept++] = block_num;
+    }
+
+    for (uint32_t i = kept; i < node.size; i++) {
+        node.blocks[i] = 0;
+    }
+    node.size = kept;
+}
+
+/*FSCK_WALK::REPLACE_BLOCKS
+-------------------------------------------------
+-> Gives every file block check_blocks couldn't keep a free block of its own, lowest first: a
+copy of the block it shared, or zeros for one that was outside the image. If the image runs out
+of free blocks, the file is cut short at the first block left without one.
+-------------------------------------------------*/
+
+void fsck_walk::replace_blocks() {
+
+    uint32_t next_free = 1;
+
+    for (const block_replacement& replacement : replacements) {
+        fs_inode* node = reinterpret_cast<fs_inode*>(image.block(replacement.inode_block));
+        if (replacement.index >= node->size) {
+            continue;  //Cut short already
+        }
+
+        while (next_free < image.block_count && use[next_free] != USE_FREE) {
+            next_free++;
+        }
+
+        if (next_free == image.block_count) {
+            std::cout << paths[replacement.inode_block] << ": no free block to replace block "
+                      << replacement.index << " with, cut short there\n";
+            for (uint32_t i = replacement.index; i < node->size; i++) {
+                node->blocks[i] = 0;
+            }
+            node->size = replacement.index;
+            image.dirty[replacement.inode_block] = 1;
+            continue;
+        }
+
+        if (replacement.source != 0) {
+            memcpy(image.block(next_free), image.block(replacement.source), FS_BLOCKSIZE);
+        } else {
+            memset(image.block(next_free), 0, FS_BLOCKSIZE);
+        }
+
+        use[next_free] = USE_FILE;
+        paths[next_free] = paths[replacement.inode_block];
+        node->blocks[replacement.index] = next_free;
+        image.dirty[next_free] = 1;
+        image.dirty[replacement.inode_block] = 1;
+        result.data_blocks++;
+    }
+}
+
+void fsck_walk::run() {
+
+    fs_inode* root = reinterpret_cast<fs_inode*>(image.block(0));
+    if (root->type != 'd') {
+        std::cout << "/: the root (block 0) isn't a directory, nothing can be checked\n";
+        result.root_ok = false;
+        return;
+    }
+
+    use[0] = USE_INODE;
+    pending.emplace_back(0, "");
+
+    while (!pending.empty()) {
+        uint32_t inode_block = pending.back().first;
+        std::string path = pending.back().second;
+        pending.pop_back();
+
+        fs_inode* node = reinterpret_cast<fs_inode*>(image.block(inode_block));
+        fs_inode before = *node;
+
+        if (node->type == 'd') {
+            result.directories++;
+        } else {
+            result.files++;
+        }
+
+        check_blocks(inode_block, *node, path);
+        if (node->type == 'd') {
+            check_directory(inode_block, *node, path);
+        }
+
+        if (memcmp(&before, node, sizeof(fs_inode)) != 0) {
+            image.dirty[inode_block] = 1;
+        }
+    }
+
+    replace_blocks();
+
+    for (uint32_t block_num = 1; block_num < image.block_count; block_num++) {
+        if (use[block_num] == USE_FREE) {
+            result.free_blocks++;
+        }
+    }
+}
+
+
+/*WRITE_REPAIRS
+-------------------------------------------------
+-> Writes the blocks the repairs changed back to the image, and syncs it. Returns false if a
+write fails.
+-------------------------------------------------*/
+
+static bool write_repairs(int fd, fsck_image& image, uint64_t& written) {
+
+    for (uint32_t block_num = 0; block_num < image.block_count; block_num++) {
+        if (!image.dirty[block_num]) {
+            continue;
+        }
+        if (pwrite(fd, image.block(block_num), FS_BLOCKSIZE, static_cast<off_t>(block_num) * FS_BLOCKSIZE) !=
+            FS_BLOCKSIZE) {
+            return false;
+        }
+        written++;
+    }
+
+    return fsync(fd) == 0;
+}
+
+static void print_result(const fsck_result& result) {
+
+    for (unsigned int problem = 0; problem < PROBLEM_COUNT; problem++) {
+        if (result.problems[problem] > 0) {
+            std::cout << std::setw(8) << result.problems[problem] << " " << problem_names[problem] << "\n";
+        }
+    }
+    std::cout << std::setw(8) << result.files << " files, " << result.directories << " directories, "
+              << result.data_blocks << " data blocks (" << result.shared_blocks << " more shared), "
+              << result.free_blocks << " free blocks\n";
+}
+
+
+int main(int argc, char* argv[]) {
+
+    fsck_config config;
+    config.threads = std::max(1u, std::thread::hardware_concurrency());
+    int option;
+
+    while ((option = getopt(argc, argv, "rj:")) != -1) {
+        switch (option) {
+            case 'r': config.repair = true; break;
+            case 'j': config.threads = std::atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 || config.threads == 0) {
+        usage(argv[0]);
+    }
+    config.image_path = argv[optind];
+
+    int fd = open(config.image_path, config.repair ? O_RDWR : O_RDONLY);
+    struct stat image_stat;
+    if (fd == -1 || fstat(fd, &image_stat) == -1) {
+        std::cerr << "error: can't open " << config.image_path << "\n";
+        return 8;
+    }
+    if (image_stat.st_size == 0 || image_stat.st_size % FS_BLOCKSIZE != 0) {
+        std::cerr << "error: " << config.image_path << " isn't a whole number of " << FS_BLOCKSIZE << " byte blocks\n";
+        return 8;
+    }
+
+    fsck_image image;
+    image.block_count = image_stat.st_size / FS_BLOCKSIZE;
+    config.threads = std::min(config.threads, image.block_count);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (!scan_image(fd, config.threads, image)) {
+        std::cerr << "error: can't read " << config.image_path << "\n";
+        return 8;
+    }
+    double scan_ms = ms_since(start);
+
+    fsck_result result;
+    fsck_walk(image, result).run();
+    double check_ms = ms_since(start);
+
+    std::cout << "# " << config.image_path << ": " << image.block_count << " blocks, read and scanned in "
+              << std::fixed << std::setprecision(2) << scan_ms << "ms on " << config.threads
+              << " threads, checked in " << check_ms << "ms\n";
+    print_result(result);
+
+    if (!result.root_ok) {
+        return 4;
+    }
+    if (result.total() == 0) {
+        return 0;
+    }
+    if (!config.repair) {
+        return 4;
+    }
+
+    uint64_t written = 0;
+    if (!write_repairs(fd, image, written)) {
+        std::cerr << "error: can't write the repairs to " << config.image_path << "\n";
+        return 8;
+    }
+
+    //CHECK THE REPAIRED IMAGE AGAIN, AS IT NOW IS ON DISK
+    fsck_image repaired;
+    repaired.block_count = image.block_count;
+    fsck_result recheck;
+    if (!scan_image(fd, config.threads, repaired)) {
+        std::cerr << "error: can't read " << config.image_path << "\n";
+        return 8;
+    }
+    fsck_walk(repaired, recheck).run();
+
+    std::cout << "# repaired: wrote " << written << " blocks, " << (recheck.total() == 0 ? "now clean" : "problems left") << "\n";
+    if (recheck.total() != 0) {
+        print_result(recheck);
+        return 4;
+    }
+
+    close(fd);
+    return 1;
+}
@@ -0,0 +1,167 @@
+#include "fs_handle.h"
+#include "fs_server.h"
+#include <atomic>
+#include <cstring>
+#include <random>
+#include <unordered_map>
+#include <arpa/inet.h>
+#include <boost/thread.hpp>
+
+//THE OPEN HANDLES, STRIPED BY HANDLE SO LOOKUPS FROM DIFFERENT CLIENTS DON'T SHARE A LOCK
+static constexpr unsigned int HANDLE_STRIPES = 64;
+static boost::mutex handle_mutexes[HANDLE_STRIPES];
+static std::unordered_map<uint64_t, open_file> handle_tables[HANDLE_STRIPES];
+
+//HOW MANY ARE OPEN, IN ALL AND BY EACH USER WITH ANY OPEN. TAKEN AFTER A STRIPE'S LOCK, IF AT ALL
+static boost::mutex count_mutex;
+static size_t open_handle_count = 0;
+static std::unordered_map<std::string, size_t> user_handle_counts;
+
+//BUMPED BY EVERY DELETE OF THE FILE AT EACH INODE BLOCK, UNDER ITS WRITER LOCK
+static std::atomic<uint32_t> inode_incarnations[FS_DISKSIZE];
+
+
+//Counts a new handle for username, unless the table or username is at its limit
+static bool reserve_handle(const std::string& username) {
+
+    boost::lock_guard<boost::mutex> lock(count_mutex);
+
+    auto user = user_handle_counts.find(username);
+    size_t user_count = user == user_handle_counts.end() ? 0 : user->second;
+
+    if (open_handle_count >= MAX_OPEN_HANDLES || user_count >= MAX_USER_HANDLES) {
+        return false;
+    }
+
+    open_handle_count++;
+    user_handle_counts[username] = user_count + 1;
+    return true;
+}
+
+static void release_handle(const std::string& username) {
+
+    boost::lock_guard<boost::mutex> lock(count_mutex);
+
+    auto user = user_handle_counts.find(username);
+    if (--user->second == 0) {
+        user_handle_counts.erase(user);
+    }
+    open_handle_count--;
+}
+
+//Drops the handles whose files have been deleted, to make room under a limit
+static void prune_retired_handles() {
+
+    for (unsigned int stripe = 0; stripe < HANDLE_STRIPES; stripe++) {
+        handle_mutexes[stripe].lock();
+
+        for (auto it = handle_tables[stripe].begin(); it != handle_tables[stripe].end(); ) {
+            if (!file_handle_current(it->second)) {
+                release_handle(it->second.username);
+                it = handle_tables[stripe].erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        handle_mutexes[stripe].unlock();
+    }
+}
+
+
+void encode_handle(uint64_t handle, char encoded[HANDLE_LEN]) {
+
+    uint32_t fields[2] = {
+        htonl(static_cast<uint32_t>(handle >> 32)),
+        htonl(static_cast<uint32_t>(handle))
+    };
+    memcpy(encoded, fields, HANDLE_LEN);
+}
+
+/*OPEN_FILE_HANDLE
+-------------------------------------------------
+-> Handles are random, so one client can't guess (and use or close) another's, and never 0,
+which the client library keeps for "no handle".
+-> The incarnation is read while the caller holds the inode locked, so a delete either
+happened before (and the caller found no file) or happens after and retires this handle.
+-------------------------------------------------*/
+
+uint64_t open_file_handle(uint32_t inode_block, const char* username) {
+
+    static thread_local std::mt19937_64 random_handles(std::random_device{}());
+
+    if (!reserve_handle(username)) {
+        prune_retired_handles();
+
+        if (!reserve_handle(username)) {
+            return 0;
+        }
+    }
+
+    open_file file;
+    file.inode_block = inode_block;
+    file.incarnation = inode_incarnations[inode_block].load();
+    file.username = username;
+
+    while (true) {
+        uint64_t handle = random_handles();
+        if (handle == 0) {
+            continue;
+        }
+
+        unsigned int stripe = handle % HANDLE_STRIPES;
+
+        handle_mutexes[stripe].lock();
+        bool inserted = handle_tables[stripe].emplace(handle, file).second;
+        handle_mutexes[stripe].unlock();
+
+        if (inserted) {
+            return handle;
+        }
+    }
+}
+
+bool find_file_handle(uint64_t handle, const char* username, open_file& file) {
+
+    unsigned int stripe = handle % HANDLE_STRIPES;
+    bool found = false;
+
+    handle_mutexes[stripe].lock();
+
+    auto it = handle_tables[stripe].find(handle);
+    if (it != handle_tables[stripe].end() && it->second.username == username) {
+        file = it->second;
+        found = true;
+    }
+
+    handle_mutexes[stripe].unlock();
+
+    return found;
+}
+
+bool close_file_handle(uint64_t handle, const char* username) {
+
+    unsigned int stripe = handle % HANDLE_STRIPES;
+    bool closed = false;
+
+    handle_mutexes[stripe].lock();
+
+    auto it = handle_tables[stripe].find(handle);
+    if (it != handle_tables[stripe].end() && it->second.username == username) {
+        release_handle(it->second.username);
+        handle_tables[stripe].erase(it);
+        closed = true;
+    }
+
+    handle_mutexes[stripe].unlock();
+
+    return closed;
+}
+
+bool file_handle_current(const open_file& file) {
+    return inode_incarnations[file.inode_block].load() == file.incarnation;
+}
+
+void retire_file_handles(uint32_t inode_block) {
+    inode_incarnations[inode_block].fetch_add(1);
+}
@@ -0,0 +1,77 @@
+/*
+ * fs_handle.h
+ *
+ * Open file handles, so a client that reads or writes the same file over and
+ * over doesn't have the server look its path up every time.
+ *
+ * FS_OPEN looks the path up once, checks that it names a file the user owns,
+ * and returns a handle bound to the file's inode block. FS_READ_H and
+ * FS_WRITE_H name the file by handle instead of by path, and FS_CLOSE drops
+ * the handle. Like an open file descriptor, a handle follows the file through
+ * renames.
+ *
+ * Deleting a file retires every handle on it, under the file's writer lock,
+ * so a handle can never reach the file that reuses the inode block later:
+ * requests through a retired handle fail as if the path no longer existed.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+/*
+ * Most handles open at once, across all clients, and for any one user, so one
+ * user can't fill the table for everyone else. FS_OPEN fails past either limit
+ * (after dropping any handles whose files have been deleted).
+ */
+static constexpr size_t MAX_OPEN_HANDLES = 65536;
+static constexpr size_t MAX_USER_HANDLES = 1024;
+
+/*
+ * What a handle is bound to. incarnation tells whether the file it was
+ * opened on still occupies inode_block.
+ */
+struct open_file {
+    uint32_t inode_block = 0;
+    uint32_t incarnation = 0;
+    std::string username;
+};
+
+/*
+ * What follows the echo in a successful FS_OPEN response: the handle, in
+ * network byte order.
+ */
+static constexpr size_t HANDLE_LEN = 8;
+
+void encode_handle(uint64_t handle, char encoded[HANDLE_LEN]);
+
+/*
+ * Opens a handle on the file at inode_block for username, or returns 0 if the
+ * table is full or username has MAX_USER_HANDLES open already. The caller holds the inode locked and has checked that
+ * username owns it.
+ */
+uint64_t open_file_handle(uint32_t inode_block, const char* username);
+
+/*
+ * Looks handle up. False if it isn't open or belongs to another user.
+ */
+bool find_file_handle(uint64_t handle, const char* username, open_file& file);
+
+/*
+ * Drops handle. False if it isn't open or belongs to another user.
+ */
+bool close_file_handle(uint64_t handle, const char* username);
+
+/*
+ * Whether file (from find_file_handle) still names the file it was opened
+ * on. The caller holds the inode locked, so the answer holds until it lets go.
+ */
+bool file_handle_current(const open_file& file);
+
+/*
+ * Retires every handle on inode_block. The caller holds it writer-locked and
+ * is about to delete it.
+ */
+void retire_file_handles(uint32_t inode_block);
@@ -0,0 +1,239 @@
+#include "fs_lease.h"
+#include "fs_server.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <boost/thread.hpp>
+
+unsigned int lease_term_ms = 1000;
+
+struct lease_record {
+    uint64_t token;
+    uint64_t expiry_ns;
+};
+
+//THE UNEXPIRED (OR NOT YET PRUNED) LEASES ON EACH INODE, GUARDED BY THE INODE'S STRIPE OF lease_mutexes
+static constexpr unsigned int LEASE_STRIPES = 64;
+static boost::mutex lease_mutexes[LEASE_STRIPES];
+static std::condition_variable_any lease_released[LEASE_STRIPES];
+static std::vector<lease_record> inode_leases[FS_DISKSIZE];
+
+//LATEST EXPIRY EVER GRANTED ON EACH INODE AND ON THE WHOLE SERVER, SO A WRITE TO A FILE NOBODY
+//HOLDS A LEASE ON DOESN'T NEED THE STRIPE
+static std::atomic<uint64_t> inode_lease_expiry_ns[FS_DISKSIZE];
+static std::atomic<uint64_t> latest_lease_expiry_ns{0};
+
+//BUMPED BY EVERY RENAME (SEE INVALIDATE_LEASE_LOOKUPS)
+static std::atomic<uint64_t> rename_epoch{0};
+
+//SUSPENSIONS OF NEW LEASES: ON EACH INODE, GUARDED BY ITS STRIPE, AND ON ALL OF THEM
+static unsigned int inode_lease_suspensions[FS_DISKSIZE];
+static std::atomic<unsigned int> all_lease_suspensions{0};
+
+
+static uint64_t lease_now() {
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void store_max(std::atomic<uint64_t>& current, uint64_t value) {
+
+    uint64_t seen = current.load(std::memory_order_relaxed);
+    while (value > seen && !current.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+    }
+}
+
+//Drops the expired leases from one inode's list. The caller holds its stripe
+static void prune_leases(std::vector<lease_record>& leases, uint64_t now) {
+
+    size_t kept = 0;
+    for (size_t i = 0; i < leases.size(); i++) {
+        if (leases[i].expiry_ns > now) {
+            leases[kept++] = leases[i];
+        }
+    }
+    leases.resize(kept);
+}
+
+
+void encode_lease(const fs_lease& lease, char trailer[LEASE_TRAILER_LEN]) {
+
+    uint32_t fields[3] = {
+        htonl(static_cast<uint32_t>(lease.token >> 32)),
+        htonl(static_cast<uint32_t>(lease.token)),
+        htonl(lease.term_ms)
+    };
+    memcpy(trailer, fields, LEASE_TRAILER_LEN);
+}
+
+/*GRANT_LEASE
+-------------------------------------------------
+-> Records a lease on inode_block that runs out lease_term_ms from now, unless a rename has
+relinked something since the path was looked up (epoch) or leases are suspended. Both are
+checked under the inode's stripe, so once a rename has bumped the epoch (or anyone has
+suspended leases), any lease it doesn't find in the list is never granted. The token is random
+in its high bits, so one client can't guess (and release) another's lease, and carries the
+inode in its low bits, so FS_RELEASE doesn't have to look the path up again.
+-------------------------------------------------*/
+
+uint64_t lease_epoch() {
+    return rename_epoch.load();
+}
+
+fs_lease grant_lease(uint32_t inode_block, uint64_t epoch) {
+
+    fs_lease lease;
+
+    if (lease_term_ms == 0) {
+        return lease;
+    }
+
+    static thread_local std::mt19937_64 random_tokens(std::random_device{}());
+
+    uint64_t now = lease_now();
+    uint64_t expiry_ns = now + static_cast<uint64_t>(lease_term_ms) * 1000000;
+
+    //PUBLISH THE EXPIRY BEFORE THE LEASE ITSELF, SO A WRITER THAT CHECKS IT FIRST CAN'T MISS THE LEASE
+    store_max(inode_lease_expiry_ns[inode_block], expiry_ns);
+    store_max(latest_lease_expiry_ns, expiry_ns);
+
+    //EITHER THE RENAME SEES OUR EXPIRY AND LOOKS IN THE LIST, OR WE SEE ITS EPOCH AND GRANT NOTHING
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    boost::mutex& stripe = lease_mutexes[inode_block % LEASE_STRIPES];
+
+    stripe.lock();
+
+    if (rename_epoch.load() != epoch || all_lease_suspensions.load() > 0 || inode_lease_suspensions[inode_block] > 0) {
+        stripe.unlock();
+        return lease;
+    }
+
+    lease.token = (random_tokens() / FS_DISKSIZE) * FS_DISKSIZE + inode_block;
+    lease.term_ms = lease_term_ms;
+
+    prune_leases(inode_leases[inode_block], now);
+    inode_leases[inode_block].push_back({lease.token, expiry_ns});
+    stripe.unlock();
+
+    return lease;
+}
+
+void release_lease(uint64_t token) {
+
+    uint32_t inode_block = token % FS_DISKSIZE;
+    boost::mutex& stripe = lease_mutexes[inode_block % LEASE_STRIPES];
+
+    stripe.lock();
+
+    bool released = false;
+
+    std::vector<lease_record>& leases = inode_leases[inode_block];
+    for (size_t i = 0; i < leases.size(); i++) {
+        if (leases[i].token == token) {
+            leases[i] = leases.back();
+            leases.pop_back();
+            released = true;
+            break;
+        }
+    }
+
+    stripe.unlock();
+
+    if (released) {
+        lease_released[inode_block % LEASE_STRIPES].notify_all();
+    }
+}
+
+/*WAIT_FOR_LEASES
+-------------------------------------------------
+-> Sleeps until every lease on inode_block has run out or been given back. The writer lock
+the caller holds keeps new ones from being granted in the meantime (grants need the reader
+lock), or else a suspension does, so when it returns, nobody's cache can still hold the file.
+-> An FS_RELEASE can arrive while we wait (another of the holder's threads may have sent
+its write first), so a release wakes us up to look again.
+-------------------------------------------------*/
+
+void wait_for_leases(uint32_t inode_block) {
+
+    if (inode_lease_expiry_ns[inode_block].load(std::memory_order_relaxed) <= lease_now()) {
+        return;
+    }
+
+    boost::unique_lock<boost::mutex> lock(lease_mutexes[inode_block % LEASE_STRIPES]);
+
+    std::vector<lease_record>& leases = inode_leases[inode_block];
+
+    while (true) {
+        uint64_t now = lease_now();
+        prune_leases(leases, now);
+
+        if (leases.empty()) {
+            return;
+        }
+
+        uint64_t last_expiry_ns = 0;
+        for (const lease_record& lease : leases) {
+            if (lease.expiry_ns > last_expiry_ns) {
+                last_expiry_ns = lease.expiry_ns;
+            }
+        }
+
+        lease_released[inode_block % LEASE_STRIPES].wait_for(lock, std::chrono::nanoseconds(last_expiry_ns - now));
+    }
+}
+
+void suspend_leases(uint32_t inode_block) {
+
+    boost::lock_guard<boost::mutex> lock(lease_mutexes[inode_block % LEASE_STRIPES]);
+    inode_lease_suspensions[inode_block]++;
+}
+
+void resume_leases(uint32_t inode_block) {
+
+    boost::lock_guard<boost::mutex> lock(lease_mutexes[inode_block % LEASE_STRIPES]);
+    inode_lease_suspensions[inode_block]--;
+}
+
+/*SUSPEND_ALL_LEASES
+-------------------------------------------------
+-> Used by a rename that has to wait for leases on what it moves. Without it, reads through
+the old path could keep taking new leases while the rename waits, and it would never get
+to go ahead. Reads themselves aren't held up, they just get no lease.
+-------------------------------------------------*/
+
+void suspend_all_leases() {
+    all_lease_suspensions.fetch_add(1);
+}
+
+void resume_all_leases() {
+    all_lease_suspensions.fetch_sub(1);
+}
+
+void invalidate_lease_lookups() {
+
+    rename_epoch.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+bool leases_outstanding(uint32_t inode_block) {
+
+    uint64_t now = lease_now();
+    if (inode_lease_expiry_ns[inode_block].load() <= now) {
+        return false;
+    }
+
+    boost::lock_guard<boost::mutex> lock(lease_mutexes[inode_block % LEASE_STRIPES]);
+    prune_leases(inode_leases[inode_block], now);
+    return !inode_leases[inode_block].empty();
+}
+
+bool any_leases_outstanding() {
+    return latest_lease_expiry_ns.load() > lease_now();
+}
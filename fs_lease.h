@@ -0,0 +1,99 @@
+/*
+ * fs_lease.h
+ *
+ * Read leases for client-side block caches.
+ *
+ * FS_READLEASE reads a block like FS_READBLOCK and also grants the client a
+ * lease on the file's inode for lease_term_ms. Until the lease runs out, the
+ * client may serve reads of that file from its cache. To keep those caches
+ * consistent, a handler that is about to change a file (writeblock, delete)
+ * first waits, with the file writer-locked so no new lease can be granted,
+ * until every lease on it has expired. A client gives its own leases back
+ * with FS_RELEASE before it writes to, deletes or renames a file it has
+ * cached, so its own changes never wait.
+ *
+ * Nothing else may be locked during that wait. A delete waits before it locks
+ * the parent, with new leases on the file suspended until it is done (see
+ * suspend_leases). Renames change what a path refers to without touching the
+ * inodes, so a rename waits for the leases on the files it moves, with both
+ * parents unlocked and new leases suspended everywhere, and then starts over.
+ * A read that looked its path up before the rename relinked it gets no lease.
+ *
+ * The client's clock starts when it sends the request and the server's
+ * when it grants the lease, so the client always stops trusting its cache
+ * before the server lets anyone change the file.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * How long a lease lasts (fs -L, in ms). 0 grants no leases, so clients
+ * don't cache.
+ */
+extern unsigned int lease_term_ms;
+
+/*
+ * A lease as the client sees it. token names the lease in FS_RELEASE.
+ * A term_ms of 0 means no lease was granted.
+ */
+struct fs_lease {
+    uint64_t token = 0;
+    uint32_t term_ms = 0;
+};
+
+/*
+ * What follows the data block in a successful FS_READLEASE response: the
+ * token and the term, in network byte order.
+ */
+static constexpr size_t LEASE_TRAILER_LEN = 12;
+
+void encode_lease(const fs_lease& lease, char trailer[LEASE_TRAILER_LEN]);
+
+/*
+ * Read before looking up the path a lease will be granted through.
+ */
+uint64_t lease_epoch();
+
+/*
+ * Grants a lease on inode_block, or none if a rename has started since
+ * epoch was read. The caller holds the inode reader-locked.
+ */
+fs_lease grant_lease(uint32_t inode_block, uint64_t epoch);
+
+/*
+ * Drops the lease named by token, if it hasn't expired already.
+ */
+void release_lease(uint64_t token);
+
+/*
+ * Waits until every lease on inode_block has expired or been released.
+ * The caller holds the inode writer-locked, or has suspended leases on it.
+ */
+void wait_for_leases(uint32_t inode_block);
+
+/*
+ * Grants no leases on inode_block, or with the _all versions on any inode,
+ * until they are resumed. Suspensions nest.
+ */
+void suspend_leases(uint32_t inode_block);
+void resume_leases(uint32_t inode_block);
+void suspend_all_leases();
+void resume_all_leases();
+
+/*
+ * Stops leases from being granted through paths looked up before now. A
+ * rename calls it with both parents writer-locked, before it looks for
+ * leases on what it moves.
+ */
+void invalidate_lease_lookups();
+
+/*
+ * Whether a lease on inode_block, or on any inode, may still be running.
+ * Called after invalidate_lease_lookups, neither misses a lease granted to
+ * a lookup from before it.
+ */
+bool leases_outstanding(uint32_t inode_block);
+bool any_leases_outstanding();
@@ -0,0 +1,167 @@
+#include "fs_lockprof.h"
+#include "fs_server.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <vector>
+
+static const char* mode_names[LOCK_MODE_COUNT] = { "shared", "exclusive" };
+
+struct lock_stats {
+    std::atomic<uint64_t> acquisitions{0};
+    std::atomic<uint64_t> contended{0};
+    std::atomic<uint64_t> wait_ns{0};
+    std::atomic<uint64_t> max_wait_ns{0};
+    std::atomic<uint64_t> hold_ns{0};
+    std::atomic<uint64_t> max_hold_ns{0};
+};
+
+//A lock the calling thread holds, and when it got it
+struct held_lock {
+    uint32_t block_num;
+    lock_mode mode;
+    uint64_t acquired_ns;
+};
+
+static bool profiling = false;
+static lock_stats stats[FS_DISKSIZE][LOCK_MODE_COUNT];
+
+//Hand-over-hand traversal holds at most a few locks at once, so a short stack is enough
+static thread_local std::vector<held_lock> held_locks;
+
+
+static uint64_t lockprof_now() {
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void store_max(std::atomic<uint64_t>& current, uint64_t value) {
+
+    uint64_t seen = current.load(std::memory_order_relaxed);
+    while (value > seen && !current.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+    }
+}
+
+
+void lockprof_enable() {
+    profiling = true;
+}
+
+bool lockprof_enabled() {
+    return profiling;
+}
+
+void lockprof_acquired(uint32_t block_num, lock_mode mode, uint64_t wait_ns, bool contended) {
+
+    lock_stats& block_stats = stats[block_num][mode];
+
+    block_stats.acquisitions.fetch_add(1, std::memory_order_relaxed);
+    if (contended) {
+        block_stats.contended.fetch_add(1, std::memory_order_relaxed);
+        block_stats.wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+        store_max(block_stats.max_wait_ns, wait_ns);
+    }
+
+    held_locks.push_back({block_num, mode, lockprof_now()});
+}
+
+void lockprof_released(uint32_t block_num, lock_mode mode) {
+
+    //Locks are usually let go of in the reverse order they were taken, so search from the top
+    for (size_t i = held_locks.size(); i > 0; i--) {
+
+        held_lock& held = held_locks[i - 1];
+
+        if (held.block_num == block_num && held.mode == mode) {
+            uint64_t hold_ns = lockprof_now() - held.acquired_ns;
+
+            lock_stats& block_stats = stats[block_num][mode];
+            block_stats.hold_ns.fetch_add(hold_ns, std::memory_order_relaxed);
+            store_max(block_stats.max_hold_ns, hold_ns);
+
+            held_locks.erase(held_locks.begin() + (i - 1));
+            return;
+        }
+    }
+}
+
+
+/*LOCKPROF_REPORT
+-------------------------------------------------
+-> Ranks every block that has been locked by its wait time over both modes (acquisitions
+break ties), and reports the top_n of them, hottest first.
+-> For each block and mode: fs_lock_acquisitions_total, fs_lock_contended_total (the lock
+wasn't free), fs_lock_wait_ns_total/_max and fs_lock_hold_ns_total/_max.
+-------------------------------------------------*/
+
+std::string lockprof_report(size_t top_n) {
+
+    std::ostringstream report;
+
+    if (!profiling) {
+        report << "# lock profiling is off, start the server with -l\n";
+        return report.str();
+    }
+
+    struct block_rank {
+        uint32_t block_num;
+        uint64_t wait_ns;
+        uint64_t acquisitions;
+    };
+
+    std::vector<block_rank> ranked;
+    for (uint32_t block_num = 0; block_num < FS_DISKSIZE; block_num++) {
+
+        block_rank rank = {block_num, 0, 0};
+        for (unsigned int mode = 0; mode < LOCK_MODE_COUNT; mode++) {
+            rank.wait_ns += stats[block_num][mode].wait_ns.load(std::memory_order_relaxed);
+            rank.acquisitions += stats[block_num][mode].acquisitions.load(std::memory_order_relaxed);
+        }
+
+        if (rank.acquisitions > 0) {
+            ranked.push_back(rank);
+        }
+    }
+
+    size_t shown = std::min(top_n, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + shown, ranked.end(),
+        [](const block_rank& a, const block_rank& b) {
+            if (a.wait_ns != b.wait_ns) {
+                return a.wait_ns > b.wait_ns;
+            }
+            return a.acquisitions > b.acquisitions;
+        });
+
+    report << "# top " << shown << " of " << ranked.size() << " locked blocks by wait time\n";
+
+    struct family {
+        const char* name;
+        const char* type;
+        std::atomic<uint64_t> lock_stats::* field;
+    };
+
+    static const family families[] = {
+        {"fs_lock_acquisitions_total", "counter", &lock_stats::acquisitions},
+        {"fs_lock_contended_total", "counter", &lock_stats::contended},
+        {"fs_lock_wait_ns_total", "counter", &lock_stats::wait_ns},
+        {"fs_lock_wait_ns_max", "gauge", &lock_stats::max_wait_ns},
+        {"fs_lock_hold_ns_total", "counter", &lock_stats::hold_ns},
+        {"fs_lock_hold_ns_max", "gauge", &lock_stats::max_hold_ns},
+    };
+
+    for (const family& metric : families) {
+
+        report << "# TYPE " << metric.name << " " << metric.type << "\n";
+
+        for (size_t i = 0; i < shown; i++) {
+            for (unsigned int mode = 0; mode < LOCK_MODE_COUNT; mode++) {
+                report << metric.name << "{block=\"" << ranked[i].block_num << "\",mode=\"" << mode_names[mode] << "\"} "
+                       << (stats[ranked[i].block_num][mode].*metric.field).load(std::memory_order_relaxed) << "\n";
+            }
+        }
+    }
+
+    return report.str();
+}
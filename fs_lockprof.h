@@ -0,0 +1,45 @@
+/*
+ * fs_lockprof.h
+ *
+ * Contention profiler for the per-inode-block traversal locks.
+ *
+ * When enabled (fs -l), every acquisition of a block's shared_mutex is
+ * counted per block and per mode, along with how long the thread waited
+ * for it and how long it held it. Everything is recorded with relaxed
+ * atomics, and a lock that is free is taken with a single try_lock, so the
+ * profiler adds a couple of clock reads per lock and never blocks.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+enum lock_mode {
+    LOCK_SHARED, LOCK_EXCLUSIVE, LOCK_MODE_COUNT
+};
+
+/*
+ * Turns profiling on. Call before the server starts taking requests.
+ */
+void lockprof_enable();
+
+bool lockprof_enabled();
+
+/*
+ * Record that the calling thread got block_num's lock in mode after
+ * waiting wait_ns. contended is false if the lock was free.
+ */
+void lockprof_acquired(uint32_t block_num, lock_mode mode, uint64_t wait_ns, bool contended);
+
+/*
+ * Record that the calling thread let go of block_num's lock in mode.
+ */
+void lockprof_released(uint32_t block_num, lock_mode mode);
+
+/*
+ * The top_n blocks with the most total wait time (both modes), hottest
+ * first, in the Prometheus text exposition format.
+ */
+std::string lockprof_report(size_t top_n);
@@ -0,0 +1,10 @@
+#include "fs_system.h"
+
+int main(int argc, char *argv[]) {
+
+    //Get the port number
+    uint16_t port = parse_line(argc, argv);
+ 
+    init_server(port);
+
+}
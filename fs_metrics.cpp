@@ -0,0 +1,319 @@
+#include "fs_metrics.h"
+#include <chrono>
+#include <cmath>
+#include <sstream>
+
+/*
+ * Names used in the report, indexed by the enums in fs_metrics.h.
+ */
+static const char* op_names[OP_COUNT] = {
+    "READBLOCK", "WRITEBLOCK", "CREATE", "DELETE", "RENAME", "CLONE", "SNAPSHOT", "OPEN", "CLOSE", "INVALID"
+};
+
+static const char* phase_names[PHASE_COUNT] = {
+    "parse", "traverse", "lock_wait", "disk", "send", "total"
+};
+
+static const char* reject_names[REJECT_COUNT] = {
+    "other", "bad_request", "bad_path", "not_found", "not_owner", "wrong_type",
+    "out_of_range", "no_space", "exists", "not_empty"
+};
+
+static const char* busy_names[BUSY_COUNT] = {
+    "connections", "queue", "deadline"
+};
+
+static const double report_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+//COUNTERS AND HISTOGRAMS FOR EVERY REQUEST SINCE THE SERVER STARTED
+static std::atomic<uint64_t> request_counts[OP_COUNT][2];
+static std::atomic<uint64_t> reject_counts[REJECT_COUNT];
+static std::atomic<uint64_t> busy_counts[BUSY_COUNT];
+static std::atomic<uint64_t> snapshots_dropped{0};
+static latency_histogram histograms[OP_COUNT][PHASE_COUNT];
+
+//The request the calling thread is working on, if any
+static thread_local request_metrics* current_request = nullptr;
+
+
+/*LATENCY_HISTOGRAM
+-------------------------------------------------
+-> Values below HISTOGRAM_SUB_BUCKETS get a bucket each. Above that, the values
+whose highest set bit is bit m share HISTOGRAM_SUB_BUCKETS buckets, each
+2^(m - HISTOGRAM_SUB_BITS) wide. Values past HISTOGRAM_MAX_BITS go in the last bucket.
+-------------------------------------------------*/
+
+unsigned int latency_histogram::bucket_index(uint64_t value) {
+
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+
+    unsigned int msb = 63 - __builtin_clzll(value);
+
+    if (msb >= HISTOGRAM_MAX_BITS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+
+    unsigned int group = msb - HISTOGRAM_SUB_BITS + 1;
+    unsigned int sub = (value >> (msb - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_BUCKETS;
+
+    return group * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+//The highest value that lands in bucket index
+uint64_t latency_histogram::bucket_value(unsigned int index) {
+
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+
+    unsigned int group = index / HISTOGRAM_SUB_BUCKETS;
+    unsigned int sub = index % HISTOGRAM_SUB_BUCKETS;
+    unsigned int shift = group - 1;
+
+    uint64_t lowest = static_cast<uint64_t>(HISTOGRAM_SUB_BUCKETS + sub) << shift;
+
+    return lowest + (static_cast<uint64_t>(1) << shift) - 1;
+}
+
+void latency_histogram::record(uint64_t value) {
+
+    buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+    total_count.fetch_add(1, std::memory_order_relaxed);
+    total_sum.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t current_max = max_value.load(std::memory_order_relaxed);
+    while (value > current_max &&
+           !max_value.compare_exchange_weak(current_max, value, std::memory_order_relaxed)) {
+    }
+}
+
+uint64_t latency_histogram::count() const {
+    return total_count.load(std::memory_order_relaxed);
+}
+
+uint64_t latency_histogram::sum() const {
+    return total_sum.load(std::memory_order_relaxed);
+}
+
+uint64_t latency_histogram::max() const {
+    return max_value.load(std::memory_order_relaxed);
+}
+
+uint64_t latency_histogram::percentile(double q) const {
+
+    uint64_t total = count();
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t target = static_cast<uint64_t>(std::ceil(q * total));
+    if (target == 0) {
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+
+        if (seen >= target) {
+            uint64_t value = bucket_value(i);
+            return value < max() ? value : max();
+        }
+    }
+
+    return max();
+}
+
+
+uint64_t metrics_now() {
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/*REQUEST_METRICS
+-------------------------------------------------
+-> Becomes the calling thread's current request for as long as it lives.
+-> On destruction, every phase is recorded in its op's histograms (so all phases of an
+op have the same count), and the request is counted as ok or as rejected for its reason.
+-------------------------------------------------*/
+
+request_metrics::request_metrics() : start_ns(metrics_now()) {
+
+    current_request = this;
+}
+
+request_metrics::~request_metrics() {
+
+    uint64_t end_ns = metrics_now();
+
+    phase_ns[PHASE_TOTAL] = end_ns - start_ns;
+
+    if (!parse_done) { //Never got to a handler
+        phase_ns[PHASE_PARSE] = phase_ns[PHASE_TOTAL];
+    }
+
+    for (unsigned int phase = 0; phase < PHASE_COUNT; phase++) {
+        histograms[op][phase].record(phase_ns[phase]);
+    }
+
+    request_counts[op][success ? 0 : 1].fetch_add(1, std::memory_order_relaxed);
+
+    if (!success) {
+        if (reason == REJECT_NONE && !parse_done) {
+            reason = REJECT_BAD_REQUEST;
+        }
+        reject_counts[reason].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    current_request = nullptr;
+}
+
+void request_metrics::set_op(fs_op new_op) {
+    op = new_op;
+}
+
+void request_metrics::parsed() {
+
+    parse_done = true;
+    phase_ns[PHASE_PARSE] = metrics_now() - start_ns;
+}
+
+void request_metrics::succeeded() {
+    success = true;
+}
+
+void request_metrics::add(fs_phase phase, uint64_t ns) {
+    phase_ns[phase] += ns;
+}
+
+void request_metrics::reject(fs_reject new_reason) {
+
+    if (reason == REJECT_NONE) {
+        reason = new_reason;
+    }
+}
+
+
+void metrics_add(fs_phase phase, uint64_t ns) {
+
+    if (current_request != nullptr) {
+        current_request->add(phase, ns);
+    }
+}
+
+void metrics_reject(fs_reject reason) {
+
+    if (current_request != nullptr) {
+        current_request->reject(reason);
+    }
+}
+
+void metrics_busy(fs_busy reason) {
+
+    busy_counts[reason].fetch_add(1, std::memory_order_relaxed);
+}
+
+void metrics_snapshot_dropped() {
+
+    snapshots_dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+phase_timer::phase_timer(fs_phase timed_phase) : phase(timed_phase), start_ns(metrics_now()) {
+}
+
+phase_timer::~phase_timer() {
+
+    metrics_add(phase, metrics_now() - start_ns);
+}
+
+
+fs_op op_from_name(const std::string& name) {
+
+    for (unsigned int op = 0; op < OP_INVALID; op++) {
+        if (name == std::string("FS_") + op_names[op]) {
+            return static_cast<fs_op>(op);
+        }
+    }
+
+    return OP_INVALID;
+}
+
+
+/*METRICS_REPORT
+-------------------------------------------------
+-> Formats every counter and histogram in the Prometheus text format, one sample per line:
+fs_requests_total{op,result}, fs_rejects_total{reason}, fs_busy_total{reason},
+fs_snapshots_dropped_total (see WRITE_BLOCK in fs_system.cpp), and for every op and phase the
+fs_latency_ns summary (p50/p90/p99/p99.9, _sum, _count), and after it the fs_latency_ns_max gauge.
+-> Ops that haven't seen a request yet are left out of the latency section.
+-------------------------------------------------*/
+
+std::string metrics_report() {
+
+    std::ostringstream report;
+
+    report << "# TYPE fs_requests_total counter\n";
+    for (unsigned int op = 0; op < OP_COUNT; op++) {
+        report << "fs_requests_total{op=\"" << op_names[op] << "\",result=\"ok\"} "
+               << request_counts[op][0].load(std::memory_order_relaxed) << "\n";
+        report << "fs_requests_total{op=\"" << op_names[op] << "\",result=\"rejected\"} "
+               << request_counts[op][1].load(std::memory_order_relaxed) << "\n";
+    }
+
+    report << "# TYPE fs_rejects_total counter\n";
+    for (unsigned int reason = 0; reason < REJECT_COUNT; reason++) {
+        report << "fs_rejects_total{reason=\"" << reject_names[reason] << "\"} "
+               << reject_counts[reason].load(std::memory_order_relaxed) << "\n";
+    }
+
+    report << "# TYPE fs_busy_total counter\n";
+    for (unsigned int reason = 0; reason < BUSY_COUNT; reason++) {
+        report << "fs_busy_total{reason=\"" << busy_names[reason] << "\"} "
+               << busy_counts[reason].load(std::memory_order_relaxed) << "\n";
+    }
+
+    report << "# TYPE fs_snapshots_dropped_total counter\n"
+           << "fs_snapshots_dropped_total " << snapshots_dropped.load(std::memory_order_relaxed) << "\n";
+
+    report << "# TYPE fs_latency_ns summary\n";
+    for (unsigned int op = 0; op < OP_COUNT; op++) {
+
+        if (histograms[op][PHASE_TOTAL].count() == 0) {
+            continue;
+        }
+
+        for (unsigned int phase = 0; phase < PHASE_COUNT; phase++) {
+
+            const latency_histogram& histogram = histograms[op][phase];
+            std::string labels = std::string("op=\"") + op_names[op] + "\",phase=\"" + phase_names[phase] + "\"";
+
+            for (double q : report_quantiles) {
+                report << "fs_latency_ns{" << labels << ",quantile=\"" << q << "\"} "
+                       << histogram.percentile(q) << "\n";
+            }
+            report << "fs_latency_ns_sum{" << labels << "} " << histogram.sum() << "\n";
+            report << "fs_latency_ns_count{" << labels << "} " << histogram.count() << "\n";
+        }
+    }
+
+    //A SUMMARY CAN ONLY HOLD QUANTILES, _SUM AND _COUNT, SO THE MAX IS A FAMILY OF ITS OWN
+    report << "# TYPE fs_latency_ns_max gauge\n";
+    for (unsigned int op = 0; op < OP_COUNT; op++) {
+
+        if (histograms[op][PHASE_TOTAL].count() == 0) {
+            continue;
+        }
+
+        for (unsigned int phase = 0; phase < PHASE_COUNT; phase++) {
+            report << "fs_latency_ns_max{op=\"" << op_names[op] << "\",phase=\"" << phase_names[phase] << "\"} "
+                   << histograms[op][phase].max() << "\n";
+        }
+    }
+
+    return report.str();
+}
@@ -0,0 +1,178 @@
+/*
+ * fs_metrics.h
+ *
+ * Request counters and latency histograms for the file server.
+ *
+ * Everything is recorded with relaxed atomics, so handler threads never
+ * wait on each other to record a metric. metrics_report formats all of it
+ * as text for FS_STATS requests.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/*
+ * Operations, in the order they are reported. OP_INVALID counts requests
+ * that couldn't be parsed far enough to know what they were.
+ */
+enum fs_op {
+    OP_READBLOCK, OP_WRITEBLOCK, OP_CREATE, OP_DELETE,
+    OP_RENAME, OP_CLONE, OP_SNAPSHOT, OP_OPEN, OP_CLOSE, OP_INVALID, OP_COUNT
+};
+
+/*
+ * Where a request spent its time. TRAVERSE is the wall time of the
+ * traverse_tree family and so includes the lock waits and disk reads it
+ * does. LOCK_WAIT and DISK are summed over the whole request. TOTAL runs
+ * from the end of recv to the end of the response.
+ */
+enum fs_phase {
+    PHASE_PARSE, PHASE_TRAVERSE, PHASE_LOCK_WAIT, PHASE_DISK,
+    PHASE_SEND, PHASE_TOTAL, PHASE_COUNT
+};
+
+/*
+ * Why a request was rejected (the server closes the socket without a
+ * response). The first reason recorded for a request wins.
+ */
+enum fs_reject {
+    REJECT_NONE, REJECT_BAD_REQUEST, REJECT_BAD_PATH, REJECT_NOT_FOUND,
+    REJECT_NOT_OWNER, REJECT_WRONG_TYPE, REJECT_OUT_OF_RANGE,
+    REJECT_NO_SPACE, REJECT_EXISTS, REJECT_NOT_EMPTY, REJECT_COUNT
+};
+
+/*
+ * Why a request was answered FS_BUSY instead of being served (see
+ * fs_admission.h). Those never reach a handler, so they aren't counted as
+ * requests.
+ */
+enum fs_busy {
+    BUSY_CONNECTIONS, BUSY_QUEUE, BUSY_DEADLINE, BUSY_COUNT
+};
+
+/*
+ * latency_histogram
+ *
+ * HDR-style log-linear histogram of nanosecond values. Each power of two
+ * is split into HISTOGRAM_SUB_BUCKETS linear buckets, so any recorded value
+ * is reported within ~3% of its true value, from 1ns up to ~18 minutes.
+ */
+static constexpr unsigned int HISTOGRAM_SUB_BITS = 5;
+static constexpr unsigned int HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS;
+static constexpr unsigned int HISTOGRAM_MAX_BITS = 40;
+static constexpr unsigned int HISTOGRAM_BUCKETS =
+    (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS;
+
+class latency_histogram {
+public:
+    void record(uint64_t value);
+
+    uint64_t count() const;
+    uint64_t sum() const;
+    uint64_t max() const;
+
+    // Smallest recorded bucket value v such that a fraction q of the values are <= v
+    uint64_t percentile(double q) const;
+
+private:
+    static unsigned int bucket_index(uint64_t value);
+    static uint64_t bucket_value(unsigned int index);
+
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint64_t> total_count{0};
+    std::atomic<uint64_t> total_sum{0};
+    std::atomic<uint64_t> max_value{0};
+};
+
+/*
+ * Nanoseconds on the steady clock.
+ */
+uint64_t metrics_now();
+
+/*
+ * request_metrics
+ *
+ * Declare one at the start of every request. While it is alive, it is the
+ * calling thread's current request: phase_timer, metrics_add and
+ * metrics_reject all charge to it. Its destructor records the request
+ * under its op, so every early return is counted without extra code.
+ */
+class request_metrics {
+public:
+    request_metrics();
+    ~request_metrics();
+
+    request_metrics(const request_metrics&) = delete;
+    request_metrics& operator=(const request_metrics&) = delete;
+
+    void set_op(fs_op op);
+
+    // Call right before handing the request to its handler; ends PHASE_PARSE
+    void parsed();
+
+    // Call once the response has been sent
+    void succeeded();
+
+    void add(fs_phase phase, uint64_t ns);
+    void reject(fs_reject reason);
+
+private:
+    fs_op op = OP_INVALID;
+    bool success = false;
+    bool parse_done = false;
+    fs_reject reason = REJECT_NONE;
+    uint64_t start_ns;
+    uint64_t phase_ns[PHASE_COUNT] = {};
+};
+
+/*
+ * Charge ns to phase of the calling thread's current request (if any).
+ */
+void metrics_add(fs_phase phase, uint64_t ns);
+
+/*
+ * Record why the calling thread's current request is about to fail.
+ */
+void metrics_reject(fs_reject reason);
+
+/*
+ * Count a request turned away with FS_BUSY.
+ */
+void metrics_busy(fs_busy reason);
+
+/*
+ * Count a snapshot write_block had to delete because the disk had no room
+ * left to copy a block aside for it.
+ */
+void metrics_snapshot_dropped();
+
+/*
+ * phase_timer
+ *
+ * Charges the time between its construction and destruction to phase.
+ */
+class phase_timer {
+public:
+    explicit phase_timer(fs_phase phase);
+    ~phase_timer();
+
+    phase_timer(const phase_timer&) = delete;
+    phase_timer& operator=(const phase_timer&) = delete;
+
+private:
+    fs_phase phase;
+    uint64_t start_ns;
+};
+
+/*
+ * Maps a request type ("FS_READBLOCK", ...) to its op, or OP_INVALID.
+ */
+fs_op op_from_name(const std::string& name);
+
+/*
+ * All counters and histograms in the Prometheus text exposition format.
+ */
+std::string metrics_report();
@@ -0,0 +1,425 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include "fs_client.h"
+#include "fs_metrics.h"
+#include "fs_trace.h"
+
+/*
+ * fs_replay
+ *
+ * Sends the requests in a trace (recorded with fs -t, see fs_trace.h) to a
+ * server again, and compares their latencies with the trace's:
+ *
+ *   fs_replay [-s SPEED] [-j THREADS] TRACE <server> <serverPort>
+ *
+ * At -s 1 (the default) requests are sent as far apart as they arrived, at
+ * -s 2 twice as fast, and at -s 0 as fast as the server answers them. While
+ * paced, a request's latency counts from when it was due, as loadgen's open
+ * loop does, so a server that falls behind shows up in the percentiles.
+ *
+ * THREADS threads (8 by default) take the requests in the order they
+ * started, so up to THREADS of them are in flight at once: as many as the
+ * trace had, if it is enough. A request is held back until the requests that
+ * had finished when it started in the trace have finished in the replay too,
+ * so it can't overtake one it may depend on (a write the file's create) even
+ * at -s 0 or on a server that falls behind. Handles are mapped from the
+ * traced FS_OPEN's to the replayed one's.
+ *
+ * A request whose result differs from the trace's (it failed where it had
+ * succeeded, or the other way round) is counted as a mismatch: the tree
+ * replayed against should start out as the traced one did.
+ *
+ *   fs_replay -d OLD NEW
+ *
+ * compares the server side latencies in two traces of the same requests,
+ * say one recorded by each of two builds while replaying a third.
+ */
+
+struct replay_config {
+    const char* trace_path = nullptr;
+    const char* server = nullptr;
+    const char* port = nullptr;
+    double speed = 1;
+    unsigned int threads = 8;
+};
+
+//One op's latencies: as traced (server side) and as replayed (client side)
+struct op_latencies {
+    latency_histogram traced;
+    latency_histogram replayed;
+    std::atomic<uint64_t> mismatches{0};
+};
+
+static op_latencies* latencies[TRACE_OP_COUNT];
+
+//THE NEXT RECORD TO REPLAY, AND THE HANDLES REPLAYED FS_OPENS GOT BACK, BY THE TRACE'S
+static std::atomic<size_t> next_record{0};
+//WHICH RECORDS HAVE BEEN REPLAYED. EVERY ONE BEFORE first_unfinished HAS
+static std::mutex finished_mutex;
+static std::condition_variable finished_changed;
+static std::vector<bool> finished;
+static size_t first_unfinished = 0;
+static std::mutex handles_mutex;
+static std::unordered_map<uint64_t, uint64_t> handles;
+
+
+/*USAGE
+-------------------------------------------------
+-> Prints the options and exits.
+-------------------------------------------------*/
+
+static void usage(const char* name) {
+
+    std::cout << "usage: " << name << " [options] <trace> <server> <serverPort>\n"
+              << "       " << name << " -d <old trace> <new trace>\n"
+              << "  -s speed     1 replays at the traced pace, 2 twice as fast, 0 as fast as possible (default 1)\n"
+              << "  -j threads   requests in flight at most (default 8)\n"
+              << "  -d           compare the latencies in two traces instead\n";
+    exit(1);
+}
+
+/*LOAD_TRACE
+-------------------------------------------------
+-> Reads the records of the trace at path, sorted by when they started. A trace cut off in the
+middle of a record (its server still running, or killed) is read up to that record.
+-------------------------------------------------*/
+
+static std::vector<trace_record> load_trace(const char* path) {
+
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    std::string trace = contents.str();
+
+    if (!file || trace.compare(0, TRACE_MAGIC.length(), TRACE_MAGIC) != 0) {
+        std::cerr << "error: " << path << " isn't a trace\n";
+        exit(1);
+    }
+
+    std::vector<trace_record> records;
+    const char* next = trace.data() + TRACE_MAGIC.length();
+    const char* end = trace.data() + trace.length();
+
+    trace_record record;
+    while (decode_trace_record(&next, end, record)) {
+        records.push_back(record);
+    }
+    if (next != end) {
+        std::cerr << "warning: " << path << " ends with " << end - next << " bytes that aren't a whole record\n";
+    }
+
+    std::stable_sort(records.begin(), records.end(), [](const trace_record& a, const trace_record& b) {
+        return a.start_ns < b.start_ns;
+    });
+    return records;
+}
+
+
+/*REPLAY_ONE
+-------------------------------------------------
+-> Sends record's request through the client library. Writes send filler, since a trace
+doesn't keep the data. An FS_READLEASE is replayed as the FS_READBLOCK it amounts to for a
+client without a cache.
+-> A handle the trace used that no replayed FS_OPEN has returned (yet) is sent as 0, which fails.
+-------------------------------------------------*/
+
+static int replay_one(const trace_record& record) {
+
+    static const std::string filler(FS_BLOCKSIZE, 'r');
+    char block[FS_BLOCKSIZE];
+
+    const char* user = record.username.c_str();
+    const char* path = record.pathname.c_str();
+    uint64_t replayed_handle = 0;
+    handles_mutex.lock();
+    auto handle = handles.find(record.handle);
+    if (handle != handles.end()) {
+        replayed_handle = handle->second;
+    }
+    handles_mutex.unlock();
+
+    switch (record.op) {
+        case TRACE_READBLOCK:
+        case TRACE_READLEASE:
+            return fs_readblock(user, path, record.block, block);
+        case TRACE_WRITEBLOCK:
+            return fs_writeblock(user, path, record.block, filler.data());
+        case TRACE_CREATE:
+            return fs_create(user, path, record.file_type);
+        case TRACE_DELETE:
+            return fs_delete(user, path);
+        case TRACE_OPEN: {
+            uint64_t opened = 0;
+            int status = fs_open(user, path, &opened);
+            if (status == 0) {
+                handles_mutex.lock();
+                handles[record.handle] = opened;
+                handles_mutex.unlock();
+            }
+            return status;
+        }
+        case TRACE_READ_H:
+            return fs_readblock_h(user, replayed_handle, record.block, block);
+        case TRACE_WRITE_H:
+            return fs_writeblock_h(user, replayed_handle, record.block, filler.data());
+        case TRACE_CLOSE:
+            handles_mutex.lock();
+            handles.erase(record.handle);
+            handles_mutex.unlock();
+            return fs_close(user, replayed_handle);
+        case TRACE_RENAME:
+            return fs_rename(user, path, record.new_pathname.c_str());
+        case TRACE_CLONE:
+            return fs_clone(user, path, record.new_pathname.c_str());
+        case TRACE_SNAPSHOT:
+            return fs_snapshot(user, path);
+        default:
+            return -1;
+    }
+}
+
+/*WAIT_FOR_PREDECESSORS
+-------------------------------------------------
+-> Waits until every record before records[index] that finished (in the trace) before it
+started has been replayed. Only the records since first_unfinished need looking at, and those
+are the few the trace had in flight at once.
+-------------------------------------------------*/
+
+static void wait_for_predecessors(const std::vector<trace_record>& records, size_t index) {
+
+    std::unique_lock<std::mutex> lock(finished_mutex);
+
+    auto ready = [&]() {
+        for (size_t earlier = first_unfinished; earlier < index; earlier++) {
+            if (!finished[earlier] &&
+                records[earlier].start_ns + records[earlier].latency_ns <= records[index].start_ns) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    finished_changed.wait(lock, ready);
+}
+
+static void mark_finished(size_t index) {
+
+    std::lock_guard<std::mutex> lock(finished_mutex);
+
+    finished[index] = true;
+    while (first_unfinished < finished.size() && finished[first_unfinished]) {
+        first_unfinished++;
+    }
+    finished_changed.notify_all();
+}
+
+/*REPLAY_THREAD
+-------------------------------------------------
+-> Takes the next record not yet taken and replays it when its time comes at config.speed (or
+straight away at speed 0) and the records it waits for have been replayed, until there are
+none left.
+-------------------------------------------------*/
+
+static void replay_thread(const replay_config& config, const std::vector<trace_record>& records,
+                          std::chrono::steady_clock::time_point start) {
+
+    size_t index;
+
+    while ((index = next_record.fetch_add(1, std::memory_order_relaxed)) < records.size()) {
+
+        const trace_record& record = records[index];
+
+        std::chrono::steady_clock::time_point due;
+        if (config.speed > 0) {
+            //THE TRACE STARTS WHEN ITS FIRST REQUEST DID, NOT WHEN ITS SERVER STARTED
+            uint64_t offset_ns = record.start_ns - records.front().start_ns;
+            due = start + std::chrono::nanoseconds(static_cast<uint64_t>(offset_ns / config.speed));
+            std::this_thread::sleep_until(due);
+        }
+
+        wait_for_predecessors(records, index);
+        if (config.speed == 0) {
+            due = std::chrono::steady_clock::now();
+        }
+
+        int status = replay_one(record);
+        mark_finished(index);
+
+        uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - due).count();
+
+        op_latencies& op = *latencies[record.op];
+        op.traced.record(record.latency_ns);
+        op.replayed.record(latency);
+        if ((status == 0) != record.ok) {
+            op.mismatches.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+
+/*PRINT_COMPARISON
+-------------------------------------------------
+-> One row per op that ran: how many, p50 and p99 (in microseconds) before and after, and the
+change in p99. extra is printed at the end of each row.
+-------------------------------------------------*/
+
+static void print_header(const char* before, const char* after, const char* extra) {
+
+    std::cout << std::left << std::setw(14) << "op" << std::right << std::setw(10) << "count"
+              << std::setw(12) << (std::string(before) + "_p50") << std::setw(12) << (std::string(before) + "_p99")
+              << std::setw(12) << (std::string(after) + "_p50") << std::setw(12) << (std::string(after) + "_p99")
+              << std::setw(10) << "p99_diff" << std::setw(12) << extra << "\n";
+}
+
+static void print_row(const char* name, const latency_histogram& before, const latency_histogram& after,
+                      uint64_t extra) {
+
+    double before_p99 = before.percentile(0.99) / 1000.0;
+    double after_p99 = after.percentile(0.99) / 1000.0;
+
+    std::cout << std::left << std::setw(14) << name << std::right << std::setw(10) << after.count()
+              << std::fixed << std::setprecision(1)
+              << std::setw(12) << before.percentile(0.5) / 1000.0 << std::setw(12) << before_p99
+              << std::setw(12) << after.percentile(0.5) / 1000.0 << std::setw(12) << after_p99
+              << std::setw(9) << (before_p99 > 0 ? 100 * (after_p99 - before_p99) / before_p99 : 0) << "%"
+              << std::setw(12) << extra << "\n";
+}
+
+
+/*DIFF_TRACES
+-------------------------------------------------
+-> Compares the server side latencies per op in two traces, and counts the requests that
+succeeded in one but not the other (going by the order they started in, which replays of the
+same trace at speed 1 keep for each user).
+-------------------------------------------------*/
+
+static int diff_traces(const char* old_path, const char* new_path) {
+
+    std::vector<trace_record> old_records = load_trace(old_path);
+    std::vector<trace_record> new_records = load_trace(new_path);
+
+    for (unsigned int op = 0; op < TRACE_OP_COUNT; op++) {
+        latencies[op] = new op_latencies();
+    }
+
+    for (const trace_record& record : old_records) {
+        latencies[record.op]->traced.record(record.latency_ns);
+    }
+    for (const trace_record& record : new_records) {
+        latencies[record.op]->replayed.record(record.latency_ns);
+    }
+
+    //MATCH EACH USER'S REQUESTS UP IN ORDER
+    std::unordered_map<std::string, std::vector<const trace_record*>> old_by_user;
+    for (const trace_record& record : old_records) {
+        old_by_user[record.username].push_back(&record);
+    }
+
+    std::unordered_map<std::string, size_t> matched;
+    for (const trace_record& record : new_records) {
+        std::vector<const trace_record*>& earlier = old_by_user[record.username];
+        size_t& index = matched[record.username];
+        if (index < earlier.size() && earlier[index]->op == record.op && earlier[index]->ok != record.ok) {
+            latencies[record.op]->mismatches.fetch_add(1, std::memory_order_relaxed);
+        }
+        index++;
+    }
+
+    std::cout << "# " << old_records.size() << " requests in " << old_path << ", "
+              << new_records.size() << " in " << new_path << ", latencies in us\n";
+    print_header("old", "new", "mismatches");
+
+    for (unsigned int op = 0; op < TRACE_OP_COUNT; op++) {
+        if (latencies[op]->replayed.count() > 0 || latencies[op]->traced.count() > 0) {
+            print_row(trace_op_names[op], latencies[op]->traced, latencies[op]->replayed,
+                      latencies[op]->mismatches.load());
+        }
+    }
+
+    return 0;
+}
+
+
+int main(int argc, char* argv[]) {
+
+    replay_config config;
+    bool diff = false;
+    int option;
+
+    while ((option = getopt(argc, argv, "s:j:d")) != -1) {
+        switch (option) {
+            case 's': config.speed = std::atof(optarg); break;
+            case 'j': config.threads = std::atoi(optarg); break;
+            case 'd': diff = true; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (diff) {
+        if (argc - optind != 2) {
+            usage(argv[0]);
+        }
+        return diff_traces(argv[optind], argv[optind + 1]);
+    }
+
+    if (argc - optind != 3 || config.threads == 0 || config.speed < 0) {
+        usage(argv[0]);
+    }
+    config.trace_path = argv[optind];
+    config.server = argv[optind + 1];
+    config.port = argv[optind + 2];
+
+    std::vector<trace_record> records = load_trace(config.trace_path);
+
+    if (fs_clientinit(config.server, std::atoi(config.port)) == -1) {
+        std::cerr << "error: couldn't initialize the client library\n";
+        exit(1);
+    }
+
+    for (unsigned int op = 0; op < TRACE_OP_COUNT; op++) {
+        latencies[op] = new op_latencies();
+    }
+
+    finished.assign(records.size(), false);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned int id = 0; id < config.threads; id++) {
+        workers.emplace_back(replay_thread, std::cref(config), std::cref(records), start);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double traced_seconds = records.empty() ? 0 : (records.back().start_ns - records.front().start_ns) / 1e9;
+
+    std::cout << "# " << records.size() << " requests from " << config.trace_path << " in "
+              << std::fixed << std::setprecision(2) << seconds << "s (traced over " << traced_seconds << "s), "
+              << (config.speed > 0 ? "at speed " + std::to_string(config.speed) : std::string("as fast as possible"))
+              << ", latencies in us\n";
+    print_header("traced", "replay", "mismatches");
+
+    for (unsigned int op = 0; op < TRACE_OP_COUNT; op++) {
+        if (latencies[op]->replayed.count() > 0) {
+            print_row(trace_op_names[op], latencies[op]->traced, latencies[op]->replayed,
+                      latencies[op]->mismatches.load());
+        }
+    }
+
+    return 0;
+}
@@ -1,5 +1,49 @@
 #include "fs_system.h"
+#include <cerrno>
 #include <unistd.h>
+#include <netinet/tcp.h>
+
+//THE BLOCK DEVICE READ_BLOCK AND WRITE_BLOCK USE, SET BY -b AND -S
+std::unique_ptr<disk_backend> disk_device(new lib_disk());
+
+//MUTEX FOR IN-MEMORY DATA STRUCTURES
+boost::mutex ds_mutex;
+
+//SERIALIZES RENAMES ACROSS DIRECTORIES (SEE LOCK_RENAME_PARENTS)
+boost::mutex rename_mutex;
+
+std::vector<uint32_t> available_disk_blocks;
+std::vector<uint32_t> block_refcounts(FS_DISKSIZE, 0);
+
+//SNAPSHOT STATE, PROTECTED BY DS_MUTEX
+std::vector<uint32_t> block_generation(FS_DISKSIZE, 0);
+uint32_t allocation_generation = 0;
+bool snapshot_active = false;
+uint32_t snapshot_id = 0;
+uint32_t snapshot_generation = 0;
+std::string snapshot_owner;
+std::unordered_map<uint32_t, uint32_t> snapshot_blocks;
+std::vector<uint32_t> snapshot_pinned_blocks;
+boost::shared_mutex snapshot_mutex;
+
+//DEDUP STATE (-d), PROTECTED BY DS_MUTEX
+bool dedup_enabled = false;
+std::unordered_map<uint64_t, uint32_t> fingerprint_index;
+std::unordered_map<uint32_t, uint64_t> block_fingerprints;
+
+bool thread_per_connection = false;
+unsigned int worker_threads = 32;
+
+boost::shared_mutex locks[FS_DISKSIZE];
+boost::mutex name_locks[NAME_LOCK_STRIPES];
+std::atomic<uint32_t> inode_versions[FS_DISKSIZE];
+
+uint16_t server_port;
+const char* server_hostname;
+sockaddr_in addr{};
+
+std::unordered_map<std::string, std::shared_ptr<boost::shared_mutex>> mutex_map;
+
 
 /*SET_USED_BLOCKS
 --------------------------------------------------------------------
@@ -7,6 +51,8 @@
 ->blocks currently in use by an existing filesystem image that MAY EXIST
 ->Traverses the existing filesystem and puts the blocks in use into used_blocks. If
 the block is in this set, we don't add it to available_disk_blocks in init_server.
+->It also rebuilds block_refcounts: every inode counts once, and every data block
+counts once per file that lists it, so blocks shared by FS_CLONE survive a restart.
 --------------------------------------------------------------------*/
 
 void set_used_blocks(uint32_t block_num, std::set<uint32_t>& used_blocks) {
@@ -25,15 +71,14 @@ void set_used_blocks(uint32_t block_num, std::set<uint32_t>& used_blocks) {
             continue;
         }
 
-        locks.emplace(current_block_num, std::make_shared<boost::shared_mutex>());
-
         used_blocks.insert(current_block_num);
+        block_refcounts[current_block_num] = 1;
 
         fs_inode node;
         
         char inode_buf[FS_BLOCKSIZE];
         memset(inode_buf, 0, FS_BLOCKSIZE);
-        disk_readblock(current_block_num, inode_buf);
+        read_block(current_block_num, inode_buf);
         
         memcpy(&node, inode_buf, sizeof(fs_inode));
 
@@ -42,12 +87,13 @@ void set_used_blocks(uint32_t block_num, std::set<uint32_t>& used_blocks) {
 
             if (data_block_num != 0) {
                 used_blocks.insert(data_block_num);
+                block_refcounts[data_block_num]++;
 
                 if (node.type == 'd') {
 
                     char dir_block_buf[FS_BLOCKSIZE];
                     memset(dir_block_buf, 0, FS_BLOCKSIZE);
-                    disk_readblock(data_block_num, dir_block_buf);
+                    read_block(data_block_num, dir_block_buf);
                     fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_block_buf);
 
                     for (int j = 0; j < 8; ++j) {
@@ -67,1067 +113,3629 @@ void set_used_blocks(uint32_t block_num, std::set<uint32_t>& used_blocks) {
 }
 
 
-/*FIND_DUPLICATE
+/*ALLOCATE_BLOCK
 --------------------------------------------------------------------
-->A helper function we use in handle_create to determine if a created file/directory
-already exists in a given path and if it does, the function returns -1.
+->Takes the next block off available_disk_blocks and gives it a reference count of 1.
+->The caller must hold ds_mutex and must have checked that a block is available.
 --------------------------------------------------------------------*/
 
-int find_duplicate(fs_inode main, std::string fname){
-    //Traverse all the direntries
-    
-    for(uint32_t i = 0; i < main.size; ++i){
+uint32_t allocate_block() {
 
-        char dir_block_buf[FS_BLOCKSIZE];
-        memset(dir_block_buf, 0, FS_BLOCKSIZE);
-        disk_readblock(main.blocks[i], dir_block_buf);
-        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_block_buf);
+    uint32_t block_num = available_disk_blocks.back();
+    available_disk_blocks.pop_back();
 
-        for(int i = 0; i < 8; ++i){
-            
-            if(strcmp(direntries[i].name, fname.c_str()) == 0){
-                //FOUND A DUPLICATE!
-                return -1;
-            }
-        }
-    }
-    return 0;
+    block_refcounts[block_num] = 1;
+    block_generation[block_num] = allocation_generation;
+
+    return block_num;
 }
 
-/*HANDLE_REQUEST
------------------------------------------------------------
-->We use this function to handle each of the four requests made by the client.
-->First, we receive the client's message and read in the 'type',
-handling each of the four types of requests accordingly.
-->If any of the helper-handler functions fail, handle_request
-checks and the socket is closed without sending a message.
------------------------------------------------------------*/
+/*ALLOCATE_RUN
+--------------------------------------------------------------------
+->Like allocate_block, but takes count neighbouring blocks at once, the lowest-numbered run
+of them that is free, and returns the first in first_block. Used by the defragmenter.
+->Returns false, allocating nothing, if no run that long is free.
+->The caller must hold ds_mutex.
+--------------------------------------------------------------------*/
 
-void handle_request(int client_socket){
-    
-    char msg[64] = {}; 
+bool allocate_run(uint32_t count, uint32_t& first_block) {
 
-    std::string message;
-    int return_val = 0;
-    uint32_t total_bytes = 0;
-    int max_message_len = FS_BLOCKSIZE + 3 + FS_MAXFILENAME + FS_MAXPATHNAME + FS_MAXUSERNAME + 13 + 3;
-   
-    do {     
-        return_val = recv(client_socket, msg, 64, 0);
-        total_bytes += return_val;
-       
-        if(return_val == 0){
-            break;
-        }else if(return_val < 0){
-        
-            break;
-        }
-            
-        message += std::string(msg, return_val);
+    std::vector<bool> free_blocks(FS_DISKSIZE, false);
+    for (uint32_t block_num : available_disk_blocks) {
+        free_blocks[block_num] = true;
+    }
 
-    } while ((return_val == 64) && (message[message.length() - 1] != '\0') && (message.length() < max_message_len));
+    uint32_t run = 0;
+    for (uint32_t block_num = 1; block_num < FS_DISKSIZE && run < count; block_num++) {
+        run = free_blocks[block_num] ? run + 1 : 0;
+        first_block = block_num + 1 - run;
+    }
 
-    if(message.length() > max_message_len){
-        close(client_socket);
-        return;
+    if (count == 0 || run < count) {
+        return false;
     }
 
-    std::istringstream istr(message);
-    std::istringstream testist(message);
+    std::erase_if(available_disk_blocks, [&](uint32_t block_num) {
+        return block_num >= first_block && block_num < first_block + count;
+    });
 
-    std::string token;
+    for (uint32_t block_num = first_block; block_num < first_block + count; block_num++) {
+        block_refcounts[block_num] = 1;
+        block_generation[block_num] = allocation_generation;
+    }
 
-    std::vector<std::string> command;
+    return true;
+}
 
-   while(std::getline(testist, token, ' ')) {
-        command.push_back(token);
+/*RELEASE_BLOCK
+--------------------------------------------------------------------
+->Drops one reference to block_num. Only when the last reference is gone (the block
+isn't shared with a clone anymore) does it go back on available_disk_blocks.
+->The caller must hold ds_mutex.
+--------------------------------------------------------------------*/
 
-        if(token == "FS_WRITEBLOCK") {
-            break;
-        }
+void release_block(uint32_t block_num) {
 
-        if(command.size() > 4) {
-            close(client_socket);
-            return;
-        }
+    if (block_refcounts[block_num] > 0) {
+        block_refcounts[block_num]--;
     }
 
-    if(command[0] == "FS_READBLOCK") {
-        if(command.size() != 4) {
-            close(client_socket);
-            return;
+    if (block_refcounts[block_num] == 0) {
+
+        dedup_unindex(block_num);
+
+        //THE SNAPSHOT STILL READS THIS BLOCK IN PLACE, SO IT CAN'T BE REUSED UNTIL THE SNAPSHOT IS DELETED
+        if (snapshot_needs_block(block_num)) {
+            snapshot_pinned_blocks.push_back(block_num);
+        } else {
+            available_disk_blocks.push_back(block_num);
         }
     }
-    
-    if(command[0] == "FS_CREATE") {
-        if(command.size() != 4) {
-            close(client_socket);
-            return;
-        }
+}
+
+/*SNAPSHOT_NEEDS_BLOCK
+--------------------------------------------------------------------
+->Returns true if the active snapshot still reads block_num in place: the block was
+allocated before the snapshot was taken and its old contents haven't been copied aside yet.
+->The caller must hold ds_mutex.
+--------------------------------------------------------------------*/
+
+bool snapshot_needs_block(uint32_t block_num) {
+
+    return snapshot_active && block_generation[block_num] <= snapshot_generation
+           && snapshot_blocks.count(block_num) == 0;
+}
+
+/*READ_BLOCK
+--------------------------------------------------------------------
+->Every handler reads disk blocks through this function instead of calling the disk
+directly, so the time spent on disk is charged to the current request.
+--------------------------------------------------------------------*/
+
+void read_block(uint32_t block_num, void* buf) {
+
+    phase_timer timer(PHASE_DISK);
+
+    disk_device->read(block_num, buf);
+}
+
+/*READ_BLOCKS
+--------------------------------------------------------------------
+->Reads count blocks into bufs (count * FS_BLOCKSIZE bytes) with one read_batch, so a
+backend with an I/O queue (-b uring:PATH) has all of them in flight at once.
+--------------------------------------------------------------------*/
+
+void read_blocks(const uint32_t* block_nums, size_t count, char* bufs) {
+
+    phase_timer timer(PHASE_DISK);
+
+    disk_device->read_batch(block_nums, count, bufs);
+}
+
+/*WRITE_BLOCK
+--------------------------------------------------------------------
+->Every handler writes disk blocks through this function instead of calling the disk directly.
+->If a snapshot is active and still reads block_num in place, the old contents are first
+copied to a fresh block (copy-before-write) and recorded in snapshot_blocks. Each block is
+copied at most once per snapshot, so taking a snapshot never stalls writers up front.
+->Only one thread writes a given block at a time (the handlers hold its inode's writer lock),
+so the copy can be made outside ds_mutex. The new contents go to disk only after
+snapshot_blocks points at the copy, which is what snapshot_readblock relies on.
+->If the disk has no room left for the copy, the snapshot is deleted rather than failing the write
+(see HANDLE_SNAPSHOT), and counted in fs_snapshots_dropped_total.
+--------------------------------------------------------------------*/
+
+void write_block(uint32_t block_num, const void* buf) {
+
+    phase_timer timer(PHASE_DISK);
+
+    ds_mutex.lock();
+
+    if (!snapshot_needs_block(block_num)) {
+        ds_mutex.unlock();
+        disk_device->write(block_num, buf);
+        return;
     }
 
-    if(command[0] == "FS_DELETE") {
-        if(command.size() != 3) {
-            close(client_socket);
-            return;
+    if (available_disk_blocks.size() < 1) { //NO ROOM TO PRESERVE THE OLD CONTENTS
+        ds_mutex.unlock();
+        if (drop_snapshot(nullptr) == 0) {
+            metrics_snapshot_dropped();
         }
+        disk_device->write(block_num, buf);
+        return;
     }
 
-    if(command[0] != "FS_READBLOCK" && command[0] != "FS_WRITEBLOCK" && command[0] != "FS_CREATE" && command[0] != "FS_DELETE") {
-        close(client_socket);
-        return;
+    uint32_t copy_block_num = allocate_block();
+    uint32_t id = snapshot_id;
+
+    ds_mutex.unlock();
+
+    char old_buf[FS_BLOCKSIZE];
+    read_block(block_num, old_buf);
+    disk_device->write(copy_block_num, old_buf);
+
+    ds_mutex.lock();
+
+    if (snapshot_active && snapshot_id == id) {
+        snapshot_blocks[block_num] = copy_block_num;
+    } else { //The snapshot was deleted while we were copying
+        release_block(copy_block_num);
     }
 
+    ds_mutex.unlock();
 
-    
-    std::string type;
-    std::string usernm;
-    std::string pathnm;
-        
-    if (!(istr >> type)) {
-        close(client_socket);
+    disk_device->write(block_num, buf);
+}
+
+
+/*READER_LOCK / WRITER_LOCK
+--------------------------------------------------------------------
+->Every handler locks and unlocks inode blocks through these instead of using locks[]
+directly, so the time spent waiting for a lock is charged to the current request.
+->With -l, each acquisition and release is also handed to the lock profiler. The lock is
+tried first, so a lock that was free is counted as uncontended without timing a wait.
+->Taking and releasing a writer lock each bump the inode's version, so it is odd exactly
+while the inode is writer-locked (see OPTIMISTIC_TRAVERSE).
+->writer_try_lock takes the writer lock only if it is free, and returns whether it did.
+--------------------------------------------------------------------*/
+
+void reader_lock(uint32_t block_num) {
+
+    if(lockprof_enabled() && locks[block_num].try_lock_shared()) {
+        lockprof_acquired(block_num, LOCK_SHARED, 0, false);
         return;
     }
-    char typeArray[type.length() + 1];
-    std::strcpy(typeArray, type.c_str());
 
-    if (!(istr >> usernm)) {
-        close(client_socket);
-        return;
+    uint64_t start_ns = metrics_now();
+    locks[block_num].lock_shared();
+    uint64_t wait_ns = metrics_now() - start_ns;
+
+    metrics_add(PHASE_LOCK_WAIT, wait_ns);
+    if(lockprof_enabled()) {
+        lockprof_acquired(block_num, LOCK_SHARED, wait_ns, true);
+    }
+}
+
+void reader_unlock(uint32_t block_num) {
+
+    if(lockprof_enabled()) {
+        lockprof_released(block_num, LOCK_SHARED);
     }
 
-    if (usernm.length() > FS_MAXUSERNAME) {
-        close(client_socket);
+    locks[block_num].unlock_shared();
+}
+
+void writer_lock(uint32_t block_num) {
+
+    if(lockprof_enabled() && locks[block_num].try_lock()) {
+        lockprof_acquired(block_num, LOCK_EXCLUSIVE, 0, false);
+        inode_versions[block_num].fetch_add(1);
         return;
     }
-    char usernmArray[usernm.length() + 1];
-    std::strcpy(usernmArray, usernm.c_str());
 
-    if (!(istr >> pathnm)) {
-        close(client_socket);
-        return;
+    uint64_t start_ns = metrics_now();
+    locks[block_num].lock();
+    uint64_t wait_ns = metrics_now() - start_ns;
+
+    inode_versions[block_num].fetch_add(1);
+
+    metrics_add(PHASE_LOCK_WAIT, wait_ns);
+    if(lockprof_enabled()) {
+        lockprof_acquired(block_num, LOCK_EXCLUSIVE, wait_ns, true);
     }
-    if (pathnm.length() > FS_MAXPATHNAME) {
-         close(client_socket);
-         return;
+}
+
+bool writer_try_lock(uint32_t block_num) {
+
+    if(!locks[block_num].try_lock()) {
+        return false;
     }
-    char pathnmArray[pathnm.length() + 1];
-    std::strcpy(pathnmArray, pathnm.c_str());
 
-        
-    if(type == "FS_READBLOCK") {
+    inode_versions[block_num].fetch_add(1);
 
-        uint32_t block_int;
-        std::string block_string;
+    if(lockprof_enabled()) {
+        lockprof_acquired(block_num, LOCK_EXCLUSIVE, 0, false);
+    }
+    return true;
+}
 
-        std::string temp;
-        std::string temp_message;
-        std::vector<std::string> temp_vector;
+void writer_unlock(uint32_t block_num) {
 
-        std::istringstream istr2(message);
+    if(lockprof_enabled()) {
+        lockprof_released(block_num, LOCK_EXCLUSIVE);
+    }
 
-        std::getline(istr2, temp_message, '\0');
-        
-        std::istringstream istr3(temp_message);
-        
-        while(std::getline(istr3, temp, ' ')) {
-            temp_vector.push_back(temp);
-        }
+    inode_versions[block_num].fetch_add(1);
 
-        block_string = temp_vector.back();
+    locks[block_num].unlock();
+}
 
-        if(block_string.empty()) {
-            close(client_socket);
-            return;
-        }
 
-        if(block_string[0] == '0' && block_string.length() > 1) {
-            close(client_socket);
-            return;
-        }
+/*OPTIMISTIC_TRAVERSE
+--------------------------------------------------------------------
+->Walks path_vector down to the parent of its last name without locking the root or any
+directory on the way, seqlock style: each directory's version is read before its blocks and
+checked again after the next directory's version has been read. Any directory that changed
+(or was writer-locked) in between shows up as a different version.
+->A slot-level create or delete changes a direntry with its directory only reader-locked, so
+the version of the direntry block the name was found in is checked along with it. Otherwise
+the direntry could be cleared and its inode freed and reused as another directory, whose
+version the walk would then take for the one it was looking for.
+->Only the parent is locked, reader-locked or writer-locked if write_parent is set, and its
+version must still be the one the walk saw. Since deleting a directory writer-locks it, the
+parent is then known to still be where the walk found it.
+->The blocks read without a lock may be torn by a concurrent write, so nothing read from them
+is trusted (sizes and block numbers are range-checked) until the version check passes.
+->Returns false with nothing locked if anything changed underneath it or the path doesn't
+look right. The caller then falls back to hand-over-hand locking, which reports errors.
+--------------------------------------------------------------------*/
 
-        block_int = std::stoul(block_string);
+bool optimistic_traverse(const std::vector<std::string>& path_vector, bool write_parent, uint32_t& parent_block, char user[FS_MAXUSERNAME + 1]) {
 
-        if(block_int >= FS_MAXFILEBLOCKS) {
-            close(client_socket);
-            return;
-        }
+    uint32_t current_block = 0;
+    uint32_t version = inode_versions[0].load(std::memory_order_acquire);
 
-        int status = 0;
-        
-        
-        std::shared_ptr<char[]> data = handle_readblock(usernmArray, pathnmArray, block_int, status);
-     
-        if(status != -1){
-            
-            message.append(data.get(), FS_BLOCKSIZE);
-      
-            size_t bytes_sent = 0;
-           
-            do {
-                bytes_sent += send(client_socket, message.c_str() + bytes_sent, 
-                message.length() - bytes_sent, 0);
-            
-            } while ((bytes_sent < message.length()));
+    for(size_t i = 0; i + 1 < path_vector.size(); i++) {
+
+        if(version & 1) { //A WRITER HAS IT
+            return false;
         }
-            
-    }else if(type == "FS_WRITEBLOCK") {
 
-        uint32_t block_int;
-        std::string block_string;
+        fs_inode main_inode;
+        char main_inode_buf[FS_BLOCKSIZE];
+        read_block(current_block, main_inode_buf);
+        memcpy(&main_inode, main_inode_buf, sizeof(fs_inode));
 
-        std::string temp;
-        std::string temp_message;
-        std::vector<std::string> temp_vector;
+        if(main_inode.type != 'd' || main_inode.size > FS_MAXFILEBLOCKS ||
+           (current_block != 0 && strncmp(user, main_inode.owner, FS_MAXUSERNAME + 1) != 0)) {
+            return false;
+        }
 
-        std::istringstream istr2(message);
-     
-        std::getline(istr2, temp_message, '\0');
-        
-        std::istringstream istr3(temp_message);
-      
-        while(std::getline(istr3, temp, ' ')) {
-          
-            temp_vector.push_back(temp);
-            if(temp_vector.size() > 4) {
-               
-                close(client_socket);
-                return;
+        for(uint32_t j = 0; j < main_inode.size; j++) {
+            if(main_inode.blocks[j] >= FS_DISKSIZE) {
+                return false;
             }
         }
 
-        if(temp_vector.size() != 4) {
-            close(client_socket);
-            return;
+        uint32_t direntry_block = 0;
+        uint32_t direntry_version = 0;
+        uint32_t next_block = find_direntry(main_inode, path_vector[i], &direntry_block, &direntry_version);
+
+        if(next_block == 0 || next_block >= FS_DISKSIZE) {
+            return false;
         }
 
-        block_string = temp_vector.back();
+        uint32_t next_version = inode_versions[next_block].load(std::memory_order_acquire);
 
-        if(block_string.empty()) {
-            close(client_socket);
-            return;
-        }
-      
-        if(block_string[0] == '0' && block_string.length() > 1) {
-            close(client_socket);
-            return;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(inode_versions[current_block].load(std::memory_order_relaxed) != version ||
+           inode_versions[direntry_block].load(std::memory_order_relaxed) != direntry_version) {
+            return false;
         }
 
-        block_int = std::stoul(block_string);
+        current_block = next_block;
+        version = next_version;
+    }
 
+    if(write_parent) {
+        writer_lock(current_block);
+        version++; //OUR OWN WRITER_LOCK'S BUMP
+    } else {
+        reader_lock(current_block);
+    }
 
-        if(block_int >= FS_MAXFILEBLOCKS) {
-            close(client_socket);
-            return;
+    if(inode_versions[current_block].load(std::memory_order_acquire) != version) {
+        if(write_parent) {
+            writer_unlock(current_block);
+        } else {
+            reader_unlock(current_block);
         }
+        return false;
+    }
 
-        if(total_bytes < FS_BLOCKSIZE) {
-            close(client_socket);
-            return;
-        }
+    parent_block = current_block;
 
-        char* null_pos = (char*)memchr(message.c_str(), '\0', total_bytes);
+    return true;
+}
 
-        std::string command = message.substr(0, null_pos - message.c_str());
 
-        char* data = null_pos + 1;
-        
+/*FINGERPRINT_BLOCK
+--------------------------------------------------------------------
+->A fast (not cryptographic) 64-bit hash of a block's contents, used by dedup mode to
+find identical blocks. Matches are always confirmed byte for byte, so collisions are harmless.
+--------------------------------------------------------------------*/
 
-        size_t command_len = null_pos - message.c_str();
-        command_len++;
-        
-        size_t data_len = message.length() - command_len;
-        
-        if(handle_writeblock(usernmArray, pathnmArray, block_int, data, data_len) == 0) {
-            
-            size_t bytes_sent = 0;
-            do {
-                bytes_sent += send(client_socket, message.c_str() + bytes_sent, 
-                command_len - bytes_sent, 0);
-            } while (bytes_sent < command_len); 
+uint64_t fingerprint_block(const char* buf) {
 
-        }
+    uint64_t hash = 0x9e3779b97f4a7c15ULL;
 
-    }else if(type == "FS_CREATE") {
-     
-        std::string file_type;
-        istr >> file_type;
-        char file_typeArray[file_type.length() + 1];
-        std::strcpy(file_typeArray, file_type.c_str());
-        char file_type_char = file_typeArray[0];
+    for (uint32_t i = 0; i < FS_BLOCKSIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof(uint64_t));
 
-        if(file_type_char != 'f' && file_type_char != 'd') {
-            close(client_socket);
-            return;
-        }
+        hash ^= word;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
 
-      
-        if(handle_create(usernmArray, pathnmArray, file_type_char) == 0) {
-            size_t bytes_sent = 0;
-            do {
-                bytes_sent += send(client_socket, message.c_str() + bytes_sent, 
-                message.length(), 0);
-            } while (bytes_sent < message.length());
-        }
+    return hash;
+}
 
+/*DEDUP_INDEX
+--------------------------------------------------------------------
+->Records that block_num now holds data with this fingerprint, so later identical
+writes can share it. Only file data blocks written by handle_writeblock are indexed.
+--------------------------------------------------------------------*/
 
-    } else if(type == "FS_DELETE") {
-    
-        //The response message for a successful FS_DELETE is the same as the request message.
+void dedup_index(uint32_t block_num, uint64_t fingerprint) {
 
-        if(handle_delete(usernmArray, pathnmArray) == 0) {
-            size_t bytes_sent = 0;
-            do {
-                bytes_sent += send(client_socket, message.c_str() + bytes_sent, 
-                message.length(), 0);
-            } while (bytes_sent < message.length());
-        }
+    ds_mutex.lock();
 
-    }else{
-        
-        //Close the client socket
-    }  
+    //ONLY INDEX IT IF NOBODY FREED IT OR CHANGED IT SINCE WE WROTE IT
+    if (block_refcounts[block_num] > 0 && fingerprint_index.count(fingerprint) == 0) {
+        fingerprint_index[fingerprint] = block_num;
+        block_fingerprints[block_num] = fingerprint;
+    }
 
-    close(client_socket); 
+    ds_mutex.unlock();
 }
 
+/*DEDUP_UNINDEX
+--------------------------------------------------------------------
+->Forgets block_num's fingerprint. Called before a block is overwritten in place and
+when it is freed, so nothing can start sharing a block whose contents are changing.
+->The caller must hold ds_mutex.
+--------------------------------------------------------------------*/
 
-int main(int argc, char *argv[]) {
+void dedup_unindex(uint32_t block_num) {
 
-    //Get the port number
-    uint16_t port = parse_line(argc, argv);
- 
-    init_server(port);
+    auto indexed = block_fingerprints.find(block_num);
 
+    if (indexed == block_fingerprints.end()) {
+        return;
+    }
+
+    fingerprint_index.erase(indexed->second);
+    block_fingerprints.erase(indexed);
 }
 
-/*INIT_SERVER
--------------------------------------------------
--> Function we use to initialize the client server.
--> First, we call set_used_blocks to read in any existing
-filesystem and make sure we don't make any used blocks available.
--> We initialize the client socket, bind(), then assign the port specified
-(if none is specified, the OS assigns it).
--> We call listen() to await any client connections, then print the port
-number.
--> When a client connects, we create a thread to handle the client's request.
--------------------------------------------------*/
+/*DEDUP_WRITEBLOCK
+--------------------------------------------------------------------
+->Used by handle_writeblock in dedup mode, with the file's writer lock held. If a block
+with the same contents as buf is already on disk, block number "block" of the file
+(an existing block or the one right after the end) is pointed at it instead of writing
+buf, and true is returned. Otherwise nothing changes and false is returned.
+->The reference on the match is taken under ds_mutex before it is compared, so it can't be
+freed, and since shared blocks are never overwritten in place, it can't change either.
+--------------------------------------------------------------------*/
 
-int init_server(uint16_t port){
-    
+bool dedup_writeblock(uint32_t inode_block, fs_inode& node, uint32_t block, char buf[FS_BLOCKSIZE], uint64_t fingerprint) {
 
-    std::set<uint32_t> blocks_used;
+    uint32_t old_block_num = (block < node.size) ? node.blocks[block] : 0;
 
-    set_used_blocks(0, blocks_used);
+    ds_mutex.lock();
 
-    for (uint32_t i = 4095; i > 0; i--) {
-        if (blocks_used.find(i) == blocks_used.end()) {
-            available_disk_blocks.push_back(i);
-        }
+    auto indexed = fingerprint_index.find(fingerprint);
+
+    if (indexed == fingerprint_index.end() || indexed->second == old_block_num) {
+        ds_mutex.unlock();
+        return false;
     }
 
- 
+    uint32_t match_block_num = indexed->second;
+    block_refcounts[match_block_num]++;
 
+    ds_mutex.unlock();
 
-    //Set up socket clients will use
-    //Make sure this works if user does not specify port number
-    //Initialize Connection
-    int tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (tcp_socket == -1) {//Failed on socket init...
+    char match_buf[FS_BLOCKSIZE];
+    read_block(match_block_num, match_buf);
+
+    if (memcmp(match_buf, buf, FS_BLOCKSIZE) != 0) { //Hash collision!
+        ds_mutex.lock();
+        release_block(match_block_num);
+        ds_mutex.unlock();
+        return false;
     }
 
-    int yesval = 1;
-    if(setsockopt(tcp_socket, SOL_SOCKET, SO_REUSEADDR, &yesval, sizeof(yesval)) == -1){
-        close(tcp_socket);
+    node.blocks[block] = match_block_num;
+    if (block == node.size) {
+        node.size++;
     }
-    
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    if(port == 0) {
-        addr.sin_port = 0;
-        if(bind(tcp_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
-            close(tcp_socket);
-            return -1; 
-        }
-        // Correctly get the assigned port AFTER binding
-        socklen_t addrlen = sizeof(addr);
-        if (getsockname(tcp_socket, reinterpret_cast<sockaddr*>(&addr), &addrlen) == -1) {
-            perror("getsockname failed");
-            close(tcp_socket);
-            return -1; 
-        }
-        server_port = ntohs(addr.sin_port); 
-    }else {
-        addr.sin_port = htons(port); 
-        if(bind(tcp_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
-            close(tcp_socket);
-            return -1; 
-        }
-        server_port = port;
+
+    char inode_buf[FS_BLOCKSIZE];
+    memset(inode_buf, 0, FS_BLOCKSIZE);
+    memcpy(inode_buf, &node, sizeof(fs_inode));
+    write_block(inode_block, inode_buf);
+
+    //DROP THE OLD BLOCK ONLY ONCE THE INODE NO LONGER POINTS AT IT
+    if (old_block_num != 0) {
+        ds_mutex.lock();
+        release_block(old_block_num);
+        ds_mutex.unlock();
     }
 
-    
-    if(listen(tcp_socket, 30) == -1) {
-        
-        close(tcp_socket);
+    return true;
+}
+
+
+/*FIND_DUPLICATE
+--------------------------------------------------------------------
+->A helper function we use in handle_create to determine if a created file/directory
+already exists in a given path and if it does, the function returns -1.
+--------------------------------------------------------------------*/
+
+int find_duplicate(fs_inode main, std::string fname){
+    //Traverse all the direntries, DIRECTORY_READAHEAD blocks at a time
+
+    char dir_blocks_buf[DIRECTORY_READAHEAD * FS_BLOCKSIZE];
+
+    for(uint32_t first = 0; first < main.size; first += DIRECTORY_READAHEAD){
+
+        uint32_t count = std::min(DIRECTORY_READAHEAD, main.size - first);
+        read_blocks(main.blocks + first, count, dir_blocks_buf);
+        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_blocks_buf);
+
+        for(uint32_t i = 0; i < count * FS_DIRENTRIES; ++i){
+            
+            if(strcmp(direntries[i].name, fname.c_str()) == 0){
+                //FOUND A DUPLICATE!
+                return -1;
+            }
+        }
     }
+    return 0;
+}
 
-    print_port(server_port);
-    //if accept is detected, create new boost thread to service request
-    //int accept(int socket, struct sockaddr *address, int *address_len);
-    //If successful, accept() returns a nonnegative. If unsuccessful, accept() returns -1 
+/*READ_DIRECTORY_BLOCKS
+--------------------------------------------------------------------
+->Reads count (at most DIRECTORY_READAHEAD) direntry blocks without locking them, seqlock
+style. A slot-level create or delete holds a direntry block's writer lock while it rewrites
+the block, which makes the block's version odd, so a read that overlapped one is retried.
+->If versions_out is given, each block's version as read is stored there, for a caller that
+has to check later on that the block still says the same.
+--------------------------------------------------------------------*/
+
+void read_directory_blocks(const uint32_t* block_nums, size_t count, char* bufs, uint32_t* versions_out){
+
+    uint32_t versions[DIRECTORY_READAHEAD];
 
-    socklen_t addr_len = sizeof(addr);
     while(true){
-        int client_socket = accept(tcp_socket, reinterpret_cast<sockaddr*>(&addr), &addr_len);
 
-        if(client_socket > -1){
-            
-            boost::thread client_thread(&handle_request, client_socket);
-            client_thread.detach();
-        
-        }else{
-            break;
+        bool busy = false;
+        for(size_t i = 0; i < count; i++){
+            versions[i] = inode_versions[block_nums[i]].load(std::memory_order_acquire);
+            busy = busy || (versions[i] & 1);
         }
 
-    }
+        if(!busy){
+            read_blocks(block_nums, count, bufs);
 
+            std::atomic_thread_fence(std::memory_order_acquire);
 
+            bool changed = false;
+            for(size_t i = 0; i < count; i++){
+                changed = changed || inode_versions[block_nums[i]].load(std::memory_order_relaxed) != versions[i];
+            }
 
-    return tcp_socket;
+            if(!changed){
+                if(versions_out != nullptr){
+                    std::copy(versions, versions + count, versions_out);
+                }
+                return;
+            }
+        }
 
+        boost::this_thread::yield();
+    }
 }
 
-uint16_t parse_line(int argc, char *argv[]){
-    //if argc == 2, port was specified
-    if(argc == 1) {
-        return 0;
-    }else{
-        return std::atoi(argv[1]);
+/*FIND_DIRENTRY
+--------------------------------------------------------------------
+->A helper function that scans the direntry blocks of the directory inode main
+looking for fname.
+->Returns the inode block the direntry points to, or 0 if fname isn't in the directory.
+->No locks are taken (see READ_DIRECTORY_BLOCKS), so a caller that goes on to lock the
+inode has to check it's still there. Locked lookups use lock_direntry.
+->If direntry_block is given, the direntry block the name was found in and its version as
+read are stored in direntry_block and direntry_version. The direntry still names the same
+inode for as long as the block's version stays the same.
+--------------------------------------------------------------------*/
+
+uint32_t find_direntry(fs_inode main, std::string fname, uint32_t* direntry_block, uint32_t* direntry_version){
+
+    char dir_blocks_buf[DIRECTORY_READAHEAD * FS_BLOCKSIZE];
+    uint32_t versions[DIRECTORY_READAHEAD];
+
+    for(uint32_t first = 0; first < main.size; first += DIRECTORY_READAHEAD){
+
+        uint32_t count = std::min(DIRECTORY_READAHEAD, main.size - first);
+        read_directory_blocks(main.blocks + first, count, dir_blocks_buf, versions);
+        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_blocks_buf);
+
+        for(uint32_t j = 0; j < count * FS_DIRENTRIES; ++j){
+
+            //BOUNDED, SINCE OPTIMISTIC_TRAVERSE MAY HAND US A TORN BLOCK WITH NO TERMINATOR
+            if(direntries[j].inode_block != 0 && strncmp(direntries[j].name, fname.c_str(), FS_MAXFILENAME + 1) == 0){
+                if(direntry_block != nullptr){
+                    *direntry_block = main.blocks[first + j / FS_DIRENTRIES];
+                    *direntry_version = versions[j / FS_DIRENTRIES];
+                }
+                return direntries[j].inode_block;
+            }
+        }
     }
+    return 0;
 }
 
-/*HANDLE_READBLOCK
--------------------------------------------------
--> This function is used to handle any FS_READBLOCK requests from the client.
--> This function completes most of the error checking (some being done in handle_request)
-and handles the rest of the read block request.
--> In the end, if able to fetch the data requested from disk, it returns a pointer to the char buffer
-containing the data read from disk, which can then be sent to the client in handle_request.
--------------------------------------------------*/
+/*LOCK_DIRENTRY
+--------------------------------------------------------------------
+->Looks fname up in the directory main, whose inode the caller holds locked, and locks the
+inode it names: writer-locked if write_child is set, reader-locked otherwise.
+->Each direntry block is reader-locked while it is scanned, and the one naming the child
+stays locked until the child is, so a slot-level delete (see DELETE_FROM_SLOT) can't unlink
+and free the child in between.
+->Returns the child's inode block, or 0 with nothing locked if fname isn't in the directory.
+--------------------------------------------------------------------*/
 
-std::shared_ptr<char[]> handle_readblock(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], uint32_t block, int &status) {
+uint32_t lock_direntry(const fs_inode& main, const std::string& fname, bool write_child){
 
-    std::vector<std::string> path_vector = char_array_to_string_vector(pathname_char);
-    if(path_vector.size() == 0) {
-        status = -1;
-        return nullptr;
-    }
-    std::string username = std::string(username_char);
+    char dir_block_buf[FS_BLOCKSIZE];
 
-    uint32_t child_block = 0;
-    uint32_t parent_block = 0;
+    for(uint32_t i = 0; i < main.size; i++){
 
-    int check = traverse_tree(path_vector, false, child_block, parent_block, username_char);
+        reader_lock(main.blocks[i]);
+        read_block(main.blocks[i], dir_block_buf);
 
-    //FIXME: we dont need to hold parent lock right?
-    
-    if(check == -1) { //Path does not exist!
-       
-        status = -1;
-        return nullptr;
-    }
+        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_block_buf);
 
-    locks[parent_block]->unlock_shared();
+        for(uint32_t j = 0; j < FS_DIRENTRIES; j++){
 
-    fs_inode node;
-    char inode_buf[FS_BLOCKSIZE]; //Buffer to read inode block
-    disk_readblock(child_block, inode_buf);
-    memcpy(&node, inode_buf, sizeof(fs_inode)); //Copy from buffer
+            if(direntries[j].inode_block != 0 && strcmp(direntries[j].name, fname.c_str()) == 0){
 
-    if(std::strcmp(username_char, node.owner) != 0) {
-        
-        locks[child_block]->unlock_shared();
-        
-        status = -1;
-        return nullptr;
-    }
-    
-    if(node.type != 'f') { //MAKE SURE ITS ACTUALLY A FILE WERE READING FROM
+                uint32_t child_block = direntries[j].inode_block;
 
-        locks[child_block]->unlock_shared();
+                if(write_child) {
+                    writer_lock(child_block);
+                } else {
+                    reader_lock(child_block);
+                }
 
-        status = -1;
-        return nullptr;
+                reader_unlock(main.blocks[i]);
+                return child_block;
+            }
+        }
+
+        reader_unlock(main.blocks[i]);
     }
-    
+    return 0;
+}
 
-    if(block < node.size) {
-    
-        std::shared_ptr<char[]> buf(new char[FS_BLOCKSIZE]);
-        memset(buf.get(), 0, FS_BLOCKSIZE);
-        uint32_t block_read_from = node.blocks[block];
-        
-        disk_readblock(block_read_from, buf.get());
-   
-        locks[child_block]->unlock_shared();
+/*RESPONSE_WRITER
+-----------------------------------------------------------
+->Sends responses to the client. A blocking writer sends everything, however many send
+calls that takes. A non-blocking writer (the event pipeline) sends what the socket will
+take right now and keeps the rest in pending, for the connection's executor to finish.
+->With a body, the header and body go out back to back without first being copied
+into one buffer (MSG_MORE keeps the kernel from sending the header on its own).
+->Gives up if the client has gone away.
+-----------------------------------------------------------*/
 
-        return buf;
-    }else{ //Block is not in file!
+void response_writer::send_bytes(const char* buf, size_t len, int flags) {
 
-        locks[child_block]->unlock_shared();
+    size_t bytes_sent = 0;
 
-        status = -1;
-        
-        return nullptr;
+    while(!failed && pending.empty() && bytes_sent < len) {
+        ssize_t sent = ::send(client_socket, buf + bytes_sent, len - bytes_sent,
+                              MSG_NOSIGNAL | flags | (blocking ? 0 : MSG_DONTWAIT));
+
+        if(sent > 0) {
+            bytes_sent += sent;
+        }else if(!blocking && sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }else if(sent < 0 && errno == EINTR) {
+            continue;
+        }else {
+            failed = true;
+        }
     }
 
+    //ONCE ANYTHING IS LEFT OVER, EVERYTHING AFTER IT WAITS TOO, SO THE BYTES STAY IN ORDER
+    if(!failed && bytes_sent < len) {
+        pending.append(buf + bytes_sent, len - bytes_sent);
+    }
 }
 
-/*HANDLE_WRITEBLOCK
--------------------------------------------------
--> This function is used to handle any FS_WRITEBLOCK requests from the client.
--> This function completes most of the error checking (some being done in handle_request)
-for a write block request.
--> It checks if the file is full, if the block is valid, and if the user has permission to write to the file.
--> If the file is not full, it writes the data to the block specified.
--> If the file is full, it checks if there is space on disk to write a new block.
--> If there is space, it writes the data to a new block and updates the inode.
--> If there is no space, it returns -1.
--> After a succesful write to disk, it returns 0 to let the handle_request function know that the write was successful.
--------------------------------------------------*/
+void response_writer::send(const char* buf, size_t len) {
 
-int handle_writeblock(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], uint32_t block, void* data, size_t data_len) {
-  
-    std::vector<std::string> path_vector = char_array_to_string_vector(pathname_char);
-    if(path_vector.size() == 0) {
-        return -1;
-    }
+    phase_timer timer(PHASE_SEND);
 
-    std::string username = std::string(username_char);
+    responded = true;
+    send_bytes(buf, len, 0);
+}
 
-    uint32_t child_block = 0;
-    uint32_t parent_block = 0;
+void response_writer::send(const char* header, size_t header_len, const char* body, size_t body_len) {
 
-    int check = traverse_tree(path_vector, true, child_block, parent_block, username_char);
+    phase_timer timer(PHASE_SEND);
 
+    responded = true;
+    send_bytes(header, header_len, MSG_MORE);
+    send_bytes(body, body_len, 0);
+}
 
-    if(check == -1) {    //Path does not exist!
-        return -1;
-    }
+/*REQUEST_LENGTH
+-----------------------------------------------------------
+->The length of the request at the start of message once all of it has arrived (0 until then):
+everything up to the null terminator of the header, plus the data block that follows it for
+FS_WRITEBLOCK and FS_WRITE_H. The data itself may contain null bytes anywhere, including at the end of a recv.
+->Anything after that length is the next request on a session connection.
+-----------------------------------------------------------*/
 
-    locks[parent_block]->unlock_shared();
+size_t request_length(const std::string& message) {
 
-    fs_inode node;
-    char inode_buf[FS_BLOCKSIZE]; // Buffer to read inode block
-    disk_readblock(child_block, inode_buf);
-    memcpy(&node, inode_buf, sizeof(fs_inode)); // Copy from buffer
+    size_t null_index = message.find('\0');
 
-    if(std::strcmp(username_char, node.owner) != 0) {
-        
-        locks[child_block]->unlock();
-        
-        return -1;
+    if(null_index == std::string::npos) {
+        return 0;
     }
-    
-    //Path is a directory!
-    if(node.type != 'f') { //MAKE SURE ITS ACTUALLY A FILE WE'RE READING FROM
-        
-        locks[child_block]->unlock();
 
-        return -1;
-    }
+    bool has_data = message.compare(0, 14, "FS_WRITEBLOCK ") == 0 || message.compare(0, 11, "FS_WRITE_H ") == 0;
+    size_t length = null_index + 1 + (has_data ? FS_BLOCKSIZE : 0);
+
+    return message.length() >= length ? length : 0;
+}
+
+/*HANDLE_REQUEST
+-----------------------------------------------------------
+->Serves one connection on the calling thread, start to finish (the -T thread per
+connection mode; see fs_executor.h for the default event pipeline).
+->First, we receive the client's message, then serve_request handles it and sends the
+response. The socket is closed either way.
+->A client that opens with SESSION_REQUEST (the source-built client library's pooled
+connections) keeps the connection for request after request instead, until one fails or the
+client closes it. A failed request still gets no response, just the close.
+->On a tagged session (TAGGED_SESSION_REQUEST) every request gets a thread of its own, up to
+MAX_TAGGED_IN_FLIGHT at once, and answers for itself (see TAGGED_CONNECTION).
+->Requests wait for one of worker_threads service slots in serve_admitted, and one the
+server is too busy for is answered BUSY_RESPONSE (see fs_admission.h).
+-----------------------------------------------------------*/
+
+void handle_request(int client_socket){
     
-        if(block < node.size) {
+    char msg[64] = {}; 
 
-            uint32_t block_write_to = node.blocks[block];
-            
-            char buf[FS_BLOCKSIZE];
-            memset(buf, 0, FS_BLOCKSIZE);
-            memcpy(buf, data, FS_BLOCKSIZE);
-            
-            disk_writeblock(block_write_to, buf);
-        
-        }else if(block == node.size){
+    std::string buffer;
+    bool session = false;
 
-            //FILE IS FULL
-            if(node.size == FS_MAXFILEBLOCKS) { 
-        
-                locks[child_block]->unlock();
-                
-                return -1;
+    std::shared_ptr<tagged_connection> tagged;
+    std::string tag;
+
+    while(true) {
+
+        int return_val = 0;
+
+        while(request_length(buffer) == 0 && buffer.length() < MAX_REQUEST_LEN) {
+            return_val = recv(client_socket, msg, 64, 0);
+           
+            if(return_val <= 0){
+                break;
             }
-       
-            
-            ds_mutex.lock();
-             //NOT ENOUGH DISK SPACE!
-            if(available_disk_blocks.size() < 1) {
-                ds_mutex.unlock();
-                locks[child_block]->unlock();
                 
-                return -1;
+            buffer += std::string(msg, return_val);
+        }
+
+        size_t length = request_length(buffer);
+
+        //A SESSION ENDS WHEN THE CLIENT CLOSES IT (OR SENDS SOMETHING THAT NEVER COMPLETES)
+        if(session && length == 0) {
+            break;
+        }
+
+        std::string message = (length == 0) ? buffer : buffer.substr(0, length);
+        buffer.erase(0, message.length());
+
+        response_writer writer;
+        writer.client_socket = client_socket;
+        writer.blocking = true;
+
+        if(!session && (message == SESSION_REQUEST || message == TAGGED_SESSION_REQUEST)) {
+            session = true;
+
+            //RESPONSES ON A SESSION CAN FOLLOW EACH OTHER CLOSELY (FS_RELEASE THEN A WRITE), SO
+            //DON'T LET NAGLE HOLD ONE BACK UNTIL THE CLIENT ACKS THE LAST
+            int nodelay = 1;
+            setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+            writer.send(message.c_str(), message.length());
+
+            if(message == TAGGED_SESSION_REQUEST) {
+                tagged = std::make_shared<tagged_connection>(client_socket);
             }
+            continue;
+        }
 
-            uint32_t new_block_num = available_disk_blocks.back();
-            available_disk_blocks.pop_back();
-            ds_mutex.unlock();
-            
-            char buf[FS_BLOCKSIZE];
-            memset(buf, 0, FS_BLOCKSIZE);
-            memcpy(buf, data, FS_BLOCKSIZE);
-            
-            disk_writeblock(new_block_num, buf);
+        if(tagged) {
+
+            if(tag.empty()) {
+                if(!parse_tag(message)) {
+                    break;
+                }
+                tag = message;
+                continue;
+            }
+
+            boost::unique_lock<boost::mutex> lock(tagged->state_mutex);
+            while(tagged->in_flight >= MAX_TAGGED_IN_FLIGHT) {
+                tagged->slot_freed.wait(lock);
+            }
+            tagged->in_flight++;
+            lock.unlock();
+
+            boost::thread request_thread(start_tagged_request(tagged, tag, message, admission_now()));
+            request_thread.detach();
+
+            tag.clear();
+            continue;
+        }
+
+        if(!serve_admitted(message, writer, admission_now())) {
+            writer.send(BUSY_RESPONSE.c_str(), BUSY_RESPONSE.length());
+        }
+
+        if(!session || !writer.responded || writer.failed) {
+            break;
+        }
+    }
+
+    //A TAGGED SOCKET IS CLOSED BY THE LAST REQUEST STILL ANSWERING ON IT
+    if(!tagged) {
+        close(client_socket); 
+        connection_closed();
+    }
+}
+
+/*TAGGED_CONNECTION
+-----------------------------------------------------------
+->A tagged session lets one connection carry many requests at once. The client sends
+"FS_TAG <n>" ahead of each request, where n is any number it likes. Each request is
+served on its own (on the worker pool, or a thread of its own with -T), and its response
+is sent, whole, as soon as it is ready: "FS_TAG <n>" and then the usual response, or just
+"FS_FAIL <n>" if the request failed. The connection stays open either way.
+->Responses from different requests never interleave, since each is sent under
+send_mutex. On the worker pool they are sent without blocking: what the socket won't take
+goes into the connection's outbox, which flush_tagged_later sends from the connection's
+executor as the socket makes room. A request keeps its slot in in_flight until its response
+is all out, so a client that stops reading is sent at most MAX_TAGGED_IN_FLIGHT responses
+before the server stops reading from it too, and no worker ever waits on it. With -T each
+request has a thread of its own, which simply blocks in send.
+->FS_RELEASE is applied as soon as it is read, so a release sent ahead of a write is in
+effect before the write starts, just as on an ordinary session.
+->A request the server is too busy for (see fs_admission.h) is answered "FS_BUSY <n>".
+-----------------------------------------------------------*/
+
+tagged_connection::~tagged_connection() {
+    if(write_socket != -1) {
+        close(write_socket);
+    }
+    close(client_socket);
+    connection_closed();
+}
+
+//Sends what it can of the outbox (all of it if blocking) and returns how many responses are
+//now out. Once the client has gone away, every response counts as out. Holds send_mutex
+static size_t send_outbox(tagged_connection& connection, bool blocking) {
+
+    size_t bytes_sent = 0;
+
+    while(!connection.failed && bytes_sent < connection.outbox.length()) {
+        ssize_t sent = ::send(connection.client_socket, connection.outbox.data() + bytes_sent,
+                              connection.outbox.length() - bytes_sent, MSG_NOSIGNAL | (blocking ? 0 : MSG_DONTWAIT));
+
+        if(sent > 0) {
+            bytes_sent += sent;
+        }else if(!blocking && sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }else if(sent < 0 && errno == EINTR) {
+            continue;
+        }else {
+            connection.failed = true;
+        }
+    }
+
+    if(connection.failed) {
+        bytes_sent = connection.outbox.length();
+    }
+
+    connection.outbox.erase(0, bytes_sent);
+
+    size_t done = 0;
+    while(!connection.outbox_ends.empty() && connection.outbox_ends.front() <= bytes_sent) {
+        connection.outbox_ends.pop_front();
+        done++;
+    }
+    for(size_t& end : connection.outbox_ends) {
+        end -= bytes_sent;
+    }
+
+    return done;
+}
+
+/*TAGGED_CONNECTION::SEND_RESPONSE
+-----------------------------------------------------------
+->Queues one request's response behind any still in the outbox and sends what it can. Each
+response sent gives its request's slot back (see finish_request). If the socket is full, the
+rest is left to flush_tagged_later.
+-----------------------------------------------------------*/
+
+void tagged_connection::send_response(const std::string& response) {
+
+    send_mutex.lock();
+
+    outbox += response;
+    outbox_ends.push_back(outbox.length());
+
+    size_t done = 0;
+    bool flush_later = false;
+
+    if(!flushing) {
+        done = send_outbox(*this, home == nullptr);
+
+        if(!outbox.empty()) {
+            flushing = true;
+            flush_later = true;
+        }
+    }
+
+    send_mutex.unlock();
+
+    if(flush_later) {
+        flush_tagged_later(shared_from_this());
+    }
+
+    for(size_t i = 0; i < done; i++) {
+        finish_request();
+    }
+}
+
+/*TAGGED_CONNECTION::FLUSH
+-----------------------------------------------------------
+->Called by flush_tagged_later each time the socket has room. Returns true once the outbox
+is empty (or the client has gone away), false if it has to wait for room again.
+-----------------------------------------------------------*/
+
+bool tagged_connection::flush() {
+
+    send_mutex.lock();
+
+    size_t done = send_outbox(*this, false);
+
+    bool flushed = outbox.empty();
+    if(flushed) {
+        flushing = false;
+    }
+
+    send_mutex.unlock();
+
+    for(size_t i = 0; i < done; i++) {
+        finish_request();
+    }
+
+    return flushed;
+}
+
+void tagged_connection::finish_request() {
+
+    state_mutex.lock();
+
+    in_flight--;
+    std::coroutine_handle<> reader = parked;
+    parked = nullptr;
+
+    state_mutex.unlock();
+
+    slot_freed.notify_one();
+
+    if(reader) {
+        home->post([reader]() { reader.resume(); });
+    }
+}
+
+bool parse_tag(const std::string& message) {
+
+    if(message.compare(0, 7, "FS_TAG ") != 0 || message.length() < 9 || message.length() > 7 + 20 + 1) {
+        return false;
+    }
+
+    for(size_t i = 7; i < message.length() - 1; i++) {
+        if(message[i] < '0' || message[i] > '9') {
+            return false;
+        }
+    }
+
+    return message.back() == '\0';
+}
+
+/*START_TAGGED_REQUEST
+-----------------------------------------------------------
+->Returns the job that serves message (tagged with tag, "FS_TAG <n>" and its terminator) and
+sends its response. The caller has already taken a slot for it in connection->in_flight,
+which is given back once the response is out (see TAGGED_CONNECTION::SEND_RESPONSE). arrived_ns is when the message finished arriving, for serve_admitted.
+->FS_RELEASE is served right here, so only its response is left for the job.
+-----------------------------------------------------------*/
+
+std::function<void()> start_tagged_request(std::shared_ptr<tagged_connection> connection, const std::string& tag, std::string message, uint64_t arrived_ns) {
+
+    auto serve = [tag, arrived_ns](std::string& request) {
+
+        //WITH THE TAG ALREADY IN PENDING, THE WRITER ONLY BUFFERS: EVERYTHING AFTER IT WAITS
+        //THERE TOO, SO THE WHOLE RESPONSE CAN GO OUT IN ONE PIECE UNDER send_mutex
+        response_writer writer;
+        writer.blocking = false;
+        writer.pending = tag;
+
+        if(!serve_admitted(request, writer, arrived_ns)) {
+            return "FS_BUSY" + tag.substr(6);
+        }
+        if(!writer.responded) {
+            return "FS_FAIL" + tag.substr(6);
+        }
+        return writer.pending;
+    };
+
+    if(message.compare(0, 11, "FS_RELEASE ") == 0) {
+        std::string response = serve(message);
+        return [connection, response]() {
+            connection->send_response(response);
+        };
+    }
+
+    return [connection, message, serve]() mutable {
+        connection->send_response(serve(message));
+    };
+}
+
+/*SERVE_ADMITTED
+-----------------------------------------------------------
+->serve_request, unless admission control turns message away (see fs_admission.h), in which
+case nothing is sent and it returns false for the caller to answer BUSY_RESPONSE.
+arrived_ns is when message finished arriving.
+->With -T, the request waits here for a service slot. On the worker pool it has already
+waited its turn in the pool's queue, so only its deadline is left to check.
+->FS_RELEASE is served straight away.
+-----------------------------------------------------------*/
+
+bool serve_admitted(std::string& message, response_writer& writer, uint64_t arrived_ns) {
+
+    if(is_lease_release(message)) {
+        serve_request(message, writer);
+        return true;
+    }
+
+    if(thread_per_connection) {
+        fair_ticket ticket;
+        if(!enter_service(request_user(message), arrived_ns, ticket)) {
+            return false;
+        }
+        serve_request(message, writer);
+        leave_service(ticket);
+        return true;
+    }
+
+    if(request_expired(arrived_ns)) {
+        metrics_busy(BUSY_DEADLINE);
+        stats_for_user(request_user(message)).turned_away.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    serve_request(message, writer);
+    return true;
+}
+
+//Records a request served by serve_request in the trace (see fs_trace.h)
+static void trace_parsed_request(const fs_request& parsed_request, bool ok, uint64_t started_ns) {
+
+    trace_record record;
+    if(!trace_op_from_name(parsed_request.type, record.op)) {
+        return;
+    }
+
+    record.handle = parsed_request.handle;
+    record.block = parsed_request.block;
+    record.ok = ok;
+    record.file_type = parsed_request.file_type;
+    record.username = parsed_request.username;
+    record.pathname = parsed_request.pathname;
+    record.new_pathname = parsed_request.new_pathname;
+
+    trace_request(record, started_ns);
+}
+
+/*SERVE_REQUEST
+-----------------------------------------------------------
+->Handles one received request message and sends its response through writer.
+->We read in the 'type' and hand the request to its handler.
+->If any of the helper-handler functions fail, nothing is sent, and the caller closes the
+socket without a response.
+->A request_metrics records how long each request took and whether it failed.
+The special request "FS_STATS" gets those metrics back as text instead, and
+"FS_LOCKSTATS <n>" gets the lock profiler's n hottest locks.
+->FS_READLEASE is FS_READBLOCK plus a read lease, and "FS_RELEASE <token>" gives one back
+(see fs_lease.h).
+->FS_OPEN returns a handle that FS_READ_H and FS_WRITE_H take in place of the path, until
+FS_CLOSE (see fs_handle.h).
+-----------------------------------------------------------*/
+
+void serve_request(std::string& message, response_writer& writer){
+
+    //FS_STATS ISN'T A FILESYSTEM REQUEST, SO IT ISN'T COUNTED IN THE METRICS IT REPORTS
+    if(std::strcmp(message.c_str(), "FS_STATS") == 0) {
+        std::string report = metrics_report() + fairshare_report() + trace_report() + defrag_report();
+        writer.send(report.c_str(), report.length());
+        return;
+    }
+
+    //"FS_LOCKSTATS <n>" REPORTS THE n HOTTEST LOCKS (10 IF n IS LEFT OUT)
+    if(message.compare(0, 12, "FS_LOCKSTATS") == 0 && (message[12] == '\0' || message[12] == ' ')) {
+        size_t top_n = 10;
+        if(message[12] == ' ') {
+            top_n = std::strtoul(message.c_str() + 13, nullptr, 10);
+        }
+        std::string report = lockprof_report(top_n);
+        writer.send(report.c_str(), report.length());
+        return;
+    }
+
+    //"FS_RELEASE <token>" GIVES BACK A READ LEASE BEFORE THE CLIENT WRITES TO THE FILE (SEE fs_lease.h)
+    if(message.compare(0, 11, "FS_RELEASE ") == 0) {
+        char* end = nullptr;
+        uint64_t token = std::strtoull(message.c_str() + 11, &end, 10);
+        if(end == message.c_str() + 11 || *end != '\0' || end + 1 != message.c_str() + message.length()) {
+            return;
+        }
+        release_lease(token);
+        writer.send(message.c_str(), message.length());
+        return;
+    }
+
+    request_metrics request;
+    uint64_t started_ns = trace_enabled ? metrics_now() : 0;
+
+    if(message.length() > MAX_REQUEST_LEN){
+        return;
+    }
+
+    //A LEASED READ IS STILL A READ, AND SO ARE READS AND WRITES THROUGH A HANDLE
+    std::string op_name = message.substr(0, message.find(' '));
+    if(op_name == "FS_READLEASE" || op_name == "FS_READ_H") {
+        op_name = "FS_READBLOCK";
+    }else if(op_name == "FS_WRITE_H") {
+        op_name = "FS_WRITEBLOCK";
+    }
+    request.set_op(op_from_name(op_name));
+
+    fs_request parsed_request;
+    if(parse_request(message, parsed_request) == -1) {
+        return;
+    }
+
+    request.parsed();
+
+    const std::string& type = parsed_request.type;
+    char* usernmArray = &parsed_request.username[0];
+    char* pathnmArray = &parsed_request.pathname[0];
+
+    if(type == "FS_READBLOCK") {
+
+        int status = 0;
+
+        //ZERO-COPY ONLY WHEN THE SEND CAN'T BLOCK: THE FILE STAYS READER-LOCKED UNTIL IT IS DONE
+        std::shared_ptr<const char[]> data = handle_readblock(usernmArray, pathnmArray, parsed_request.block, status, nullptr, !writer.blocking);
+     
+        if(status != -1){
             
-            //EDIT INODE AFTER DISK WRITE FOR CRASH CONSISTENCY
-            node.blocks[node.size] = new_block_num;
-            node.size++;
+            writer.send(message.c_str(), message.length(), data.get(), FS_BLOCKSIZE);
+            request.succeeded();
+        }
             
-            char inode_buf[FS_BLOCKSIZE];
-            memset(inode_buf, 0, FS_BLOCKSIZE);
-            memcpy(inode_buf, &node, sizeof(fs_inode));
-            disk_writeblock(child_block, inode_buf); 
+    }else if(type == "FS_READLEASE") {
+
+        //THE RESPONSE IS FS_READBLOCK'S WITH THE LEASE (OR A TERM OF 0, FOR NONE) AFTER THE DATA
+        int status = 0;
+        fs_lease lease;
+
+        std::shared_ptr<const char[]> data = handle_readblock(usernmArray, pathnmArray, parsed_request.block, status, &lease);
+
+        if(status != -1){
+
+            std::string body(data.get(), FS_BLOCKSIZE);
+            body.resize(FS_BLOCKSIZE + LEASE_TRAILER_LEN);
+            encode_lease(lease, &body[FS_BLOCKSIZE]);
+
+            writer.send(message.c_str(), message.length(), body.data(), body.length());
+            request.succeeded();
+        }
+
+    }else if(type == "FS_READ_H") {
+
+        int status = 0;
+
+        std::shared_ptr<const char[]> data = handle_read_h(usernmArray, parsed_request.handle, parsed_request.block, status, !writer.blocking);
+
+        if(status != -1){
+            writer.send(message.c_str(), message.length(), data.get(), FS_BLOCKSIZE);
+            request.succeeded();
+        }
 
+    }else if(type == "FS_WRITE_H") {
+
+        if(handle_write_h(usernmArray, parsed_request.handle, parsed_request.block, parsed_request.data, parsed_request.data_len) == 0) {
+            writer.send(message.c_str(), parsed_request.header_len);
+            request.succeeded();
+        }
+
+    }else if(type == "FS_OPEN") {
+
+        //THE RESPONSE IS THE ECHO FOLLOWED BY THE HANDLE (SEE fs_handle.h)
+        uint64_t handle = 0;
+
+        if(handle_open(usernmArray, pathnmArray, handle) == 0) {
+            parsed_request.handle = handle;
+
+            char encoded[HANDLE_LEN];
+            encode_handle(handle, encoded);
+
+            writer.send(message.c_str(), message.length(), encoded, HANDLE_LEN);
+            request.succeeded();
+        }
+
+    }else if(type == "FS_CLOSE") {
+
+        if(close_file_handle(parsed_request.handle, usernmArray)) {
+            writer.send(message.c_str(), message.length());
+            request.succeeded();
         }else {
+            metrics_reject(REJECT_NOT_FOUND);
+        }
+
+    }else if(type == "FS_WRITEBLOCK") {
+
+        if(handle_writeblock(usernmArray, pathnmArray, parsed_request.block, parsed_request.data, parsed_request.data_len) == 0) {
             
-            locks[child_block]->unlock();
-            
+            writer.send(message.c_str(), parsed_request.header_len);
+            request.succeeded();
+
+        }
+
+    }else if(type == "FS_CREATE") {
+
+        if(handle_create(usernmArray, pathnmArray, parsed_request.file_type) == 0) {
+            writer.send(message.c_str(), message.length());
+            request.succeeded();
+        }
+
+    } else if(type == "FS_DELETE") {
+    
+        //The response message for a successful FS_DELETE is the same as the request message.
+
+        if(handle_delete(usernmArray, pathnmArray) == 0) {
+            writer.send(message.c_str(), message.length());
+            request.succeeded();
+        }
+
+    } else if(type == "FS_SNAPSHOT") {
+
+        //The response message for a successful FS_SNAPSHOT is the same as the request message.
+
+        if(handle_snapshot(usernmArray, pathnmArray) == 0) {
+            writer.send(message.c_str(), message.length());
+            request.succeeded();
+        }
+
+    } else if(type == "FS_RENAME" || type == "FS_CLONE") {
+
+        //The response message for a successful FS_RENAME or FS_CLONE is the same as the request message.
+
+        char* new_pathnmArray = &parsed_request.new_pathname[0];
+
+        int result = 0;
+        if(type == "FS_RENAME") {
+            result = handle_rename(usernmArray, pathnmArray, new_pathnmArray);
+        } else {
+            result = handle_clone(usernmArray, pathnmArray, new_pathnmArray);
+        }
+
+        if(result == 0) {
+            writer.send(message.c_str(), message.length());
+            request.succeeded();
+        }
+
+    }
+
+    if(trace_enabled) {
+        trace_parsed_request(parsed_request, writer.responded, started_ns);
+    }
+}
+
+/*PARSE_REQUEST
+-----------------------------------------------------------
+->Checks that message is a well formed request and splits it into request's fields.
+->The header is space separated and ends with a null terminator. FS_WRITEBLOCK's
+data block follows the terminator, and data points at it inside message.
+->Returns -1 if the request is malformed, 0 otherwise.
+-----------------------------------------------------------*/
+
+int parse_request(const std::string& message, fs_request& request) {
+
+    std::istringstream istr(message);
+    std::istringstream testist(message);
+
+    std::string token;
+
+    std::vector<std::string> command;
+
+    while(std::getline(testist, token, ' ')) {
+        command.push_back(token);
+
+        if(token == "FS_WRITEBLOCK" || token == "FS_WRITE_H") {
+            break;
+        }
+
+        if(command.size() > 4) {
             return -1;
         }
+    }
+
+    if(command.empty()) { //The client didn't send anything
+        return -1;
+    }
+
+    if(command[0] == "FS_READBLOCK" || command[0] == "FS_READLEASE" || command[0] == "FS_READ_H" || command[0] == "FS_CREATE" || command[0] == "FS_RENAME" || command[0] == "FS_CLONE") {
+        if(command.size() != 4) {
+            return -1;
+        }
+    }
+
+    if(command[0] == "FS_DELETE" || command[0] == "FS_SNAPSHOT" || command[0] == "FS_OPEN" || command[0] == "FS_CLOSE") {
+        if(command.size() != 3) {
+            return -1;
+        }
+    }
+
+    if(command[0] != "FS_READBLOCK" && command[0] != "FS_READLEASE" && command[0] != "FS_WRITEBLOCK" && command[0] != "FS_CREATE" && command[0] != "FS_DELETE" && command[0] != "FS_RENAME" && command[0] != "FS_CLONE" && command[0] != "FS_SNAPSHOT" &&
+       command[0] != "FS_OPEN" && command[0] != "FS_READ_H" && command[0] != "FS_WRITE_H" && command[0] != "FS_CLOSE") {
+        return -1;
+    }
+
+    std::string usernm;
+    std::string pathnm;
+
+    if (!(istr >> request.type)) {
+        return -1;
+    }
+
+    if (!(istr >> usernm)) {
+        return -1;
+    }
+
+    if (usernm.length() > FS_MAXUSERNAME) {
+        return -1;
+    }
+    request.username = usernm.c_str(); //Drops anything after a null terminator
+
+    if (!(istr >> pathnm)) {
+        return -1;
+    }
+    if (pathnm.length() > FS_MAXPATHNAME) {
+        return -1;
+    }
+    request.pathname = pathnm.c_str();
+
+    //THE HANDLE REQUESTS NAME THE FILE BY A HANDLE FROM FS_OPEN INSTEAD
+    if(request.type == "FS_READ_H" || request.type == "FS_WRITE_H" || request.type == "FS_CLOSE") {
+
+        if(request.pathname.empty() || request.pathname.length() > 20) {
+            return -1;
+        }
+
+        for(char c : request.pathname) {
+            if(c < '0' || c > '9') {
+                return -1;
+            }
+        }
+
+        errno = 0;
+        request.handle = std::strtoull(request.pathname.c_str(), nullptr, 10);
+        if(errno == ERANGE || request.handle == 0) {
+            return -1;
+        }
+    }
+
+    size_t header_len = message.find('\0');
+    if(header_len == std::string::npos) {
+        header_len = message.length();
+    }
+    std::string header = message.substr(0, header_len);
+
+    if(request.type == "FS_READBLOCK" || request.type == "FS_READLEASE" || request.type == "FS_WRITEBLOCK" ||
+       request.type == "FS_READ_H" || request.type == "FS_WRITE_H") {
+
+        std::vector<std::string> temp_vector;
+        std::istringstream istr3(header);
+        std::string temp;
+
+        while(std::getline(istr3, temp, ' ')) {
+            temp_vector.push_back(temp);
+            if(temp_vector.size() > 4) {
+                return -1;
+            }
+        }
+
+        if(temp_vector.size() != 4) {
+            return -1;
+        }
+
+        std::string block_string = temp_vector.back();
+
+        if(block_string.empty() || block_string.length() > 10) {
+            return -1;
+        }
+
+        if(block_string[0] == '0' && block_string.length() > 1) {
+            return -1;
+        }
+
+        for(char c : block_string) {
+            if(c < '0' || c > '9') {
+                return -1;
+            }
+        }
+
+        unsigned long block_int = std::stoul(block_string);
+
+        if(block_int >= FS_MAXFILEBLOCKS) {
+            return -1;
+        }
+
+        request.block = block_int;
+    }
+
+    if(request.type == "FS_WRITEBLOCK" || request.type == "FS_WRITE_H") {
+
+        if(message.length() < FS_BLOCKSIZE || header_len == message.length()) {
+            return -1;
+        }
+
+        request.header_len = header_len + 1;
+        request.data = message.data() + request.header_len;
+        request.data_len = message.length() - request.header_len;
+
+    }else if(request.type == "FS_CREATE") {
+
+        std::string file_type;
+        istr >> file_type;
+
+        if(file_type.empty() || (file_type[0] != 'f' && file_type[0] != 'd')) {
+            return -1;
+        }
+
+        request.file_type = file_type[0];
+
+    }else if(request.type == "FS_RENAME" || request.type == "FS_CLONE") {
+
+        std::string new_pathnm;
+        if (!(istr >> new_pathnm)) {
+            return -1;
+        }
+
+        request.new_pathname = new_pathnm.c_str();
+
+        if (request.new_pathname.length() > FS_MAXPATHNAME) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*LOAD_FILESYSTEM
+-------------------------------------------------
+-> Reads in the existing filesystem with set_used_blocks and makes every block it
+doesn't use available. Must run before any request is handled.
+-------------------------------------------------*/
+
+void load_filesystem() {
+
+    std::set<uint32_t> blocks_used;
+
+    set_used_blocks(0, blocks_used);
+
+    for (uint32_t i = FS_DISKSIZE - 1; i > 0; i--) {
+        if (blocks_used.find(i) == blocks_used.end()) {
+            available_disk_blocks.push_back(i);
+        }
+    }
+}
+
+/*INIT_SERVER
+-------------------------------------------------
+-> Function we use to initialize the client server.
+-> First, we call load_filesystem to read in any existing
+filesystem and make sure we don't make any used blocks available.
+-> We initialize the client socket, bind(), then assign the port specified
+(if none is specified, the OS assigns it).
+-> We call listen() to await any client connections, then print the port
+number.
+-> When a client connects, we hand the connection to an executor (one per core, see
+fs_executor.h), or with -T, create a thread to handle the client's request. A connection
+past max_connections is answered FS_BUSY and closed instead (see fs_admission.h).
+-------------------------------------------------*/
+
+int init_server(uint16_t port){
+    
+    load_filesystem();
+
+    if(defrag_blocks_per_sec != 0) {
+        start_defragmenter();
+    }
+
+
+    //Set up socket clients will use
+    //Make sure this works if user does not specify port number
+    //Initialize Connection
+    int tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (tcp_socket == -1) {//Failed on socket init...
+    }
+
+    int yesval = 1;
+    if(setsockopt(tcp_socket, SOL_SOCKET, SO_REUSEADDR, &yesval, sizeof(yesval)) == -1){
+        close(tcp_socket);
+    }
+    
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if(port == 0) {
+        addr.sin_port = 0;
+        if(bind(tcp_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+            close(tcp_socket);
+            return -1; 
+        }
+        // Correctly get the assigned port AFTER binding
+        socklen_t addrlen = sizeof(addr);
+        if (getsockname(tcp_socket, reinterpret_cast<sockaddr*>(&addr), &addrlen) == -1) {
+            perror("getsockname failed");
+            close(tcp_socket);
+            return -1; 
+        }
+        server_port = ntohs(addr.sin_port); 
+    }else {
+        addr.sin_port = htons(port); 
+        if(bind(tcp_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+            close(tcp_socket);
+            return -1; 
+        }
+        server_port = port;
+    }
+
+    
+    if(listen(tcp_socket, listen_backlog) == -1) {
+        
+        close(tcp_socket);
+    }
+
+    print_port(server_port);
+    //if accept is detected, create new boost thread to service request
+    //int accept(int socket, struct sockaddr *address, int *address_len);
+    //If successful, accept() returns a nonnegative. If unsuccessful, accept() returns -1 
+
+    if(!thread_per_connection) {
+        unsigned int cores = boost::thread::hardware_concurrency();
+        start_executors(cores == 0 ? 1 : cores, worker_threads);
+    }
+
+    socklen_t addr_len = sizeof(addr);
+    while(true){
+        int client_socket = accept(tcp_socket, reinterpret_cast<sockaddr*>(&addr), &addr_len);
+
+        if(client_socket > -1 && !admit_connection()){
+
+            refuse_connection(client_socket);
+
+        }else if(client_socket > -1 && !thread_per_connection){
+
+            dispatch_connection(client_socket);
+
+        }else if(client_socket > -1){
+            
+            boost::thread client_thread(&handle_request, client_socket);
+            client_thread.detach();
+        
+        }else{
+            break;
+        }
+
+    }
+
+
+
+    return tcp_socket;
+
+}
+
+/*PARSE_LINE
+-------------------------------------------------
+-> Usage: fs [-d] [-l] [-T] [-C] [-W] [-p WORKERS] [-L LEASE_MS] [-M CONNECTIONS] [-Q QUEUED] [-D DEADLINE_MS] [-B BACKLOG] [-U USER=WEIGHT[:CAP],...] [-t TRACE] [-F BLOCKS_PER_SEC] [-b lib|ram|file:PATH|mmap:PATH|uring:PATH] [-S ssd|hdd|LATENCY_US,MBPS[,JITTER_US[,CHANNELS]]] [port]
+-> If no port is given, the OS assigns one.
+-> -d turns on block deduplication in handle_writeblock.
+-> -l turns on the lock contention profiler (see FS_LOCKSTATS in handle_request).
+-> -T serves each connection on a thread of its own instead of the executors, and -p sets
+how many worker threads the executors run handlers on (32 by default), or with -T, how many
+requests are served at once (1 to 1024).
+-> -L sets how long the read leases behind client caches last (1000ms by default, 0 for none).
+-> -M, -Q and -D are the admission limits (see fs_admission.h): how many connections may be
+open at once (no limit by default), how many requests one user may have waiting for a worker
+(1024), and how long one may wait before it is turned away (no limit). -B sets the listen
+backlog (30).
+-> -U sets users' weights in the fair share of the workers, and optionally caps how many of
+their requests are served at once (see fs_fairshare.h). "*" stands for everyone not named;
+by default every user has a weight of 1 and no cap.
+-> -t records every request served to the file TRACE, for fs_replay (see fs_trace.h).
+-> -F runs the online defragmenter, moving at most BLOCKS_PER_SEC blocks a second (see
+fs_defrag.h).
+-> -b picks the disk backend (see fs_disk.h): libfs_server's image (the default), an
+in-memory copy of it, or an image file of our own read with pread/pwrite, mmap or io_uring.
+-> -S slows the backend down to a simulated device with that latency, bandwidth and jitter.
+-> -C makes concurrent reads of the same block share one I/O (see coalescing_disk). That
+saves a slow device from a crowd of requests for one hot block, but costs more than it saves
+when reads come out of memory, so it is off by default.
+-> -W queues writes and writes them in sorted, merged batches (see write_queue_disk).
+-------------------------------------------------*/
+
+uint16_t parse_line(int argc, char *argv[]){
+
+    std::string backend_spec = "lib";
+    std::string profile_spec;
+    bool coalesce_reads = false;
+    bool queue_writes = false;
+
+    //THE WORKER COUNT AND ADMISSION LIMITS ARE ALL COUNTS OR MILLISECONDS, PARSED ALIKE
+    auto parse_limit = [](const char* what, unsigned long most) {
+        char* end = nullptr;
+        unsigned long value = std::strtoul(optarg, &end, 10);
+        if(end == optarg || *end != '\0' || value > most) {
+            std::cerr << "fs: bad " << what << " \"" << optarg << "\"\n";
+            exit(1);
+        }
+        return static_cast<unsigned int>(value);
+    };
+
+    int option;
+    while((option = getopt(argc, argv, "dlTCWp:L:M:Q:D:B:U:t:F:b:S:")) != -1) {
+        if(option == 'd') {
+            dedup_enabled = true;
+        }else if(option == 'l') {
+            lockprof_enable();
+        }else if(option == 'T') {
+            thread_per_connection = true;
+        }else if(option == 'C') {
+            coalesce_reads = true;
+        }else if(option == 'W') {
+            queue_writes = true;
+        }else if(option == 'p') {
+            worker_threads = parse_limit("worker thread count", 1024);
+            if(worker_threads == 0) {
+                std::cerr << "fs: bad worker thread count \"" << optarg << "\"\n";
+                exit(1);
+            }
+        }else if(option == 'L') {
+            char* end = nullptr;
+            unsigned long term_ms = std::strtoul(optarg, &end, 10);
+            if(end == optarg || *end != '\0' || term_ms > 3600000) {
+                std::cerr << "fs: bad lease term \"" << optarg << "\"\n";
+                exit(1);
+            }
+            lease_term_ms = term_ms;
+        }else if(option == 'M') {
+            max_connections = parse_limit("connection limit", 1000000);
+        }else if(option == 'Q') {
+            request_queue_limit = parse_limit("queue limit", 1000000);
+        }else if(option == 'D') {
+            request_deadline_ms = parse_limit("deadline", 3600000);
+        }else if(option == 'B') {
+            listen_backlog = parse_limit("listen backlog", 65535);
+        }else if(option == 'U') {
+            if(!parse_user_shares(optarg)) {
+                std::cerr << "fs: bad user shares \"" << optarg << "\"\n";
+                exit(1);
+            }
+        }else if(option == 't') {
+            if(!trace_open(optarg)) {
+                std::cerr << "fs: can't write trace \"" << optarg << "\"\n";
+                exit(1);
+            }
+        }else if(option == 'F') {
+            defrag_blocks_per_sec = parse_limit("defragmenter rate", 1000000);
+            if(defrag_blocks_per_sec == 0) {
+                std::cerr << "fs: bad defragmenter rate \"" << optarg << "\"\n";
+                exit(1);
+            }
+        }else if(option == 'b') {
+            backend_spec = optarg;
+        }else if(option == 'S') {
+            profile_spec = optarg;
+        }
+    }
+
+    std::unique_ptr<disk_backend> backend = make_disk_backend(backend_spec);
+    if(!backend) {
+        std::cerr << "fs: can't use disk backend \"" << backend_spec << "\"\n";
+        exit(1);
+    }
+
+    if(!profile_spec.empty()) {
+        disk_profile profile;
+        if(!parse_disk_profile(profile_spec, profile)) {
+            std::cerr << "fs: bad simulated disk \"" << profile_spec << "\"\n";
+            exit(1);
+        }
+        backend.reset(new simulated_disk(std::move(backend), profile));
+    }
+
+    if(queue_writes) {
+        backend.reset(new write_queue_disk(std::move(backend)));
+    }
+
+    if(coalesce_reads) {
+        backend.reset(new coalescing_disk(std::move(backend)));
+    }
+
+    disk_device = std::move(backend);
+
+    //if a port is left after the options, it was specified
+    if(optind >= argc) {
+        return 0;
+    }else{
+        return std::atoi(argv[optind]);
+    }
+}
+
+/*HANDLE_READBLOCK
+-------------------------------------------------
+-> This function is used to handle any FS_READBLOCK requests from the client.
+-> This function completes most of the error checking (some being done in handle_request)
+and handles the rest of the read block request.
+-> In the end, if able to fetch the data requested from disk, it returns a pointer to the char buffer
+containing the data read from disk, which can then be sent to the client in handle_request.
+-> If zero_copy is set and the disk backend can hand out the block in place (-b mmap:PATH),
+nothing is copied: the pointer is into the mapping, and the file stays reader-locked until the
+pointer is dropped. So the caller only asks for it when it sends without blocking (the event
+pipeline), or a client that stops reading would keep the file locked.
+-> For FS_READLEASE, lease is filled in with a read lease on the file (see fs_lease.h).
+Snapshot reads never get one.
+-------------------------------------------------*/
+
+std::shared_ptr<const char[]> handle_readblock(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], uint32_t block, int &status, fs_lease* lease, bool zero_copy) {
+
+    std::vector<std::string> path_vector = char_array_to_string_vector(pathname_char);
+    if(path_vector.size() == 0) {
+        metrics_reject(REJECT_BAD_PATH);
+        status = -1;
+        return nullptr;
+    }
+
+    if(path_vector[0] == SNAPSHOT_DIR_NAME) { //Reading from the snapshot
+        path_vector.erase(path_vector.begin());
+        return handle_snapshot_readblock(username_char, path_vector, block, status);
+    }
+
+    std::string username = std::string(username_char);
+
+    //BEFORE THE PATH IS LOOKED UP, SO A RENAME FROM HERE ON VOIDS THE LEASE
+    uint64_t epoch = lease_epoch();
+
+    uint32_t child_block = 0;
+    uint32_t parent_block = 0;
+
+    int check = traverse_tree(path_vector, false, child_block, parent_block, username_char);
+
+    //FIXME: we dont need to hold parent lock right?
+    
+    if(check == -1) { //Path does not exist!
+       
+        status = -1;
+        return nullptr;
+    }
+
+    reader_unlock(parent_block);
+
+    return read_file_block(child_block, username_char, block, status, lease, epoch, zero_copy);
+}
+
+/*READ_FILE_BLOCK
+-------------------------------------------------
+-> The rest of a read once the file is found and reader-locked (by handle_readblock, or
+handle_read_h through an open handle): checks the file, reads the block, and unlocks it.
+-------------------------------------------------*/
+
+std::shared_ptr<const char[]> read_file_block(uint32_t child_block, char username_char[FS_MAXUSERNAME + 1], uint32_t block, int &status, fs_lease* lease, uint64_t epoch, bool zero_copy) {
+
+    fs_inode node;
+    char inode_buf[FS_BLOCKSIZE]; //Buffer to read inode block
+    read_block(child_block, inode_buf);
+    memcpy(&node, inode_buf, sizeof(fs_inode)); //Copy from buffer
+
+    if(std::strcmp(username_char, node.owner) != 0) {
+        
+        reader_unlock(child_block);
+        
+        metrics_reject(REJECT_NOT_OWNER);
+        status = -1;
+        return nullptr;
+    }
+    
+    if(node.type != 'f') { //MAKE SURE ITS ACTUALLY A FILE WERE READING FROM
+
+        reader_unlock(child_block);
+
+        metrics_reject(REJECT_WRONG_TYPE);
+        status = -1;
+        return nullptr;
+    }
+    
+
+    if(block < node.size) {
+
+        //GRANTED WHILE THE FILE IS STILL READER-LOCKED, SO NO WRITE CAN SLIP IN BEFORE THE LEASE IS RECORDED
+        if(lease != nullptr) {
+            *lease = grant_lease(child_block, epoch);
+        }
+
+        //ZERO-COPY: HAND OUT THE BLOCK WHERE THE BACKEND KEEPS IT, AND KEEP THE FILE
+        //READER-LOCKED (SO NOTHING CAN WRITE OR FREE THE BLOCK) UNTIL THE CALLER DROPS IT
+        const char* mapped = zero_copy ? disk_device->mapped_block(node.blocks[block]) : nullptr;
+        if(mapped != nullptr) {
+            return std::shared_ptr<const char[]>(mapped, [child_block](const char*) {
+                reader_unlock(child_block);
+            });
+        }
+    
+        std::shared_ptr<char[]> buf(new char[FS_BLOCKSIZE]);
+        memset(buf.get(), 0, FS_BLOCKSIZE);
+        uint32_t block_read_from = node.blocks[block];
+        
+        read_block(block_read_from, buf.get());
+   
+        reader_unlock(child_block);
+
+        return buf;
+    }else{ //Block is not in file!
+
+        reader_unlock(child_block);
+
+        metrics_reject(REJECT_OUT_OF_RANGE);
+        status = -1;
+        
+        return nullptr;
+    }
+
+}
+
+/*HANDLE_WRITEBLOCK
+-------------------------------------------------
+-> This function is used to handle any FS_WRITEBLOCK requests from the client.
+-> This function completes most of the error checking (some being done in handle_request)
+for a write block request.
+-> It checks if the file is full, if the block is valid, and if the user has permission to write to the file.
+-> If the file is not full, it writes the data to the block specified.
+-> If the file is full, it checks if there is space on disk to write a new block.
+-> If there is space, it writes the data to a new block and updates the inode.
+-> If there is no space, it returns -1.
+-> After a succesful write to disk, it returns 0 to let the handle_request function know that the write was successful.
+-------------------------------------------------*/
+
+int handle_writeblock(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], uint32_t block, const void* data, size_t data_len) {
+  
+    std::vector<std::string> path_vector = char_array_to_string_vector(pathname_char);
+    if(path_vector.size() == 0) {
+        metrics_reject(REJECT_BAD_PATH);
+        return -1;
+    }
+
+    std::string username = std::string(username_char);
+
+    uint32_t child_block = 0;
+    uint32_t parent_block = 0;
+
+    int check = traverse_tree(path_vector, true, child_block, parent_block, username_char);
+
+
+    if(check == -1) {    //Path does not exist!
+        return -1;
+    }
+
+    reader_unlock(parent_block);
+
+    return write_file_block(child_block, username_char, block, data, data_len);
+}
+
+/*WRITE_FILE_BLOCK
+-------------------------------------------------
+-> The rest of a write once the file is found and writer-locked (by handle_writeblock, or
+handle_write_h through an open handle): checks the file, writes the block, and unlocks it.
+-------------------------------------------------*/
+
+int write_file_block(uint32_t child_block, char username_char[FS_MAXUSERNAME + 1], uint32_t block, const void* data, size_t data_len) {
+
+    fs_inode node;
+    char inode_buf[FS_BLOCKSIZE]; // Buffer to read inode block
+    read_block(child_block, inode_buf);
+    memcpy(&node, inode_buf, sizeof(fs_inode)); // Copy from buffer
+
+    if(std::strcmp(username_char, node.owner) != 0) {
+        
+        writer_unlock(child_block);
+        
+        metrics_reject(REJECT_NOT_OWNER);
+        return -1;
+    }
+    
+    //Path is a directory!
+    if(node.type != 'f') { //MAKE SURE ITS ACTUALLY A FILE WE'RE READING FROM
+        
+        writer_unlock(child_block);
+
+        metrics_reject(REJECT_WRONG_TYPE);
+        return -1;
+    }
+
+    //NO CLIENT MAY STILL BE READING THE OLD DATA FROM ITS CACHE
+    wait_for_leases(child_block);
+
+    char buf[FS_BLOCKSIZE];
+    memset(buf, 0, FS_BLOCKSIZE);
+    memcpy(buf, data, FS_BLOCKSIZE);
+
+    uint64_t fingerprint = 0;
+    uint32_t written_block = 0;
+
+    if(dedup_enabled && block <= node.size && block < FS_MAXFILEBLOCKS) {
+
+        fingerprint = fingerprint_block(buf);
+
+        //IDENTICAL DATA IS ALREADY ON DISK, JUST POINT THE INODE AT IT
+        if(dedup_writeblock(child_block, node, block, buf, fingerprint)) {
+
+            writer_unlock(child_block);
+
+            return 0;
+        }
+    }
+    
+        if(block < node.size) {
+
+            uint32_t block_write_to = node.blocks[block];
+
+            //IS THE BLOCK SHARED WITH A CLONE? NOBODY CAN CLONE THIS FILE WHILE WE HOLD ITS WRITER LOCK
+            ds_mutex.lock();
+
+            bool shared = block_refcounts[block_write_to] > 1;
+            uint32_t private_block_num = 0;
+
+            if(shared) {
+                //NOT ENOUGH DISK SPACE FOR A PRIVATE COPY!
+                if(available_disk_blocks.size() < 1) {
+                    ds_mutex.unlock();
+                    writer_unlock(child_block);
+
+                    metrics_reject(REJECT_NO_SPACE);
+                    return -1;
+                }
+
+                private_block_num = allocate_block();
+            } else {
+                //ITS CONTENTS ARE ABOUT TO CHANGE, SO NOBODY MAY DEDUPLICATE AGAINST IT ANYMORE
+                dedup_unindex(block_write_to);
+            }
+
+            ds_mutex.unlock();
+
+            if(!shared) {
+
+                write_block(block_write_to, buf);
+                written_block = block_write_to;
+
+            } else {
+
+                //COPY ON WRITE: THE NEW DATA GOES TO OUR PRIVATE BLOCK, THEN THE INODE POINTS AT IT
+                write_block(private_block_num, buf);
+                written_block = private_block_num;
+
+                node.blocks[block] = private_block_num;
+
+                char inode_buf[FS_BLOCKSIZE];
+                memset(inode_buf, 0, FS_BLOCKSIZE);
+                memcpy(inode_buf, &node, sizeof(fs_inode));
+                write_block(child_block, inode_buf);
+
+                //DROP OUR REFERENCE TO THE SHARED BLOCK ONLY ONCE OUR INODE NO LONGER POINTS AT IT
+                ds_mutex.lock();
+                release_block(block_write_to);
+                ds_mutex.unlock();
+            }
+        
+        }else if(block == node.size){
+
+            //FILE IS FULL
+            if(node.size == FS_MAXFILEBLOCKS) { 
+        
+                writer_unlock(child_block);
+                
+                metrics_reject(REJECT_NO_SPACE);
+                return -1;
+            }
+       
+            
+            ds_mutex.lock();
+             //NOT ENOUGH DISK SPACE!
+            if(available_disk_blocks.size() < 1) {
+                ds_mutex.unlock();
+                writer_unlock(child_block);
+                
+                metrics_reject(REJECT_NO_SPACE);
+                return -1;
+            }
+
+            uint32_t new_block_num = allocate_block();
+            ds_mutex.unlock();
+            
+            write_block(new_block_num, buf);
+            written_block = new_block_num;
+            
+            //EDIT INODE AFTER DISK WRITE FOR CRASH CONSISTENCY
+            node.blocks[node.size] = new_block_num;
+            node.size++;
+            
+            char inode_buf[FS_BLOCKSIZE];
+            memset(inode_buf, 0, FS_BLOCKSIZE);
+            memcpy(inode_buf, &node, sizeof(fs_inode));
+            write_block(child_block, inode_buf); 
+
+        }else {
+            
+            writer_unlock(child_block);
+            
+            metrics_reject(REJECT_OUT_OF_RANGE);
+            return -1;
+        }
+
+        if(dedup_enabled) {
+            dedup_index(written_block, fingerprint);
+        }
+
+        writer_unlock(child_block);
+        
+    //Success!
+    return 0;
+
+}
+
+/*HANDLE_OPEN
+-------------------------------------------------
+-> Handles FS_OPEN: looks pathname up like a read, checks that it is a file username owns,
+and opens a handle on its inode (see fs_handle.h). Snapshot files can't be opened.
+-> Returns 0 and the handle, or -1 if the file can't be read, the handle table is full or
+username has MAX_USER_HANDLES open.
+-------------------------------------------------*/
+
+int handle_open(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], uint64_t& handle) {
+
+    std::vector<std::string> path_vector = char_array_to_string_vector(pathname_char);
+    if(path_vector.size() == 0 || path_vector[0] == SNAPSHOT_DIR_NAME) {
+        metrics_reject(REJECT_BAD_PATH);
+        return -1;
+    }
+
+    uint32_t child_block = 0;
+    uint32_t parent_block = 0;
+
+    if(traverse_tree(path_vector, false, child_block, parent_block, username_char) == -1) {
+        return -1;
+    }
+
+    reader_unlock(parent_block);
+
+    fs_inode node;
+    char inode_buf[FS_BLOCKSIZE];
+    read_block(child_block, inode_buf);
+    memcpy(&node, inode_buf, sizeof(fs_inode));
+
+    if(std::strcmp(username_char, node.owner) != 0) {
+        reader_unlock(child_block);
+        metrics_reject(REJECT_NOT_OWNER);
+        return -1;
+    }
+
+    if(node.type != 'f') {
+        reader_unlock(child_block);
+        metrics_reject(REJECT_WRONG_TYPE);
+        return -1;
+    }
+
+    //STILL READER-LOCKED, SO A DELETE CAN'T SLIP IN BEFORE THE HANDLE IS RECORDED
+    handle = open_file_handle(child_block, username_char);
+
+    reader_unlock(child_block);
+
+    //THE TABLE IS FULL, OR USERNAME HAS ALL THE HANDLES THEY MAY
+    if(handle == 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*HANDLE_READ_H
+-------------------------------------------------
+-> Handles FS_READ_H: FS_READBLOCK through a handle from FS_OPEN, with no path to look up.
+The file is locked and then checked against the handle, since it may have been deleted
+since it was opened.
+-------------------------------------------------*/
+
+std::shared_ptr<const char[]> handle_read_h(char username_char[FS_MAXUSERNAME + 1], uint64_t handle, uint32_t block, int &status, bool zero_copy) {
+
+    open_file file;
+
+    if(!find_file_handle(handle, username_char, file)) {
+        metrics_reject(REJECT_NOT_FOUND);
+        status = -1;
+        return nullptr;
+    }
+
+    reader_lock(file.inode_block);
+
+    if(!file_handle_current(file)) {
+        reader_unlock(file.inode_block);
+        metrics_reject(REJECT_NOT_FOUND);
+        status = -1;
+        return nullptr;
+    }
+
+    return read_file_block(file.inode_block, username_char, block, status, nullptr, 0, zero_copy);
+}
+
+/*HANDLE_WRITE_H
+-------------------------------------------------
+-> Handles FS_WRITE_H: FS_WRITEBLOCK through a handle, checked like handle_read_h.
+-------------------------------------------------*/
+
+int handle_write_h(char username_char[FS_MAXUSERNAME + 1], uint64_t handle, uint32_t block, const void* data, size_t data_len) {
+
+    open_file file;
+
+    if(!find_file_handle(handle, username_char, file)) {
+        metrics_reject(REJECT_NOT_FOUND);
+        return -1;
+    }
+
+    writer_lock(file.inode_block);
+
+    if(!file_handle_current(file)) {
+        writer_unlock(file.inode_block);
+        metrics_reject(REJECT_NOT_FOUND);
+        return -1;
+    }
+
+    return write_file_block(file.inode_block, username_char, block, data, data_len);
+}
+
+/*HANDLE_CREATE
+-------------------------------------------------
+-> This function is used to handle any FS_CREATE requests from the client.
+-> It calls traverse_tree_create to find and lock the parent. Most creates only need it
+reader-locked (see CREATE_IN_SLOT); the rest take it again writer-locked.
+-> This function completes most of the error checking (some being done in handle_request).
+-> It checks if the path exists, if the file already exists, and if the user has permission to create a file in the directory.
+-> If everything is succesful (and blocks exist), it creates a new file or directory in the path specified.
+-> This consists of making a new inode, a new direnntry slot, and even a new direntry block if necessary.
+-> If any failure occurs, it returns -1, else it returns 0 to handle_request.
+-> The work is done by create_node, which handle_clone shares. handle_create just gives it an empty inode.
+-------------------------------------------------*/
+
+
+int handle_create(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], char type) {
+
+    fs_inode new_inode;
+    memset(&new_inode, 0, sizeof(fs_inode));
+    new_inode.type = type;
+    std::strcpy(new_inode.owner, username_char);
+    new_inode.size = 0;
+
+    return create_node(username_char, pathname_char, new_inode);
+}
+
+/*CREATE_NODE
+-------------------------------------------------
+-> Links new_inode into the filesystem at pathname_char, as described for handle_create.
+-> new_inode is written to its new block as is, so a clone's inode keeps its size and data blocks.
+-------------------------------------------------*/
+
+int create_node(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], fs_inode new_inode) {
+  
+    
+    std::vector<std::string> path_vector = char_array_to_string_vector(pathname_char);
+    if(path_vector.size() == 0) {
+        metrics_reject(REJECT_BAD_PATH);
+        return -1;
+    }
+    std::string file_name = path_vector.back();
+    std::string username = std::string(username_char);
+
+    if(file_name.length() > FS_MAXFILENAME) {
+        metrics_reject(REJECT_BAD_PATH);
+        return -1;
+    }
+
+    //"/.snapshot" IS WHERE THE SNAPSHOT IS READ FROM
+    if(path_vector.size() == 1 && file_name == SNAPSHOT_DIR_NAME) {
+        metrics_reject(REJECT_EXISTS);
+        return -1;
+    }
+
+    
+    uint32_t parent_block = 0;
+
+    //FIRST WITH THE PARENT ONLY READER-LOCKED, TAKING A FREE SLOT IN AN EXISTING DIRENTRY BLOCK
+    if(traverse_tree_create(path_vector, false, parent_block, username_char) == -1) {
+        return -1;
+    }
+
+    int result = create_in_slot(parent_block, file_name, new_inode, username_char);
+    reader_unlock(parent_block);
+
+    if(result != NEEDS_PARENT_LOCK) {
+        return result;
+    }
+
+    int check = 0;
+
+
+    check = traverse_tree_create(path_vector, true, parent_block, username_char);
+    if(check == -1) { //Path does not exist!
+        return -1;
+    }
+
+    fs_inode node;
+    char node_buf[FS_BLOCKSIZE]; //Buffer to read inode block
+    
+    read_block(parent_block, node_buf);
+    
+    memcpy(&node, node_buf, sizeof(fs_inode)); //Copy from buffer
+
+    if(node.type != 'd') {
+        writer_unlock(parent_block);
+        
+        metrics_reject(REJECT_WRONG_TYPE);
+        return -1;
+    }
+
+    if(std::strcmp(username_char, node.owner) != 0 && parent_block != 0) {
+
+        writer_unlock(parent_block);
+
+        metrics_reject(REJECT_NOT_OWNER);
+        return -1;
+    }
+
+    //ALL INODES LOCK
+
+    bool found = false;
+    uint32_t first_empty_block = 0;
+    int empty_direntry_offset = -1;
+    uint32_t temp_empty_block = 0;
+
+    char temp_buf[FS_BLOCKSIZE];
+    memset(temp_buf, 0, FS_BLOCKSIZE);
+
+    char dir_block_buf[FS_BLOCKSIZE];
+    memset(dir_block_buf, 0, FS_BLOCKSIZE);
+
+
+    for(uint32_t i = 0; i < node.size; i++) {
+        temp_empty_block = node.blocks[i];
+
+        memset(temp_buf, 0, FS_BLOCKSIZE);
+        
+        read_block(temp_empty_block, temp_buf);
+
+        if(!found) {
+            first_empty_block = temp_empty_block;
+            memcpy(dir_block_buf, temp_buf, FS_BLOCKSIZE);
+        }
+        
+        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(temp_buf);
+
+        for(uint32_t j = 0; j < 8; j++) {
+            if(strcmp(direntries[j].name, file_name.c_str()) == 0){
+
+                //FOUND A DUPLICATE!
+
+                writer_unlock(parent_block);
+                
+                metrics_reject(REJECT_EXISTS);
+                return -1;
+            }
+
+            if(direntries[j].inode_block == 0 && !found) {
+                empty_direntry_offset = j;
+                found = true;
+            }
+        }
+
+    }
+
+    if(node.type != 'd') { //Can't create a file in a file!
+
+        writer_unlock(parent_block);
+
+        metrics_reject(REJECT_WRONG_TYPE);
+        return -1;
+    }
+
+
+    uint32_t temp_inode_block_num;
+
+    if(empty_direntry_offset == -1) {//CASE WHERE LAST BLOCK IS FULL OF DIRENTRIES
+      
+
+        if(node.size == FS_MAXFILEBLOCKS) { //DIRECTORY IS FULL!
+            
+            writer_unlock(parent_block);
+            
+            metrics_reject(REJECT_NO_SPACE);
+            return -1;
+        }
+
+        ds_mutex.lock();
+
+        if(available_disk_blocks.size() < 2) { //NO DISK SPACE
+            ds_mutex.unlock();
+            writer_unlock(parent_block);
+            
+            metrics_reject(REJECT_NO_SPACE);
+            return -1;
+        }
+
+        uint32_t new_inode_block_num = allocate_block();
+        temp_inode_block_num = new_inode_block_num;
+
+        //TAKING THE LOWEST AVAILABLE DIRECTORY BLOCK
+        uint32_t new_direntry_block_num = allocate_block();
+        
+        ds_mutex.unlock();
+
+        
+        fs_direntry new_direntry;
+        std::strcpy(new_direntry.name, file_name.c_str());
+        new_direntry.inode_block = new_inode_block_num;
+
+        //Handle making a new file and directory differently
+
+        writer_lock(temp_inode_block_num);
+
+        char buf[FS_BLOCKSIZE];
+        memset(buf, 0, FS_BLOCKSIZE);
+
+        memcpy(buf, &new_inode, sizeof(fs_inode));
+        
+        write_block(temp_inode_block_num, buf);
+                
+        char dirbuf[FS_BLOCKSIZE];
+        memset(dirbuf, 0, FS_BLOCKSIZE);
+
+        memcpy(dirbuf, &new_direntry, sizeof(fs_direntry));
+
+        
+        write_block(new_direntry_block_num, dirbuf);
+        
+        node.blocks[node.size] = new_direntry_block_num;
+        node.size++;
+
+        char parent_buf[FS_BLOCKSIZE];
+        memset(parent_buf, 0, FS_BLOCKSIZE);
+
+        memcpy(parent_buf, &node, sizeof(fs_inode));        
+        
+        write_block(parent_block, parent_buf);
+
+        
+    }else{//CASE WHERE YOU CAN FIT MORE DIRENTRIES IN LAST BLOCK OF DIRECTORY
+        
+        ds_mutex.lock(); //LOCK AVAILABLE DISK BLOCKS
+
+        if(available_disk_blocks.size() < 1) { //NO DISK SPACE. CHECK MUST BE INSIDE LOCK SO NO CHANGES CAN OCCUR
+            
+            ds_mutex.unlock();
+            writer_unlock(parent_block);
+            
+            metrics_reject(REJECT_NO_SPACE);
+            return -1;
+        }
+
+        uint32_t new_inode_block_num = allocate_block();
+
+        ds_mutex.unlock(); //UNLOCK AVAILABLE DISK BLOCKS
+
+        temp_inode_block_num = new_inode_block_num;
+
+        fs_direntry new_direntry;
+        std::strcpy(new_direntry.name, file_name.c_str());
+        new_direntry.inode_block = new_inode_block_num;
+
+        writer_lock(temp_inode_block_num);
+        
+        char buf[FS_BLOCKSIZE];
+        memset(buf, 0, FS_BLOCKSIZE);
+
+        memcpy(buf, &new_inode, sizeof(fs_inode));
+        
+        write_block(temp_inode_block_num, buf);
+    
+
+        uint32_t offset = sizeof(fs_direntry) * empty_direntry_offset;
+        
+        memcpy(dir_block_buf + offset, &new_direntry, sizeof(fs_direntry));
+
+        
+        write_block(first_empty_block, dir_block_buf);
+
+    }
+
+    writer_unlock(temp_inode_block_num);
+    writer_unlock(parent_block);
+   
+    return 0;
+}
+
+/*CREATE_IN_SLOT
+-------------------------------------------------
+-> create_node's fast path, run with the parent only reader-locked so that creates in one
+directory go ahead side by side. It takes a free slot in one of the parent's existing direntry
+blocks, writer-locking just that block while it adds the new direntry.
+-> The name's stripe of name_locks is held from the duplicate check until the direntry is
+written, so two creates of the same name can't both miss each other. Everything else that adds
+a name to a directory (the slow path, rename) has the parent writer-locked.
+-> Returns NEEDS_PARENT_LOCK, having changed nothing, if there is no free slot: the directory
+needs another direntry block, and that means changing the parent's inode.
+-------------------------------------------------*/
+
+int create_in_slot(uint32_t parent_block, const std::string& file_name, const fs_inode& new_inode, char username_char[FS_MAXUSERNAME + 1]) {
+
+    fs_inode node;
+    char node_buf[FS_BLOCKSIZE]; //Buffer to read inode block
+    read_block(parent_block, node_buf);
+    memcpy(&node, node_buf, sizeof(fs_inode)); //Copy from buffer
+
+    if(node.type != 'd') {
+        metrics_reject(REJECT_WRONG_TYPE);
+        return -1;
+    }
+
+    if(std::strcmp(username_char, node.owner) != 0 && parent_block != 0) {
+        metrics_reject(REJECT_NOT_OWNER);
+        return -1;
+    }
+
+    boost::mutex& name_lock = name_locks[(std::hash<std::string>()(file_name) ^ parent_block) % NAME_LOCK_STRIPES];
+    name_lock.lock();
+
+    //CHECK FOR A DUPLICATE, NOTING EVERY DIRENTRY BLOCK WITH A FREE SLOT ON THE WAY
+    uint32_t open_blocks[FS_MAXFILEBLOCKS];
+    uint32_t open_count = 0;
+
+    char dir_blocks_buf[DIRECTORY_READAHEAD * FS_BLOCKSIZE];
+
+    for(uint32_t first = 0; first < node.size; first += DIRECTORY_READAHEAD) {
+
+        uint32_t count = std::min(DIRECTORY_READAHEAD, node.size - first);
+        read_directory_blocks(node.blocks + first, count, dir_blocks_buf);
+        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_blocks_buf);
+
+        for(uint32_t i = 0; i < count; i++) {
+
+            bool has_free_slot = false;
+
+            for(uint32_t j = 0; j < FS_DIRENTRIES; j++) {
+
+                fs_direntry& direntry = direntries[i * FS_DIRENTRIES + j];
+
+                if(direntry.inode_block == 0) {
+                    has_free_slot = true;
+                } else if(strcmp(direntry.name, file_name.c_str()) == 0) {
+                    //FOUND A DUPLICATE!
+                    name_lock.unlock();
+                    metrics_reject(REJECT_EXISTS);
+                    return -1;
+                }
+            }
+
+            if(has_free_slot) {
+                open_blocks[open_count++] = node.blocks[first + i];
+            }
+        }
+    }
+
+    //ANOTHER CREATE MAY HAVE TAKEN THE SLOT WE SAW, SO LOOK AGAIN ONCE THE BLOCK IS OURS
+    for(uint32_t i = 0; i < open_count; i++) {
+
+        uint32_t direntry_block_num = open_blocks[i];
+        writer_lock(direntry_block_num);
+
+        char dir_block_buf[FS_BLOCKSIZE];
+        read_block(direntry_block_num, dir_block_buf);
+        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_block_buf);
+
+        int free_offset = -1;
+        for(uint32_t j = 0; j < FS_DIRENTRIES && free_offset == -1; j++) {
+            if(direntries[j].inode_block == 0) {
+                free_offset = j;
+            }
+        }
+
+        if(free_offset == -1) {
+            writer_unlock(direntry_block_num);
+            continue;
+        }
+
+        ds_mutex.lock();
+
+        if(available_disk_blocks.size() < 1) { //NO DISK SPACE
+            ds_mutex.unlock();
+            writer_unlock(direntry_block_num);
+            name_lock.unlock();
+
+            metrics_reject(REJECT_NO_SPACE);
+            return -1;
+        }
+
+        uint32_t new_inode_block_num = allocate_block();
+
+        ds_mutex.unlock();
+
+        writer_lock(new_inode_block_num);
+
+        char buf[FS_BLOCKSIZE];
+        memset(buf, 0, FS_BLOCKSIZE);
+        memcpy(buf, &new_inode, sizeof(fs_inode));
+
+        //THE INODE IS ON DISK BEFORE ANY DIRENTRY POINTS TO IT
+        write_block(new_inode_block_num, buf);
+
+        fs_direntry& new_direntry = direntries[free_offset];
+        memset(&new_direntry, 0, sizeof(fs_direntry));
+        std::strcpy(new_direntry.name, file_name.c_str());
+        new_direntry.inode_block = new_inode_block_num;
+
+        write_block(direntry_block_num, dir_block_buf);
+
+        writer_unlock(new_inode_block_num);
+        writer_unlock(direntry_block_num);
+        name_lock.unlock();
+
+        return 0;
+    }
+
+    name_lock.unlock();
+
+    return NEEDS_PARENT_LOCK;
+}
+
+/*HANDLE_CLONE
+-------------------------------------------------
+-> This function is used to handle any FS_CLONE requests from the client.
+-> It creates new_pathname_char as a copy of the file pathname_char without copying any data:
+the new inode lists the same data blocks, and each of them gains a reference in block_refcounts.
+-> The references are taken while the source is still reader-locked, so its blocks can't be freed
+or overwritten in place before create_node links the clone in. After that, the first
+handle_writeblock to a shared block through either file writes a private copy instead.
+-> If any failure occurs, the references are dropped again and it returns -1, else it returns 0.
+-------------------------------------------------*/
+
+int handle_clone(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], char new_pathname_char[FS_MAXFILENAME + 1]) {
+
+    std::vector<std::string> path_vector = char_array_to_string_vector(pathname_char);
+    if(path_vector.size() == 0) {
+        metrics_reject(REJECT_BAD_PATH);
+        return -1;
+    }
+
+    uint32_t child_block = 0;
+    uint32_t parent_block = 0;
+
+    if(traverse_tree(path_vector, false, child_block, parent_block, username_char) == -1) { //Path does not exist!
+        return -1;
+    }
+
+    reader_unlock(parent_block);
+
+    fs_inode node;
+    char inode_buf[FS_BLOCKSIZE]; //Buffer to read inode block
+    read_block(child_block, inode_buf);
+    memcpy(&node, inode_buf, sizeof(fs_inode)); //Copy from buffer
+
+    if(std::strcmp(username_char, node.owner) != 0 || node.type != 'f') {
+
+        reader_unlock(child_block);
+
+        metrics_reject(node.type != 'f' ? REJECT_WRONG_TYPE : REJECT_NOT_OWNER);
+        return -1;
+    }
+
+    ds_mutex.lock();
+    for(uint32_t i = 0; i < node.size; i++) {
+        block_refcounts[node.blocks[i]]++;
+    }
+    ds_mutex.unlock();
+
+    //LET GO OF THE SOURCE BEFORE LOCKING THE DESTINATION'S PARENT, LOCKS ARE ONLY EVER TAKEN TOP-DOWN
+    reader_unlock(child_block);
+
+    if(create_node(username_char, new_pathname_char, node) == -1) {
+
+        ds_mutex.lock();
+        for(uint32_t i = 0; i < node.size; i++) {
+            release_block(node.blocks[i]);
+        }
+        ds_mutex.unlock();
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/*HANDLE_SNAPSHOT
+-------------------------------------------------
+-> This function is used to handle any FS_SNAPSHOT requests from the client.
+-> The only tree that can be snapshotted is the whole filesystem, so pathname must be "/".
+-> Taking the snapshot is O(1): it just records the current allocation generation. Blocks
+allocated before it are copied aside lazily by write_block the first time they're overwritten,
+and blocks freed after it are pinned by release_block until the snapshot is deleted.
+-> The snapshot is read-only and is read through the "/.snapshot" prefix. FS_DELETE of
+"/.snapshot" deletes it, and only the user who took it may. Only one snapshot exists at a
+time and it doesn't survive a restart.
+-> Writes always win over the snapshot: if a write finds the disk too full to copy a block
+aside, the snapshot is deleted so the write can go ahead (see WRITE_BLOCK). That shows up
+in FS_STATS as fs_snapshots_dropped_total, and reads under "/.snapshot" fail from then on.
+-> If any failure occurs, it returns -1, else it returns 0 to handle_request.
+-------------------------------------------------*/
+
+int handle_snapshot(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1]) {
+
+    if(std::strcmp(pathname_char, "/") != 0) {
+        metrics_reject(REJECT_BAD_PATH);
+        return -1;
+    }
+
+    //WAIT FOR SNAPSHOT READERS OF A SNAPSHOT THAT MIGHT HAVE JUST BEEN DELETED
+    snapshot_mutex.lock();
+    ds_mutex.lock();
+
+    if(snapshot_active) { //There is already a snapshot!
+        ds_mutex.unlock();
+        snapshot_mutex.unlock();
+        metrics_reject(REJECT_EXISTS);
+        return -1;
+    }
+
+    snapshot_active = true;
+    snapshot_id++;
+    snapshot_generation = allocation_generation;
+    snapshot_owner = username_char;
+    allocation_generation++;
+
+    ds_mutex.unlock();
+    snapshot_mutex.unlock();
+
+    return 0;
+}
+
+/*DROP_SNAPSHOT
+-------------------------------------------------
+-> Deletes the active snapshot: every copy write_block made for it and every block
+release_block pinned for it go back on available_disk_blocks.
+-> It waits for snapshot readers to finish first, since they read those blocks without tree locks.
+-> username_char is the user deleting "/.snapshot", who must be the one who took it, or null
+when the server drops it itself (see WRITE_BLOCK).
+-> Returns -1 if there is no snapshot or it isn't the user's, else 0.
+-------------------------------------------------*/
+
+int drop_snapshot(const char* username_char) {
+
+    snapshot_mutex.lock();
+    ds_mutex.lock();
+
+    if(!snapshot_active) {
+        ds_mutex.unlock();
+        snapshot_mutex.unlock();
+        metrics_reject(REJECT_NOT_FOUND);
+        return -1;
+    }
+
+    if(username_char != nullptr && snapshot_owner != username_char) {
+        ds_mutex.unlock();
+        snapshot_mutex.unlock();
+        metrics_reject(REJECT_NOT_OWNER);
+        return -1;
+    }
+
+    snapshot_active = false;
+    snapshot_owner.clear();
+
+    for(auto& preserved : snapshot_blocks) {
+        release_block(preserved.second);
+    }
+    snapshot_blocks.clear();
+
+    for(uint32_t pinned_block : snapshot_pinned_blocks) {
+        available_disk_blocks.push_back(pinned_block);
+    }
+    snapshot_pinned_blocks.clear();
+
+    ds_mutex.unlock();
+    snapshot_mutex.unlock();
+
+    return 0;
+}
+
+/*SNAPSHOT_READBLOCK
+-------------------------------------------------
+-> Reads block_num as it was when the snapshot was taken: from the copy in snapshot_blocks
+if write_block has preserved it, else from the block itself.
+-> write_block records the copy before overwriting the block, so if the block wasn't preserved
+before our read but is after it, the read may have seen the new contents and is redone from the copy.
+-> The caller must hold snapshot_mutex as a reader.
+-------------------------------------------------*/
+
+void snapshot_readblock(uint32_t block_num, void* buf) {
+
+    ds_mutex.lock();
+    auto preserved = snapshot_blocks.find(block_num);
+    uint32_t read_from = (preserved == snapshot_blocks.end()) ? block_num : preserved->second;
+    ds_mutex.unlock();
+
+    read_block(read_from, buf);
+
+    if(read_from != block_num) {
+        return;
+    }
+
+    ds_mutex.lock();
+    preserved = snapshot_blocks.find(block_num);
+    read_from = (preserved == snapshot_blocks.end()) ? block_num : preserved->second;
+    ds_mutex.unlock();
+
+    if(read_from != block_num) {
+        read_block(read_from, buf);
+    }
+}
+
+/*HANDLE_SNAPSHOT_READBLOCK
+-------------------------------------------------
+-> Used by handle_readblock for FS_READBLOCK requests under "/.snapshot". path_vector
+is the rest of the path, which is looked up in the snapshot with the usual ownership checks.
+-> The snapshot never changes, so no tree locks are taken. snapshot_mutex is reader-locked
+for the whole request so the snapshot can't be deleted under us.
+-> Returns the data like handle_readblock, or sets status to -1.
+-------------------------------------------------*/
+
+std::shared_ptr<char[]> handle_snapshot_readblock(char username_char[FS_MAXUSERNAME + 1], std::vector<std::string> path_vector, uint32_t block, int &status) {
+
+    if(path_vector.size() == 0) {
+        metrics_reject(REJECT_BAD_PATH);
+        status = -1;
+        return nullptr;
+    }
+
+    snapshot_mutex.lock_shared();
+
+    ds_mutex.lock();
+    bool active = snapshot_active;
+    ds_mutex.unlock();
+
+    if(!active) { //There is no snapshot!
+        snapshot_mutex.unlock_shared();
+        metrics_reject(REJECT_NOT_FOUND);
+        status = -1;
+        return nullptr;
+    }
+
+    uint32_t current_block = 0;
+    fs_inode node;
+    char inode_buf[FS_BLOCKSIZE];
+
+    for(uint32_t i = 0; i < path_vector.size(); i++) {
+
+        snapshot_readblock(current_block, inode_buf);
+        memcpy(&node, inode_buf, sizeof(fs_inode));
+
+        if(node.type != 'd' || (std::strcmp(username_char, node.owner) != 0 && current_block != 0)) {
+            snapshot_mutex.unlock_shared();
+            metrics_reject(node.type != 'd' ? REJECT_WRONG_TYPE : REJECT_NOT_OWNER);
+            status = -1;
+            return nullptr;
+        }
+
+        uint32_t block_to_find = 0;
+
+        for(uint32_t j = 0; j < node.size && block_to_find == 0; j++) {
+
+            char dir_block_buf[FS_BLOCKSIZE];
+            snapshot_readblock(node.blocks[j], dir_block_buf);
+            fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_block_buf);
+
+            for(uint32_t k = 0; k < FS_DIRENTRIES; k++) {
+                if(direntries[k].inode_block != 0 && strcmp(direntries[k].name, path_vector[i].c_str()) == 0) {
+                    block_to_find = direntries[k].inode_block;
+                    break;
+                }
+            }
+        }
+
+        if(block_to_find == 0) { //Path does not exist in the snapshot!
+            snapshot_mutex.unlock_shared();
+            metrics_reject(REJECT_NOT_FOUND);
+            status = -1;
+            return nullptr;
+        }
+
+        current_block = block_to_find;
+    }
+
+    snapshot_readblock(current_block, inode_buf);
+    memcpy(&node, inode_buf, sizeof(fs_inode));
+
+    if(std::strcmp(username_char, node.owner) != 0 || node.type != 'f' || block >= node.size) {
+        snapshot_mutex.unlock_shared();
+        metrics_reject(node.type != 'f' ? REJECT_WRONG_TYPE : block >= node.size ? REJECT_OUT_OF_RANGE : REJECT_NOT_OWNER);
+        status = -1;
+        return nullptr;
+    }
+
+    std::shared_ptr<char[]> buf(new char[FS_BLOCKSIZE]);
+    memset(buf.get(), 0, FS_BLOCKSIZE);
+    snapshot_readblock(node.blocks[block], buf.get());
+
+    snapshot_mutex.unlock_shared();
+
+    return buf;
+}
+
+/*HANDLE_DELETE
+-------------------------------------------------
+-> This function is used to handle any FS_DELETE requests from the client.
+-> It calls traverse_tree_delete to find and lock the parent, but handles finding and writer-locking the child itself.
+-> Most deletes only need the parent reader-locked (see DELETE_FROM_SLOT); the rest take it again writer-locked.
+-> If any client may hold a lease on the file, new leases on it are suspended and the old ones
+waited out first, before the parent is locked (see WAIT_FOR_FILE_LEASES).
+-> This function completes most of the error checking (some being done in handle_request)
+-> It checks if the path exists, if the file exists, and if the user has permission to delete the file.
+-> If everything is succesful, it deletes the file in the path specified.
+-> If any failure occurs, it returns -1, else it returns 0 to handle_request.
+-> Overall, if successful, it clears up space on the disk and makes blocks available as necessary,
+handling requests seperately for if a direntry is the last in its disk block, or if there are more left.
+-------------------------------------------------*/
+
+int handle_delete(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1]) {
+ 
+    std::vector<std::string> path_vector = char_array_to_string_vector(pathname_char);
+
+    if(path_vector.size() == 0) {
+        metrics_reject(REJECT_BAD_PATH);
+        return -1;
+    }
+
+    if(path_vector.size() == 1 && path_vector[0] == SNAPSHOT_DIR_NAME) { //Deleting "/.snapshot" deletes the snapshot
+        return drop_snapshot(username_char);
+    }
+
+    uint32_t leased_block = 0;
+
+    if(any_leases_outstanding() && wait_for_file_leases(path_vector, username_char, leased_block) == -1) {
+        return -1;
+    }
+
+    int result = unlink_path(path_vector, username_char);
+
+    if(leased_block != 0) {
+        resume_leases(leased_block);
+    }
+
+    return result;
+}
+
+/*WAIT_FOR_FILE_LEASES
+-------------------------------------------------
+-> handle_delete's first step when leases are out. It writer-locks the file at path_vector
+just long enough to suspend new leases on it, then waits for the ones already granted with
+nothing locked at all, so a directory never stalls behind one client's lease.
+-> leased_block is set to the file's inode, which the caller resumes leases on once the file
+is gone, or left at 0 if the path names a directory or someone else's file.
+-> Returns -1 if the path can't be found, with the rejection already counted.
+-------------------------------------------------*/
+
+int wait_for_file_leases(std::vector<std::string>& path_vector, char username_char[FS_MAXUSERNAME + 1], uint32_t& leased_block) {
+
+    uint32_t child_block = 0;
+    uint32_t parent_block = 0;
+
+    if(traverse_tree(path_vector, true, child_block, parent_block, username_char) == -1) {
+        return -1;
+    }
+
+    reader_unlock(parent_block);
+
+    fs_inode child_node;
+    char inode_buf[FS_BLOCKSIZE];
+    read_block(child_block, inode_buf);
+    memcpy(&child_node, inode_buf, sizeof(fs_inode));
+
+    if(child_node.type == 'f' && std::strcmp(username_char, child_node.owner) == 0) {
+        suspend_leases(child_block);
+        leased_block = child_block;
+    }
+
+    writer_unlock(child_block);
+
+    if(leased_block != 0) {
+        wait_for_leases(leased_block);
+    }
+
+    return 0;
+}
+
+/*UNLINK_PATH
+-------------------------------------------------
+-> The rest of handle_delete: finds the direntry and removes it, along with the child's blocks.
+-> A file is checked for leases again with the direntry locked, but only one granted after
+handle_delete looked can still be there.
+-------------------------------------------------*/
+
+int unlink_path(std::vector<std::string>& path_vector, char username_char[FS_MAXUSERNAME + 1]) {
+
+    uint32_t child_block = 0;
+    uint32_t parent_block = 0;
+
+
+    //FIRST WITH THE PARENT ONLY READER-LOCKED, CLEARING THE DIRENTRY'S SLOT IN PLACE
+    if(traverse_tree_delete(path_vector, false, child_block, parent_block, username_char) == -1) {
+        return -1;
+    }
+
+    int result = delete_from_slot(parent_block, path_vector.back(), username_char);
+    reader_unlock(parent_block);
+
+    if(result != NEEDS_PARENT_LOCK) {
+        return result;
+    }
+
+    int check = traverse_tree_delete(path_vector, true, child_block, parent_block, username_char);
+
+    if(check == -1) {//Path does not exist!
+        return -1;
+   }
+
+
+    fs_inode parent_node;
+    char parent_inode_buf[FS_BLOCKSIZE]; //Buffer to read inode block
+    read_block(parent_block, parent_inode_buf);
+    memcpy(&parent_node, parent_inode_buf, sizeof(fs_inode)); //Copy from buffer
+    
+
+    if(parent_node.type != 'd') {
+        
+        writer_unlock(parent_block);
+        
+        metrics_reject(REJECT_WRONG_TYPE);
+        return -1;
+    }
+
+    if(std::strcmp(username_char, parent_node.owner) != 0 && parent_block != 0) {
+        
+        writer_unlock(parent_block);
+        
+        metrics_reject(REJECT_NOT_OWNER);
+        return -1;
+    }
+    
+    uint32_t block_to_find = 0;
+
+    uint32_t direntry_block_num = 0;
+    int direntry_file_block_num = -1;
+    int direntry_offset = -1;
+    uint32_t direntry_block_size = 0;
+
+    bool found = false;
+
+    char dir_block_buf[FS_BLOCKSIZE];
+
+    for(uint32_t i = 0; i < parent_node.size; i++) {
+
+        direntry_block_num = parent_node.blocks[i];
+        direntry_file_block_num = i;
+   
+
+        memset(dir_block_buf, 0, FS_BLOCKSIZE);
+        read_block(parent_node.blocks[i], dir_block_buf);
+        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_block_buf);
+
+        for(uint32_t j = 0; j < 8; j++){
+
+            if(direntries[j].inode_block != 0) {
+                direntry_block_size++;
+            
+                if(strcmp(direntries[j].name, path_vector.back().c_str()) == 0) {
+                    block_to_find = direntries[j].inode_block;
+                    writer_lock(block_to_find);
+                    direntry_offset = j;
+                    found = true;
+                }
+            }
+        }
+
+        if(found) {
+            break;
+        } else {
+            direntry_block_size = 0;
+        }
+    }
+
+    if(!found) {
+      
+        writer_unlock(parent_block);
+
+        metrics_reject(REJECT_NOT_FOUND);
+        return -1;
+
+    } else {
+
+        child_block = block_to_find;
+
+    }
+
+
+    fs_inode child_node;
+    char inode_buf[FS_BLOCKSIZE]; 
+    memset(inode_buf, 0, FS_BLOCKSIZE);
+    read_block(child_block, inode_buf);
+    memcpy(&child_node, inode_buf, sizeof(fs_inode));
+
+    if(std::strcmp(username_char, child_node.owner) != 0) {
+        
+        writer_unlock(child_block);
+        writer_unlock(parent_block);
+        
+        metrics_reject(REJECT_NOT_OWNER);
+        return -1;
+    }
+
+
+    if(child_node.size > 0 && child_node.type == 'd') {
+        
+        writer_unlock(child_block);
+        writer_unlock(parent_block);
+        
+        metrics_reject(REJECT_NOT_EMPTY);
+        return -1;
+    }
+
+    if(child_node.type == 'f') {
+        wait_for_leases(child_block);
+        retire_file_handles(child_block);
+    }
+    
+
+    if(direntry_block_size == 1) { 
+              
+        for(uint32_t i = direntry_file_block_num; i < parent_node.size - 1; i++) {
+            parent_node.blocks[i] = parent_node.blocks[i + 1];
+        }
+        
+        parent_node.blocks[parent_node.size - 1] = 0;
+        
+        parent_node.size--;
+
+        char parent_buf[FS_BLOCKSIZE];
+        memset(parent_buf, 0, FS_BLOCKSIZE);
+
+        //EDITED PARENT BLOCK AND REMOVED DIRENTRY BLOCK AND REDUCED SIZE SO THIS MUST BE UPDATED TO DISK
+        memcpy(parent_buf, &parent_node, sizeof(fs_inode));
+        
+        write_block(parent_block, parent_buf);
+
+        ds_mutex.lock();
+        release_block(direntry_block_num);
+        ds_mutex.unlock();
+        
+    } else { //CASE WHERE THERE ARE DIRENTRIES LEFT IN THE BLOCK
+      
+        uint32_t offset = sizeof(fs_direntry) * direntry_offset;
+                
+        memset(dir_block_buf + offset, 0, sizeof(fs_direntry));
+
+        write_block(direntry_block_num, dir_block_buf);
+
+    }
+
+    if(child_node.type == 'f') {
+        ds_mutex.lock();
+        for(uint32_t i = 0; i < child_node.size; i++) {
+            release_block(child_node.blocks[i]);
+        }
+        ds_mutex.unlock();
+        std::memset(child_node.blocks, 0, FS_MAXFILEBLOCKS * sizeof(uint32_t));
+
+        child_node.size = 0;
+    }
+
+    writer_unlock(child_block);
+
+    ds_mutex.lock();
+    release_block(child_block);
+    ds_mutex.unlock();
+
+    writer_unlock(parent_block);
+    return 0;
+}
+
+
+/*DELETE_FROM_SLOT
+-------------------------------------------------
+-> handle_delete's fast path, run with the parent only reader-locked so that deletes (and
+creates) in one directory go ahead side by side. The direntry's slot is cleared with just its
+direntry block writer-locked, along with the child as usual.
+-> Returns NEEDS_PARENT_LOCK, having changed nothing, if the direntry is the last one in its
+block (the empty block then has to come out of the parent's inode) or if it moved before the
+block was locked.
+-------------------------------------------------*/
+
+int delete_from_slot(uint32_t parent_block, const std::string& file_name, char username_char[FS_MAXUSERNAME + 1]) {
+
+    fs_inode parent_node;
+    char parent_inode_buf[FS_BLOCKSIZE]; //Buffer to read inode block
+    read_block(parent_block, parent_inode_buf);
+    memcpy(&parent_node, parent_inode_buf, sizeof(fs_inode)); //Copy from buffer
+
+    if(parent_node.type != 'd') {
+        metrics_reject(REJECT_WRONG_TYPE);
+        return -1;
+    }
+
+    if(std::strcmp(username_char, parent_node.owner) != 0 && parent_block != 0) {
+        metrics_reject(REJECT_NOT_OWNER);
+        return -1;
+    }
+
+    uint32_t direntry_block_num = 0;
+
+    char dir_blocks_buf[DIRECTORY_READAHEAD * FS_BLOCKSIZE];
+
+    for(uint32_t first = 0; first < parent_node.size && direntry_block_num == 0; first += DIRECTORY_READAHEAD) {
+
+        uint32_t count = std::min(DIRECTORY_READAHEAD, parent_node.size - first);
+        read_directory_blocks(parent_node.blocks + first, count, dir_blocks_buf);
+        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_blocks_buf);
+
+        for(uint32_t j = 0; j < count * FS_DIRENTRIES; j++) {
+            if(direntries[j].inode_block != 0 && strcmp(direntries[j].name, file_name.c_str()) == 0) {
+                direntry_block_num = parent_node.blocks[first + j / FS_DIRENTRIES];
+                break;
+            }
+        }
+    }
+
+    if(direntry_block_num == 0) {
+        metrics_reject(REJECT_NOT_FOUND);
+        return -1;
+    }
+
+    writer_lock(direntry_block_num);
+
+    char dir_block_buf[FS_BLOCKSIZE];
+    read_block(direntry_block_num, dir_block_buf);
+    fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_block_buf);
+
+    int direntry_offset = -1;
+    uint32_t direntry_block_size = 0;
+
+    for(uint32_t j = 0; j < FS_DIRENTRIES; j++) {
+        if(direntries[j].inode_block != 0) {
+            direntry_block_size++;
+
+            if(strcmp(direntries[j].name, file_name.c_str()) == 0) {
+                direntry_offset = j;
+            }
+        }
+    }
+
+    if(direntry_offset == -1 || direntry_block_size == 1) {
+        writer_unlock(direntry_block_num);
+        return NEEDS_PARENT_LOCK;
+    }
 
-        locks[child_block]->unlock();
-        
-    //Success!
-    return 0;
+    uint32_t child_block = direntries[direntry_offset].inode_block;
+    writer_lock(child_block);
 
-}
+    fs_inode child_node;
+    char inode_buf[FS_BLOCKSIZE];
+    read_block(child_block, inode_buf);
+    memcpy(&child_node, inode_buf, sizeof(fs_inode));
 
-/*HANDLE_CREATE
--------------------------------------------------
--> This function is used to handle any FS_CREATE requests from the client.
--> It calls traverse_tree_create to find and writer-lock the parent.
--> This function completes most of the error checking (some being done in handle_request).
--> It checks if the path exists, if the file already exists, and if the user has permission to create a file in the directory.
--> If everything is succesful (and blocks exist), it creates a new file or directory in the path specified.
--> This consists of making a new inode, a new direnntry slot, and even a new direntry block if necessary.
--> If any failure occurs, it returns -1, else it returns 0 to handle_request.
--------------------------------------------------*/
+    if(std::strcmp(username_char, child_node.owner) != 0) {
 
+        writer_unlock(child_block);
+        writer_unlock(direntry_block_num);
 
-int handle_create(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], char type) {
-  
-    
-    std::vector<std::string> path_vector = char_array_to_string_vector(pathname_char);
-    if(path_vector.size() == 0) {
+        metrics_reject(REJECT_NOT_OWNER);
         return -1;
     }
-    std::string file_name = path_vector.back();
-    std::string username = std::string(username_char);
 
-    if(file_name.length() > FS_MAXFILENAME) {
+    if(child_node.size > 0 && child_node.type == 'd') {
+
+        writer_unlock(child_block);
+        writer_unlock(direntry_block_num);
+
+        metrics_reject(REJECT_NOT_EMPTY);
         return -1;
     }
 
-    
-    uint32_t parent_block = 0;
+    if(child_node.type == 'f') {
+        wait_for_leases(child_block);
+        retire_file_handles(child_block);
+    }
 
-    int check = 0;
+    memset(&direntries[direntry_offset], 0, sizeof(fs_direntry));
 
+    write_block(direntry_block_num, dir_block_buf);
 
-    check = traverse_tree_create(path_vector, parent_block, username_char);
-    if(check == -1) { //Path does not exist!
-        return -1;
+    if(child_node.type == 'f') {
+        ds_mutex.lock();
+        for(uint32_t i = 0; i < child_node.size; i++) {
+            release_block(child_node.blocks[i]);
+        }
+        ds_mutex.unlock();
     }
 
-    fs_inode node;
-    char node_buf[FS_BLOCKSIZE]; //Buffer to read inode block
-    
-    disk_readblock(parent_block, node_buf);
-    
-    memcpy(&node, node_buf, sizeof(fs_inode)); //Copy from buffer
+    writer_unlock(child_block);
 
-    if(node.type != 'd') {
-        locks[parent_block]->unlock();
-        
-        return -1;
-    }
+    ds_mutex.lock();
+    release_block(child_block);
+    ds_mutex.unlock();
 
-    if(std::strcmp(username_char, node.owner) != 0 && parent_block != 0) {
+    writer_unlock(direntry_block_num);
+
+    return 0;
+}
+
+/*HANDLE_RENAME
+-------------------------------------------------
+-> This function is used to handle any FS_RENAME requests from the client.
+-> A rename only relinks the fs_direntry. The inode and its data blocks never move, so the
+cost doesn't depend on the size of the file or directory being moved.
+-> If both paths have the same parent, traverse_tree_create writer-locks it and the name is
+rewritten in place in its direntry block.
+-> Otherwise lock_rename_parents writer-locks both parents in a deadlock-free order. The new
+direntry is written into the destination before it is cleared from the source, so a crash in
+between can never lose the file.
+-> It checks that the source exists and is owned by username, that both parents are directories
+owned by username, that the destination doesn't exist yet, and that a directory isn't moved into itself.
+-> No client may go on reading a moved file from its cache under the old path. Once everything
+has been checked, try_rename looks for leases on the files it is moving. If there are any, it
+unlocks both parents and handle_rename waits them out with nothing locked, then starts over.
+-> If any failure occurs, it returns -1, else it returns 0 to handle_request.
+-------------------------------------------------*/
 
-        locks[parent_block]->unlock();
+int handle_rename(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], char new_pathname_char[FS_MAXFILENAME + 1]) {
 
+    std::vector<std::string> src_vector = char_array_to_string_vector(pathname_char);
+    std::vector<std::string> dst_vector = char_array_to_string_vector(new_pathname_char);
+
+    if(src_vector.size() == 0 || dst_vector.size() == 0) {
+        metrics_reject(REJECT_BAD_PATH);
         return -1;
     }
 
-    //ALL INODES LOCK
+    std::string dst_name = dst_vector.back();
 
-    bool found = false;
-    uint32_t first_empty_block = 0;
-    int empty_direntry_offset = -1;
-    uint32_t temp_empty_block = 0;
+    if(dst_name.length() > FS_MAXFILENAME) {
+        metrics_reject(REJECT_BAD_PATH);
+        return -1;
+    }
 
-    char temp_buf[FS_BLOCKSIZE];
-    memset(temp_buf, 0, FS_BLOCKSIZE);
+    if(dst_vector.size() == 1 && dst_name == SNAPSHOT_DIR_NAME) {
+        metrics_reject(REJECT_EXISTS);
+        return -1;
+    }
 
-    char dir_block_buf[FS_BLOCKSIZE];
-    memset(dir_block_buf, 0, FS_BLOCKSIZE);
+    //Can't move a file or directory onto itself or into its own subtree
+    if(dst_vector.size() >= src_vector.size() && std::equal(src_vector.begin(), src_vector.end(), dst_vector.begin())) {
+        metrics_reject(REJECT_BAD_PATH);
+        return -1;
+    }
 
+    std::vector<uint32_t> leased;
+    bool suspended = false;
 
-    for(uint32_t i = 0; i < node.size; i++) {
-        temp_empty_block = node.blocks[i];
+    int result = try_rename(username_char, src_vector, dst_vector, leased, suspended);
 
-        memset(temp_buf, 0, FS_BLOCKSIZE);
-        
-        disk_readblock(temp_empty_block, temp_buf);
+    while(result == NEEDS_LEASE_WAIT) {
 
-        if(!found) {
-            first_empty_block = temp_empty_block;
-            memcpy(dir_block_buf, temp_buf, FS_BLOCKSIZE);
+        for(uint32_t inode_block : leased) {
+            wait_for_leases(inode_block);
         }
-        
-        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(temp_buf);
-
-        for(uint32_t j = 0; j < 8; j++) {
-            if(strcmp(direntries[j].name, file_name.c_str()) == 0){
+        leased.clear();
 
-                //FOUND A DUPLICATE!
+        result = try_rename(username_char, src_vector, dst_vector, leased, suspended);
+    }
 
-                locks[parent_block]->unlock();
-                
-                return -1;
-            }
+    if(suspended) {
+        resume_all_leases();
+    }
 
-            if(direntries[j].inode_block == 0 && !found) {
-                empty_direntry_offset = j;
-                found = true;
-            }
-        }
+    return result;
+}
 
-    }
+/*TRY_RENAME
+-------------------------------------------------
+-> handle_rename once the paths are known to be good: locks the parents, checks everything
+and relinks the direntry.
+-> Just before anything is written, it stops reads that looked the old path up from getting a
+lease (see INVALIDATE_LEASE_LOOKUPS) and collects the files under the moved direntry that still
+have one into leased. If there are any, it suspends new leases everywhere (once, noted in
+suspended, for handle_rename to resume), unlocks both parents without having changed anything,
+and returns NEEDS_LEASE_WAIT.
+-------------------------------------------------*/
 
-    if(node.type != 'd') { //Can't create a file in a file!
+int try_rename(char username_char[FS_MAXUSERNAME + 1], std::vector<std::string>& src_vector, std::vector<std::string>& dst_vector, std::vector<uint32_t>& leased, bool& suspended) {
 
-        locks[parent_block]->unlock();
+    std::string src_name = src_vector.back();
+    std::string dst_name = dst_vector.back();
 
-        return -1;
-    }
+    std::vector<std::string> src_parent(src_vector.begin(), src_vector.end() - 1);
+    std::vector<std::string> dst_parent(dst_vector.begin(), dst_vector.end() - 1);
 
+    bool same_parent = (src_parent == dst_parent);
 
-    uint32_t temp_inode_block_num;
+    uint32_t src_parent_block = 0;
+    uint32_t dst_parent_block = 0;
 
-    if(empty_direntry_offset == -1) {//CASE WHERE LAST BLOCK IS FULL OF DIRENTRIES
-      
+    if(same_parent) {
 
-        if(node.size == FS_MAXFILEBLOCKS) { //DIRECTORY IS FULL!
-            
-            locks[parent_block]->unlock();
-            
+        if(traverse_tree_create(src_vector, true, src_parent_block, username_char) == -1) {
             return -1;
         }
+        dst_parent_block = src_parent_block;
 
-        ds_mutex.lock();
+    } else {
 
-        if(available_disk_blocks.size() < 2) { //NO DISK SPACE
-            ds_mutex.unlock();
-            locks[parent_block]->unlock();
-            
+        //ONLY ONE CROSS-DIRECTORY RENAME AT A TIME, SEE LOCK_RENAME_PARENTS
+        rename_mutex.lock();
+
+        if(lock_rename_parents(src_parent, dst_parent, src_parent_block, dst_parent_block, username_char) == -1) {
+            rename_mutex.unlock();
             return -1;
         }
+    }
 
-        uint32_t new_inode_block_num = available_disk_blocks.back();
-        available_disk_blocks.pop_back();
-        temp_inode_block_num = new_inode_block_num;
+    fs_inode src_parent_node;
+    char src_parent_buf[FS_BLOCKSIZE];
+    read_block(src_parent_block, src_parent_buf);
+    memcpy(&src_parent_node, src_parent_buf, sizeof(fs_inode));
 
-        //TAKING THE LOWEST AVAILABLE DIRECTORY BLOCK
-        uint32_t new_direntry_block_num = available_disk_blocks.back();
-        available_disk_blocks.pop_back();
-        
-        ds_mutex.unlock();
+    fs_inode dst_parent_node;
+    char dst_parent_buf[FS_BLOCKSIZE];
+    read_block(dst_parent_block, dst_parent_buf);
+    memcpy(&dst_parent_node, dst_parent_buf, sizeof(fs_inode));
 
-        
-        fs_direntry new_direntry;
-        std::strcpy(new_direntry.name, file_name.c_str());
-        new_direntry.inode_block = new_inode_block_num;
+    if(src_parent_node.type != 'd' || dst_parent_node.type != 'd') {
+        unlock_rename_parents(src_parent_block, dst_parent_block, same_parent);
+        metrics_reject(REJECT_WRONG_TYPE);
+        return -1;
+    }
 
-        //Handle making a new file and directory differently
+    if((std::strcmp(username_char, src_parent_node.owner) != 0 && src_parent_block != 0) ||
+       (std::strcmp(username_char, dst_parent_node.owner) != 0 && dst_parent_block != 0)) {
+        unlock_rename_parents(src_parent_block, dst_parent_block, same_parent);
+        metrics_reject(REJECT_NOT_OWNER);
+        return -1;
+    }
 
-        ds_mutex.lock();
-        locks.emplace(temp_inode_block_num, std::make_shared<boost::shared_mutex>());
-        ds_mutex.unlock();
+    //FIND THE SOURCE DIRENTRY
 
-        locks[temp_inode_block_num]->lock();
+    uint32_t moved_block = 0;
+    uint32_t src_direntry_block_num = 0;
+    int src_direntry_file_block_num = -1;
+    int src_direntry_offset = -1;
+    uint32_t src_direntry_block_size = 0;
 
-        char buf[FS_BLOCKSIZE];
-        memset(buf, 0, FS_BLOCKSIZE);
+    char src_dir_block_buf[FS_BLOCKSIZE];
 
-        fs_inode new_inode;
-        new_inode.type = type;
-        std::strcpy(new_inode.owner, username_char);
-        new_inode.size = 0;
+    for(uint32_t i = 0; i < src_parent_node.size && moved_block == 0; i++) {
 
-        memcpy(buf, &new_inode, sizeof(fs_inode));
-        
-        disk_writeblock(temp_inode_block_num, buf);
-                
-        char dirbuf[FS_BLOCKSIZE];
-        memset(dirbuf, 0, FS_BLOCKSIZE);
+        src_direntry_block_num = src_parent_node.blocks[i];
+        src_direntry_file_block_num = i;
+        src_direntry_block_size = 0;
 
-        memcpy(dirbuf, &new_direntry, sizeof(fs_direntry));
+        memset(src_dir_block_buf, 0, FS_BLOCKSIZE);
+        read_block(src_direntry_block_num, src_dir_block_buf);
+        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(src_dir_block_buf);
 
-        
-        disk_writeblock(new_direntry_block_num, dirbuf);
-        
-        node.blocks[node.size] = new_direntry_block_num;
-        node.size++;
+        for(uint32_t j = 0; j < FS_DIRENTRIES; j++) {
+            if(direntries[j].inode_block != 0) {
+                src_direntry_block_size++;
 
-        char parent_buf[FS_BLOCKSIZE];
-        memset(parent_buf, 0, FS_BLOCKSIZE);
+                if(strcmp(direntries[j].name, src_name.c_str()) == 0) {
+                    moved_block = direntries[j].inode_block;
+                    src_direntry_offset = j;
+                }
+            }
+        }
+    }
 
-        memcpy(parent_buf, &node, sizeof(fs_inode));        
-        
-        disk_writeblock(parent_block, parent_buf);
+    if(moved_block == 0) { //Source does not exist!
+        unlock_rename_parents(src_parent_block, dst_parent_block, same_parent);
+        metrics_reject(REJECT_NOT_FOUND);
+        return -1;
+    }
 
-        
-    }else{//CASE WHERE YOU CAN FIT MORE DIRENTRIES IN LAST BLOCK OF DIRECTORY
-        
-        ds_mutex.lock(); //LOCK AVAILABLE DISK BLOCKS
+    //THE OWNER OF AN INODE NEVER CHANGES, AND IT CAN'T BE DELETED WHILE WE HOLD ITS PARENT
+    fs_inode moved_node;
+    char moved_buf[FS_BLOCKSIZE];
+    read_block(moved_block, moved_buf);
+    memcpy(&moved_node, moved_buf, sizeof(fs_inode));
 
-        if(available_disk_blocks.size() < 1) { //NO DISK SPACE. CHECK MUST BE INSIDE LOCK SO NO CHANGES CAN OCCUR
-            
-            ds_mutex.unlock();
-            locks[parent_block]->unlock();
-            
-            return -1;
-        }
+    if(std::strcmp(username_char, moved_node.owner) != 0) {
+        unlock_rename_parents(src_parent_block, dst_parent_block, same_parent);
+        metrics_reject(REJECT_NOT_OWNER);
+        return -1;
+    }
 
-        uint32_t new_inode_block_num = available_disk_blocks.back();
-        available_disk_blocks.pop_back();
+    //FIND A FREE SLOT IN THE DESTINATION, CHECKING FOR DUPLICATES ALONG THE WAY
 
-        ds_mutex.unlock(); //UNLOCK AVAILABLE DISK BLOCKS
+    bool found = false;
+    uint32_t dst_direntry_block_num = 0;
+    int dst_direntry_offset = -1;
 
-        temp_inode_block_num = new_inode_block_num;
+    char dst_dir_block_buf[FS_BLOCKSIZE];
+    memset(dst_dir_block_buf, 0, FS_BLOCKSIZE);
 
-        fs_direntry new_direntry;
-        std::strcpy(new_direntry.name, file_name.c_str());
-        new_direntry.inode_block = new_inode_block_num;
+    if(same_parent) {
 
-        ds_mutex.lock();
-        locks.emplace(temp_inode_block_num, std::make_shared<boost::shared_mutex>());
-        ds_mutex.unlock();
+        if(find_duplicate(dst_parent_node, dst_name) == -1) { //Destination already exists!
+            unlock_rename_parents(src_parent_block, dst_parent_block, same_parent);
+            metrics_reject(REJECT_EXISTS);
+            return -1;
+        }
 
-        locks[temp_inode_block_num]->lock();
-        
-        char buf[FS_BLOCKSIZE];
-        memset(buf, 0, FS_BLOCKSIZE);
+    } else {
 
-        fs_inode new_inode;
-        new_inode.type = type;
-        std::strcpy(new_inode.owner, username_char);
-        new_inode.size = 0;
+        char temp_buf[FS_BLOCKSIZE];
 
-        memcpy(buf, &new_inode, sizeof(fs_inode));
-        
-        disk_writeblock(temp_inode_block_num, buf);
-    
+        for(uint32_t i = 0; i < dst_parent_node.size; i++) {
 
-        uint32_t offset = sizeof(fs_direntry) * empty_direntry_offset;
-        
-        memcpy(dir_block_buf + offset, &new_direntry, sizeof(fs_direntry));
+            memset(temp_buf, 0, FS_BLOCKSIZE);
+            read_block(dst_parent_node.blocks[i], temp_buf);
+            fs_direntry* direntries = reinterpret_cast<fs_direntry*>(temp_buf);
 
-        
-        disk_writeblock(first_empty_block, dir_block_buf);
+            for(uint32_t j = 0; j < FS_DIRENTRIES; j++) {
+
+                if(direntries[j].inode_block != 0 && strcmp(direntries[j].name, dst_name.c_str()) == 0) {
+                    //Destination already exists!
+                    unlock_rename_parents(src_parent_block, dst_parent_block, same_parent);
+                    metrics_reject(REJECT_EXISTS);
+                    return -1;
+                }
+
+                if(direntries[j].inode_block == 0 && !found) {
+                    dst_direntry_block_num = dst_parent_node.blocks[i];
+                    dst_direntry_offset = j;
+                    memcpy(dst_dir_block_buf, temp_buf, FS_BLOCKSIZE);
+                    found = true;
+                }
+            }
+        }
 
+        if(!found && dst_parent_node.size == FS_MAXFILEBLOCKS) { //DIRECTORY IS FULL!
+            unlock_rename_parents(src_parent_block, dst_parent_block, same_parent);
+            metrics_reject(REJECT_NO_SPACE);
+            return -1;
+        }
     }
 
-    locks[temp_inode_block_num]->unlock();
-    locks[parent_block]->unlock();
-   
-    return 0;
-}
+    //NO CLIENT MAY STILL BE READING ANYTHING UNDER THE OLD PATH FROM ITS CACHE
+    invalidate_lease_lookups();
 
-/*HANDLE_DELETE
--------------------------------------------------
--> This function is used to handle any FS_DELETE requests from the client.
--> It calls traverse_tree_delete to find and writer-lock the parent, but handles finding and writer-locking the child itself.
--> This function completes most of the error checking (some being done in handle_request)
--> It checks if the path exists, if the file exists, and if the user has permission to delete the file.
--> If everything is succesful, it deletes the file in the path specified.
--> If any failure occurs, it returns -1, else it returns 0 to handle_request.
--> Overall, if successful, it clears up space on the disk and makes blocks available as necessary,
-handling requests seperately for if a direntry is the last in its disk block, or if there are more left.
--------------------------------------------------*/
+    if(any_leases_outstanding()) {
+        collect_leased_files(moved_block, leased);
+    }
 
-int handle_delete(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1]) {
- 
-    std::vector<std::string> path_vector = char_array_to_string_vector(pathname_char);
+    if(!leased.empty()) {
 
-    if(path_vector.size() == 0) {
-        return -1;
+        if(!suspended) {
+            suspend_all_leases();
+            suspended = true;
+        }
+
+        unlock_rename_parents(src_parent_block, dst_parent_block, same_parent);
+        return NEEDS_LEASE_WAIT;
     }
 
-    std::string username = std::string(username_char);
+    fs_direntry new_direntry;
+    memset(&new_direntry, 0, sizeof(fs_direntry));
+    std::strcpy(new_direntry.name, dst_name.c_str());
+    new_direntry.inode_block = moved_block;
 
-    uint32_t child_block = 0;
-    uint32_t parent_block = 0;
+    if(same_parent) {
 
+        //A SINGLE BLOCK WRITE, SO THE RENAME IS ATOMIC ON DISK
+        uint32_t offset = sizeof(fs_direntry) * src_direntry_offset;
+        memcpy(src_dir_block_buf + offset, &new_direntry, sizeof(fs_direntry));
+        write_block(src_direntry_block_num, src_dir_block_buf);
 
-    int check = traverse_tree_delete(path_vector, child_block, parent_block, username_char);
+        unlock_rename_parents(src_parent_block, dst_parent_block, same_parent);
+        return 0;
+    }
 
-    if(check == -1) {//Path does not exist!
-        return -1;
-   }
+    if(found) { //CASE WHERE THE DESTINATION HAS A FREE DIRENTRY SLOT
 
+        uint32_t offset = sizeof(fs_direntry) * dst_direntry_offset;
+        memcpy(dst_dir_block_buf + offset, &new_direntry, sizeof(fs_direntry));
+        write_block(dst_direntry_block_num, dst_dir_block_buf);
 
-    fs_inode parent_node;
-    char parent_inode_buf[FS_BLOCKSIZE]; //Buffer to read inode block
-    disk_readblock(parent_block, parent_inode_buf);
-    memcpy(&parent_node, parent_inode_buf, sizeof(fs_inode)); //Copy from buffer
-    
+    } else { //CASE WHERE THE DESTINATION NEEDS A NEW DIRENTRY BLOCK
 
-    if(parent_node.type != 'd') {
-        
-        locks[parent_block]->unlock();
-        
-        return -1;
-    }
+        ds_mutex.lock();
 
-    if(std::strcmp(username_char, parent_node.owner) != 0 && parent_block != 0) {
-        
-        locks[parent_block]->unlock();
-        
-        return -1;
-    }
-    
-    uint32_t block_to_find = 0;
+        if(available_disk_blocks.size() < 1) { //NO DISK SPACE
+            ds_mutex.unlock();
+            unlock_rename_parents(src_parent_block, dst_parent_block, same_parent);
+            metrics_reject(REJECT_NO_SPACE);
+            return -1;
+        }
 
-    uint32_t direntry_block_num = 0;
-    int direntry_file_block_num = -1;
-    int direntry_offset = -1;
-    uint32_t direntry_block_size = 0;
+        uint32_t new_direntry_block_num = allocate_block();
 
-    bool found = false;
+        ds_mutex.unlock();
 
-    char dir_block_buf[FS_BLOCKSIZE];
+        char dirbuf[FS_BLOCKSIZE];
+        memset(dirbuf, 0, FS_BLOCKSIZE);
+        memcpy(dirbuf, &new_direntry, sizeof(fs_direntry));
+        write_block(new_direntry_block_num, dirbuf);
 
-    for(uint32_t i = 0; i < parent_node.size; i++) {
+        //EDIT INODE AFTER DIRENTRY WRITE FOR CRASH CONSISTENCY
+        dst_parent_node.blocks[dst_parent_node.size] = new_direntry_block_num;
+        dst_parent_node.size++;
 
-        direntry_block_num = parent_node.blocks[i];
-        direntry_file_block_num = i;
-   
+        memset(dst_parent_buf, 0, FS_BLOCKSIZE);
+        memcpy(dst_parent_buf, &dst_parent_node, sizeof(fs_inode));
+        write_block(dst_parent_block, dst_parent_buf);
+    }
 
-        memset(dir_block_buf, 0, FS_BLOCKSIZE);
-        disk_readblock(parent_node.blocks[i], dir_block_buf);
-        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_block_buf);
+    //ONLY NOW REMOVE THE SOURCE DIRENTRY, SAME AS HANDLE_DELETE
 
-        for(uint32_t j = 0; j < 8; j++){
+    if(src_direntry_block_size == 1) {
 
-            if(direntries[j].inode_block != 0) {
-                direntry_block_size++;
-            
-                if(strcmp(direntries[j].name, path_vector.back().c_str()) == 0) {
-                    block_to_find = direntries[j].inode_block;
-                    locks[block_to_find]->lock();
-                    direntry_offset = j;
-                    found = true;
-                }
-            }
+        for(uint32_t i = src_direntry_file_block_num; i < src_parent_node.size - 1; i++) {
+            src_parent_node.blocks[i] = src_parent_node.blocks[i + 1];
         }
 
-        if(found) {
-            break;
-        } else {
-            direntry_block_size = 0;
-        }
-    }
+        src_parent_node.blocks[src_parent_node.size - 1] = 0;
+        src_parent_node.size--;
 
-    if(!found) {
-      
-        locks[parent_block]->unlock();
+        memset(src_parent_buf, 0, FS_BLOCKSIZE);
+        memcpy(src_parent_buf, &src_parent_node, sizeof(fs_inode));
+        write_block(src_parent_block, src_parent_buf);
 
-        return -1;
+        ds_mutex.lock();
+        release_block(src_direntry_block_num);
+        ds_mutex.unlock();
 
     } else {
 
-        child_block = block_to_find;
-
+        uint32_t offset = sizeof(fs_direntry) * src_direntry_offset;
+        memset(src_dir_block_buf + offset, 0, sizeof(fs_direntry));
+        write_block(src_direntry_block_num, src_dir_block_buf);
     }
 
+    unlock_rename_parents(src_parent_block, dst_parent_block, same_parent);
 
-    fs_inode child_node;
-    char inode_buf[FS_BLOCKSIZE]; 
-    memset(inode_buf, 0, FS_BLOCKSIZE);
-    disk_readblock(child_block, inode_buf);
-    memcpy(&child_node, inode_buf, sizeof(fs_inode));
+    return 0;
+}
 
-    if(std::strcmp(username_char, child_node.owner) != 0) {
-        
-        locks[child_block]->unlock();
-        locks[parent_block]->unlock();
-        
-        return -1;
-    }
+/*COLLECT_LEASED_FILES
+-------------------------------------------------
+-> Used by try_rename to find the files at or under inode_block that a client may still hold
+a lease on, and add them to leased.
+-> The caller holds inode_block's parent writer-locked, so it can't be unlinked meanwhile.
+Directories below it, and each of their direntry blocks, are reader-locked while they are
+scanned, parent before child as in any traversal.
+-------------------------------------------------*/
 
+void collect_leased_files(uint32_t inode_block, std::vector<uint32_t>& leased) {
 
-    if(child_node.size > 0 && child_node.type == 'd') {
-        
-        locks[child_block]->unlock();
-        locks[parent_block]->unlock();
-        
-        return -1;
-    }
-    
+    fs_inode node;
+    char inode_buf[FS_BLOCKSIZE];
+    read_block(inode_block, inode_buf);
+    memcpy(&node, inode_buf, sizeof(fs_inode));
 
-    if(direntry_block_size == 1) { 
-              
-        for(uint32_t i = direntry_file_block_num; i < parent_node.size - 1; i++) {
-            parent_node.blocks[i] = parent_node.blocks[i + 1];
+    if(node.type == 'f') {
+        if(leases_outstanding(inode_block)) {
+            leased.push_back(inode_block);
         }
-        
-        parent_node.blocks[parent_node.size - 1] = 0;
-        
-        parent_node.size--;
+        return;
+    }
 
-        char parent_buf[FS_BLOCKSIZE];
-        memset(parent_buf, 0, FS_BLOCKSIZE);
+    reader_lock(inode_block);
 
-        //EDITED PARENT BLOCK AND REMOVED DIRENTRY BLOCK AND REDUCED SIZE SO THIS MUST BE UPDATED TO DISK
-        memcpy(parent_buf, &parent_node, sizeof(fs_inode));
-        
-        disk_writeblock(parent_block, parent_buf);
+    //ITS DIRENTRY BLOCKS MAY HAVE CHANGED BEFORE WE LOCKED IT
+    read_block(inode_block, inode_buf);
+    memcpy(&node, inode_buf, sizeof(fs_inode));
 
-        ds_mutex.lock();
-        available_disk_blocks.push_back(direntry_block_num);
-        ds_mutex.unlock();
-        
-    } else { //CASE WHERE THERE ARE DIRENTRIES LEFT IN THE BLOCK
-      
-        uint32_t offset = sizeof(fs_direntry) * direntry_offset;
-                
-        memset(dir_block_buf + offset, 0, sizeof(fs_direntry));
+    char dir_block_buf[FS_BLOCKSIZE];
 
-        disk_writeblock(direntry_block_num, dir_block_buf);
+    for(uint32_t i = 0; i < node.size; i++) {
 
-    }
+        reader_lock(node.blocks[i]);
+        read_block(node.blocks[i], dir_block_buf);
 
-    if(child_node.type == 'f') {
-        ds_mutex.lock();
-        for(uint32_t i = 0; i < child_node.size; i++) {
-            available_disk_blocks.push_back(child_node.blocks[i]);
+        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_block_buf);
+
+        for(uint32_t j = 0; j < FS_DIRENTRIES; j++) {
+            if(direntries[j].inode_block != 0) {
+                collect_leased_files(direntries[j].inode_block, leased);
+            }
         }
-        ds_mutex.unlock();
-        std::memset(child_node.blocks, 0, FS_MAXFILEBLOCKS * sizeof(uint32_t));
 
-        child_node.size = 0;
+        reader_unlock(node.blocks[i]);
     }
 
-    ds_mutex.lock();
-    locks.erase(child_block);
-    available_disk_blocks.push_back(child_block);
-    ds_mutex.unlock();
-
-    locks[parent_block]->unlock();
-    return 0;
+    reader_unlock(inode_block);
 }
 
+/*UNLOCK_RENAME_PARENTS
+-------------------------------------------------
+-> Releases the writer locks handle_rename holds on the source and destination parents,
+and the rename_mutex if the rename was across directories.
+-------------------------------------------------*/
+
+void unlock_rename_parents(uint32_t src_parent_block, uint32_t dst_parent_block, bool same_parent) {
+
+    writer_unlock(src_parent_block);
+
+    if(!same_parent) {
+        writer_unlock(dst_parent_block);
+        rename_mutex.unlock();
+    }
+}
 
 /*CHAR_ARRAY_TO_STRING_VECTOR
 ------------------------------------------------
@@ -1183,28 +3791,188 @@ std::vector<std::string> char_array_to_string_vector(char char_array[FS_MAXFILEN
 }
 
 
+/*LOCK_RENAME_PARENTS
+-------------------------------------------------
+-> This function is used by handle_rename to writer-lock two different parent directories.
+-> Every other request only ever waits for a lock further down the tree than the locks it
+already holds (hand-over-hand). Cross-directory renames are serialized by rename_mutex, so
+as long as this function also locks top-down, nobody can wait on us while we wait on them.
+-> It walks to the deepest common ancestor of the two parents first and holds it while it
+descends, so neither parent can be deleted or moved between lookup and locking.
+-> If one parent is an ancestor of the other, the ancestor is locked first. Otherwise they
+are in different subtrees of the common ancestor and the subtree with the lower inode block
+is locked first.
+-> On success both parents are writer-locked and every other lock has been released. On
+failure nothing is left locked and -1 is returned.
+-------------------------------------------------*/
+
+int lock_rename_parents(std::vector<std::string> src_parent, std::vector<std::string> dst_parent, uint32_t& src_parent_block, uint32_t& dst_parent_block, char user[FS_MAXUSERNAME + 1]) {
+
+    phase_timer timer(PHASE_TRAVERSE);
+
+    size_t common = 0;
+    while(common < src_parent.size() && common < dst_parent.size() && src_parent[common] == dst_parent[common]) {
+        common++;
+    }
+
+    bool src_is_common = (common == src_parent.size());
+    bool dst_is_common = (common == dst_parent.size());
+
+    uint32_t common_block = 0;
+
+    if(common == 0 && (src_is_common || dst_is_common)) {
+        writer_lock(common_block);
+    } else {
+        reader_lock(common_block);
+    }
+
+    if(common > 0) {
+        if(descend_tree(0, src_parent, 0, common, src_is_common || dst_is_common, common_block, user) == -1) {
+            reader_unlock(0);
+            return -1;
+        }
+        reader_unlock(0);
+    }
+
+    if(src_is_common || dst_is_common) {
+
+        //THE COMMON ANCESTOR IS ONE OF THE PARENTS AND IS ALREADY WRITER-LOCKED
+        std::vector<std::string>& lower = src_is_common ? dst_parent : src_parent;
+        uint32_t lower_block = 0;
+
+        if(descend_tree(common_block, lower, common, lower.size(), true, lower_block, user) == -1) {
+            writer_unlock(common_block);
+            return -1;
+        }
+
+        src_parent_block = src_is_common ? common_block : lower_block;
+        dst_parent_block = src_is_common ? lower_block : common_block;
+
+        return 0;
+    }
+
+    fs_inode common_inode;
+    char common_inode_buf[FS_BLOCKSIZE];
+    read_block(common_block, common_inode_buf);
+    memcpy(&common_inode, common_inode_buf, sizeof(fs_inode));
+
+    uint32_t src_head = 0;
+    uint32_t dst_head = 0;
+
+    if(common_inode.type == 'd') {
+        src_head = find_direntry(common_inode, src_parent[common]);
+        dst_head = find_direntry(common_inode, dst_parent[common]);
+    }
+
+    if(src_head == 0 || dst_head == 0) {
+        reader_unlock(common_block);
+        metrics_reject(REJECT_NOT_FOUND);
+        return -1;
+    }
+
+    bool src_first = src_head < dst_head;
+
+    std::vector<std::string>& first = src_first ? src_parent : dst_parent;
+    std::vector<std::string>& second = src_first ? dst_parent : src_parent;
+
+    uint32_t first_block = 0;
+    uint32_t second_block = 0;
+
+    if(descend_tree(common_block, first, common, first.size(), true, first_block, user) == -1) {
+        reader_unlock(common_block);
+        return -1;
+    }
+
+    if(descend_tree(common_block, second, common, second.size(), true, second_block, user) == -1) {
+        writer_unlock(first_block);
+        reader_unlock(common_block);
+        return -1;
+    }
+
+    reader_unlock(common_block);
+
+    src_parent_block = src_first ? first_block : second_block;
+    dst_parent_block = src_first ? second_block : first_block;
+
+    return 0;
+}
+
+/*DESCEND_TREE
+-------------------------------------------------
+-> Used by lock_rename_parents to walk from a directory the caller already holds a lock on
+(start_block) through path_vector[begin, end) with hand-over-hand locking.
+-> The start block is never unlocked here since the caller still needs it. Directories in
+between are reader-locked, and the block reached at the end is writer-locked if write_last is set.
+-> If the path doesn't exist or isn't owned by user, the locks this function took are released
+and it returns -1.
+-------------------------------------------------*/
+
+int descend_tree(uint32_t start_block, std::vector<std::string>& path_vector, size_t begin, size_t end, bool write_last, uint32_t& end_block, char user[FS_MAXUSERNAME + 1]) {
+
+    uint32_t current_block = start_block;
+
+    for(size_t i = begin; i < end; i++) {
+
+        fs_inode main_inode;
+        char main_inode_buf[FS_BLOCKSIZE]; //Buffer to read inode block
+        read_block(current_block, main_inode_buf);
+        memcpy(&main_inode, main_inode_buf, sizeof(fs_inode)); //Copy from buffer
+
+        uint32_t block_to_find = 0;
+
+        if(main_inode.type == 'd' && (std::strcmp(user, main_inode.owner) == 0 || current_block == 0)) {
+            block_to_find = lock_direntry(main_inode, path_vector[i], i == end - 1 && write_last);
+        }
+
+        if(block_to_find == 0) {
+
+            if(current_block != start_block) {
+                reader_unlock(current_block);
+            }
+
+            metrics_reject(REJECT_NOT_FOUND);
+            return -1;
+        }
+
+        if(current_block != start_block) {
+            reader_unlock(current_block);
+        }
+
+        current_block = block_to_find;
+    }
+
+    end_block = current_block;
+
+    return 0;
+}
+
 /*TRAVERSE_TREE_DELETE
 -------------------------------------------------
 -> This function is used by handle_delete to traverse the file system.
 -> It takes advantage of hand-over-hand locking in order to make sure that
-the parent is writer-locked before returning back to handle_delete.
+the parent is locked before returning back to handle_delete: writer-locked if write_parent is set,
+and otherwise reader-locked, for the slot-level fast path (see DELETE_FROM_SLOT).
 -> It goes through the file system by reading in the inode blocks, reading its direntries,
 and looking for the next file/directory in the path until finding the parent of the file/directory.
 -> The parent block is passed in by reference so the parent can be updated in handle_delete.
 -------------------------------------------------*/
 
-int traverse_tree_delete(std::vector<std::string> path_vector, uint32_t& child_block, uint32_t& parent_block, char user[FS_MAXUSERNAME + 1]) {
+int traverse_tree_delete(std::vector<std::string> path_vector, bool write_parent, uint32_t& child_block, uint32_t& parent_block, char user[FS_MAXUSERNAME + 1]) {
+
+    phase_timer timer(PHASE_TRAVERSE);
     std::string name_to_find = path_vector.back();
     uint32_t block_to_find = 0;
 
-    bool found = false;
 
     uint32_t current_block = 0;
+
+    //TRY WITHOUT LOCKING THE WAY DOWN FIRST. IF THAT WORKS, THE PARENT IS ALREADY LOCKED
+    bool traversed = path_vector.size() > 1 && optimistic_traverse(path_vector, write_parent, current_block, user);
     
-    if(path_vector.size() == 1) {
-        locks[current_block]->lock();
-    }else {
-        locks[current_block]->lock_shared();
+    if(path_vector.size() == 1 && write_parent) {
+        writer_lock(current_block);
+    }else if(!traversed) {
+        reader_lock(current_block);
     }
     
 
@@ -1216,74 +3984,39 @@ int traverse_tree_delete(std::vector<std::string> path_vector, uint32_t& child_b
         std::string parent_name = path_vector.back();
 
 
-        for(uint32_t i = 0; i < path_vector.size(); i++) {
+        for(uint32_t i = traversed ? path_vector.size() : 0; i < path_vector.size(); i++) {
             char main_inode_buf[FS_BLOCKSIZE]; //Buffer to read inode block
             
-            disk_readblock(current_block, main_inode_buf);
+            read_block(current_block, main_inode_buf);
             
             memcpy(&main_inode, main_inode_buf, sizeof(fs_inode)); //Copy from buffer
 
             if(main_inode.type != 'd') {
                 
-                locks[current_block]->unlock_shared();
+                reader_unlock(current_block);
                 
+                metrics_reject(REJECT_WRONG_TYPE);
                 return -1;
             }
 
             if(std::strcmp(user, main_inode.owner) != 0 && current_block != 0) {
         
-                locks[current_block]->unlock_shared();
+                reader_unlock(current_block);
         
+                metrics_reject(REJECT_NOT_OWNER);
                 return -1;
             }
 
-            for(uint32_t j = 0; j < main_inode.size; j++) {
-
-                char dir_block_buf[FS_BLOCKSIZE];
-                memset(dir_block_buf, 0, FS_BLOCKSIZE);
-                
-                disk_readblock(main_inode.blocks[j], dir_block_buf);
-                
-                fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_block_buf);
-
-                for(uint32_t k = 0; k < 8; k++){
-                    if(direntries[k].inode_block != 0){
-                    
-                        if(strcmp(direntries[k].name, path_vector[i].c_str()) == 0) {
-                            block_to_find = direntries[k].inode_block;
-                            found = true;
-                            
-                            if(i == path_vector.size() - 1 ) {
-                                locks[block_to_find]->lock();
-                            }else {
-                                locks[block_to_find]->lock_shared();
-                            }
-
-                            locks[current_block]->unlock_shared();
-                            
-                            break;
-                        }
-
-                    }
-                }
-
-                if(found) {
-                    break;
-                }
+            block_to_find = lock_direntry(main_inode, path_vector[i], i == path_vector.size() - 1 && write_parent);
 
-            }
+            reader_unlock(current_block);
 
-            if(!found) {
-                
-                locks[current_block]->unlock_shared();
-    
+            if(block_to_find == 0) {
+                metrics_reject(REJECT_NOT_FOUND);
                 return -1;
-            } else {
-
-                current_block = block_to_find;
-                found = false;
-
             }
+
+            current_block = block_to_find;
         }
     }
    
@@ -1309,14 +4042,20 @@ a writer lock to protect that critical section.
 --------------------------------------------------------------*/
 
 int traverse_tree(std::vector<std::string> path_vector, bool write_child, uint32_t& child_block, uint32_t& parent_block, char user[FS_MAXUSERNAME + 1]) {
+
+    phase_timer timer(PHASE_TRAVERSE);
     std::string name_to_find = path_vector.back();
     uint32_t block_to_find = 0;
 
-    bool found = false;
 
     uint32_t current_block = 0;
+
+    //TRY WITHOUT LOCKING THE WAY DOWN FIRST. IF THAT WORKS, THE PARENT IS ALREADY READER-LOCKED
+    bool traversed = path_vector.size() > 1 && optimistic_traverse(path_vector, false, current_block, user);
     
-    locks[current_block]->lock_shared();
+    if(!traversed) {
+        reader_lock(current_block);
+    }
     
 
     fs_inode main_inode;
@@ -1327,70 +4066,39 @@ int traverse_tree(std::vector<std::string> path_vector, bool write_child, uint32
         std::string parent_name = path_vector.back();
 
 
-        for(uint32_t i = 0; i < path_vector.size(); i++) {
+        for(uint32_t i = traversed ? path_vector.size() : 0; i < path_vector.size(); i++) {
             char main_inode_buf[FS_BLOCKSIZE]; // Buffer to read inode block
             
-            disk_readblock(current_block, main_inode_buf);
+            read_block(current_block, main_inode_buf);
             
             memcpy(&main_inode, main_inode_buf, sizeof(fs_inode)); // Copy from buffer
 
             if(main_inode.type != 'd') {
                 
-                locks[current_block]->unlock_shared();
+                reader_unlock(current_block);
                 
+                metrics_reject(REJECT_WRONG_TYPE);
                 return -1;
             }
 
             if(std::strcmp(user, main_inode.owner) != 0 && current_block != 0) {
         
-                locks[current_block]->unlock_shared();
+                reader_unlock(current_block);
         
+                metrics_reject(REJECT_NOT_OWNER);
                 return -1;
             }
 
-            for(uint32_t j = 0; j < main_inode.size; j++) {
+            block_to_find = lock_direntry(main_inode, path_vector[i], false);
 
-                char dir_block_buf[FS_BLOCKSIZE];
-                memset(dir_block_buf, 0, FS_BLOCKSIZE);
-                
-                disk_readblock(main_inode.blocks[j], dir_block_buf);
-                
-                fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_block_buf);
-
-                for(uint32_t k = 0; k < 8; k++){
-                    if(direntries[k].inode_block != 0){
-                    
-                        if(strcmp(direntries[k].name, path_vector[i].c_str()) == 0) {
-                            block_to_find = direntries[k].inode_block;
-                            found = true;
-                            
-                            locks[block_to_find]->lock_shared();
-
-                            locks[current_block]->unlock_shared();
-                            
-                            break;
-                        }
-
-                    }
-                }
-
-                if(found) {
-                    break;
-                }
-
-            }
+            reader_unlock(current_block);
 
-            if(!found) {
-                
-                locks[current_block]->unlock_shared();
-    
+            if(block_to_find == 0) {
+                metrics_reject(REJECT_NOT_FOUND);
                 return -1;
-            } else {
-
-                current_block = block_to_find;
-                found = false;
-
             }
+
+            current_block = block_to_find;
         }
     }
    
@@ -1399,69 +4107,38 @@ int traverse_tree(std::vector<std::string> path_vector, bool write_child, uint32
     fs_inode parent_inode;
     char parent_inode_buf[FS_BLOCKSIZE]; // Buffer to read inode block
     
-    disk_readblock(parent_block, parent_inode_buf);
+    read_block(parent_block, parent_inode_buf);
     
     memcpy(&parent_inode, parent_inode_buf, sizeof(fs_inode)); // Copy from buffer
 
     if(parent_inode.type != 'd') {
         
-        locks[parent_block]->unlock_shared();
+        reader_unlock(parent_block);
         
+        metrics_reject(REJECT_WRONG_TYPE);
         return -1;
     }
 
     if(std::strcmp(user, parent_inode.owner) != 0 && parent_block != 0) {
         
-        locks[parent_block]->unlock_shared();
+        reader_unlock(parent_block);
 
+        metrics_reject(REJECT_NOT_OWNER);
         return -1;
     }
 
-    for(uint32_t i = 0; i < parent_inode.size; i++) {
-   
-        char dir_block_buf[FS_BLOCKSIZE];
-        memset(dir_block_buf, 0, FS_BLOCKSIZE);
-        
-        disk_readblock(parent_inode.blocks[i], dir_block_buf);
-        
-        fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_block_buf);
-
-        for(uint32_t j = 0; j < 8; j++){
-            if(direntries[j].inode_block != 0){
-               
-                if(strcmp(direntries[j].name, name_to_find.c_str()) == 0) {
-                  
-                    block_to_find = direntries[j].inode_block;
-                    found = true;
-                    
-                    if(write_child) {
-                        locks[block_to_find]->lock();
-                    } else{
-                        locks[block_to_find]->lock_shared();
-                    }
-                    
-                    break;
-                }
-            }
-        }
-
-        if(found) {
-            break;
-        }
-    }
+    block_to_find = lock_direntry(parent_inode, name_to_find, write_child);
 
-    if(!found) {
+    if(block_to_find == 0) {
       
-        locks[current_block]->unlock_shared();
+        reader_unlock(current_block);
       
+        metrics_reject(REJECT_NOT_FOUND);
         return -1;
-    } else {
-
-        child_block = block_to_find;
-        found = false;
-
     }
 
+    child_block = block_to_find;
+
     return 0;
 }
 
@@ -1469,25 +4146,30 @@ int traverse_tree(std::vector<std::string> path_vector, bool write_child, uint32
 -------------------------------------------------
 -> This function is used by handle_create to traverse the file system.
 -> It takes advantage of hand-over-hand locking in order to make sure that
-the parent is writer-locked before returning back to handle_create.
+the parent is locked before returning back to handle_create: writer-locked if write_parent is set,
+and otherwise reader-locked, for the slot-level fast path (see CREATE_IN_SLOT).
 -> It goes through the file system by reading in the inode blocks, reading its direntries,
 and looking for the next file/directory in the path until finding the parent of the file/directory.
 -> The parent block is passed in by reference so the parent can be updated in handle_create.
 -------------------------------------------------*/
 
-int traverse_tree_create(std::vector<std::string> path_vector, uint32_t& parent_block, char user[FS_MAXUSERNAME + 1]) {
+int traverse_tree_create(std::vector<std::string> path_vector, bool write_parent, uint32_t& parent_block, char user[FS_MAXUSERNAME + 1]) {
+
+    phase_timer timer(PHASE_TRAVERSE);
     std::string file_name = path_vector.back();
 
     uint32_t block_to_find = 0;
 
-    bool found = false;
 
     uint32_t current_block = 0;
+
+    //TRY WITHOUT LOCKING THE WAY DOWN FIRST. IF THAT WORKS, THE PARENT IS ALREADY LOCKED
+    bool traversed = path_vector.size() > 1 && optimistic_traverse(path_vector, write_parent, current_block, user);
     
-    if(path_vector.size() == 1) {
-        locks[current_block]->lock();
-    }else {
-        locks[current_block]->lock_shared();
+    if(path_vector.size() == 1 && write_parent) {
+        writer_lock(current_block);
+    }else if(!traversed) {
+        reader_lock(current_block);
     }
 
     fs_inode main_inode;
@@ -1497,75 +4179,41 @@ int traverse_tree_create(std::vector<std::string> path_vector, uint32_t& parent_
 
         std::string parent_name = path_vector.back();
 
-        for(uint32_t i = 0; i < path_vector.size(); i++) {
+        for(uint32_t i = traversed ? path_vector.size() : 0; i < path_vector.size(); i++) {
             char main_inode_buf[FS_BLOCKSIZE]; // Buffer to read inode block
             
-            disk_readblock(current_block, main_inode_buf);
+            read_block(current_block, main_inode_buf);
             
             memcpy(&main_inode, main_inode_buf, sizeof(fs_inode)); // Copy from buffer
 
             if(main_inode.type != 'd') {
                 
-                locks[current_block]->unlock_shared();
+                reader_unlock(current_block);
                 
+                metrics_reject(REJECT_WRONG_TYPE);
                 return -1;
             }  
 
             if(std::strcmp(user, main_inode.owner) != 0 && current_block != 0) {
         
-                locks[current_block]->unlock_shared();
+                reader_unlock(current_block);
         
+                metrics_reject(REJECT_NOT_OWNER);
                 return -1;
             }
 
 
 
-            for(uint32_t j = 0; j < main_inode.size; j++) {
-
-                char dir_block_buf[FS_BLOCKSIZE];
-                memset(dir_block_buf, 0, FS_BLOCKSIZE);
-                
-                disk_readblock(main_inode.blocks[j], dir_block_buf);
-                
-                fs_direntry* direntries = reinterpret_cast<fs_direntry*>(dir_block_buf);
-
-                for(uint32_t k = 0; k < 8; k++){
-                    if(direntries[k].inode_block != 0){
-                    
-                        if(strcmp(direntries[k].name, path_vector[i].c_str()) == 0) {
-                            block_to_find = direntries[k].inode_block;
-                            found = true;
-
-                            if(i == path_vector.size() - 1 ) {
-                                locks[block_to_find]->lock();
-                            }else {
-                                locks[block_to_find]->lock_shared();
-                            }
-                            locks[current_block]->unlock_shared();
-                            
-                            break;
-                        }
-
-                    }
-                }
-
-                if(found) {
-                    break;
-                }
+            block_to_find = lock_direntry(main_inode, path_vector[i], i == path_vector.size() - 1 && write_parent);
 
-            }
+            reader_unlock(current_block);
 
-            if(!found) {
-                
-                locks[current_block]->unlock_shared();
-    
+            if(block_to_find == 0) {
+                metrics_reject(REJECT_NOT_FOUND);
                 return -1;
-            } else {
-
-                current_block = block_to_find;
-                found = false;
-
             }
+
+            current_block = block_to_find;
         }
     }
    
@@ -1,8 +1,19 @@
 
+#pragma once
+
 #include "fs_server.h"
 #include <boost/thread.hpp>
 #include "fs_client.h"
 #include "fs_param.h"
+#include "fs_metrics.h"
+#include "fs_lockprof.h"
+#include "fs_disk.h"
+#include "fs_executor.h"
+#include "fs_lease.h"
+#include "fs_handle.h"
+#include "fs_admission.h"
+#include "fs_trace.h"
+#include "fs_defrag.h"
 #include <iostream>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -13,6 +24,7 @@
 #include <vector>
 #include <string>
 #include <set>
+#include <deque>
 
 
 
@@ -35,8 +47,14 @@ boost::mutex tree_mutex;
 boost::mutex all_names_mutex;
 boost::mutex mutex_map_mutex;*/
 
+//THE BLOCK DEVICE THE FILESYSTEM LIVES ON (LIBFS_SERVER'S IMAGE UNLESS -b SAYS OTHERWISE)
+extern std::unique_ptr<disk_backend> disk_device;
+
 //MUTEX FOR IN-MEMORY DATA STRUCTURES
-boost::mutex ds_mutex;
+extern boost::mutex ds_mutex;
+
+//SERIALIZES RENAMES ACROSS DIRECTORIES (SEE LOCK_RENAME_PARENTS)
+extern boost::mutex rename_mutex;
 
 
 //TODO:
@@ -51,8 +69,60 @@ boost::mutex ds_mutex;
 //std::vector<uint32_t> block_to_inode;
 //std::vector<uint32_t> block_to_direntries;
 
-std::vector<uint32_t> available_disk_blocks;
-std::unordered_map<uint32_t, std::shared_ptr<boost::shared_mutex>> locks;
+extern std::vector<uint32_t> available_disk_blocks;
+
+//Index is the block #, and the value is how many inodes reference it (more than 1 once FS_CLONE shares a data block)
+extern std::vector<uint32_t> block_refcounts;
+
+//SNAPSHOT STATE, PROTECTED BY DS_MUTEX
+//Index is the block #, and the value is the allocation_generation it was last allocated in
+extern std::vector<uint32_t> block_generation;
+extern uint32_t allocation_generation;
+extern bool snapshot_active;
+extern uint32_t snapshot_id;
+extern uint32_t snapshot_generation;
+//The user who took the snapshot, the only one who may delete it
+extern std::string snapshot_owner;
+//Key is a block the snapshot reads, and the value is the block its old contents were copied to
+extern std::unordered_map<uint32_t, uint32_t> snapshot_blocks;
+//Blocks freed since the snapshot that the snapshot still reads in place
+extern std::vector<uint32_t> snapshot_pinned_blocks;
+
+//DEDUP STATE (-d), PROTECTED BY DS_MUTEX
+extern bool dedup_enabled;
+//Key is a fingerprint_block hash, and the value is a data block holding those contents
+extern std::unordered_map<uint64_t, uint32_t> fingerprint_index;
+//Key is an indexed data block, and the value is its fingerprint
+extern std::unordered_map<uint32_t, uint64_t> block_fingerprints;
+
+//REQUEST PIPELINE (-T, -p), SET BY PARSE_LINE
+extern bool thread_per_connection;
+extern unsigned int worker_threads;
+
+//READER-LOCKED BY SNAPSHOT READS, WRITER-LOCKED TO TAKE OR DELETE THE SNAPSHOT
+extern boost::shared_mutex snapshot_mutex;
+
+//Directory scans read this many direntry blocks per batch
+static constexpr uint32_t DIRECTORY_READAHEAD = 8;
+
+//The snapshot is read through "/.snapshot"
+static const std::string SNAPSHOT_DIR_NAME = ".snapshot";
+
+//ONE LOCK PER DISK BLOCK, SO A LOCK OUTLIVES THE INODE THAT USES IT
+extern boost::shared_mutex locks[FS_DISKSIZE];
+
+//HASHED BY (PARENT DIRECTORY, NAME). A SLOT-LEVEL CREATE HOLDS ITS STRIPE FROM THE DUPLICATE CHECK UNTIL ITS DIRENTRY IS WRITTEN
+static constexpr unsigned int NAME_LOCK_STRIPES = 64;
+extern boost::mutex name_locks[NAME_LOCK_STRIPES];
+
+//Returned by create_in_slot and delete_from_slot when the parent has to be writer-locked after all
+static constexpr int NEEDS_PARENT_LOCK = 1;
+
+//Returned by try_rename when it has to wait for leases on what it moves, with nothing locked
+static constexpr int NEEDS_LEASE_WAIT = 2;
+
+//SEQLOCK VERSION OF EACH INODE: ODD WHILE IT IS WRITER-LOCKED, BUMPED ON EVERY WRITER_LOCK AND WRITER_UNLOCK
+extern std::atomic<uint32_t> inode_versions[FS_DISKSIZE];
 
 
 /*struct TreeNode{
@@ -75,25 +145,162 @@ std::unordered_map<uint32_t, std::shared_ptr<boost::shared_mutex>> locks;
 //std::set<std::string> all_names;
 
 
-uint16_t server_port;
-const char* server_hostname;
-sockaddr_in addr{};
+extern uint16_t server_port;
+extern const char* server_hostname;
+extern sockaddr_in addr;
+
+extern std::unordered_map<std::string, std::shared_ptr<boost::shared_mutex>> mutex_map;
+
+/*
+ * A request header split into its fields by parse_request. For FS_WRITEBLOCK,
+ * data points into the message that was parsed, so it must outlive this.
+ */
+struct fs_request {
+    std::string type;
+    std::string username;
+    std::string pathname;
+    std::string new_pathname;  //FS_RENAME and FS_CLONE
+    uint32_t block = 0;        //FS_READBLOCK and FS_WRITEBLOCK (and their _H forms)
+    uint64_t handle = 0;       //FS_READ_H, FS_WRITE_H and FS_CLOSE, in place of pathname
+    char file_type = 0;        //FS_CREATE
+    const char* data = nullptr;
+    size_t data_len = 0;
+    size_t header_len = 0;     //FS_WRITEBLOCK's (or FS_WRITE_H's) header, including the null terminator
+};
+
+/*
+ * Longest request the server will read: an FS_WRITEBLOCK header plus its data.
+ */
+static constexpr size_t MAX_REQUEST_LEN = FS_BLOCKSIZE + 3 + FS_MAXFILENAME + FS_MAXPATHNAME + FS_MAXUSERNAME + 13 + 3;
+
+/*
+ * The first message on a session connection: the client means to send request after
+ * request on it. The server echoes it back (see HANDLE_REQUEST in fs_system.cpp).
+ */
+static const std::string SESSION_REQUEST("FS_SESSION", sizeof("FS_SESSION"));
+
+/*
+ * Opens a tagged session instead: every request is preceded by "FS_TAG <n>",
+ * they are served concurrently, and each response comes back (in whatever
+ * order they finish) after "FS_TAG <n>", or as "FS_FAIL <n>" if the request
+ * failed. See TAGGED_CONNECTION in fs_system.cpp.
+ */
+static const std::string TAGGED_SESSION_REQUEST("FS_SESSION TAGGED", sizeof("FS_SESSION TAGGED"));
+
+//HOW MANY REQUESTS ONE TAGGED SESSION CAN HAVE IN FLIGHT BEFORE THE SERVER STOPS READING MORE
+static constexpr unsigned int MAX_TAGGED_IN_FLIGHT = 64;
+
+/*
+ * Where serve_request sends a response (see RESPONSE_WRITER in fs_system.cpp).
+ */
+struct response_writer {
+    int client_socket = -1;
+    bool blocking = true;
+    bool failed = false;
+    bool responded = false;  //Set by the first send; a request that failed never sends
+    std::string pending;  //What a non-blocking writer couldn't send yet
+
+    void send(const char* buf, size_t len);
+    void send(const char* header, size_t header_len, const char* body, size_t body_len);
+
+private:
+    void send_bytes(const char* buf, size_t len, int flags);
+};
+
+/*
+ * A tagged session's socket, shared by the requests in flight on it. The
+ * socket is closed when the last of them (and the connection's reader and
+ * flusher) let go of it.
+ */
+struct tagged_connection : std::enable_shared_from_this<tagged_connection> {
+    explicit tagged_connection(int socket) : client_socket(socket) {}
+    ~tagged_connection();
+
+    tagged_connection(const tagged_connection&) = delete;
+    tagged_connection& operator=(const tagged_connection&) = delete;
+
+    void send_response(const std::string& response);
+    bool flush();
+    void finish_request();
+
+    int client_socket;
+    boost::mutex send_mutex;
+    bool failed = false;
+
+    //RESPONSES NOT SENT YET, AND WHERE EACH OF THEM ENDS IN IT, GUARDED BY send_mutex
+    std::string outbox;
+    std::deque<size_t> outbox_ends;
+    bool flushing = false;   //The outbox is waiting for room in the socket, on home
+    int write_socket = -1;   //A dup of client_socket, so the flusher has an epoll registration of its own
 
-std::unordered_map<std::string, std::shared_ptr<boost::shared_mutex>> mutex_map;
+    boost::mutex state_mutex;
+    boost::condition_variable slot_freed;
+    unsigned int in_flight = 0;
+    std::coroutine_handle<> parked;   //The reader, if it is waiting for a slot on an executor
+    executor* home = nullptr;
+};
 
 uint16_t parse_line(int argc, char *argv[]);
 
 int init_server(uint16_t port);
+void load_filesystem();
 
 void set_used_blocks(uint32_t block_num, std::set<uint32_t>& used_blocks);
+uint32_t allocate_block();
+bool allocate_run(uint32_t count, uint32_t& first_block);
+void release_block(uint32_t block_num);
+bool snapshot_needs_block(uint32_t block_num);
+void read_block(uint32_t block_num, void* buf);
+void read_blocks(const uint32_t* block_nums, size_t count, char* bufs);
+void write_block(uint32_t block_num, const void* buf);
+void reader_lock(uint32_t block_num);
+void reader_unlock(uint32_t block_num);
+void writer_lock(uint32_t block_num);
+bool writer_try_lock(uint32_t block_num);
+void writer_unlock(uint32_t block_num);
+bool optimistic_traverse(const std::vector<std::string>& path_vector, bool write_parent, uint32_t& parent_block, char user[FS_MAXUSERNAME + 1]);
+uint64_t fingerprint_block(const char* buf);
+void dedup_index(uint32_t block_num, uint64_t fingerprint);
+void dedup_unindex(uint32_t block_num);
+bool dedup_writeblock(uint32_t inode_block, fs_inode& node, uint32_t block, char buf[FS_BLOCKSIZE], uint64_t fingerprint);
 int find_duplicate(fs_inode main, std::string fname);
+void read_directory_blocks(const uint32_t* block_nums, size_t count, char* bufs, uint32_t* versions_out = nullptr);
+uint32_t lock_direntry(const fs_inode& main, const std::string& fname, bool write_child);
+uint32_t find_direntry(fs_inode main, std::string fname, uint32_t* direntry_block = nullptr, uint32_t* direntry_version = nullptr);
 
-std::shared_ptr<char[]> handle_readblock(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], uint32_t block, int &status);
-int handle_writeblock(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], uint32_t block, void* data, size_t data_len);
+std::shared_ptr<const char[]> handle_readblock(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], uint32_t block, int &status, fs_lease* lease = nullptr, bool zero_copy = false);
+std::shared_ptr<const char[]> read_file_block(uint32_t child_block, char username_char[FS_MAXUSERNAME + 1], uint32_t block, int &status, fs_lease* lease, uint64_t epoch, bool zero_copy);
+int handle_writeblock(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], uint32_t block, const void* data, size_t data_len);
+int write_file_block(uint32_t child_block, char username_char[FS_MAXUSERNAME + 1], uint32_t block, const void* data, size_t data_len);
+int handle_open(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], uint64_t& handle);
+std::shared_ptr<const char[]> handle_read_h(char username_char[FS_MAXUSERNAME + 1], uint64_t handle, uint32_t block, int &status, bool zero_copy);
+int handle_write_h(char username_char[FS_MAXUSERNAME + 1], uint64_t handle, uint32_t block, const void* data, size_t data_len);
+int create_in_slot(uint32_t parent_block, const std::string& file_name, const fs_inode& new_inode, char username_char[FS_MAXUSERNAME + 1]);
+int delete_from_slot(uint32_t parent_block, const std::string& file_name, char username_char[FS_MAXUSERNAME + 1]);
 int handle_create(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], char type);
+int create_node(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], fs_inode new_inode);
+int handle_clone(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], char new_pathname_char[FS_MAXFILENAME + 1]);
+int handle_snapshot(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1]);
+int drop_snapshot(const char* username_char);
+void snapshot_readblock(uint32_t block_num, void* buf);
+std::shared_ptr<char[]> handle_snapshot_readblock(char username_char[FS_MAXUSERNAME + 1], std::vector<std::string> path_vector, uint32_t block, int &status);
 int handle_delete(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1]);
+int wait_for_file_leases(std::vector<std::string>& path_vector, char username_char[FS_MAXUSERNAME + 1], uint32_t& leased_block);
+int unlink_path(std::vector<std::string>& path_vector, char username_char[FS_MAXUSERNAME + 1]);
+int handle_rename(char username_char[FS_MAXUSERNAME + 1], char pathname_char[FS_MAXFILENAME + 1], char new_pathname_char[FS_MAXFILENAME + 1]);
+int try_rename(char username_char[FS_MAXUSERNAME + 1], std::vector<std::string>& src_vector, std::vector<std::string>& dst_vector, std::vector<uint32_t>& leased, bool& suspended);
+void collect_leased_files(uint32_t inode_block, std::vector<uint32_t>& leased);
+void unlock_rename_parents(uint32_t src_parent_block, uint32_t dst_parent_block, bool same_parent);
 void handle_request(int client_socket);
+size_t request_length(const std::string& message);
+void serve_request(std::string& message, response_writer& writer);
+bool serve_admitted(std::string& message, response_writer& writer, uint64_t arrived_ns);
+bool parse_tag(const std::string& message);
+std::function<void()> start_tagged_request(std::shared_ptr<tagged_connection> connection, const std::string& tag, std::string message, uint64_t arrived_ns);
+int parse_request(const std::string& message, fs_request& request);
 std::vector<std::string> char_array_to_string_vector(char char_array[FS_MAXFILENAME + 1]);
 int traverse_tree(std::vector<std::string> path_vector, bool write_child, uint32_t& child_block, uint32_t& parent_block, char username_char[FS_MAXUSERNAME + 1]);
-int traverse_tree_create(std::vector<std::string> path_vector, uint32_t& parent_block, char username_char[FS_MAXUSERNAME + 1]);
-int traverse_tree_delete(std::vector<std::string> path_vector, uint32_t& child_block, uint32_t& parent_block,  char username_char[FS_MAXUSERNAME + 1]);
+int traverse_tree_create(std::vector<std::string> path_vector, bool write_parent, uint32_t& parent_block, char username_char[FS_MAXUSERNAME + 1]);
+int traverse_tree_delete(std::vector<std::string> path_vector, bool write_parent, uint32_t& child_block, uint32_t& parent_block,  char username_char[FS_MAXUSERNAME + 1]);
+int lock_rename_parents(std::vector<std::string> src_parent, std::vector<std::string> dst_parent, uint32_t& src_parent_block, uint32_t& dst_parent_block, char username_char[FS_MAXUSERNAME + 1]);
+int descend_tree(uint32_t start_block, std::vector<std::string>& path_vector, size_t begin, size_t end, bool write_last, uint32_t& end_block, char username_char[FS_MAXUSERNAME + 1]);
@@ -0,0 +1,137 @@
+#include "fs_trace.h"
+#include "fs_metrics.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/thread.hpp>
+
+bool trace_enabled = false;
+
+static int trace_fd = -1;
+static uint64_t trace_epoch_ns = 0;
+
+//RECORDS WAITING FOR THE WRITER THREAD
+static boost::mutex trace_mutex;
+static std::condition_variable_any trace_ready;
+static std::string trace_buffer;
+
+static std::atomic<uint64_t> records_written{0};
+static std::atomic<uint64_t> records_dropped{0};
+
+//SET IF THE TRACE FILE CAN'T BE WRITTEN, AFTER WHICH EVERY RECORD IS DROPPED
+static std::atomic<bool> trace_failed{false};
+
+//THE WRITER WAKES FOR THIS MUCH, OR EVERY TRACE_FLUSH_MS, WHICHEVER COMES FIRST
+static constexpr size_t TRACE_FLUSH_BYTES = 64 << 10;
+static constexpr unsigned int TRACE_FLUSH_MS = 100;
+
+
+static bool write_all(const char* buf, size_t len) {
+
+    while(len > 0) {
+        ssize_t written = write(trace_fd, buf, len);
+
+        if(written < 0 && errno == EINTR) {
+            continue;
+        }
+        if(written <= 0) {
+            return false;
+        }
+        buf += written;
+        len -= written;
+    }
+
+    return true;
+}
+
+/*TRACE_WRITER
+-------------------------------------------------
+-> The writer thread: takes whatever has been buffered once there is enough of it (or every
+TRACE_FLUSH_MS, so a quiet server's trace still gets written), and writes it out without
+holding trace_mutex.
+-> Only whole records are ever buffered, so the file stays readable up to its last write.
+-------------------------------------------------*/
+
+static void trace_writer() {
+
+    std::string writing;
+
+    while(true) {
+        boost::unique_lock<boost::mutex> lock(trace_mutex);
+        trace_ready.wait_for(lock, std::chrono::milliseconds(TRACE_FLUSH_MS),
+                             []() { return trace_buffer.size() >= TRACE_FLUSH_BYTES; });
+        writing.swap(trace_buffer);
+        lock.unlock();
+
+        if(!writing.empty() && !write_all(writing.data(), writing.length())) {
+            std::cerr << "fs: can't write the trace file, tracing stopped\n";
+            trace_failed.store(true, std::memory_order_relaxed);
+            return;
+        }
+        writing.clear();
+    }
+}
+
+bool trace_open(const std::string& path) {
+
+    trace_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(trace_fd == -1 || !write_all(TRACE_MAGIC.data(), TRACE_MAGIC.length())) {
+        return false;
+    }
+
+    trace_epoch_ns = metrics_now();
+    trace_enabled = true;
+
+    boost::thread writer(&trace_writer);
+    writer.detach();
+
+    return true;
+}
+
+void trace_request(trace_record& record, uint64_t started_ns) {
+
+    uint64_t now = metrics_now();
+    record.start_ns = started_ns - trace_epoch_ns;
+    record.latency_ns = now - started_ns;
+
+    std::string encoded;
+    encode_trace_record(record, encoded);
+
+    trace_mutex.lock();
+
+    if(trace_buffer.size() + encoded.size() > TRACE_BUFFER_LIMIT ||
+       trace_failed.load(std::memory_order_relaxed)) {
+        trace_mutex.unlock();
+        records_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    trace_buffer += encoded;
+    bool full = trace_buffer.size() >= TRACE_FLUSH_BYTES;
+
+    trace_mutex.unlock();
+
+    records_written.fetch_add(1, std::memory_order_relaxed);
+
+    if(full) {
+        trace_ready.notify_one();
+    }
+}
+
+std::string trace_report() {
+
+    if(trace_fd == -1) {
+        return "";
+    }
+
+    std::ostringstream report;
+    report << "# TYPE fs_trace_records_total counter\n"
+           << "fs_trace_records_total{result=\"written\"} " << records_written.load(std::memory_order_relaxed) << "\n"
+           << "fs_trace_records_total{result=\"dropped\"} " << records_dropped.load(std::memory_order_relaxed) << "\n";
+    return report.str();
+}
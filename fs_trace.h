@@ -0,0 +1,165 @@
+/*
+ * fs_trace.h
+ *
+ * Request traces. With fs -t PATH, the server appends a record of every
+ * request it parses to PATH: what it was, who sent it, when it started, how
+ * long it took and whether it succeeded. fs_replay sends a trace to a
+ * server again, and compares the latencies in two traces (see
+ * fs_replay.cpp).
+ *
+ * The file is TRACE_MAGIC followed by records. Each record is
+ * TRACE_RECORD_FIXED_LEN bytes of fixed fields, then the username, pathname
+ * and new pathname. Integers are in host byte order, so a trace is read on
+ * the same kind of machine that wrote it. A write's data isn't kept.
+ *
+ * Records are written in the order requests finish, so a reader sorts
+ * them by start_ns. A thread of its own writes them out, so a request never
+ * waits on the trace file. If that thread falls TRACE_BUFFER_LIMIT bytes
+ * behind, records are dropped and counted instead (see trace_report).
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+static const std::string TRACE_MAGIC("FSTRACE1", 8);
+
+/*
+ * The requests a trace records, by their names on the wire.
+ */
+enum trace_op : uint8_t {
+    TRACE_READBLOCK, TRACE_READLEASE, TRACE_WRITEBLOCK, TRACE_CREATE, TRACE_DELETE,
+    TRACE_RENAME, TRACE_CLONE, TRACE_SNAPSHOT, TRACE_OPEN, TRACE_READ_H, TRACE_WRITE_H,
+    TRACE_CLOSE, TRACE_OP_COUNT
+};
+
+static const char* const trace_op_names[TRACE_OP_COUNT] = {
+    "FS_READBLOCK", "FS_READLEASE", "FS_WRITEBLOCK", "FS_CREATE", "FS_DELETE",
+    "FS_RENAME", "FS_CLONE", "FS_SNAPSHOT", "FS_OPEN", "FS_READ_H", "FS_WRITE_H",
+    "FS_CLOSE"
+};
+
+inline bool trace_op_from_name(const std::string& name, trace_op& op) {
+
+    for(unsigned int i = 0; i < TRACE_OP_COUNT; i++) {
+        if(name == trace_op_names[i]) {
+            op = static_cast<trace_op>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * One request. start_ns counts from when the trace was opened. handle is
+ * the one FS_OPEN returned, or the one an _H request or FS_CLOSE used.
+ */
+struct trace_record {
+    uint64_t start_ns = 0;
+    uint64_t latency_ns = 0;
+    uint64_t handle = 0;
+    uint32_t block = 0;
+    trace_op op = TRACE_READBLOCK;
+    bool ok = false;
+    char file_type = 0;
+    std::string username;
+    std::string pathname;
+    std::string new_pathname;
+};
+
+static constexpr size_t TRACE_RECORD_FIXED_LEN = 36;
+
+//HOW FAR THE WRITER THREAD CAN FALL BEHIND BEFORE RECORDS ARE DROPPED
+static constexpr size_t TRACE_BUFFER_LIMIT = 16 << 20;
+
+
+inline void encode_trace_record(const trace_record& record, std::string& out) {
+
+    char fixed[TRACE_RECORD_FIXED_LEN];
+    uint8_t op = record.op;
+    uint8_t ok = record.ok;
+    uint8_t user_len = record.username.length();
+    uint16_t path_len = record.pathname.length();
+    uint16_t new_path_len = record.new_pathname.length();
+
+    memcpy(fixed, &record.start_ns, 8);
+    memcpy(fixed + 8, &record.latency_ns, 8);
+    memcpy(fixed + 16, &record.handle, 8);
+    memcpy(fixed + 24, &record.block, 4);
+    memcpy(fixed + 28, &op, 1);
+    memcpy(fixed + 29, &ok, 1);
+    memcpy(fixed + 30, &record.file_type, 1);
+    memcpy(fixed + 31, &user_len, 1);
+    memcpy(fixed + 32, &path_len, 2);
+    memcpy(fixed + 34, &new_path_len, 2);
+
+    out.append(fixed, TRACE_RECORD_FIXED_LEN);
+    out.append(record.username, 0, user_len);
+    out.append(record.pathname, 0, path_len);
+    out.append(record.new_pathname, 0, new_path_len);
+}
+
+/*
+ * Decodes the record at *next, and moves *next past it. Returns false,
+ * leaving *next alone, if the record is cut off before end or malformed.
+ */
+inline bool decode_trace_record(const char** next, const char* end, trace_record& record) {
+
+    const char* at = *next;
+    if(end - at < static_cast<ptrdiff_t>(TRACE_RECORD_FIXED_LEN)) {
+        return false;
+    }
+
+    uint8_t op, ok, user_len;
+    uint16_t path_len, new_path_len;
+
+    memcpy(&record.start_ns, at, 8);
+    memcpy(&record.latency_ns, at + 8, 8);
+    memcpy(&record.handle, at + 16, 8);
+    memcpy(&record.block, at + 24, 4);
+    memcpy(&op, at + 28, 1);
+    memcpy(&ok, at + 29, 1);
+    memcpy(&record.file_type, at + 30, 1);
+    memcpy(&user_len, at + 31, 1);
+    memcpy(&path_len, at + 32, 2);
+    memcpy(&new_path_len, at + 34, 2);
+    at += TRACE_RECORD_FIXED_LEN;
+
+    if(op >= TRACE_OP_COUNT || end - at < user_len + path_len + new_path_len) {
+        return false;
+    }
+
+    record.op = static_cast<trace_op>(op);
+    record.ok = ok != 0;
+    record.username.assign(at, user_len);
+    record.pathname.assign(at + user_len, path_len);
+    record.new_pathname.assign(at + user_len + path_len, new_path_len);
+
+    *next = at + user_len + path_len + new_path_len;
+    return true;
+}
+
+
+//SET ONCE TRACE_OPEN SUCCEEDS
+extern bool trace_enabled;
+
+/*
+ * Starts tracing to path (fs -t), which is created or truncated. Returns
+ * false if it can't be opened.
+ */
+bool trace_open(const std::string& path);
+
+/*
+ * Records a request that started at started_ns (metrics_now) and just
+ * finished.
+ */
+void trace_request(trace_record& record, uint64_t started_ns);
+
+/*
+ * How many records were written and dropped, for FS_STATS. Empty when not
+ * tracing.
+ */
+std::string trace_report();
@@ -0,0 +1,372 @@
+#include "fs_disk.h"
+#include "fs_server.h"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+//THE SUBMISSION AND COMPLETION RINGS SHARED WITH THE KERNEL, AND WHO IS USING THEM
+struct uring_ring {
+    int ring_fd = -1;
+    unsigned int entries = 0;
+
+    void* sq_map = nullptr;
+    size_t sq_map_len = 0;
+    void* cq_map = nullptr;
+    size_t cq_map_len = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_len = 0;
+
+    unsigned int* sq_tail = nullptr;
+    unsigned int* sq_mask = nullptr;
+    unsigned int* sq_array = nullptr;
+    unsigned int* cq_head = nullptr;
+    unsigned int* cq_tail = nullptr;
+    unsigned int* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    //PROTECTED BY SQ_MUTEX
+    boost::mutex sq_mutex;
+    boost::condition_variable space_cond;
+    unsigned int queued = 0;     //On the ring, not yet handed to the kernel
+    unsigned int in_flight = 0;  //Handed to the kernel, not yet reaped
+    bool submitting = false;
+};
+
+//The I/Os one caller is waiting on
+struct uring_disk::io_batch {
+    boost::mutex mutex;
+    boost::condition_variable done_cond;
+    size_t remaining = 0;
+    bool failed = false;
+};
+
+static int uring_setup(unsigned int entries, io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+
+/*SUBMIT_QUEUED
+-------------------------------------------------
+-> Hands everything queued on the ring to the kernel. Only one thread submits at a time;
+anyone who queues I/O while a submit is in progress leaves it for that thread, which keeps
+going until the queue is empty. That is what batches I/O from many threads into few calls.
+-> Must be called with sq_mutex held (through lock), which it drops while in the kernel.
+-------------------------------------------------*/
+
+static void submit_queued(uring_ring& ring, boost::unique_lock<boost::mutex>& lock) {
+
+    if (ring.submitting) {
+        return;
+    }
+
+    ring.submitting = true;
+
+    while (ring.queued > 0) {
+        unsigned int to_submit = ring.queued;
+
+        lock.unlock();
+        int submitted = uring_enter(ring.ring_fd, to_submit, 0, 0);
+        int error = errno;
+        lock.lock();
+
+        if (submitted > 0) {
+            ring.queued -= submitted;
+            ring.in_flight += submitted;
+        } else if (submitted < 0 && error != EINTR && error != EAGAIN && error != EBUSY) {
+            std::cerr << "fs: io_uring_enter failed: " << strerror(error) << "\n";
+            abort();
+        } else if (submitted < 0 && error != EINTR) { //OUT OF KERNEL RESOURCES, LET SOME I/O FINISH
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            lock.lock();
+        }
+    }
+
+    ring.submitting = false;
+}
+
+//Puts one I/O on the submission ring. sq_mutex must be held and the ring must have room.
+static void queue_io(uring_ring& ring, uint8_t opcode, int fd, char* buf, uint64_t offset, void* user_data) {
+
+    unsigned int tail = *ring.sq_tail;
+    unsigned int index = tail & *ring.sq_mask;
+
+    io_uring_sqe* sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = opcode == IORING_OP_NOP ? 0 : FS_BLOCKSIZE;
+    sqe->off = offset;
+    sqe->user_data = reinterpret_cast<uint64_t>(user_data);
+
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring.queued++;
+}
+
+
+uring_disk::uring_disk(const std::string& path, unsigned int entries) : ring(new uring_ring()) {
+
+    fd = open_disk_image(path, O_DSYNC);
+    if (fd == -1) {
+        return;
+    }
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 2;
+
+    ring->ring_fd = uring_setup(entries, &params);
+    if (ring->ring_fd == -1) {
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    ring->sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+
+    ring->sq_map = mmap(nullptr, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->ring_fd, IORING_OFF_SQ_RING);
+    ring->cq_map = mmap(nullptr, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->ring_fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(nullptr, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd, IORING_OFF_SQES);
+
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ring->ring_fd);
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    char* sq = static_cast<char*>(ring->sq_map);
+    char* cq = static_cast<char*>(ring->cq_map);
+
+    ring->sqes = static_cast<io_uring_sqe*>(sqes);
+    ring->sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+    ring->sq_mask = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+    ring->sq_array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+    ring->cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+    ring->cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+    ring->cq_mask = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    reaper = boost::thread(&uring_disk::reap, this);
+}
+
+//A NOP with no batch tells the reaper to stop
+uring_disk::~uring_disk() {
+
+    if (fd == -1) {
+        return;
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(ring->sq_mutex);
+        while (ring->in_flight + ring->queued >= ring->entries) {
+            ring->space_cond.wait(lock);
+        }
+        queue_io(*ring, IORING_OP_NOP, -1, nullptr, 0, nullptr);
+        submit_queued(*ring, lock);
+    }
+
+    reaper.join();
+
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->cq_map, ring->cq_map_len);
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->ring_fd);
+    close(fd);
+}
+
+bool uring_disk::is_open() const {
+    return fd != -1;
+}
+
+
+/*REAP
+-------------------------------------------------
+-> Runs on its own thread for the life of the backend. Waits for completions, counts each
+one against its batch (waking the batch's thread when it is done) and gives the ring
+space back to threads waiting to queue more.
+-------------------------------------------------*/
+
+void uring_disk::reap() {
+
+    bool stopping = false;
+
+    while (!stopping) {
+
+        if (uring_enter(ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            std::cerr << "fs: io_uring_enter failed: " << strerror(errno) << "\n";
+            abort();
+        }
+
+        unsigned int head = *ring->cq_head;
+        unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        unsigned int reaped = 0;
+
+        while (head != tail) {
+            io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            io_batch* batch = reinterpret_cast<io_batch*>(cqe->user_data);
+
+            if (batch == nullptr) {
+                stopping = true;
+            } else {
+                boost::lock_guard<boost::mutex> batch_lock(batch->mutex);
+                if (cqe->res != FS_BLOCKSIZE) {
+                    batch->failed = true;
+                }
+                if (--batch->remaining == 0) {
+                    batch->done_cond.notify_all();
+                }
+            }
+
+            head++;
+            reaped++;
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (reaped > 0) {
+            boost::lock_guard<boost::mutex> lock(ring->sq_mutex);
+            ring->in_flight -= reaped;
+            ring->space_cond.notify_all();
+        }
+    }
+}
+
+
+/*SUBMIT_AND_WAIT
+-------------------------------------------------
+-> Queues count block reads or writes (block_nums[i] to or from bufs + i * FS_BLOCKSIZE),
+submits them, and blocks until all of them have completed.
+-> If the ring is full, what has been queued so far is submitted and the caller waits for room.
+-> An I/O that fails or comes up short is redone synchronously, so callers see the same
+all-or-nothing blocks as the other backends.
+-------------------------------------------------*/
+
+void uring_disk::submit_and_wait(const uint32_t* block_nums, size_t count, char* bufs, bool is_write) {
+
+    if (count == 0) {
+        return;
+    }
+
+    io_batch batch;
+    batch.remaining = count;
+
+    {
+        boost::unique_lock<boost::mutex> lock(ring->sq_mutex);
+
+        for (size_t i = 0; i < count; i++) {
+
+            while (ring->in_flight + ring->queued >= ring->entries) {
+                submit_queued(*ring, lock);
+                if (ring->in_flight + ring->queued >= ring->entries) {
+                    ring->space_cond.wait(lock);
+                }
+            }
+
+            queue_io(*ring, is_write ? IORING_OP_WRITE : IORING_OP_READ, fd, bufs + i * FS_BLOCKSIZE,
+                     static_cast<uint64_t>(block_nums[i]) * FS_BLOCKSIZE, &batch);
+        }
+
+        submit_queued(*ring, lock);
+    }
+
+    bool failed = false;
+    {
+        boost::unique_lock<boost::mutex> batch_lock(batch.mutex);
+        while (batch.remaining > 0) {
+            batch.done_cond.wait(batch_lock);
+        }
+        failed = batch.failed;
+    }
+
+    if (failed) {
+        for (size_t i = 0; i < count; i++) {
+            off_t offset = static_cast<off_t>(block_nums[i]) * FS_BLOCKSIZE;
+            if (is_write) {
+                (void)pwrite(fd, bufs + i * FS_BLOCKSIZE, FS_BLOCKSIZE, offset);
+            } else if (pread(fd, bufs + i * FS_BLOCKSIZE, FS_BLOCKSIZE, offset) != FS_BLOCKSIZE) {
+                memset(bufs + i * FS_BLOCKSIZE, 0, FS_BLOCKSIZE);
+            }
+        }
+    }
+}
+
+void uring_disk::read(uint32_t block_num, void* buf) {
+    submit_and_wait(&block_num, 1, static_cast<char*>(buf), false);
+}
+
+//THE KERNEL ONLY READS FROM buf FOR A WRITE, THE CAST IS JUST TO SHARE SUBMIT_AND_WAIT
+void uring_disk::write(uint32_t block_num, const void* buf) {
+    submit_and_wait(&block_num, 1, static_cast<char*>(const_cast<void*>(buf)), true);
+}
+
+void uring_disk::read_batch(const uint32_t* block_nums, size_t count, char* bufs) {
+    submit_and_wait(block_nums, count, bufs, false);
+}
+
+void uring_disk::write_batch(const uint32_t* block_nums, size_t count, const char* bufs) {
+    submit_and_wait(block_nums, count, const_cast<char*>(bufs), true);
+}
+
+#else //NO IO_URING OFF LINUX, MAKE_DISK_BACKEND REPORTS THE BACKEND AS UNUSABLE
+
+struct uring_ring {
+};
+
+struct uring_disk::io_batch {
+};
+
+uring_disk::uring_disk(const std::string& path, unsigned int entries) {
+}
+
+uring_disk::~uring_disk() {
+}
+
+bool uring_disk::is_open() const {
+    return false;
+}
+
+void uring_disk::read(uint32_t block_num, void* buf) {
+    memset(buf, 0, FS_BLOCKSIZE);
+}
+
+void uring_disk::write(uint32_t block_num, const void* buf) {
+}
+
+void uring_disk::read_batch(const uint32_t* block_nums, size_t count, char* bufs) {
+    memset(bufs, 0, count * FS_BLOCKSIZE);
+}
+
+void uring_disk::write_batch(const uint32_t* block_nums, size_t count, const char* bufs) {
+}
+
+void uring_disk::submit_and_wait(const uint32_t* block_nums, size_t count, char* bufs, bool is_write) {
+}
+
+void uring_disk::reap() {
+}
+
+#endif
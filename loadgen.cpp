@@ -0,0 +1,392 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <unistd.h>
+#include "fs_client.h"
+#include "fs_metrics.h"
+
+/*
+ * loadgen
+ *
+ * Drives the file server from many threads through the fs_client.h API and
+ * reports throughput and latency percentiles.
+ *
+ * Closed loop (the default): every thread sends its next request as soon as
+ * the last one returns. Open loop (-r): requests are scheduled at a fixed
+ * total rate, and latency is measured from when a request was due, so a
+ * server that falls behind shows up in the percentiles.
+ */
+
+static const char* USER = "loadgen";
+static const char* ROOT_DIR = "/loadgen";
+
+enum load_op {
+    LOAD_READ, LOAD_WRITE, LOAD_CREATE, LOAD_DELETE, LOAD_OP_COUNT
+};
+
+static const char* load_op_names[LOAD_OP_COUNT] = { "read", "write", "create", "delete" };
+
+struct load_config {
+    const char* server = nullptr;
+    uint16_t port = 0;
+    std::vector<unsigned int> thread_counts = {4};
+    double seconds = 5;
+    unsigned int mix[LOAD_OP_COUNT] = {70, 20, 5, 5};
+    unsigned int depth = 2;
+    unsigned int fanout = 4;
+    unsigned int files_per_dir = 4;
+    unsigned int file_blocks = 4;
+    double rate = 0; //Total requests per second, 0 for closed loop
+    unsigned int cache_blocks = 0; //Client block cache size, 0 for none
+};
+
+//What one thread saw during one run
+struct thread_result {
+    uint64_t ops[LOAD_OP_COUNT] = {};
+    uint64_t errors[LOAD_OP_COUNT] = {};
+};
+
+static latency_histogram* op_latency[LOAD_OP_COUNT];
+static latency_histogram* all_latency;
+
+
+/*USAGE
+-------------------------------------------------
+-> Prints the options and exits.
+-------------------------------------------------*/
+
+static void usage(const char* name) {
+
+    std::cout << "usage: " << name << " [options] <server> <serverPort>\n"
+              << "  -t threads   thread count, or a comma separated sweep like 1,2,4,8 (default 4)\n"
+              << "  -s seconds   length of each run (default 5)\n"
+              << "  -m r:w:c:d   op mix weights for read, write, create, delete (default 70:20:5:5)\n"
+              << "  -p depth     directory levels under " << ROOT_DIR << " (default 2)\n"
+              << "  -f fanout    subdirectories per directory (default 4)\n"
+              << "  -n files     files in each leaf directory (default 4)\n"
+              << "  -b blocks    blocks in each file (default 4)\n"
+              << "  -r rate      open loop at this many requests per second in total (default closed loop)\n"
+              << "  -c blocks    turn on the client block cache with room for this many blocks (default off)\n";
+    exit(1);
+}
+
+static std::vector<unsigned int> parse_list(const char* text, char separator) {
+
+    std::vector<unsigned int> values;
+    std::string item;
+
+    for (const char* c = text; ; c++) {
+        if (*c == separator || *c == '\0') {
+            values.push_back(std::strtoul(item.c_str(), nullptr, 10));
+            item.clear();
+            if (*c == '\0') {
+                break;
+            }
+        } else {
+            item += *c;
+        }
+    }
+
+    return values;
+}
+
+static load_config parse_args(int argc, char* argv[]) {
+
+    load_config config;
+    int option;
+
+    while ((option = getopt(argc, argv, "t:s:m:p:f:n:b:r:c:")) != -1) {
+        switch (option) {
+            case 't': config.thread_counts = parse_list(optarg, ','); break;
+            case 's': config.seconds = std::atof(optarg); break;
+            case 'm': {
+                std::vector<unsigned int> mix = parse_list(optarg, ':');
+                if (mix.size() != LOAD_OP_COUNT) {
+                    usage(argv[0]);
+                }
+                std::copy(mix.begin(), mix.end(), config.mix);
+                break;
+            }
+            case 'p': config.depth = std::atoi(optarg); break;
+            case 'f': config.fanout = std::atoi(optarg); break;
+            case 'n': config.files_per_dir = std::atoi(optarg); break;
+            case 'b': config.file_blocks = std::atoi(optarg); break;
+            case 'r': config.rate = std::atof(optarg); break;
+            case 'c': config.cache_blocks = std::atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2 || config.fanout == 0 || config.files_per_dir == 0 || config.file_blocks == 0 ||
+        config.file_blocks > FS_MAXFILEBLOCKS) {
+        usage(argv[0]);
+    }
+
+    unsigned int total_weight = 0;
+    for (unsigned int op = 0; op < LOAD_OP_COUNT; op++) {
+        total_weight += config.mix[op];
+    }
+    for (unsigned int threads : config.thread_counts) {
+        if (threads == 0) {
+            usage(argv[0]);
+        }
+    }
+    if (total_weight == 0) {
+        usage(argv[0]);
+    }
+
+    config.server = argv[optind];
+    config.port = std::atoi(argv[optind + 1]);
+
+    return config;
+}
+
+
+/*BUILD_TREE
+-------------------------------------------------
+-> Creates depth levels of fanout directories under ROOT_DIR, and files_per_dir files of
+file_blocks blocks in every leaf directory. Returns the leaf directories, and the files in files.
+-> Anything left over from an earlier run is reused, so creates that fail are fine as long as
+the files end up with enough blocks to read and write.
+-------------------------------------------------*/
+
+static std::vector<std::string> build_tree(const load_config& config, std::vector<std::string>& files) {
+
+    std::vector<std::string> level = {ROOT_DIR};
+    fs_create(USER, ROOT_DIR, 'd');
+
+    for (unsigned int d = 0; d < config.depth; d++) {
+        std::vector<std::string> next;
+        for (const std::string& parent : level) {
+            for (unsigned int i = 0; i < config.fanout; i++) {
+                std::string dir = parent + "/d" + std::to_string(i);
+                fs_create(USER, dir.c_str(), 'd');
+                next.push_back(dir);
+            }
+        }
+        level = next;
+    }
+
+    char block[FS_BLOCKSIZE];
+    memset(block, 'l', FS_BLOCKSIZE);
+
+    for (const std::string& dir : level) {
+        for (unsigned int i = 0; i < config.files_per_dir; i++) {
+            std::string file = dir + "/f" + std::to_string(i);
+            fs_create(USER, file.c_str(), 'f');
+
+            for (unsigned int b = 0; b < config.file_blocks; b++) {
+                if (fs_writeblock(USER, file.c_str(), b, block) == -1) {
+                    std::cerr << "error: couldn't write block " << b << " of " << file << "\n";
+                    exit(1);
+                }
+            }
+            files.push_back(file);
+        }
+    }
+
+    return level;
+}
+
+
+/*RUN_THREAD
+-------------------------------------------------
+-> Picks ops by the mix weights until deadline. Reads and writes go to a random block of a
+random tree file. Creates make a new file in a random leaf directory, and deletes remove one
+of the files this thread created (a delete with nothing to delete becomes a create).
+-> In open loop mode, this thread's share of the rate is issued on a fixed schedule and each
+latency is measured from when the request was due.
+-> Files this thread created are cleaned up afterwards, outside the timed section.
+-------------------------------------------------*/
+
+static void run_thread(const load_config& config, unsigned int threads, unsigned int id, unsigned int run,
+                       const std::vector<std::string>& leaves, const std::vector<std::string>& files,
+                       std::chrono::steady_clock::time_point deadline, thread_result& result) {
+
+    std::mt19937_64 random(std::random_device{}() ^ (static_cast<uint64_t>(id) << 32));
+
+    unsigned int total_weight = 0;
+    for (unsigned int op = 0; op < LOAD_OP_COUNT; op++) {
+        total_weight += config.mix[op];
+    }
+
+    char block[FS_BLOCKSIZE];
+    memset(block, 'a' + id % 26, FS_BLOCKSIZE);
+
+    std::vector<std::string> created;
+    uint64_t created_count = 0;
+    std::string name_prefix = "/t" + std::to_string(getpid()) + "_" + std::to_string(run) + "_" + std::to_string(id) + "_";
+
+    std::chrono::nanoseconds interval(0);
+    if (config.rate > 0) {
+        interval = std::chrono::nanoseconds(static_cast<uint64_t>(1e9 * threads / config.rate));
+    }
+    std::chrono::steady_clock::time_point due = std::chrono::steady_clock::now();
+
+    while (true) {
+
+        if (config.rate > 0) {
+            std::this_thread::sleep_until(due);
+        } else {
+            due = std::chrono::steady_clock::now();
+        }
+
+        if (due >= deadline) {
+            break;
+        }
+
+        unsigned int pick = random() % total_weight;
+        unsigned int op = 0;
+        while (pick >= config.mix[op]) {
+            pick -= config.mix[op];
+            op++;
+        }
+
+        if (op == LOAD_DELETE && created.empty()) {
+            op = LOAD_CREATE;
+        }
+
+        int status = 0;
+
+        if (op == LOAD_READ || op == LOAD_WRITE) {
+            const std::string& file = files[random() % files.size()];
+            unsigned int offset = random() % config.file_blocks;
+
+            if (op == LOAD_READ) {
+                status = fs_readblock(USER, file.c_str(), offset, block);
+            } else {
+                status = fs_writeblock(USER, file.c_str(), offset, block);
+            }
+        } else if (op == LOAD_CREATE) {
+            std::string file = leaves[random() % leaves.size()] + name_prefix + std::to_string(created_count++);
+            status = fs_create(USER, file.c_str(), 'f');
+            if (status == 0) {
+                created.push_back(file);
+            }
+        } else {
+            size_t victim = random() % created.size();
+            status = fs_delete(USER, created[victim].c_str());
+            created[victim] = created.back();
+            created.pop_back();
+        }
+
+        uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - due).count();
+
+        op_latency[op]->record(latency);
+        all_latency->record(latency);
+        result.ops[op]++;
+        if (status != 0) {
+            result.errors[op]++;
+        }
+
+        due += interval;
+    }
+
+    for (const std::string& file : created) {
+        fs_delete(USER, file.c_str());
+    }
+}
+
+
+/*RUN_LOAD
+-------------------------------------------------
+-> One timed run with the given number of threads. Prints throughput and percentiles for all
+ops together, then for each op that ran.
+-------------------------------------------------*/
+
+static void run_load(const load_config& config, unsigned int threads, unsigned int run,
+                     const std::vector<std::string>& leaves, const std::vector<std::string>& files) {
+
+    for (unsigned int op = 0; op < LOAD_OP_COUNT; op++) {
+        op_latency[op] = new latency_histogram();
+    }
+    all_latency = new latency_histogram();
+
+    std::vector<thread_result> results(threads);
+    std::vector<std::thread> workers;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point deadline =
+        start + std::chrono::nanoseconds(static_cast<uint64_t>(config.seconds * 1e9));
+
+    for (unsigned int id = 0; id < threads; id++) {
+        workers.emplace_back(run_thread, std::cref(config), threads, id, run, std::cref(leaves), std::cref(files),
+                             deadline, std::ref(results[id]));
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    double seconds = config.seconds;
+
+    auto print_row = [&](const char* name, const latency_histogram& histogram, uint64_t errors) {
+        std::cout << std::left << std::setw(8) << threads << std::setw(8) << name << std::right
+                  << std::setw(10) << histogram.count()
+                  << std::setw(8) << errors
+                  << std::setw(12) << std::fixed << std::setprecision(1) << histogram.count() / seconds
+                  << std::setw(10) << histogram.percentile(0.5) / 1000
+                  << std::setw(10) << histogram.percentile(0.99) / 1000
+                  << std::setw(10) << histogram.percentile(0.999) / 1000
+                  << std::setw(10) << histogram.max() / 1000 << "\n";
+    };
+
+    uint64_t total_errors = 0;
+    uint64_t op_errors[LOAD_OP_COUNT] = {};
+    for (const thread_result& result : results) {
+        for (unsigned int op = 0; op < LOAD_OP_COUNT; op++) {
+            op_errors[op] += result.errors[op];
+            total_errors += result.errors[op];
+        }
+    }
+
+    print_row("all", *all_latency, total_errors);
+    for (unsigned int op = 0; op < LOAD_OP_COUNT; op++) {
+        if (op_latency[op]->count() > 0) {
+            print_row(load_op_names[op], *op_latency[op], op_errors[op]);
+        }
+    }
+
+    for (unsigned int op = 0; op < LOAD_OP_COUNT; op++) {
+        delete op_latency[op];
+    }
+    delete all_latency;
+}
+
+
+int main(int argc, char* argv[]) {
+
+    load_config config = parse_args(argc, argv);
+
+    if (fs_clientinit(config.server, config.port) == -1) {
+        std::cerr << "error: couldn't initialize the client library\n";
+        exit(1);
+    }
+
+    fs_clientcache(config.cache_blocks);
+
+    std::vector<std::string> files;
+    std::vector<std::string> leaves = build_tree(config, files);
+
+    std::cout << "# " << files.size() << " files of " << config.file_blocks << " blocks in " << leaves.size()
+              << " leaf directories, mix r:w:c:d " << config.mix[0] << ":" << config.mix[1] << ":"
+              << config.mix[2] << ":" << config.mix[3] << ", "
+              << (config.rate > 0 ? "open loop at " + std::to_string(config.rate) + " req/s" : std::string("closed loop"))
+              << ", " << config.seconds << "s per run\n";
+    std::cout << std::left << std::setw(8) << "threads" << std::setw(8) << "op" << std::right
+              << std::setw(10) << "ops" << std::setw(8) << "errors" << std::setw(12) << "ops/s"
+              << std::setw(10) << "p50_us" << std::setw(10) << "p99_us" << std::setw(10) << "p999_us"
+              << std::setw(10) << "max_us" << "\n";
+
+    for (unsigned int run = 0; run < config.thread_counts.size(); run++) {
+        run_load(config, config.thread_counts[run], run, leaves, files);
+    }
+
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include <iostream>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include "fs_client.h"
+
+int main(int argc, char* argv[]) {
+    //Test fs_clone: a clone reads the same, and writes to either file don't show in the other
+    char* server;
+    int server_port;
+
+    char writedata[FS_BLOCKSIZE];
+    char readdata[FS_BLOCKSIZE];
+    int status = -2;
+
+    if (argc != 3) {
+        std::cout << "error: usage: " << argv[0] << " <server> <serverPort>\n";
+        exit(1);
+    }
+    server = argv[1];
+    server_port = atoi(argv[2]);
+
+    fs_clientinit(server, server_port);
+
+    status = fs_create("user1", "/clonedir", 'd');
+    assert(!status);
+
+    status = fs_create("user1", "/clonedir/file", 'f');
+    assert(!status);
+
+    memset(writedata, 'a', FS_BLOCKSIZE);
+    status = fs_writeblock("user1", "/clonedir/file", 0, writedata);
+    assert(!status);
+
+    memset(writedata, 'b', FS_BLOCKSIZE);
+    status = fs_writeblock("user1", "/clonedir/file", 1, writedata);
+    assert(!status);
+
+    status = fs_clone("user1", "/clonedir/file", "/clonedir/copy");
+    assert(!status);
+
+    status = fs_readblock("user1", "/clonedir/copy", 0, readdata);
+    assert(!status && readdata[0] == 'a' && readdata[FS_BLOCKSIZE - 1] == 'a');
+
+    status = fs_readblock("user1", "/clonedir/copy", 1, readdata);
+    assert(!status && readdata[0] == 'b');
+
+    //Writing to the clone leaves the original alone, and the other way round
+    memset(writedata, 'c', FS_BLOCKSIZE);
+    status = fs_writeblock("user1", "/clonedir/copy", 0, writedata);
+    assert(!status);
+
+    status = fs_readblock("user1", "/clonedir/file", 0, readdata);
+    assert(!status && readdata[0] == 'a');
+
+    memset(writedata, 'd', FS_BLOCKSIZE);
+    status = fs_writeblock("user1", "/clonedir/file", 1, writedata);
+    assert(!status);
+
+    status = fs_readblock("user1", "/clonedir/copy", 1, readdata);
+    assert(!status && readdata[0] == 'b');
+
+    //The clone grows on its own
+    memset(writedata, 'e', FS_BLOCKSIZE);
+    status = fs_writeblock("user1", "/clonedir/copy", 2, writedata);
+    assert(!status);
+
+    status = fs_readblock("user1", "/clonedir/file", 2, readdata);
+    assert(status == -1);
+
+    //Deleting the original doesn't take the shared blocks with it
+    status = fs_delete("user1", "/clonedir/file");
+    assert(!status);
+
+    status = fs_readblock("user1", "/clonedir/copy", 1, readdata);
+    assert(!status && readdata[0] == 'b');
+
+    //Only an existing file of ours can be cloned, and only to a new name
+    status = fs_clone("user1", "/clonedir", "/clonedir2");
+    assert(status == -1);
+
+    status = fs_clone("user1", "/clonedir/file", "/clonedir/again");
+    assert(status == -1);
+
+    status = fs_create("user1", "/clonedir/taken", 'f');
+    assert(!status);
+
+    status = fs_clone("user1", "/clonedir/copy", "/clonedir/taken");
+    assert(status == -1);
+
+    status = fs_clone("user2", "/clonedir/copy", "/copy");
+    assert(status == -1);
+
+    status = fs_delete("user1", "/clonedir/taken");
+    assert(!status);
+
+    status = fs_delete("user1", "/clonedir/copy");
+    assert(!status);
+
+    status = fs_delete("user1", "/clonedir");
+    assert(!status);
+
+    std::cout << "testclone passed" << std::endl;
+}
@@ -0,0 +1,90 @@
+#include <iostream>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "fs_client.h"
+
+//More blocks than the whole disk holds, if each took one of its own
+static const int FILES = 40;
+
+int main(int argc, char* argv[]) {
+    //Test dedup mode (run against "fs -d"): identical blocks share storage, and writes to one copy stay private
+    char* server;
+    int server_port;
+
+    char writedata[FS_BLOCKSIZE];
+    char readdata[FS_BLOCKSIZE];
+    int status = -2;
+
+    if (argc != 3) {
+        std::cout << "error: usage: " << argv[0] << " <server> <serverPort>\n";
+        exit(1);
+    }
+    server = argv[1];
+    server_port = atoi(argv[2]);
+
+    fs_clientinit(server, server_port);
+
+    status = fs_create("user1", "/dedupdir", 'd');
+    assert(!status);
+
+    memset(writedata, 's', FS_BLOCKSIZE);
+
+    for (int i = 0; i < FILES; i++) {
+        std::string path = "/dedupdir/file" + std::to_string(i);
+
+        status = fs_create("user1", path.c_str(), 'f');
+        assert(!status);
+
+        for (unsigned int block = 0; block < FS_MAXFILEBLOCKS; block++) {
+            status = fs_writeblock("user1", path.c_str(), block, writedata);
+            assert(!status);
+        }
+    }
+
+    //Overwriting one shared block changes only that file
+    memset(writedata, 'u', FS_BLOCKSIZE);
+    status = fs_writeblock("user1", "/dedupdir/file0", 5, writedata);
+    assert(!status);
+
+    status = fs_readblock("user1", "/dedupdir/file0", 5, readdata);
+    assert(!status && readdata[0] == 'u');
+
+    status = fs_readblock("user1", "/dedupdir/file1", 5, readdata);
+    assert(!status && readdata[0] == 's' && readdata[FS_BLOCKSIZE - 1] == 's');
+
+    status = fs_readblock("user1", "/dedupdir/file0", 6, readdata);
+    assert(!status && readdata[0] == 's');
+
+    //A block that matches one in another file after all is shared again
+    memset(writedata, 's', FS_BLOCKSIZE);
+    status = fs_writeblock("user1", "/dedupdir/file0", 5, writedata);
+    assert(!status);
+
+    status = fs_readblock("user1", "/dedupdir/file0", 5, readdata);
+    assert(!status && readdata[0] == 's');
+
+    //Blocks that differ only in their last byte aren't mistaken for each other
+    writedata[FS_BLOCKSIZE - 1] = 'v';
+    status = fs_writeblock("user1", "/dedupdir/file1", 0, writedata);
+    assert(!status);
+
+    status = fs_readblock("user1", "/dedupdir/file1", 0, readdata);
+    assert(!status && readdata[FS_BLOCKSIZE - 1] == 'v');
+
+    status = fs_readblock("user1", "/dedupdir/file2", 0, readdata);
+    assert(!status && readdata[FS_BLOCKSIZE - 1] == 's');
+
+    for (int i = 0; i < FILES; i++) {
+        std::string path = "/dedupdir/file" + std::to_string(i);
+
+        status = fs_delete("user1", path.c_str());
+        assert(!status);
+    }
+
+    status = fs_delete("user1", "/dedupdir");
+    assert(!status);
+
+    std::cout << "testdedup passed" << std::endl;
+}
@@ -0,0 +1,158 @@
+#include <iostream>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "fs_client.h"
+#include "fs_handle.h"
+
+int main(int argc, char* argv[]) {
+    //Test fs_open and the calls through its handles
+    char* server;
+    int server_port;
+
+    char writedata[FS_BLOCKSIZE];
+    char readdata[FS_BLOCKSIZE];
+    int status = -2;
+    uint64_t handle = 0;
+    uint64_t other_handle = 0;
+    std::vector<uint64_t> handles;
+
+    if (argc != 3) {
+        std::cout << "error: usage: " << argv[0] << " <server> <serverPort>\n";
+        exit(1);
+    }
+    server = argv[1];
+    server_port = atoi(argv[2]);
+
+    fs_clientinit(server, server_port);
+
+    status = fs_create("user1", "/handledir", 'd');
+    assert(!status);
+
+    status = fs_create("user1", "/handledir/file", 'f');
+    assert(!status);
+
+    //Only existing files of ours can be opened
+    status = fs_open("user1", "/handledir", &handle);
+    assert(status == -1);
+
+    status = fs_open("user1", "/handledir/nothere", &handle);
+    assert(status == -1);
+
+    status = fs_open("user2", "/handledir/file", &handle);
+    assert(status == -1);
+
+    status = fs_open("user1", "/handledir/file", &handle);
+    assert(!status);
+
+    //Writes through the handle grow the file like fs_writeblock, and show up by path
+    memset(writedata, 'h', FS_BLOCKSIZE);
+    status = fs_writeblock_h("user1", handle, 0, writedata);
+    assert(!status);
+
+    memset(writedata, 'i', FS_BLOCKSIZE);
+    status = fs_writeblock_h("user1", handle, 1, writedata);
+    assert(!status);
+
+    status = fs_writeblock_h("user1", handle, 3, writedata);
+    assert(status == -1);
+
+    status = fs_readblock("user1", "/handledir/file", 1, readdata);
+    assert(!status && readdata[0] == 'i');
+
+    status = fs_readblock_h("user1", handle, 0, readdata);
+    assert(!status && readdata[0] == 'h' && readdata[FS_BLOCKSIZE - 1] == 'h');
+
+    status = fs_readblock_h("user1", handle, 2, readdata);
+    assert(status == -1);
+
+    //A handle is only good for the user who opened it
+    status = fs_readblock_h("user2", handle, 0, readdata);
+    assert(status == -1);
+
+    //It stays bound to the file when the file is renamed
+    status = fs_rename("user1", "/handledir/file", "/handledir/moved");
+    assert(!status);
+
+    status = fs_readblock_h("user1", handle, 1, readdata);
+    assert(!status && readdata[0] == 'i');
+
+    //Two handles on one file see each other's writes
+    status = fs_open("user1", "/handledir/moved", &other_handle);
+    assert(!status);
+
+    memset(writedata, 'j', FS_BLOCKSIZE);
+    status = fs_writeblock_h("user1", other_handle, 0, writedata);
+    assert(!status);
+
+    status = fs_readblock_h("user1", handle, 0, readdata);
+    assert(!status && readdata[0] == 'j');
+
+    status = fs_close("user1", other_handle);
+    assert(!status);
+
+    status = fs_close("user1", other_handle);
+    assert(status == -1);
+
+    status = fs_readblock_h("user1", other_handle, 0, readdata);
+    assert(status == -1);
+
+    //Once the file is deleted, calls through the handle fail
+    status = fs_delete("user1", "/handledir/moved");
+    assert(!status);
+
+    status = fs_readblock_h("user1", handle, 0, readdata);
+    assert(status == -1);
+
+    status = fs_writeblock_h("user1", handle, 0, writedata);
+    assert(status == -1);
+
+    fs_close("user1", handle);
+
+    //One user can only hold so many handles, and leaves the rest of the table to others
+    status = fs_create("user1", "/handledir/many", 'f');
+    assert(!status);
+
+    status = fs_create("user2", "/theirs", 'f');
+    assert(!status);
+
+    while (fs_open("user1", "/handledir/many", &handle) == 0) {
+        handles.push_back(handle);
+        assert(handles.size() <= MAX_USER_HANDLES);
+    }
+    assert(handles.size() == MAX_USER_HANDLES);
+
+    status = fs_open("user2", "/theirs", &other_handle);
+    assert(!status);
+
+    status = fs_close("user1", handles.back());
+    assert(!status);
+
+    status = fs_open("user1", "/handledir/many", &handles.back());
+    assert(!status);
+
+    //Handles on a deleted file stop counting against the limit
+    status = fs_delete("user1", "/handledir/many");
+    assert(!status);
+
+    status = fs_create("user1", "/handledir/file", 'f');
+    assert(!status);
+
+    status = fs_open("user1", "/handledir/file", &handle);
+    assert(!status);
+
+    fs_close("user1", handle);
+    fs_close("user2", other_handle);
+
+    status = fs_delete("user1", "/handledir/file");
+    assert(!status);
+
+    status = fs_delete("user2", "/theirs");
+    assert(!status);
+
+    status = fs_delete("user1", "/handledir");
+    assert(!status);
+
+    std::cout << "testhandles passed" << std::endl;
+}
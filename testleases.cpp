@@ -0,0 +1,93 @@
+#include <iostream>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "fs_client.h"
+
+//Milliseconds since start
+static long elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    //Test read leases and the client block cache (run against a server with leases on, the default)
+    char* server;
+    int server_port;
+
+    char writedata[FS_BLOCKSIZE];
+    char readdata[FS_BLOCKSIZE];
+    int status = -2;
+
+    if (argc != 3) {
+        std::cout << "error: usage: " << argv[0] << " <server> <serverPort>\n";
+        exit(1);
+    }
+    server = argv[1];
+    server_port = atoi(argv[2]);
+
+    //A second client, in a process of its own, deletes the file once told to through the pipe
+    int go[2];
+    assert(pipe(go) == 0);
+
+    pid_t other = fork();
+    assert(other >= 0);
+
+    if (other == 0) {
+        char c;
+        close(go[1]);
+        assert(read(go[0], &c, 1) == 1);
+
+        fs_clientinit(server, server_port);
+        status = fs_delete("user1", "/leasedir/file");
+        exit(status == 0 ? 0 : 1);
+    }
+    close(go[0]);
+
+    fs_clientinit(server, server_port);
+    fs_clientcache(64);
+
+    status = fs_create("user1", "/leasedir", 'd');
+    assert(!status);
+
+    status = fs_create("user1", "/leasedir/file", 'f');
+    assert(!status);
+
+    memset(writedata, 'a', FS_BLOCKSIZE);
+    status = fs_writeblock("user1", "/leasedir/file", 0, writedata);
+    assert(!status);
+
+    //The second read comes from the cache
+    status = fs_readblock("user1", "/leasedir/file", 0, readdata);
+    assert(!status && readdata[0] == 'a');
+
+    status = fs_readblock("user1", "/leasedir/file", 0, readdata);
+    assert(!status && readdata[0] == 'a');
+
+    //Our own write gives our lease back first, so it doesn't wait for it to run out
+    auto start = std::chrono::steady_clock::now();
+    memset(writedata, 'b', FS_BLOCKSIZE);
+    status = fs_writeblock("user1", "/leasedir/file", 0, writedata);
+    assert(!status);
+    assert(elapsed_ms(start) < 500);
+
+    status = fs_readblock("user1", "/leasedir/file", 0, readdata);
+    assert(!status && readdata[0] == 'b');
+
+    //The other client's delete waits out our lease, and after it our cache doesn't have the file
+    assert(write(go[1], "x", 1) == 1);
+
+    int other_status = 0;
+    assert(waitpid(other, &other_status, 0) == other);
+    assert(WIFEXITED(other_status) && WEXITSTATUS(other_status) == 0);
+
+    status = fs_readblock("user1", "/leasedir/file", 0, readdata);
+    assert(status == -1);
+
+    status = fs_delete("user1", "/leasedir");
+    assert(!status);
+
+    std::cout << "testleases passed" << std::endl;
+}
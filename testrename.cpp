@@ -0,0 +1,98 @@
+#include <iostream>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include "fs_client.h"
+
+int main(int argc, char* argv[]) {
+    //Test fs_rename within a directory, across directories, and its failures
+    char* server;
+    int server_port;
+
+    char writedata[FS_BLOCKSIZE];
+    char readdata[FS_BLOCKSIZE];
+    int status = -2;
+
+    if (argc != 3) {
+        std::cout << "error: usage: " << argv[0] << " <server> <serverPort>\n";
+        exit(1);
+    }
+    server = argv[1];
+    server_port = atoi(argv[2]);
+
+    fs_clientinit(server, server_port);
+    fs_clientcache(64);
+
+    memset(writedata, 'r', FS_BLOCKSIZE);
+
+    status = fs_create("user1", "/src", 'd');
+    assert(!status);
+
+    status = fs_create("user1", "/dst", 'd');
+    assert(!status);
+
+    status = fs_create("user1", "/src/file", 'f');
+    assert(!status);
+
+    status = fs_writeblock("user1", "/src/file", 0, writedata);
+    assert(!status);
+
+    //Within a directory, the data comes along and the old name is gone
+    status = fs_rename("user1", "/src/file", "/src/renamed");
+    assert(!status);
+
+    status = fs_readblock("user1", "/src/renamed", 0, readdata);
+    assert(!status && !memcmp(readdata, writedata, FS_BLOCKSIZE));
+
+    status = fs_readblock("user1", "/src/file", 0, readdata);
+    assert(status == -1);
+
+    //A directory moves with what's in it, and a cached block under the old path is dropped
+    status = fs_readblock("user1", "/src/renamed", 0, readdata);
+    assert(!status);
+
+    status = fs_rename("user1", "/src", "/dst/moved");
+    assert(!status);
+
+    status = fs_readblock("user1", "/src/renamed", 0, readdata);
+    assert(status == -1);
+
+    status = fs_readblock("user1", "/dst/moved/renamed", 0, readdata);
+    assert(!status && !memcmp(readdata, writedata, FS_BLOCKSIZE));
+
+    //The destination can't exist, be inside the source, or be in someone else's directory
+    status = fs_create("user1", "/dst/other", 'f');
+    assert(!status);
+
+    status = fs_rename("user1", "/dst/moved/renamed", "/dst/other");
+    assert(status == -1);
+
+    status = fs_rename("user1", "/dst", "/dst/moved/inside");
+    assert(status == -1);
+
+    status = fs_create("user2", "/theirs", 'd');
+    assert(!status);
+
+    status = fs_rename("user1", "/dst/other", "/theirs/other");
+    assert(status == -1);
+
+    status = fs_rename("user1", "/nothere", "/dst/nothere");
+    assert(status == -1);
+
+    status = fs_delete("user1", "/dst/moved/renamed");
+    assert(!status);
+
+    status = fs_delete("user1", "/dst/moved");
+    assert(!status);
+
+    status = fs_delete("user1", "/dst/other");
+    assert(!status);
+
+    status = fs_delete("user1", "/dst");
+    assert(!status);
+
+    status = fs_delete("user2", "/theirs");
+    assert(!status);
+
+    std::cout << "testrename passed" << std::endl;
+}
@@ -0,0 +1,103 @@
+#include <iostream>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include "fs_client.h"
+
+int main(int argc, char* argv[]) {
+    //Test fs_snapshot and reads under "/.snapshot"
+    char* server;
+    int server_port;
+
+    char writedata[FS_BLOCKSIZE];
+    char readdata[FS_BLOCKSIZE];
+    int status = -2;
+
+    if (argc != 3) {
+        std::cout << "error: usage: " << argv[0] << " <server> <serverPort>\n";
+        exit(1);
+    }
+    server = argv[1];
+    server_port = atoi(argv[2]);
+
+    fs_clientinit(server, server_port);
+
+    status = fs_create("user1", "/snapdir", 'd');
+    assert(!status);
+
+    status = fs_create("user1", "/snapdir/file", 'f');
+    assert(!status);
+
+    memset(writedata, 'a', FS_BLOCKSIZE);
+    status = fs_writeblock("user1", "/snapdir/file", 0, writedata);
+    assert(!status);
+
+    status = fs_create("user1", "/snapdir/gone", 'f');
+    assert(!status);
+
+    status = fs_writeblock("user1", "/snapdir/gone", 0, writedata);
+    assert(!status);
+
+    //Only the whole filesystem, and only one snapshot at a time
+    status = fs_snapshot("user1", "/snapdir");
+    assert(status == -1);
+
+    status = fs_snapshot("user1", "/");
+    assert(!status);
+
+    status = fs_snapshot("user1", "/");
+    assert(status == -1);
+
+    //Changes after the snapshot don't show in it
+    memset(writedata, 'b', FS_BLOCKSIZE);
+    status = fs_writeblock("user1", "/snapdir/file", 0, writedata);
+    assert(!status);
+
+    status = fs_delete("user1", "/snapdir/gone");
+    assert(!status);
+
+    status = fs_create("user1", "/snapdir/new", 'f');
+    assert(!status);
+
+    status = fs_readblock("user1", "/snapdir/file", 0, readdata);
+    assert(!status && readdata[0] == 'b');
+
+    status = fs_readblock("user1", "/.snapshot/snapdir/file", 0, readdata);
+    assert(!status && readdata[0] == 'a' && readdata[FS_BLOCKSIZE - 1] == 'a');
+
+    status = fs_readblock("user1", "/.snapshot/snapdir/gone", 0, readdata);
+    assert(!status && readdata[0] == 'a');
+
+    status = fs_readblock("user1", "/.snapshot/snapdir/new", 0, readdata);
+    assert(status == -1);
+
+    //The snapshot is read-only, its files keep their owners, and only user1 may delete it
+    status = fs_writeblock("user1", "/.snapshot/snapdir/file", 0, writedata);
+    assert(status == -1);
+
+    status = fs_readblock("user2", "/.snapshot/snapdir/file", 0, readdata);
+    assert(status == -1);
+
+    status = fs_delete("user2", "/.snapshot");
+    assert(status == -1);
+
+    status = fs_delete("user1", "/.snapshot");
+    assert(!status);
+
+    status = fs_readblock("user1", "/.snapshot/snapdir/file", 0, readdata);
+    assert(status == -1);
+
+    status = fs_delete("user1", "/.snapshot");
+    assert(status == -1);
+
+    status = fs_delete("user1", "/snapdir/file");
+    assert(!status);
+
+    status = fs_delete("user1", "/snapdir/new");
+    assert(!status);
+
+    status = fs_delete("user1", "/snapdir");
+    assert(!status);
+
+    std::cout << "testsnapshot passed" << std::endl;
+}